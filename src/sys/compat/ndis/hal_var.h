@@ -39,6 +39,8 @@ extern struct image_patch_table hal_functbl[];
 
 void	hal_libfini(void);
 void	hal_libinit(void);
+void	hal_spin_lower(void);
+void	hal_spin_raise(void);
 uint8_t	KeGetCurrentIrql(void);
 uint8_t	KfAcquireSpinLock(unsigned long *);
 void	KfLowerIrql(uint8_t);
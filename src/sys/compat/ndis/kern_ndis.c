@@ -44,6 +44,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/conf.h>
+#include <sys/mbuf.h>
 
 #include <sys/kernel.h>
 #include <sys/module.h>
@@ -75,9 +76,51 @@ SYSCTL_INT(_debug, OID_AUTO, ndis, CTLFLAG_RW, &ndis_debug,
 	    0, "control debugging printfs");
 #endif
 
+SYSCTL_DECL(_hw_ndis);
+
+/*
+ * Number of threads running each type of work item for an adapter.
+ * Can be overridden per device with the workq_threads hint. The cpu
+ * hint pins the DPC thread, and the critical_cpu, delayed_cpu and
+ * hypercritical_cpu hints pin the matching work item lane.
+ */
+static int ndis_workq_threads = 1;
+TUNABLE_INT("hw.ndis.workq_threads", &ndis_workq_threads);
+SYSCTL_INT(_hw_ndis, OID_AUTO, workq_threads, CTLFLAG_RDTUN,
+    &ndis_workq_threads, 0, "Work item threads per adapter");
+
+/*
+ * How long detach waits for the stack to give back loaned RX
+ * packets before it gives up with EBUSY, in seconds.
+ */
+static int ndis_rxdrain = 10;
+TUNABLE_INT("hw.ndis.rx_drain_secs", &ndis_rxdrain);
+SYSCTL_INT(_hw_ndis, OID_AUTO, rx_drain_secs, CTLFLAG_RW,
+    &ndis_rxdrain, 0, "Seconds detach waits for loaned RX packets");
+
+static const char *ndis_lane_hints[WORKQUEUE_MAX] = {
+	[CRITICAL] =		"critical_cpu",
+	[DELAYED] =		"delayed_cpu",
+	[HYPERCRITICAL] =	"hypercritical_cpu",
+};
+
 static void	ndis_create_sysctls(struct ndis_softc *);
 static void	ndis_flush_sysctls(struct ndis_softc *);
 static void	ndis_free_bufs(struct mdl *);
+static struct ndis_oidreq *ndis_oid_alloc(uint32_t, uint32_t, void *,
+		    uint32_t);
+static int	ndis_oid_cache_get(struct ndis_softc *, int, void *,
+		    uint32_t, uint32_t *, uint32_t *);
+static int	ndis_oid_cache_idx(uint32_t);
+static void	ndis_oid_cache_invalidate(struct ndis_softc *, uint32_t);
+static void	ndis_oid_cache_put(struct ndis_softc *, int, uint32_t,
+		    void *, uint32_t);
+static void	ndis_oid_complete(struct ndis_softc *, int32_t);
+static void	ndis_oid_done(struct ndis_softc *, struct ndis_oidreq *,
+		    int32_t);
+static void	ndis_oid_run(struct ndis_softc *);
+static void	ndis_oid_submit(struct ndis_softc *, struct ndis_oidreq *);
+static int32_t	ndis_reset_miniport(struct ndis_softc *, int);
 static void	NdisMIndicateStatus(struct ndis_miniport_block *, int32_t,
 		    void *, uint32_t);
 static void	NdisMIndicateStatusComplete(struct ndis_miniport_block *);
@@ -90,6 +133,7 @@ static void	NdisMResetComplete(struct ndis_miniport_block *, int32_t,
 static void	NdisMSendResourcesAvailable(struct ndis_miniport_block *);
 static void	ndis_interrupt_setup(struct nt_kdpc *, struct device_object *,
 		    struct irp *, struct ndis_softc *);
+static struct device_object *ndis_fdo_dpc_owner(struct nt_kdpc *);
 static void	ndis_return_packet_nic(struct device_object *,
 		    struct ndis_miniport_block *);
 
@@ -182,15 +226,15 @@ NdisMIndicateStatusComplete(struct ndis_miniport_block *block)
 static void
 NdisMSetInformationComplete(struct ndis_miniport_block *block, int32_t status)
 {
-	block->setstat = status;
-	KeSetEvent(&block->setevent, IO_NO_INCREMENT, FALSE);
+	ndis_oid_complete(device_get_softc(block->physdeviceobj->devext),
+	    status);
 }
 
 static void
 NdisMQueryInformationComplete(struct ndis_miniport_block *block, int32_t status)
 {
-	block->getstat = status;
-	KeSetEvent(&block->getevent, IO_NO_INCREMENT, FALSE);
+	ndis_oid_complete(device_get_softc(block->physdeviceobj->devext),
+	    status);
 }
 
 static void
@@ -201,15 +245,206 @@ NdisMResetComplete(struct ndis_miniport_block *block, int32_t status,
 	KeSetEvent(&block->resetevent, IO_NO_INCREMENT, FALSE);
 }
 
+#define	NDIS_REG_FOLD(c)	\
+	((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+#define	NDIS_REG_HASH(h)	((h) & (NDIS_REG_HASHSIZE - 1))
+
+/*
+ * FNV-1a over the case-folded key. Unicode keys are hashed on the
+ * low byte of each character, which is what the ANSI conversion
+ * would keep, so both forms of a key land in the same bucket.
+ */
+static uint32_t
+ndis_reg_hash_ansi(const char *key)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *key != '\0'; key++) {
+		h ^= NDIS_REG_FOLD((uint8_t)*key);
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static uint32_t
+ndis_reg_hash_unicode(const struct unicode_string *key)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < key->len / 2; i++) {
+		h ^= NDIS_REG_FOLD((uint8_t)key->buf[i]);
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static int
+ndis_reg_match(const struct ndis_cfglist *cfg,
+    const struct unicode_string *key)
+{
+	const char *k = cfg->ndis_cfg.key;
+	int i;
+
+	for (i = 0; i < key->len / 2; i++, k++)
+		if (*k == '\0' || NDIS_REG_FOLD((uint8_t)*k) !=
+		    NDIS_REG_FOLD((uint8_t)key->buf[i]))
+			return (0);
+	return (*k == '\0');
+}
+
+static struct ndis_cfglist *
+ndis_reg_lookup_ansi(struct ndis_softc *sc, const char *key)
+{
+	struct ndis_cfglist *cfg;
+	uint32_t h;
+
+	h = ndis_reg_hash_ansi(key);
+	mtx_lock(&sc->ndis_regmtx);
+	LIST_FOREACH(cfg, &sc->ndis_reghash[NDIS_REG_HASH(h)], ndis_hlink)
+		if (cfg->ndis_hash == h &&
+		    strcasecmp(cfg->ndis_cfg.key, key) == 0)
+			break;
+	mtx_unlock(&sc->ndis_regmtx);
+	return (cfg);
+}
+
+/*
+ * Find a registry key by its Unicode name. Entries are only freed
+ * when the driver is unloaded, so the result stays valid after the
+ * lock is dropped.
+ */
+struct ndis_cfglist *
+ndis_reg_lookup(struct ndis_softc *sc, const struct unicode_string *key)
+{
+	struct ndis_cfglist *cfg;
+	uint32_t h;
+
+	h = ndis_reg_hash_unicode(key);
+	mtx_lock(&sc->ndis_regmtx);
+	LIST_FOREACH(cfg, &sc->ndis_reghash[NDIS_REG_HASH(h)], ndis_hlink)
+		if (cfg->ndis_hash == h && ndis_reg_match(cfg, key))
+			break;
+	mtx_unlock(&sc->ndis_regmtx);
+	return (cfg);
+}
+
+/*
+ * Return the value of a key in the form the driver asked for,
+ * parsing the string only the first time each type is requested.
+ */
+int32_t
+ndis_reg_encode(struct ndis_cfglist *cfg, enum ndis_parameter_type type,
+    struct ndis_configuration_parameter **parm)
+{
+	struct ndis_softc *sc = cfg->ndis_sc;
+	struct ndis_configuration_parameter *p;
+	struct ansi_string as;
+	char *val;
+	int32_t status = NDIS_STATUS_SUCCESS;
+
+	if (type > NDIS_PARAMETER_BINARY || type == NDIS_PARAMETER_MULTI_STRING)
+		return (NDIS_STATUS_FAILURE);
+
+	mtx_lock(&sc->ndis_regmtx);
+	val = cfg->ndis_cfg.val;
+	if (strcmp(val, "UNSET") == 0) {
+		mtx_unlock(&sc->ndis_regmtx);
+		return (NDIS_STATUS_FAILURE);
+	}
+	p = &cfg->ndis_parm[type];
+	if (!(cfg->ndis_parsed & (1 << type))) {
+		p->type = type;
+		switch (type) {
+		case NDIS_PARAMETER_STRING:
+			RtlInitAnsiString(&as, val);
+			if (RtlAnsiStringToUnicodeString(&p->data.string,
+			    &as, TRUE))
+				status = NDIS_STATUS_RESOURCES;
+			break;
+		case NDIS_PARAMETER_INTEGER:
+			p->data.integer = strtol(val, NULL, 0);
+			break;
+		case NDIS_PARAMETER_HEX_INTEGER:
+			p->data.integer = strtoul(val, NULL, 16);
+			break;
+		case NDIS_PARAMETER_BINARY:
+			p->data.integer = strtoul(val, NULL, 2);
+			break;
+		default:
+			status = NDIS_STATUS_FAILURE;
+			break;
+		}
+		if (status == NDIS_STATUS_SUCCESS)
+			cfg->ndis_parsed |= 1 << type;
+	}
+	mtx_unlock(&sc->ndis_regmtx);
+	if (status == NDIS_STATUS_SUCCESS)
+		*parm = p;
+	return (status);
+}
+
+/*
+ * Replace the value of a key. Called for sysctl writes and
+ * NdisWriteConfiguration(), both at PASSIVE_LEVEL, so the
+ * allocations may sleep.
+ */
+int
+ndis_reg_setval(struct ndis_cfglist *cfg, const char *val)
+{
+	struct ndis_softc *sc = cfg->ndis_sc;
+	struct ndis_regold *old;
+	char *nval, *oval;
+
+	old = malloc(sizeof(struct ndis_regold), M_NDIS_KERN, M_WAITOK|M_ZERO);
+	nval = strdup(val, M_NDIS_KERN);
+
+	mtx_lock(&sc->ndis_regmtx);
+	oval = cfg->ndis_cfg.val;
+	cfg->ndis_cfg.val = nval;
+	if (cfg->ndis_parsed & (1 << NDIS_PARAMETER_STRING)) {
+		old->str = cfg->ndis_parm[NDIS_PARAMETER_STRING].data.string;
+		SLIST_INSERT_HEAD(&sc->ndis_regold, old, link);
+		old = NULL;
+	}
+	cfg->ndis_parsed = 0;
+	mtx_unlock(&sc->ndis_regmtx);
+
+	free(oval, M_NDIS_KERN);
+	if (old != NULL)
+		free(old, M_NDIS_KERN);
+	return (0);
+}
+
+static int
+ndis_reg_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct ndis_cfglist *cfg = arg1;
+	struct ndis_softc *sc = cfg->ndis_sc;
+	char buf[NDIS_REG_VALLEN];
+	int error;
+
+	mtx_lock(&sc->ndis_regmtx);
+	strlcpy(buf, cfg->ndis_cfg.val, sizeof(buf));
+	mtx_unlock(&sc->ndis_regmtx);
+	error = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	return (ndis_reg_setval(cfg, buf));
+}
+
 static void
 ndis_create_sysctls(struct ndis_softc *sc)
 {
 	struct ndis_cfg *cfg = sc->ndis_regvals;
 	char buf[32];
-	struct sysctl_oid *oidp;
-	struct sysctl_ctx_entry *e;
+	int i;
 
 	TAILQ_INIT(&sc->ndis_cfglist_head);
+	for (i = 0; i < NDIS_REG_HASHSIZE; i++)
+		LIST_INIT(&sc->ndis_reghash[i]);
+	SLIST_INIT(&sc->ndis_regold);
+	mtx_init(&sc->ndis_regmtx, "ndis registry", NULL, MTX_DEF);
 
 	/* Add the driver-specific registry keys. */
 	for (; cfg != NULL;) {
@@ -220,15 +455,8 @@ ndis_create_sysctls(struct ndis_softc *sc)
 			continue;
 		}
 
-		/* See if we already have a sysctl with this name */
-		oidp = NULL;
-		TAILQ_FOREACH(e, device_get_sysctl_ctx(sc->ndis_dev), link) {
-			oidp = e->entry;
-			if (strcasecmp(oidp->oid_name, cfg->key) == 0)
-				break;
-			oidp = NULL;
-		}
-		if (oidp != NULL) {
+		/* See if we already have a key with this name */
+		if (ndis_reg_lookup_ansi(sc, cfg->key) != NULL) {
 			cfg++;
 			continue;
 		}
@@ -281,13 +509,19 @@ ndis_add_sysctl(struct ndis_softc *sc, char *key, char *desc, char *val,
 	} else
 		cfg->ndis_cfg.desc = strdup(desc, M_NDIS_KERN);
 	cfg->ndis_cfg.val = strdup(val, M_NDIS_KERN);
+	cfg->ndis_sc = sc;
+	cfg->ndis_hash = ndis_reg_hash_ansi(key);
 
+	mtx_lock(&sc->ndis_regmtx);
 	TAILQ_INSERT_TAIL(&sc->ndis_cfglist_head, cfg, link);
+	LIST_INSERT_HEAD(&sc->ndis_reghash[NDIS_REG_HASH(cfg->ndis_hash)],
+	    cfg, ndis_hlink);
+	mtx_unlock(&sc->ndis_regmtx);
 
-	cfg->ndis_oid = SYSCTL_ADD_STRING(device_get_sysctl_ctx(sc->ndis_dev),
+	cfg->ndis_oid = SYSCTL_ADD_PROC(device_get_sysctl_ctx(sc->ndis_dev),
 	    SYSCTL_CHILDREN(device_get_sysctl_tree(sc->ndis_dev)),
-	    OID_AUTO, cfg->ndis_cfg.key, flag, cfg->ndis_cfg.val,
-	    sizeof(cfg->ndis_cfg.val), cfg->ndis_cfg.desc);
+	    OID_AUTO, cfg->ndis_cfg.key, CTLTYPE_STRING | flag, cfg, 0,
+	    ndis_reg_sysctl, "A", cfg->ndis_cfg.desc);
 
 	return (0);
 }
@@ -296,6 +530,7 @@ static void
 ndis_flush_sysctls(struct ndis_softc *sc)
 {
 	struct ndis_cfglist *cfg;
+	struct ndis_regold *old;
 	struct sysctl_ctx_list *clist;
 
 	clist = device_get_sysctl_ctx(sc->ndis_dev);
@@ -303,24 +538,32 @@ ndis_flush_sysctls(struct ndis_softc *sc)
 	while (!TAILQ_EMPTY(&sc->ndis_cfglist_head)) {
 		cfg = TAILQ_FIRST(&sc->ndis_cfglist_head);
 		TAILQ_REMOVE(&sc->ndis_cfglist_head, cfg, link);
+		LIST_REMOVE(cfg, ndis_hlink);
 		sysctl_ctx_entry_del(clist, cfg->ndis_oid);
 		sysctl_remove_oid(cfg->ndis_oid, 1, 0);
+		if (cfg->ndis_parsed & (1 << NDIS_PARAMETER_STRING))
+			RtlFreeUnicodeString(
+			    &cfg->ndis_parm[NDIS_PARAMETER_STRING].data.string);
 		free(cfg->ndis_cfg.key, M_NDIS_KERN);
 		free(cfg->ndis_cfg.desc, M_NDIS_KERN);
 		free(cfg->ndis_cfg.val, M_NDIS_KERN);
 		free(cfg, M_NDIS_KERN);
 	}
+	while ((old = SLIST_FIRST(&sc->ndis_regold)) != NULL) {
+		SLIST_REMOVE_HEAD(&sc->ndis_regold, link);
+		RtlFreeUnicodeString(&old->str);
+		free(old, M_NDIS_KERN);
+	}
+	mtx_destroy(&sc->ndis_regmtx);
 }
 
 void *
 ndis_get_routine_address(struct image_patch_table *functbl, char *name)
 {
-	int i;
+	struct image_patch_table *p;
 
-	for (i = 0; functbl[i].name != NULL; i++)
-		if (strcmp(name, functbl[i].name) == 0)
-			return (functbl[i].wrap);
-	return (NULL);
+	p = pe_functbl_lookup(functbl, name);
+	return (p != NULL ? p->wrap : NULL);
 }
 
 static void
@@ -353,12 +596,23 @@ ndis_return_packet(struct mbuf *m, void *buf, void *arg)
 {
 	struct ndis_packet *p = arg;
 	struct ndis_miniport_block *block;
+	struct ndis_softc *sc;
 
-	p->refcnt--;
-	if (p->refcnt)
+	/*
+	 * Loaned packets can be released from any context once
+	 * the stack is done with them, so drop the reference
+	 * atomically.
+	 */
+	if (atomic_fetchadd_int(&p->refcnt, -1) != 1)
 		return (EXT_FREE_OK);
 
-	block = ((struct ndis_softc *)p->softc)->ndis_block;
+	sc = p->softc;
+	if (p->loaned) {
+		p->loaned = FALSE;
+		atomic_subtract_int(&sc->ndis_rxloaned, 1);
+	}
+
+	block = sc->ndis_block;
 	KeAcquireSpinLockAtDpcLevel(&block->returnlock);
 	InitializeListHead(&p->list);
 	InsertHeadList(&block->returnlist, &p->list);
@@ -390,6 +644,30 @@ ndis_free_packet(struct ndis_packet *p)
 	NdisFreePacket(p);
 }
 
+/*
+ * Free a packet built by ndis_mtop(). MDLs carved out of the TX
+ * slot's vector are just dropped, anything else came from
+ * IoAllocateMdl() and has to go back.
+ */
+void
+ndis_free_txpacket(struct ndis_packet *p, struct ndis_txmdl *vec)
+{
+	struct mdl *b, *next;
+
+	KASSERT(p != NULL, ("no packet"));
+	if (vec == NULL) {
+		ndis_free_packet(p);
+		return;
+	}
+	for (b = p->private.head; b != NULL; b = next) {
+		next = b->next;
+		if ((struct ndis_txmdl *)b < vec ||
+		    (struct ndis_txmdl *)b >= vec + NDIS_MAXSEG)
+			IoFreeMdl(b);
+	}
+	NdisFreePacket(p);
+}
+
 int
 ndis_convert_res(struct ndis_softc *sc)
 {
@@ -538,28 +816,58 @@ ndis_ptom(struct mbuf **m0, struct ndis_packet *p)
  * which is vaguely analagous to the pkthdr portion of an mbuf,
  * and one or more mdl structures, which define the
  * actual memory segments in which the packet data resides.
- * We need to allocate one mdl for each mbuf in a chain,
- * plus one ndis_packet as the header.
+ * We need one mdl for each mbuf in a chain, plus one ndis_packet
+ * as the header.
+ *
+ * If the caller passes in a TX slot's preallocated MDL vector,
+ * the mdls are taken from it instead of being allocated, and
+ * chains with more than NDIS_MAXSEG buffers are first collapsed
+ * so that they fit. If that fails (a TSO frame may simply be too
+ * big for it) the buffers left over get their mdls allocated the
+ * usual way. In that case the packet must be released with
+ * ndis_free_txpacket(), and *m0 may have been replaced.
  */
 int
-ndis_mtop(struct mbuf *m0, struct ndis_packet **p)
+ndis_mtop(struct mbuf **m0, struct ndis_packet **p, struct ndis_txmdl *vec)
 {
-	struct mbuf *m;
+	struct mbuf *m, *n;
 	struct mdl *buf = NULL, *prev = NULL;
 	struct ndis_packet_private *priv;
+	int segs = 0;
 
 	KASSERT(*p != NULL, ("no packet"));
 	priv = &(*p)->private;
-	priv->total_length = m0->m_pkthdr.len;
 
-	for (m = m0; m != NULL; m = m->m_next) {
+	if (vec != NULL) {
+		for (m = *m0; m != NULL; m = m->m_next)
+			if (m->m_len != 0)
+				segs++;
+		if (segs > NDIS_MAXSEG) {
+			/* On failure the chain is still intact, if longer. */
+			n = m_collapse(*m0, M_NOWAIT, NDIS_MAXSEG);
+			if (n != NULL)
+				*m0 = n;
+		}
+		segs = 0;
+	}
+
+	priv->total_length = (*m0)->m_pkthdr.len;
+
+	for (m = *m0; m != NULL; m = m->m_next) {
 		if (m->m_len == 0)
 			continue;
-		buf = IoAllocateMdl(m->m_data, m->m_len, FALSE, FALSE, NULL);
-		if (buf == NULL) {
-			ndis_free_packet(*p);
-			*p = NULL;
-			return (ENOMEM);
+		if (vec != NULL && segs < NDIS_MAXSEG &&
+		    SPAN_PAGES(m->m_data, m->m_len) <= NDIS_TXMDL_PAGES) {
+			buf = &vec[segs++].tm_mdl;
+			MmInitializeMdl(buf, m->m_data, m->m_len);
+		} else {
+			buf = IoAllocateMdl(m->m_data, m->m_len,
+			    FALSE, FALSE, NULL);
+			if (buf == NULL) {
+				ndis_free_txpacket(*p, vec);
+				*p = NULL;
+				return (ENOMEM);
+			}
 		}
 		MmBuildMdlForNonPagedPool(buf);
 
@@ -575,60 +883,444 @@ ndis_mtop(struct mbuf *m0, struct ndis_packet **p)
 	return (0);
 }
 
+/*
+ * OIDs whose query results are cached. A value only goes away when
+ * one of the listed events happens, or when the same OID is set.
+ * Link state and speed are not in here: they change all the time,
+ * and the interface's state cache in if_ndis.c already tracks them
+ * from the status indications.
+ */
+#define	NDIS_OIDC_EVT_RESET	0x01	/* miniport reset or halt */
+#define	NDIS_OIDC_EVT_ALL	0xff
+
+static const struct ndis_oidpolicy {
+	uint32_t	op_oid;
+	uint32_t	op_events;	/* NDIS_OIDC_EVT_* */
+} ndis_oidpolicy[] = {
+	{ OID_GEN_SUPPORTED_LIST,	0 },
+	{ OID_GEN_PHYSICAL_MEDIUM,	0 },
+	{ OID_GEN_MAXIMUM_FRAME_SIZE,	0 },
+	{ OID_GEN_MAXIMUM_SEND_PACKETS,	0 },
+	{ OID_GEN_VENDOR_DRIVER_VERSION, 0 },
+	{ OID_802_3_PERMANENT_ADDRESS,	0 },
+	{ OID_802_3_MAXIMUM_LIST_SIZE,	0 },
+	{ OID_PNP_CAPABILITIES,		0 },
+	{ OID_802_11_SUPPORTED_RATES,	NDIS_OIDC_EVT_RESET },
+};
+CTASSERT(nitems(ndis_oidpolicy) <= NDIS_OIDCACHE_MAX);
+
+static int
+ndis_oid_cache_idx(uint32_t oid)
+{
+	int i;
+
+	for (i = 0; i < nitems(ndis_oidpolicy); i++)
+		if (ndis_oidpolicy[i].op_oid == oid)
+			return (i);
+	return (-1);
+}
+
+/*
+ * Answer a query from the cache. Returns 0 on a miss, including when
+ * the caller's buffer is too small, so the miniport gets to report
+ * the length it needs.
+ */
+static int
+ndis_oid_cache_get(struct ndis_softc *sc, int idx, void *buf,
+    uint32_t buflen, uint32_t *written, uint32_t *needed)
+{
+	struct ndis_oidcache *oc = &sc->ndis_oidc[idx];
+
+	mtx_lock(&sc->ndis_oidmtx);
+	if (!sc->ndis_oidcenable || !oc->oc_valid || oc->oc_len > buflen) {
+		sc->ndis_oidcmisses++;
+		mtx_unlock(&sc->ndis_oidmtx);
+		return (0);
+	}
+	memcpy(buf, oc->oc_buf, oc->oc_len);
+	if (written != NULL)
+		*written = oc->oc_len;
+	if (needed != NULL)
+		*needed = 0;
+	sc->ndis_oidchits++;
+	mtx_unlock(&sc->ndis_oidmtx);
+	return (1);
+}
+
+static void
+ndis_oid_cache_put(struct ndis_softc *sc, int idx, uint32_t gen,
+    void *buf, uint32_t len)
+{
+	struct ndis_oidcache *oc = &sc->ndis_oidc[idx];
+	void *p;
+
+	if (len == 0)
+		return;
+	p = malloc(len, M_NDIS_KERN, M_NOWAIT);
+	if (p == NULL)
+		return;
+	memcpy(p, buf, len);
+	mtx_lock(&sc->ndis_oidmtx);
+	/* Something was invalidated while the query was in flight. */
+	if (sc->ndis_oidcgen != gen) {
+		mtx_unlock(&sc->ndis_oidmtx);
+		free(p, M_NDIS_KERN);
+		return;
+	}
+	if (oc->oc_buf != NULL)
+		free(oc->oc_buf, M_NDIS_KERN);
+	oc->oc_buf = p;
+	oc->oc_len = len;
+	oc->oc_valid = 1;
+	mtx_unlock(&sc->ndis_oidmtx);
+}
+
+static void
+ndis_oid_cache_invalidate(struct ndis_softc *sc, uint32_t events)
+{
+	int i;
+
+	mtx_lock(&sc->ndis_oidmtx);
+	for (i = 0; i < nitems(ndis_oidpolicy); i++)
+		if (events == NDIS_OIDC_EVT_ALL ||
+		    ndis_oidpolicy[i].op_events & events)
+			sc->ndis_oidc[i].oc_valid = 0;
+	sc->ndis_oidcgen++;
+	mtx_unlock(&sc->ndis_oidmtx);
+}
+
+/*
+ * Drop cached results made stale by a status indication.
+ */
+void
+ndis_oid_cache_status(struct ndis_softc *sc, int32_t status)
+{
+	switch (status) {
+	case NDIS_STATUS_RESET_START:
+	case NDIS_STATUS_RESET_END:
+		ndis_oid_cache_invalidate(sc, NDIS_OIDC_EVT_RESET);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+ndis_oid_init(struct ndis_softc *sc)
+{
+	mtx_init(&sc->ndis_oidmtx, "ndis oid", NULL, MTX_DEF);
+	TAILQ_INIT(&sc->ndis_oidq);
+	sc->ndis_oidcur = NULL;
+	sc->ndis_oidrun = 0;
+	sc->ndis_oidreset = 0;
+	sc->ndis_oidcenable = 1;
+}
+
+void
+ndis_oid_destroy(struct ndis_softc *sc)
+{
+	int i;
+
+	ndis_oid_flush(sc, NDIS_STATUS_REQUEST_ABORTED);
+	for (i = 0; i < NDIS_OIDCACHE_MAX; i++)
+		if (sc->ndis_oidc[i].oc_buf != NULL)
+			free(sc->ndis_oidc[i].oc_buf, M_NDIS_KERN);
+	mtx_destroy(&sc->ndis_oidmtx);
+}
+
+/*
+ * Fail every queued request as well as the one the miniport is
+ * sitting on. Used once the miniport has been reset or halted and
+ * will not complete what it was given. A completion that shows up
+ * afterwards finds no current request and is dropped.
+ */
+void
+ndis_oid_flush(struct ndis_softc *sc, int32_t status)
+{
+	TAILQ_HEAD(, ndis_oidreq) q;
+	struct ndis_oidreq *r;
+
+	TAILQ_INIT(&q);
+	mtx_lock(&sc->ndis_oidmtx);
+	if ((r = sc->ndis_oidcur) != NULL) {
+		sc->ndis_oidcur = NULL;
+		TAILQ_INSERT_TAIL(&q, r, nor_link);
+	}
+	while ((r = TAILQ_FIRST(&sc->ndis_oidq)) != NULL) {
+		TAILQ_REMOVE(&sc->ndis_oidq, r, nor_link);
+		r->nor_flags &= ~NDIS_OIDREQ_QUEUED;
+		TAILQ_INSERT_TAIL(&q, r, nor_link);
+	}
+	mtx_unlock(&sc->ndis_oidmtx);
+
+	while ((r = TAILQ_FIRST(&q)) != NULL) {
+		TAILQ_REMOVE(&q, r, nor_link);
+		ndis_oid_done(sc, r, status);
+	}
+}
+
+static struct ndis_oidreq *
+ndis_oid_alloc(uint32_t req, uint32_t oid, void *buf, uint32_t buflen)
+{
+	struct ndis_oidreq *r;
+
+	r = malloc(sizeof(struct ndis_oidreq) + buflen, M_NDIS_KERN,
+	    M_NOWAIT|M_ZERO);
+	if (r == NULL)
+		return (NULL);
+	r->nor_req = req;
+	r->nor_oid = oid;
+	r->nor_buflen = buflen;
+	if (buflen) {
+		r->nor_buf = r + 1;
+		if (buf != NULL)
+			memcpy(r->nor_buf, buf, buflen);
+	}
+	KeInitializeEvent(&r->nor_event, NOTIFICATION_EVENT, FALSE);
+	return (r);
+}
+
+static void
+ndis_oid_submit(struct ndis_softc *sc, struct ndis_oidreq *r)
+{
+	mtx_lock(&sc->ndis_oidmtx);
+	r->nor_flags |= NDIS_OIDREQ_QUEUED;
+	TAILQ_INSERT_TAIL(&sc->ndis_oidq, r, nor_link);
+	sc->ndis_oidreqs++;
+	mtx_unlock(&sc->ndis_oidmtx);
+	ndis_oid_run(sc);
+}
+
+/*
+ * Hand queued requests to the miniport, one at a time. Only one
+ * thread runs the dispatcher; a completion that arrives while it is
+ * active, including one signalled from inside the miniport call,
+ * just lets the loop pick up the next request. Serialized miniports
+ * expect the miniport lock held across the call, but it is dropped
+ * before we ever wait for a pended request.
+ */
+static void
+ndis_oid_run(struct ndis_softc *sc)
+{
+	struct ndis_miniport_block *block = sc->ndis_block;
+	struct ndis_oidreq *r;
+	int32_t rval;
+	uint8_t irql = 0;
+
+	mtx_lock(&sc->ndis_oidmtx);
+	if (sc->ndis_oidrun) {
+		mtx_unlock(&sc->ndis_oidmtx);
+		return;
+	}
+	sc->ndis_oidrun = 1;
+	while (sc->ndis_oidcur == NULL && !sc->ndis_oidreset &&
+	    (r = TAILQ_FIRST(&sc->ndis_oidq)) != NULL) {
+		TAILQ_REMOVE(&sc->ndis_oidq, r, nor_link);
+		r->nor_flags &= ~NDIS_OIDREQ_QUEUED;
+		sc->ndis_oidcur = r;
+		mtx_unlock(&sc->ndis_oidmtx);
+
+		if (NDIS_SERIALIZED(block))
+			KeAcquireSpinLock(&block->lock, &irql);
+		if (r->nor_req == NDIS_REQUEST_QUERY_INFORMATION)
+			rval = MSCALL6(sc->ndis_chars->query_info_func,
+			    block->miniport_adapter_ctx, r->nor_oid,
+			    r->nor_buf, r->nor_buflen, &r->nor_written,
+			    &r->nor_needed);
+		else
+			rval = MSCALL6(sc->ndis_chars->set_info_func,
+			    block->miniport_adapter_ctx, r->nor_oid,
+			    r->nor_buf, r->nor_buflen, &r->nor_written,
+			    &r->nor_needed);
+		if (NDIS_SERIALIZED(block))
+			KeReleaseSpinLock(&block->lock, irql);
+
+		mtx_lock(&sc->ndis_oidmtx);
+		if (rval == NDIS_STATUS_PENDING) {
+			sc->ndis_oidpending++;
+			/* Unless it already completed from inside the call. */
+			if (sc->ndis_oidcur == r)
+				r->nor_flags |= NDIS_OIDREQ_PENDING;
+			continue;
+		}
+		if (sc->ndis_oidcur == r) {
+			sc->ndis_oidcur = NULL;
+			mtx_unlock(&sc->ndis_oidmtx);
+			ndis_oid_done(sc, r, rval);
+			mtx_lock(&sc->ndis_oidmtx);
+		}
+	}
+	sc->ndis_oidrun = 0;
+	mtx_unlock(&sc->ndis_oidmtx);
+}
+
+static void
+ndis_oid_complete(struct ndis_softc *sc, int32_t status)
+{
+	struct ndis_oidreq *r;
+
+	mtx_lock(&sc->ndis_oidmtx);
+	r = sc->ndis_oidcur;
+	sc->ndis_oidcur = NULL;
+	mtx_unlock(&sc->ndis_oidmtx);
+	if (r == NULL)
+		return;
+	ndis_oid_done(sc, r, status);
+	ndis_oid_run(sc);
+}
+
+/*
+ * Finish a request: run the caller's callback, or wake the
+ * synchronous waiter. A waiter that already timed out has left the
+ * request to us, so free it. The event is set with the lock held:
+ * a waiter whose timeout races with us frees the request as soon
+ * as it sees NDIS_OIDREQ_DONE.
+ */
+static void
+ndis_oid_done(struct ndis_softc *sc, struct ndis_oidreq *r, int32_t status)
+{
+	int abandoned;
+
+	r->nor_status = status;
+	TRACE(r->nor_req == NDIS_REQUEST_QUERY_INFORMATION ?
+	    NDBG_GET : NDBG_SET, "req %u sc %p oid %08X buflen %u "
+	    "written %u needed %u rval %08X\n", r->nor_req, sc, r->nor_oid,
+	    r->nor_buflen, r->nor_written, r->nor_needed, status);
+	if (r->nor_cb != NULL) {
+		r->nor_cb(sc, r, r->nor_arg);
+		free(r, M_NDIS_KERN);
+		return;
+	}
+	mtx_lock(&sc->ndis_oidmtx);
+	r->nor_flags |= NDIS_OIDREQ_DONE;
+	abandoned = r->nor_flags & NDIS_OIDREQ_ABANDONED;
+	if (!abandoned)
+		KeSetEvent(&r->nor_event, IO_NO_INCREMENT, FALSE);
+	mtx_unlock(&sc->ndis_oidmtx);
+	if (abandoned)
+		free(r, M_NDIS_KERN);
+}
+
+/*
+ * Queue an OID request and return without waiting for it. The
+ * callback runs once the miniport is done with it, possibly from the
+ * miniport's completion path at DISPATCH_LEVEL, so it must not sleep.
+ * The request, including its copy of the buffer, is freed when the
+ * callback returns.
+ */
+int
+ndis_request_async(struct ndis_softc *sc, uint32_t req, uint32_t oid,
+    void *buf, uint32_t buflen, ndis_oid_callback cb, void *arg)
+{
+	struct ndis_oidreq *r;
+
+	KASSERT(cb != NULL, ("no callback"));
+	if (req != NDIS_REQUEST_QUERY_INFORMATION &&
+	    req != NDIS_REQUEST_SET_INFORMATION)
+		return (NDIS_STATUS_NOT_SUPPORTED);
+	r = ndis_oid_alloc(req, oid, buf, buflen);
+	if (r == NULL)
+		return (NDIS_STATUS_RESOURCES);
+	r->nor_cb = cb;
+	r->nor_arg = arg;
+	ndis_oid_submit(sc, r);
+	return (NDIS_STATUS_PENDING);
+}
+
 static int
 ndis_request_info(uint32_t req, struct ndis_softc *sc, uint32_t oid,
     void *buf, uint32_t buflen, uint32_t *written, uint32_t *needed)
 {
+	struct ndis_oidreq *r;
 	int64_t duetime;
-	int32_t rval, w = 0, n = 0;
+	int32_t rval;
+	uint32_t gen = 0;
+	int idx;
 
-	if (!written)
-		written = &w;
-	if (!needed)
-		needed = &n;
 	KASSERT(sc->ndis_chars != NULL, ("no chars"));
 	KASSERT(sc->ndis_block != NULL, ("no block"));
 	KASSERT(sc->ndis_block->miniport_adapter_ctx != NULL, ("no adapter"));
 	KASSERT(sc->ndis_chars->query_info_func != NULL, ("no query_info"));
 	KASSERT(sc->ndis_chars->set_info_func != NULL, ("no set_info"));
+	if (req != NDIS_REQUEST_QUERY_INFORMATION &&
+	    req != NDIS_REQUEST_SET_INFORMATION)
+		return (NDIS_STATUS_NOT_SUPPORTED);
 	/*
 	 * According to the NDIS spec, MiniportQueryInformation()
 	 * and MiniportSetInformation() requests are handled serially:
 	 * once one request has been issued, we must wait for it to
-	 * finish before allowing another request to proceed.
+	 * finish before allowing another request to proceed. The
+	 * request queue takes care of that; we only wait for our own
+	 * request, without holding any lock.
 	 */
-	if (req == NDIS_REQUEST_QUERY_INFORMATION) {
-		KeAcquireSpinLockAtDpcLevel(&sc->ndis_block->lock);
-		rval = MSCALL6(sc->ndis_chars->query_info_func,
-		    sc->ndis_block->miniport_adapter_ctx,
-		    oid, buf, buflen, written, needed);
-		if (rval == NDIS_STATUS_PENDING) {
-			duetime = (5 * 1000000) * -10;
-			KeWaitForSingleObject(&sc->ndis_block->getevent,
-			    0, 0, FALSE, &duetime);
-			rval = sc->ndis_block->getstat;
-		}
-		KeReleaseSpinLockFromDpcLevel(&sc->ndis_block->lock);
-		TRACE(NDBG_GET, "req %u sc %p oid %08X buf %p buflen %u "
-		    "written %u needed %u rval %08X\n",
-		    req, sc, oid, buf, buflen, *written, *needed, rval);
-	} else if (req == NDIS_REQUEST_SET_INFORMATION) {
-		KeAcquireSpinLockAtDpcLevel(&sc->ndis_block->lock);
-		rval = MSCALL6(sc->ndis_chars->set_info_func,
-		    sc->ndis_block->miniport_adapter_ctx,
-		    oid, buf, buflen, written, needed);
-		if (rval == NDIS_STATUS_PENDING) {
-			duetime = (5 * 1000000) * -10;
-			KeWaitForSingleObject(&sc->ndis_block->setevent,
-			    0, 0, FALSE, &duetime);
-			rval = sc->ndis_block->setstat;
+	idx = ndis_oid_cache_idx(oid);
+	if (idx >= 0 && req == NDIS_REQUEST_QUERY_INFORMATION) {
+		if (ndis_oid_cache_get(sc, idx, buf, buflen, written, needed))
+			return (NDIS_STATUS_SUCCESS);
+		mtx_lock(&sc->ndis_oidmtx);
+		gen = sc->ndis_oidcgen;
+		mtx_unlock(&sc->ndis_oidmtx);
+	} else if (idx >= 0) {
+		mtx_lock(&sc->ndis_oidmtx);
+		sc->ndis_oidc[idx].oc_valid = 0;
+		sc->ndis_oidcgen++;
+		mtx_unlock(&sc->ndis_oidmtx);
+	}
+	r = ndis_oid_alloc(req, oid, buf, buflen);
+	if (r == NULL)
+		return (NDIS_STATUS_RESOURCES);
+	ndis_oid_submit(sc, r);
+
+	duetime = (5 * 1000000) * -10;
+	if (KeWaitForSingleObject(&r->nor_event, 0, 0, FALSE,
+	    &duetime) != NDIS_STATUS_SUCCESS) {
+		mtx_lock(&sc->ndis_oidmtx);
+		if (!(r->nor_flags & NDIS_OIDREQ_DONE)) {
+			sc->ndis_oidtimeouts++;
+			if (r->nor_flags & NDIS_OIDREQ_QUEUED) {
+				/* Still queued: nobody else knows about it. */
+				TAILQ_REMOVE(&sc->ndis_oidq, r, nor_link);
+				mtx_unlock(&sc->ndis_oidmtx);
+				free(r, M_NDIS_KERN);
+			} else if (sc->ndis_oidcur == r &&
+			    r->nor_flags & NDIS_OIDREQ_PENDING) {
+				/*
+				 * Pending in the miniport, which holds on
+				 * to its one request until it completes
+				 * it. Reset it to take the request back,
+				 * and hold the queue until that is done.
+				 */
+				r->nor_flags |= NDIS_OIDREQ_ABANDONED;
+				sc->ndis_oidreset = 1;
+				mtx_unlock(&sc->ndis_oidmtx);
+				device_printf(sc->ndis_dev, "OID %08X timed "
+				    "out, resetting\n", oid);
+				ndis_reset_miniport(sc, 1);
+				return (NDIS_STATUS_FAILURE);
+			} else {
+				/* In the miniport call, or completing. */
+				r->nor_flags |= NDIS_OIDREQ_ABANDONED;
+				mtx_unlock(&sc->ndis_oidmtx);
+			}
+			device_printf(sc->ndis_dev, "OID %08X timed out\n",
+			    oid);
+			return (NDIS_STATUS_FAILURE);
 		}
-		KeReleaseSpinLockFromDpcLevel(&sc->ndis_block->lock);
-		TRACE(NDBG_SET, "req %u sc %p oid %08X buf %p buflen %u "
-		    "written %u needed %u rval %08X\n",
-		    req, sc, oid, buf, buflen, *written, *needed, rval);
-	} else
-		return (NDIS_STATUS_NOT_SUPPORTED);
+		mtx_unlock(&sc->ndis_oidmtx);
+	}
+
+	rval = r->nor_status;
+	if (written != NULL)
+		*written = r->nor_written;
+	if (needed != NULL)
+		*needed = r->nor_needed;
+	if (req == NDIS_REQUEST_QUERY_INFORMATION && buflen != 0)
+		memcpy(buf, r->nor_buf, buflen);
+	if (idx >= 0 && req == NDIS_REQUEST_QUERY_INFORMATION &&
+	    rval == NDIS_STATUS_SUCCESS)
+		ndis_oid_cache_put(sc, idx, gen, r->nor_buf,
+		    r->nor_written != 0 ? min(r->nor_written, buflen) : buflen);
+	free(r, M_NDIS_KERN);
 	return (rval);
 }
 
@@ -763,7 +1455,8 @@ ndis_destroy_dma(struct ndis_softc *sc)
 
 	for (i = 0; i < sc->ndis_maxpkts; i++) {
 		if (sc->ndis_txarray[i] != NULL)
-			ndis_free_packet(sc->ndis_txarray[i]);
+			ndis_free_txpacket(sc->ndis_txarray[i],
+			    NDIS_TXMDLS(sc, i));
 		bus_dmamap_destroy(sc->ndis_ttag, sc->ndis_tmaps[i]);
 	}
 	free(sc->ndis_tmaps, M_NDIS_KERN);
@@ -773,6 +1466,19 @@ ndis_destroy_dma(struct ndis_softc *sc)
 int32_t
 ndis_reset_nic(struct ndis_softc *sc)
 {
+
+	return (ndis_reset_miniport(sc, 0));
+}
+
+/*
+ * Reset the miniport. It drops whatever request it was holding,
+ * which is failed here. With flushq set, so are the requests queued
+ * behind it, and the queue held by a timed out request is restarted.
+ */
+static int32_t
+ndis_reset_miniport(struct ndis_softc *sc, int flushq)
+{
+	struct ndis_oidreq *r;
 	int32_t rval;
 	uint8_t addressing_reset;
 	uint8_t irql = 0;
@@ -792,6 +1498,21 @@ ndis_reset_nic(struct ndis_softc *sc)
 		    FALSE, NULL);
 		rval = sc->ndis_block->resetstat;
 	}
+	ndis_oid_cache_invalidate(sc, NDIS_OIDC_EVT_RESET);
+	if (flushq) {
+		ndis_oid_flush(sc, NDIS_STATUS_REQUEST_ABORTED);
+		mtx_lock(&sc->ndis_oidmtx);
+		sc->ndis_oidreset = 0;
+		mtx_unlock(&sc->ndis_oidmtx);
+	} else {
+		mtx_lock(&sc->ndis_oidmtx);
+		r = sc->ndis_oidcur;
+		sc->ndis_oidcur = NULL;
+		mtx_unlock(&sc->ndis_oidmtx);
+		if (r != NULL)
+			ndis_oid_done(sc, r, NDIS_STATUS_REQUEST_ABORTED);
+	}
+	ndis_oid_run(sc);
 	if (rval)
 		device_printf(sc->ndis_dev, "failed to reset device; "
 		    "status: 0x%08X\n", rval);
@@ -835,11 +1556,44 @@ ndis_enable_interrupts_nic(struct ndis_softc *sc)
 		    sc->ndis_block->miniport_adapter_ctx);
 }
 
+/*
+ * Loaned mbufs point into the miniport's receive buffers, so it
+ * must not be halted while the stack still holds any. Copy from now
+ * on, let the DPCs that might be loaning finish, and give the stack
+ * hw.ndis.rx_drain_secs to hand every loan back. A socket can sit on
+ * one for as long as it likes, so if that is not enough go back to
+ * loaning and return EBUSY, leaving the miniport running.
+ */
+int
+ndis_drain_rx(struct ndis_softc *sc)
+{
+	int i;
+
+	sc->ndis_rxnoloan = 1;
+	flush_queue(sc->ndis_execq);
+	for (i = 0; sc->ndis_rxloaned != 0; i++) {
+		if (i >= ndis_rxdrain * 10) {
+			device_printf(sc->ndis_dev,
+			    "%u RX packets still on loan\n",
+			    sc->ndis_rxloaned);
+			sc->ndis_rxnoloan = 0;
+			return (EBUSY);
+		}
+		pause("ndisrx", hz / 10);
+	}
+	return (0);
+}
+
+/*
+ * Called once ndis_drain_rx() has succeeded. Returning the loans
+ * queued work for the miniport, so flush that before halting.
+ */
 void
 ndis_halt_nic(struct ndis_softc *sc)
 {
 
-	flush_queue();
+	KASSERT(sc->ndis_rxloaned == 0, ("RX packets on loan"));
+	flush_queue(sc->ndis_execq);
 	KASSERT(sc->ndis_chars != NULL, ("no chars"));
 	KASSERT(sc->ndis_block != NULL, ("no block"));
 	KASSERT(sc->ndis_block->miniport_adapter_ctx != NULL, ("no adapter"));
@@ -849,6 +1603,8 @@ ndis_halt_nic(struct ndis_softc *sc)
 	sc->ndis_block->device_ctx = NULL;
 	NDIS_UNLOCK(sc);
 	MSCALL1(sc->ndis_chars->halt_func, sc->ndis_block->miniport_adapter_ctx);
+	ndis_oid_flush(sc, NDIS_STATUS_REQUEST_ABORTED);
+	ndis_oid_cache_invalidate(sc, NDIS_OIDC_EVT_ALL);
 }
 
 void
@@ -918,6 +1674,13 @@ ndis_init_nic(struct ndis_softc *sc)
 	return (rval);
 }
 
+static struct device_object *
+ndis_fdo_dpc_owner(struct nt_kdpc *dpc)
+{
+
+	return (CONTAINING_RECORD(dpc, struct device_object, dpc));
+}
+
 static void
 ndis_interrupt_setup(struct nt_kdpc *dpc, struct device_object *dobj,
     struct irp *ip, struct ndis_softc *sc)
@@ -941,6 +1704,7 @@ ndis_load_driver(struct driver_object *drv, struct device_object *pdo)
 	struct ndis_miniport_block *block;
 	struct ndis_softc *sc;
 	int32_t status;
+	int nthreads, cpu, lanecpu[WORKQUEUE_MAX], i;
 
 	sc = device_get_softc(pdo->devext);
 	ndis_create_sysctls(sc);
@@ -976,6 +1740,30 @@ ndis_load_driver(struct driver_object *drv, struct device_object *pdo)
 	KeInitializeEvent(&block->resetevent, SYNCHRONIZATION_EVENT, FALSE);
 	InitializeListHead(&block->parmlist);
 	InitializeListHead(&block->returnlist);
+
+	/*
+	 * Give the adapter its own work item and DPC threads, so a
+	 * miniport that blocks in either only holds up itself. Must
+	 * happen before any work items are allocated against the FDO.
+	 */
+	nthreads = ndis_workq_threads;
+	resource_int_value(device_get_name(sc->ndis_dev),
+	    device_get_unit(sc->ndis_dev), "workq_threads", &nthreads);
+	cpu = NOCPU;
+	resource_int_value(device_get_name(sc->ndis_dev),
+	    device_get_unit(sc->ndis_dev), "cpu", &cpu);
+	for (i = 0; i < WORKQUEUE_MAX; i++) {
+		lanecpu[i] = NOCPU;
+		resource_int_value(device_get_name(sc->ndis_dev),
+		    device_get_unit(sc->ndis_dev), ndis_lane_hints[i],
+		    &lanecpu[i]);
+	}
+	sc->ndis_execq = ntoskrnl_execq_create(
+	    device_get_nameunit(sc->ndis_dev), nthreads, cpu, lanecpu);
+	ntoskrnl_execq_attach(fdo, sc->ndis_execq);
+	IoInitializeDpcRequest(fdo, kernndis_functbl[6].wrap);
+	ntoskrnl_execq_bind_dpc(&fdo->dpc, ndis_fdo_dpc_owner);
+
 	block->returnitem = IoAllocateWorkItem(fdo);
 
 	/*
@@ -994,15 +1782,17 @@ ndis_load_driver(struct driver_object *drv, struct device_object *pdo)
 		NdisAllocatePacketPool(&status, &block->rxpool,
 		    32, PROTOCOL_RESERVED_SIZE_IN_PACKET);
 		if (status != NDIS_STATUS_SUCCESS) {
+			IoFreeWorkItem(block->returnitem);
 			IoDetachDevice(block->nextdeviceobj);
 			IoDeleteDevice(fdo);
+			ntoskrnl_execq_destroy(sc->ndis_execq);
+			sc->ndis_execq = NULL;
 			return (status);
 		}
 		InitializeListHead(&block->packet_list);
 	}
 
 	/* Give interrupt handling priority over timers. */
-	IoInitializeDpcRequest(fdo, kernndis_functbl[6].wrap);
 	KeSetImportanceDpc(&fdo->dpc, IMPORTANCE_HIGH);
 
 	/* Finish up BSD-specific setup. */
@@ -1035,5 +1825,7 @@ ndis_unload_driver(struct ndis_softc *sc)
 	IoFreeWorkItem(sc->ndis_block->returnitem);
 	IoDetachDevice(sc->ndis_block->nextdeviceobj);
 	IoDeleteDevice(sc->ndis_block->deviceobj);
+	ntoskrnl_execq_destroy(sc->ndis_execq);
+	sc->ndis_execq = NULL;
 	ndis_flush_sysctls(sc);
 }
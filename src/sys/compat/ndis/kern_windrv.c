@@ -51,6 +51,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/smp.h>
 #include <sys/queue.h>
 #include <sys/taskqueue.h>
+#include <sys/sysctl.h>
 
 #ifdef __amd64__
 #include <machine/fpu.h>
@@ -302,20 +303,94 @@ windrv_unload(vm_offset_t img)
 }
 
 #ifdef __amd64__
-static void
+SYSCTL_DECL(_hw_ndis);
+
+/*
+ * Find KUSER_SHARED_DATA references by scanning every byte of the
+ * image, like we used to, instead of only where an instruction or
+ * aligned pointer can hold one. Only for drivers the latter misses.
+ */
+static int ndis_kuser_scan = 0;
+TUNABLE_INT("hw.ndis.kuser_scan", &ndis_kuser_scan);
+SYSCTL_INT(_hw_ndis, OID_AUTO, kuser_scan, CTLFLAG_RW, &ndis_kuser_scan,
+    0, "Scan whole driver images for KUSER_SHARED_DATA references");
+
+static int
+patch_user_shared_data_slot(vm_offset_t img, vm_offset_t off, int report)
+{
+	unsigned long *addr;
+
+	addr = (unsigned long *)(img + off);
+	if (*addr < KI_USER_SHARED_DATA || *addr >=
+	    KI_USER_SHARED_DATA + sizeof(struct kuser_shared_data))
+		return (0);
+	if (report)
+		printf("NDIS: KUSER_SHARED_DATA reference at offset %#lx\n",
+		    (u_long)off);
+	*addr -= KI_USER_SHARED_DATA;
+	*addr += (unsigned long)&kuser_data;
+	return (1);
+}
+
+/*
+ * Redirect references to KUSER_SHARED_DATA to our copy. These are
+ * absolute constants, not image addresses, so the base relocations
+ * do not list them. Code can only load a 64-bit constant with
+ * MOV r64, imm64 (REX.W B8+r) or MOV to/from moffs64 (A0-A3), so in
+ * code sections only look after those opcodes. Elsewhere only look
+ * at aligned pointers in initialized data.
+ */
+static int
 patch_user_shared_data_address(vm_offset_t img, size_t len)
 {
-	unsigned long i, n, max_addr, *addr;
-
-	n = len - sizeof(unsigned long);
-	max_addr = KI_USER_SHARED_DATA + sizeof(struct kuser_shared_data);
-	for (i = 0; i < n; i++) {
-		addr = (unsigned long *)(img + i);
-		if (*addr >= KI_USER_SHARED_DATA && *addr < max_addr) {
-			*addr -= KI_USER_SHARED_DATA;
-			*addr += (unsigned long)&kuser_data;
+	struct image_section_header *sect;
+	vm_offset_t off, end;
+	uint8_t *p;
+	int i, n = 0;
+
+	pe_get_section_header(img, &sect);
+	for (i = pe_numsections(img); i > 0; i--, sect++) {
+		off = sect->pointer_to_raw_data;
+		end = off + sect->size_of_raw_data;
+		if (off >= len)
+			continue;
+		if (end > len)
+			end = len;
+		if (end - off < sizeof(unsigned long))
+			continue;
+		end -= sizeof(unsigned long);
+		if (sect->characteristics &
+		    (IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE)) {
+			for (; off < end; off++) {
+				p = (uint8_t *)(img + off);
+				if (*p >= 0xa0 && *p <= 0xa3)
+					n += patch_user_shared_data_slot(img,
+					    off + 1, bootverbose);
+				else if ((*p & 0xf8) == 0x48 && off + 1 < end &&
+				    (p[1] & 0xf8) == 0xb8)
+					n += patch_user_shared_data_slot(img,
+					    off + 2, bootverbose);
+			}
+		} else if (sect->characteristics &
+		    IMAGE_SCN_CNT_INITIALIZED_DATA) {
+			for (off = roundup2(off, sizeof(unsigned long));
+			    off <= end; off += sizeof(unsigned long))
+				n += patch_user_shared_data_slot(img, off,
+				    bootverbose);
 		}
 	}
+	return (n);
+}
+
+static int
+patch_user_shared_data_scan(vm_offset_t img, size_t len)
+{
+	vm_offset_t off;
+	int n = 0;
+
+	for (off = 0; off + sizeof(unsigned long) <= len; off++)
+		n += patch_user_shared_data_slot(img, off, 1);
+	return (n);
 }
 #endif
 
@@ -358,7 +433,16 @@ windrv_load(vm_offset_t img, size_t len,
 	/* Dynamically link USBD.SYS -- optional */
 	pe_patch_imports(img, "USBD", usbd_functbl);
 #ifdef __amd64__
-	patch_user_shared_data_address(img, len);
+	if (ndis_kuser_scan) {
+		ret = patch_user_shared_data_scan(img, len);
+		printf("NDIS: full scan patched %d KUSER_SHARED_DATA "
+		    "references\n", ret);
+	} else {
+		ret = patch_user_shared_data_address(img, len);
+		if (bootverbose)
+			printf("NDIS: patched %d KUSER_SHARED_DATA "
+			    "references\n", ret);
+	}
 #endif
 	/* Next step: find the driver entry point. */
 	pe_get_optional_header(img, &opt_hdr);
@@ -617,6 +701,34 @@ windrv_bus_attach(struct driver_object *drv, const char *name)
 	return (0);
 }
 
+/*
+ * Take a fake bus driver back out of the database. Only needed for
+ * a bus that lives in a module of its own; the ones above stay until
+ * windrv_libfini(). The bus must not have any PDOs left on it.
+ */
+int
+windrv_bus_detach(struct driver_object *drv)
+{
+	struct drvdb_ent *d;
+
+	mtx_lock(&drvdb_mtx);
+	STAILQ_FOREACH(d, &drvdb_head, link) {
+		if (d->windrv_object == drv)
+			break;
+	}
+	if (d == NULL || drv->device_object != NULL) {
+		mtx_unlock(&drvdb_mtx);
+		return (d == NULL ? ENOENT : EBUSY);
+	}
+	STAILQ_REMOVE(&drvdb_head, d, drvdb_ent, link);
+	mtx_unlock(&drvdb_mtx);
+
+	free(d, M_NDIS_WINDRV);
+	RtlFreeUnicodeString(&drv->driver_name);
+
+	return (0);
+}
+
 #ifdef __amd64__
 extern void x86_64_wrap(void);
 extern void x86_64_wrap_call(void);
@@ -1726,7 +1726,7 @@ typedef void (*ndis_proc)(struct ndis_work_item *, void *);
 struct ndis_work_item {
 	void			*ctx;
 	ndis_proc		func;
-	struct list_entry	list;
+	uint8_t			wrapper_rsvd[8 * sizeof(void *)];
 };
 
 struct ndis_sc_element {
@@ -1737,6 +1737,50 @@ struct ndis_sc_element {
 
 #define	NDIS_MAXSEG 32
 
+/*
+ * Preallocated MDL used on the transmit path, one vector of
+ * NDIS_MAXSEG of these per TX slot. The page array is big enough
+ * for a misaligned 16k jumbo cluster; mbufs spanning more pages
+ * than that fall back to IoAllocateMdl().
+ */
+#define	NDIS_TXMDL_PAGES	5
+
+struct ndis_txmdl {
+	struct mdl	tm_mdl;
+	vm_offset_t	tm_pages[NDIS_TXMDL_PAGES];
+};
+
+/*
+ * Queued OID request. MiniportQueryInformation() and
+ * MiniportSetInformation() calls must be issued one at a time, so
+ * requests wait on the per-adapter queue until the one in flight
+ * completes. The request owns a copy of the caller's buffer, so a
+ * synchronous caller that gives up waiting does not leave the
+ * miniport writing into a dead stack frame.
+ */
+struct ndis_oidreq;
+typedef void (*ndis_oid_callback)(struct ndis_softc *, struct ndis_oidreq *,
+    void *);
+
+struct ndis_oidreq {
+	TAILQ_ENTRY(ndis_oidreq) nor_link;
+	uint32_t		nor_req;	/* NDIS_REQUEST_* */
+	uint32_t		nor_oid;
+	void			*nor_buf;	/* points past the header */
+	uint32_t		nor_buflen;
+	uint32_t		nor_written;
+	uint32_t		nor_needed;
+	int32_t			nor_status;
+	uint32_t		nor_flags;
+#define	NDIS_OIDREQ_QUEUED	0x01
+#define	NDIS_OIDREQ_DONE	0x02
+#define	NDIS_OIDREQ_ABANDONED	0x04
+#define	NDIS_OIDREQ_PENDING	0x08	/* miniport returned PENDING */
+	ndis_oid_callback	nor_cb;		/* NULL: synchronous */
+	void			*nor_arg;
+	struct nt_kevent	nor_event;
+};
+
 struct ndis_sc_list {
 	uint32_t		frags;
 	uint32_t		*reserved;
@@ -1881,9 +1925,26 @@ struct ndis_packet {
 	void			*softc;
 	void			*m0;
 	int			txidx;
+	int			txstage;
+	uint8_t			loaned;
 	struct list_entry	list;
 };
 
+/*
+ * Per-CPU magazine of free packets sitting in front of the pool's
+ * shared SList, refilled/drained from the shared list in batches.
+ * pm_mtx is almost always taken by its own CPU; other CPUs only take
+ * it to steal packets when both their own magazine and the shared
+ * list are empty.
+ */
+#define	NDIS_PKTMAG_MAX		32
+
+struct ndis_pktmag {
+	struct mtx		pm_mtx;
+	uint32_t		pm_cnt;
+	struct ndis_packet	*pm_pkts[NDIS_PKTMAG_MAX];
+} __aligned(CACHE_LINE_SIZE);
+
 struct ndis_packet_pool {
 	union slist_header	head;
 	struct nt_kevent	event;
@@ -1891,6 +1952,8 @@ struct ndis_packet_pool {
 	uint32_t		cnt;
 	uint32_t		len;
 	void			*pktmem;
+	uint32_t		magsize;	/* 0: no per-CPU caching */
+	struct ndis_pktmag	*mags;
 };
 
 struct ndis_filter_dbs {
@@ -2177,7 +2240,7 @@ void	ndis_libinit(void);
 void	ndis_libfini(void);
 int32_t	ndis_load_driver(struct driver_object *, struct device_object *);
 void	ndis_unload_driver(struct ndis_softc *);
-int	ndis_mtop(struct mbuf *, struct ndis_packet **);
+int	ndis_mtop(struct mbuf **, struct ndis_packet **, struct ndis_txmdl *);
 int	ndis_ptom(struct mbuf **, struct ndis_packet *);
 int	ndis_get(struct ndis_softc *, uint32_t, void *, uint32_t);
 int	ndis_get_int(struct ndis_softc *, uint32_t, uint32_t *);
@@ -2188,13 +2251,23 @@ int	ndis_set(struct ndis_softc *, uint32_t, void *, uint32_t);
 int	ndis_set_int(struct ndis_softc *, uint32_t, uint32_t);
 int	ndis_set_info(struct ndis_softc *, uint32_t, void *, uint32_t,
 	    uint32_t *, uint32_t *);
+int	ndis_request_async(struct ndis_softc *, uint32_t, uint32_t, void *,
+	    uint32_t, ndis_oid_callback, void *);
+void	ndis_oid_init(struct ndis_softc *);
+void	ndis_oid_flush(struct ndis_softc *, int32_t);
+void	ndis_oid_destroy(struct ndis_softc *);
+void	ndis_oid_cache_status(struct ndis_softc *, int32_t);
 void	ndis_send_packets(struct ndis_softc *, struct ndis_packet **, uint32_t);
 int32_t	ndis_send_packet(struct ndis_softc *, struct ndis_packet *);
 int	ndis_convert_res(struct ndis_softc *);
 void	ndis_free_packet(struct ndis_packet *);
+void	ndis_shm_init(struct ndis_softc *);
+void	ndis_shm_destroy(struct ndis_softc *);
+void	ndis_free_txpacket(struct ndis_packet *, struct ndis_txmdl *);
 int32_t	ndis_reset_nic(struct ndis_softc *);
 void	ndis_disable_interrupts_nic(struct ndis_softc *);
 void	ndis_enable_interrupts_nic(struct ndis_softc *);
+int	ndis_drain_rx(struct ndis_softc *);
 void	ndis_halt_nic(struct ndis_softc *);
 void	ndis_shutdown_nic(struct ndis_softc *);
 void	ndis_pnp_event_nic(struct ndis_softc *, uint32_t, uint32_t);
@@ -2204,6 +2277,11 @@ int	ndis_return_packet(struct mbuf *, void *, void *);
 int	ndis_init_dma(struct ndis_softc *);
 void	ndis_destroy_dma(struct ndis_softc *);
 int	ndis_add_sysctl(struct ndis_softc *, char *, char *, char *, int);
+struct ndis_cfglist *ndis_reg_lookup(struct ndis_softc *,
+	    const struct unicode_string *);
+int32_t	ndis_reg_encode(struct ndis_cfglist *, enum ndis_parameter_type,
+	    struct ndis_configuration_parameter **);
+int	ndis_reg_setval(struct ndis_cfglist *, const char *);
 void	NdisAllocatePacketPool(int32_t *, struct ndis_packet_pool **,
 	    uint32_t, uint32_t);
 void	NdisAllocatePacketPoolEx(int32_t *, struct ndis_packet_pool **,
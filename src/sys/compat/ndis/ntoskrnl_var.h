@@ -142,14 +142,27 @@ struct slist_entry {
 	struct slist_entry *sl_next;
 };
 
-union slist_header {  /* FIXME: amd64 */
+/*
+ * The whole header is swapped in one go by the Interlocked SList
+ * routines, using cmpxchg8b on i386 and cmpxchg16b on amd64. The
+ * latter needs the header to be 16 byte aligned, as it is on Windows.
+ */
+union slist_header {
+#ifdef __amd64__
+	uint64_t	slh_align[2];
+#else
 	uint64_t	slh_align;
+#endif
 	struct {
 		struct slist_entry	*slh_next;
 		uint16_t 		slh_depth;
 		uint16_t		slh_seq;
 	} slh_list;
-};
+}
+#ifdef __amd64__
+__aligned(16)
+#endif
+;
 
 struct list_entry {
 	struct list_entry	*flink;
@@ -292,7 +305,7 @@ struct nt_kdpc {
 	void			*deferredctx;
 	void			*sysarg1;
 	void			*sysarg2;
-	void			*lock;
+	void			*lock;		/* owning DPC queue */
 };
 
 enum kdpc_importance {
@@ -592,10 +605,14 @@ struct device_object {
 	void			*rsvd;
 };
 
+struct ntoskrnl_execq;
+
 struct devobj_extension {
 	uint16_t		type;
 	uint16_t		size;
 	struct device_object	*devobj;
+	/* Private to us, Windows drivers treat this as opaque. */
+	struct ntoskrnl_execq	*execq;
 };
 
 /* Device object flags */
@@ -917,8 +934,10 @@ struct irp {
 		union {
 			struct kapc	apc;
 			struct {
-				void	*ep;
-				void	*dev;
+				void			*ep;
+				void			*dev;
+				struct list_entry	tasklist;
+				uint32_t		tasktype;
 			} usb;
 		} misc;
 		void	*compkey;
@@ -927,6 +946,8 @@ struct irp {
 
 #define	IRP_NDIS_DEV(irp) (irp)->tail.misc.usb.dev
 #define	IRP_NDISUSB_EP(irp) (irp)->tail.misc.usb.ep
+#define	IRP_NDISUSB_TASK(irp) (irp)->tail.misc.usb.tasklist
+#define	IRP_NDISUSB_TASKTYPE(irp) (irp)->tail.misc.usb.tasktype
 
 #define	InterlockedExchangePointer(dst, val)				\
 	(void *)InterlockedExchange((uint32_t *)(dst), (uintptr_t)(val))
@@ -1129,13 +1150,18 @@ struct io_workitem {
 	void			*ctx;
 	struct list_entry	list;
 	struct device_object	*dobj;
+	struct ntoskrnl_execq	*execq;		/* NULL: shared queue */
+	int			lane;		/* work_queue_type */
+	sbintime_t		queued;
 	struct task		tq_item;
 };
 
+/* Values match WORK_QUEUE_TYPE, Windows drivers pass them directly. */
 enum work_queue_type {
-	DELAYED,
 	CRITICAL,
-	HYPERCRITICAL
+	DELAYED,
+	HYPERCRITICAL,
+	WORKQUEUE_MAX
 };
 
 #define	NDIS_KSTACK_PAGES	12
@@ -1162,6 +1188,11 @@ extern struct kuser_shared_data kuser_data;
 #endif
 typedef void (*funcptr)(void);
 typedef int (*matchfuncptr)(uint32_t, void *, void *);
+/* Finds the device object a bound DPC belongs to. */
+typedef struct device_object *(*ntoskrnl_dpc_owner)(struct nt_kdpc *);
+
+struct sysctl_ctx_list;
+struct sysctl_oid;
 
 void	windrv_libinit(void);
 void	windrv_libfini(void);
@@ -1169,6 +1200,7 @@ struct drvdb_ent	*windrv_match(matchfuncptr, void *);
 int32_t	windrv_create_pdo(struct driver_object *, device_t);
 void	windrv_destroy_pdo(struct driver_object *, device_t);
 int	windrv_bus_attach(struct driver_object *, const char *);
+int	windrv_bus_detach(struct driver_object *);
 void	windrv_wrap(funcptr, funcptr *, uint8_t, enum windrv_wrap_type);
 void	windrv_unwrap(funcptr);
 void	windrv_wrap_table(struct image_patch_table *);
@@ -1178,7 +1210,14 @@ void	ntoskrnl_libfini(void);
 void	ntoskrnl_intr(void *);
 void	ntoskrnl_time(uint64_t *);
 void	schedule_ndis_work_item(void *);
-void	flush_queue(void);
+void	flush_queue(struct ntoskrnl_execq *);
+struct ntoskrnl_execq *ntoskrnl_execq_create(const char *, int, int,
+	    const int *);
+void	ntoskrnl_execq_destroy(struct ntoskrnl_execq *);
+void	ntoskrnl_execq_sysctls(struct ntoskrnl_execq *,
+	    struct sysctl_ctx_list *, struct sysctl_oid *);
+void	ntoskrnl_execq_attach(struct device_object *, struct ntoskrnl_execq *);
+void	ntoskrnl_execq_bind_dpc(struct nt_kdpc *, ntoskrnl_dpc_owner);
 uint16_t ExQueryDepthSList(union slist_header *);
 struct slist_entry *InterlockedPushEntrySList(union slist_header *,
 	    struct slist_entry *);
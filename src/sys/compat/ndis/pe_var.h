@@ -238,6 +238,11 @@ struct image_section_header {
 	uint32_t	characteristics;
 };
 
+/* Section characteristics */
+#define	IMAGE_SCN_CNT_CODE			0x00000020
+#define	IMAGE_SCN_CNT_INITIALIZED_DATA		0x00000040
+#define	IMAGE_SCN_MEM_EXECUTE			0x20000000
+
 /* Import format */
 struct image_import_by_name {
 	uint16_t	hint;
@@ -252,6 +257,8 @@ struct image_import_by_name {
 #define	IMAGE_ORDINAL_FLAG	0x8000000000000000UL
 #endif
 
+#define	IMAGE_ORDINAL(x)	((x) & 0xffff)
+
 struct image_import_descriptor {
 	union {
 		uint32_t	characteristics;
@@ -438,10 +445,27 @@ uint32_t x86_stdcall_call(void *, int, ...);
 #define	IMPORT_SFUNC_MAP(x, y, z)	{ #x, (FUNC)y, NULL, z, STDCALL }
 #endif /* __i386__ */
 
+/*
+ * Everything pe_image_translate() needs, parsed from the headers once
+ * by pe_image_init() rather than on every address translation.
+ */
+struct pe_image {
+	vm_offset_t			pi_base;
+	struct image_section_header	*pi_sect;
+	int				pi_nsect;
+	uint32_t			pi_align;
+	int				pi_sorted;	/* by virtual address */
+};
+
+void	pe_image_init(struct pe_image *, vm_offset_t);
+vm_offset_t pe_image_translate(const struct pe_image *, vm_offset_t);
 void	pe_get_optional_header(vm_offset_t, struct image_optional_header **);
 void	pe_get_section_header(vm_offset_t, struct image_section_header **);
 int	pe_get_message(vm_offset_t, uint32_t, char **, int *, uint16_t *);
 int	pe_patch_imports(vm_offset_t, const char *, struct image_patch_table *);
+void	pe_functbl_sort(struct image_patch_table *);
+struct image_patch_table *pe_functbl_lookup(struct image_patch_table *,
+	    const char *);
 int	pe_numsections(vm_offset_t);
 int	pe_relocate(vm_offset_t);
 int	pe_validate_header(vm_offset_t);
@@ -43,6 +43,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/module.h>
 #include <sys/malloc.h>
 #include <sys/queue.h>
+#include <sys/smp.h>
 #include <sys/taskqueue.h>
 
 #include <sys/systm.h>
@@ -72,21 +73,51 @@ static void	WRITE_PORT_UCHAR(uint8_t *, uint8_t);
 static void	_KeLowerIrql(uint8_t);
 static void	dummy(void);
 
-static struct mtx disp_lock;
+MALLOC_DEFINE(M_NDIS_HAL, "ndis_hal", "ndis_hal buffers");
+
+/*
+ * IRQL is tracked per CPU, as on Windows. Being at DISPATCH_LEVEL
+ * means owning the dispatch lock of the CPU we're on, and we pin
+ * ourselves to that CPU for as long as we stay there. This keeps
+ * code at DISPATCH_LEVEL (DPCs included) from running concurrently
+ * on the same CPU, while other CPUs are free to do the same.
+ *
+ * We can't use critical_enter() here, since miniports routinely
+ * do things at DISPATCH_LEVEL that end up sleeping on a mutex
+ * (KeSetEvent(), work item queueing and so on).
+ */
+struct hal_disp {
+	struct mtx		lock;
+	u_int			spins;	/* see hal_spin_raise() */
+} __aligned(CACHE_LINE_SIZE);
+
+static struct hal_disp *disp_locks;
+
+#define	HAL_DISP()		(&disp_locks[curcpu])
+#define	HAL_DISP_LOCK()		(&HAL_DISP()->lock)
 
 void
 hal_libinit(void)
 {
+	int cpu;
 
-	mtx_init(&disp_lock, "HAL lock", NULL, MTX_DEF | MTX_RECURSE);
+	disp_locks = malloc(sizeof(struct hal_disp) * (mp_maxid + 1),
+	    M_NDIS_HAL, M_WAITOK|M_ZERO);
+	CPU_FOREACH(cpu)
+		mtx_init(&disp_locks[cpu].lock, "HAL lock", NULL,
+		    MTX_DEF | MTX_RECURSE);
 	windrv_wrap_table(hal_functbl);
+	pe_functbl_sort(hal_functbl);
 }
 
 void
 hal_libfini(void)
 {
+	int cpu;
 
-	mtx_destroy(&disp_lock);
+	CPU_FOREACH(cpu)
+		mtx_destroy(&disp_locks[cpu].lock);
+	free(disp_locks, M_NDIS_HAL);
 	windrv_unwrap_table(hal_functbl);
 }
 
@@ -207,10 +238,14 @@ KfReleaseSpinLock(unsigned long *lock, uint8_t newirql)
 	KeLowerIrql(newirql);
 }
 
+/*
+ * A thread at DISPATCH_LEVEL is pinned, so if it owns a dispatch
+ * lock at all, it's the one for the CPU it's running on.
+ */
 uint8_t
 KeGetCurrentIrql(void)
 {
-	if (mtx_owned(&disp_lock))
+	if (mtx_owned(HAL_DISP_LOCK()))
 		return (DISPATCH_LEVEL);
 	return (PASSIVE_LEVEL);
 }
@@ -232,8 +267,10 @@ KfRaiseIrql(uint8_t newirql)
 	TRACE(NDBG_HAL, "newirql %u\n", newirql);
 	oldirql = KeGetCurrentIrql();
 	KASSERT(oldirql <= newirql, ("newirql not less"));
-	if (oldirql != DISPATCH_LEVEL)
-		mtx_lock(&disp_lock);
+	if (oldirql != DISPATCH_LEVEL) {
+		sched_pin();
+		mtx_lock(HAL_DISP_LOCK());
+	}
 	return (oldirql);
 }
 
@@ -245,7 +282,43 @@ KfLowerIrql(uint8_t oldirql)
 		return;
 
 	KASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL, ("irql not greater"));
-	mtx_unlock(&disp_lock);
+	HAL_DISP()->spins = 0;
+	mtx_unlock(HAL_DISP_LOCK());
+	sched_unpin();
+}
+
+/*
+ * Spinlocks are always held at DISPATCH_LEVEL, but the AtDpcLevel
+ * routines get called below it too, and have nowhere to hand back
+ * the IRQL they found. So the first such lock raises, and we count
+ * it and every lock taken after it, at the CPU we're now pinned to;
+ * IRQL only drops back when the last of them is released, in
+ * whatever order that happens. Locks taken at a real DISPATCH_LEVEL
+ * aren't counted. The count belongs to the dispatch lock owner.
+ */
+void
+hal_spin_raise(void)
+{
+	struct hal_disp *d;
+
+	if (KeGetCurrentIrql() != DISPATCH_LEVEL) {
+		KfRaiseIrql(DISPATCH_LEVEL);
+		HAL_DISP()->spins = 1;
+		return;
+	}
+	d = HAL_DISP();
+	if (d->spins != 0)
+		d->spins++;
+}
+
+void
+hal_spin_lower(void)
+{
+	struct hal_disp *d;
+
+	d = HAL_DISP();
+	if (d->spins != 0 && --d->spins == 0)
+		KfLowerIrql(PASSIVE_LEVEL);
 }
 
 static uint8_t
@@ -50,6 +50,7 @@ __FBSDID("$FreeBSD$");
 
 #include <sys/ctype.h>
 #include <sys/param.h>
+#include <sys/bitstring.h>
 
 #include <sys/kernel.h>
 #include <sys/systm.h>
@@ -123,11 +124,8 @@ static void NdisOpenConfigurationKeyByIndex(int32_t *, void *,
     uint32_t, struct unicode_string *, void **);
 static void NdisOpenConfigurationKeyByName(int32_t *, void *,
     struct unicode_string *, void **);
-static int32_t ndis_encode_parm(struct ndis_miniport_block *,
-    struct sysctl_oid *, enum ndis_parameter_type,
-    struct ndis_configuration_parameter **);
 static int32_t ndis_decode_parm(struct ndis_miniport_block *,
-    struct ndis_configuration_parameter *, char *);
+    struct ndis_configuration_parameter *, char *, size_t);
 static void NdisReadConfiguration(int32_t *,
     struct ndis_configuration_parameter **, struct ndis_miniport_block *,
     struct unicode_string *, enum ndis_parameter_type);
@@ -177,6 +175,8 @@ static void NdisMSleep(uint32_t);
 static void NdisMCancelTimer(struct ndis_miniport_timer *, uint8_t *);
 static void ndis_timercall(struct nt_kdpc *, struct ndis_miniport_timer *,
     void *, void *);
+static struct device_object *ndis_timer_dpc_owner(struct nt_kdpc *);
+static struct device_object *ndis_intr_dpc_owner(struct nt_kdpc *);
 static void NdisMQueryAdapterResources(int32_t *, struct ndis_miniport_block *,
     struct cm_partial_resource_list *, uint32_t *);
 static int32_t NdisMRegisterIoPortRange(void **, struct ndis_miniport_block *,
@@ -316,6 +316,7 @@ ndis_libinit(void)
 	windrv_wrap((funcptr)ndis_intrhand,
 	    &ndis_intrhand_wrap, 4, STDCALL);
 	windrv_wrap_table(ndis_functbl);
+	pe_functbl_sort(ndis_functbl);
 }
 
 void
@@ -484,55 +485,15 @@ NdisOpenConfigurationKeyByIndex(int32_t *status, void  *cfg,
 	*status = NDIS_STATUS_FAILURE;
 }
 
-static int32_t
-ndis_encode_parm(struct ndis_miniport_block *block, struct sysctl_oid *oid,
-    enum ndis_parameter_type type, struct ndis_configuration_parameter **parm)
-{
-	struct ndis_configuration_parameter *p;
-	struct ndis_parmlist_entry *np;
-	struct ansi_string as;
-
-	np = malloc(sizeof(struct ndis_parmlist_entry),
-	    M_NDIS_SUBR, M_NOWAIT|M_ZERO);
-	if (np == NULL)
-		return (NDIS_STATUS_RESOURCES);
-	InsertHeadList(&block->parmlist, &np->list);
-	*parm = p = &np->parm;
-	p->type = type;
-
-	switch (type) {
-	case NDIS_PARAMETER_STRING:
-		RtlInitAnsiString(&as, (char *)oid->oid_arg1);
-		if (RtlAnsiStringToUnicodeString(&p->data.string, &as, TRUE)) {
-			free(np, M_NDIS_SUBR);
-			return (NDIS_STATUS_RESOURCES);
-		}
-		break;
-	case NDIS_PARAMETER_INTEGER:
-		p->data.integer = strtol((char *)oid->oid_arg1, NULL, 0);
-		break;
-	case NDIS_PARAMETER_HEX_INTEGER:
-		p->data.integer = strtoul((char *)oid->oid_arg1, NULL, 16);
-		break;
-	case NDIS_PARAMETER_BINARY:
-		p->data.integer = strtoul((char *)oid->oid_arg1, NULL, 2);
-		break;
-	default:
-		return (NDIS_STATUS_FAILURE);
-	}
-	return (NDIS_STATUS_SUCCESS);
-}
-
 static void
 NdisReadConfiguration(int32_t *status,
     struct ndis_configuration_parameter **parm,
     struct ndis_miniport_block *block, struct unicode_string *key,
     enum ndis_parameter_type type)
 {
-	struct sysctl_ctx_entry *e;
 	struct ansi_string as;
 	struct ndis_softc *sc;
-	struct sysctl_oid *oidp;
+	struct ndis_cfglist *cfg;
 
 	KASSERT(block != NULL, ("no block"));
 	KASSERT(block->physdeviceobj != NULL, ("no physdeviceobj"));
@@ -542,33 +503,26 @@ NdisReadConfiguration(int32_t *status,
 		return;
 	}
 
-	if (RtlUnicodeStringToAnsiString(&as, key, TRUE)) {
-		*status = NDIS_STATUS_RESOURCES;
-		return;
-	}
-
-	TRACE(NDBG_CFG, "block %p key %s type %u\n", block, as.buf, type);
-
 	/*
 	 * See if registry key is already in a list of known keys
 	 * included with the driver.
 	 */
 	sc = device_get_softc(block->physdeviceobj->devext);
-	TAILQ_FOREACH(e, device_get_sysctl_ctx(sc->ndis_dev), link) {
-		oidp = e->entry;
-		if (strcasecmp(oidp->oid_name, as.buf) == 0) {
-			if (strcmp((char *)oidp->oid_arg1, "UNSET") == 0) {
-				RtlFreeAnsiString(&as);
-				*status = NDIS_STATUS_FAILURE;
-				return;
-			}
+	cfg = ndis_reg_lookup(sc, key);
+	if (cfg != NULL) {
+		*status = ndis_reg_encode(cfg, type, parm);
+		TRACE(NDBG_CFG, "block %p key %s type %u status %08X\n",
+		    block, cfg->ndis_cfg.key, type, *status);
+		return;
+	}
 
-			*status = ndis_encode_parm(block, oidp, type, parm);
-			RtlFreeAnsiString(&as);
-			return;
-		}
+	if (RtlUnicodeStringToAnsiString(&as, key, TRUE)) {
+		*status = NDIS_STATUS_RESOURCES;
+		return;
 	}
 
+	TRACE(NDBG_CFG, "block %p key %s type %u\n", block, as.buf, type);
+
 	/*
 	 * If the key didn't match, add it to the list of dynamically
 	 * created ones. Sometimes, drivers refer to registry keys
@@ -599,7 +553,7 @@ NdisReadConfiguration(int32_t *status,
 
 static int32_t
 ndis_decode_parm(struct ndis_miniport_block *block,
-    struct ndis_configuration_parameter *parm, char *val)
+    struct ndis_configuration_parameter *parm, char *val, size_t len)
 {
 	struct ansi_string as;
 	struct unicode_string *ustr;
@@ -609,17 +563,17 @@ ndis_decode_parm(struct ndis_miniport_block *block,
 		ustr = &parm->data.string;
 		if (RtlUnicodeStringToAnsiString(&as, ustr, TRUE))
 			return (NDIS_STATUS_RESOURCES);
-		memcpy(val, as.buf, as.len);
+		memcpy(val, as.buf, min(as.len, len - 1));
 		RtlFreeAnsiString(&as);
 		break;
 	case NDIS_PARAMETER_INTEGER:
-		snprintf(val, sizeof(uint32_t), "%d", parm->data.integer);
+		snprintf(val, len, "%d", parm->data.integer);
 		break;
 	case NDIS_PARAMETER_HEX_INTEGER:
-		snprintf(val, sizeof(uint32_t), "%x", parm->data.integer);
+		snprintf(val, len, "%x", parm->data.integer);
 		break;
 	case NDIS_PARAMETER_BINARY:
-		snprintf(val, sizeof(uint32_t), "%u", parm->data.integer);
+		snprintf(val, len, "%u", parm->data.integer);
 		break;
 	default:
 		return (NDIS_STATUS_FAILURE);
@@ -633,37 +587,31 @@ NdisWriteConfiguration(int32_t *status, struct ndis_miniport_block *block,
 {
 	struct ansi_string as;
 	struct ndis_softc *sc;
-	struct sysctl_oid *oidp;
-	struct sysctl_ctx_entry *e;
-	char val[256];
+	struct ndis_cfglist *cfg;
+	char val[NDIS_REG_VALLEN];
 
 	KASSERT(block != NULL, ("no block"));
 	KASSERT(block->physdeviceobj != NULL, ("no physdeviceobj"));
 
-	if (RtlUnicodeStringToAnsiString(&as, key, TRUE)) {
-		*status = NDIS_STATUS_RESOURCES;
-		return;
-	}
-
-	TRACE(NDBG_CFG, "block %p key %s\n", block, as.buf);
-
 	memset(val, 0, sizeof(val));
-	*status = ndis_decode_parm(block, parm, val);
-	if (*status != NDIS_STATUS_SUCCESS) {
-		RtlFreeAnsiString(&as);
+	*status = ndis_decode_parm(block, parm, val, sizeof(val));
+	if (*status != NDIS_STATUS_SUCCESS)
 		return;
-	}
 
 	sc = device_get_softc(block->physdeviceobj->devext);
-	TAILQ_FOREACH(e, device_get_sysctl_ctx(sc->ndis_dev), link) {
-		oidp = e->entry;
-		if (strcasecmp(oidp->oid_name, as.buf) == 0) {
-			strcpy((char *)oidp->oid_arg1, val);
-			RtlFreeAnsiString(&as);
-			return;
-		}
+	cfg = ndis_reg_lookup(sc, key);
+	if (cfg != NULL) {
+		TRACE(NDBG_CFG, "block %p key %s\n", block, cfg->ndis_cfg.key);
+		if (ndis_reg_setval(cfg, val))
+			*status = NDIS_STATUS_RESOURCES;
+		return;
 	}
 
+	if (RtlUnicodeStringToAnsiString(&as, key, TRUE)) {
+		*status = NDIS_STATUS_RESOURCES;
+		return;
+	}
+	TRACE(NDBG_CFG, "block %p key %s\n", block, as.buf);
 	ndis_add_sysctl(sc, as.buf, "(dynamically set key)", val, CTLFLAG_RW);
 	RtlFreeAnsiString(&as);
 }
@@ -973,6 +921,15 @@ ndis_timercall(struct nt_kdpc *kdpc, struct ndis_miniport_timer *timer,
 		KeReleaseSpinLockFromDpcLevel(&timer->block->lock);
 }
 
+static struct device_object *
+ndis_timer_dpc_owner(struct nt_kdpc *kdpc)
+{
+	struct ndis_miniport_timer *timer;
+
+	timer = CONTAINING_RECORD(kdpc, struct ndis_miniport_timer, kdpc);
+	return (timer->block->deviceobj);
+}
+
 static void
 NdisMInitializeTimer(struct ndis_miniport_timer *timer,
     struct ndis_miniport_block *block, ndis_timer_function func, void *ctx)
@@ -994,6 +951,7 @@ NdisMInitializeTimer(struct ndis_miniport_timer *timer,
 	 */
 	KeInitializeTimer(&timer->ktimer);
 	KeInitializeDpc(&timer->kdpc, ndis_timercall_wrap, timer);
+	ntoskrnl_execq_bind_dpc(&timer->kdpc, ndis_timer_dpc_owner);
 	timer->ktimer.dpc = &timer->kdpc;
 }
 
@@ -1205,26 +1163,100 @@ ndis_mapshared_cb(void *arg, bus_dma_segment_t *segs, int nseg, int error)
 	*paddr = segs[0].ds_addr;
 }
 
+void
+ndis_shm_init(struct ndis_softc *sc)
+{
+	struct ndis_shmpool *nsp = &sc->ndis_shm;
+	int i;
+
+	mtx_init(&nsp->nsp_mtx, "ndis shmem", NULL, MTX_DEF);
+	for (i = 0; i < NDIS_SHM_CLASSES; i++)
+		TAILQ_INIT(&nsp->nsp_partial[i]);
+	for (i = 0; i < NDIS_SHM_HASHSIZE; i++) {
+		LIST_INIT(&nsp->nsp_vhash[i]);
+		LIST_INIT(&nsp->nsp_phash[i]);
+	}
+}
+
 static void
-NdisMAllocateSharedMemory(struct ndis_miniport_block *block, uint32_t len,
-    uint8_t cached, void **vaddr, uint64_t *paddr)
+ndis_shm_release(struct ndis_shmem *sh)
 {
-	struct ndis_softc *sc;
+	bus_dmamap_unload(sh->ndis_stag, sh->ndis_smap);
+	bus_dmamem_free(sh->ndis_stag, sh->ndis_saddr, sh->ndis_smap);
+	/* Slab chunks share the pool's tag. */
+	if (sh->ndis_class == -1)
+		bus_dma_tag_destroy(sh->ndis_stag);
+	free(sh, M_NDIS_SUBR);
+}
+
+/*
+ * Release whatever the miniport did not free itself before it was
+ * halted.
+ */
+void
+ndis_shm_destroy(struct ndis_softc *sc)
+{
+	struct ndis_shmpool *nsp = &sc->ndis_shm;
 	struct ndis_shmem *sh;
+	int i;
 
-	TRACE(NDBG_DMA, "block %p len %u cached %u vaddr %p paddr %p\n",
-	    block, len, cached, vaddr, paddr);
-	KASSERT(block != NULL, ("no block"));
-	KASSERT(block->physdeviceobj != NULL, ("no physdeviceobj"));
-	sc = device_get_softc(block->physdeviceobj->devext);
+	for (i = 0; i < NDIS_SHM_HASHSIZE; i++) {
+		while ((sh = LIST_FIRST(&nsp->nsp_vhash[i])) != NULL) {
+			LIST_REMOVE(sh, ndis_vlink);
+			ndis_shm_release(sh);
+		}
+	}
+	if (nsp->nsp_chunktag != NULL)
+		bus_dma_tag_destroy(nsp->nsp_chunktag);
+	mtx_destroy(&nsp->nsp_mtx);
+}
+
+static void
+ndis_shm_insert(struct ndis_shmpool *nsp, struct ndis_shmem *sh)
+{
+	mtx_assert(&nsp->nsp_mtx, MA_OWNED);
+	LIST_INSERT_HEAD(&nsp->nsp_vhash[NDIS_SHM_HASH((uintptr_t)
+	    sh->ndis_saddr)], sh, ndis_vlink);
+	LIST_INSERT_HEAD(&nsp->nsp_phash[NDIS_SHM_HASH(sh->ndis_paddr)],
+	    sh, ndis_plink);
+	nsp->nsp_backing += sh->ndis_len;
+	if (sh->ndis_class == -1)
+		nsp->nsp_large++;
+	else
+		nsp->nsp_chunks++;
+}
+
+static void
+ndis_shm_remove(struct ndis_shmpool *nsp, struct ndis_shmem *sh)
+{
+	mtx_assert(&nsp->nsp_mtx, MA_OWNED);
+	LIST_REMOVE(sh, ndis_vlink);
+	LIST_REMOVE(sh, ndis_plink);
+	nsp->nsp_backing -= sh->ndis_len;
+	if (sh->ndis_class == -1)
+		nsp->nsp_large--;
+	else
+		nsp->nsp_chunks--;
+}
+
+/*
+ * Get one physically contiguous, zeroed DMA buffer of len bytes
+ * using the given tag, or a tag of its own if tag is NULL.
+ */
+static struct ndis_shmem *
+ndis_shm_backing(struct ndis_softc *sc, bus_dma_tag_t tag, uint32_t len)
+{
+	struct ndis_shmem *sh;
 
 	sh = malloc(sizeof(struct ndis_shmem), M_NDIS_SUBR, M_NOWAIT|M_ZERO);
 	if (sh == NULL)
-		return;
-
-	InitializeListHead(&sh->ndis_list);
+		return (NULL);
 
-	if (bus_dma_tag_create(sc->ndis_parent_tag,
+	sh->ndis_len = len;
+	sh->ndis_class = -1;
+	if (tag != NULL)
+		sh->ndis_stag = tag;
+	else if (bus_dma_tag_create(sc->ndis_parent_tag,
 			ETHER_ALIGN, 0,
 			BUS_SPACE_MAXADDR_32BIT,
 			BUS_SPACE_MAXADDR,
@@ -1237,37 +1269,158 @@ NdisMAllocateSharedMemory(struct ndis_miniport_block *block, uint32_t len,
 			NULL,
 			&sh->ndis_stag) != 0) {
 		free(sh, M_NDIS_SUBR);
-		return;
+		return (NULL);
 	}
 
-	if (bus_dmamem_alloc(sh->ndis_stag, vaddr,
+	if (bus_dmamem_alloc(sh->ndis_stag, &sh->ndis_saddr,
 	    BUS_DMA_NOWAIT | BUS_DMA_ZERO, &sh->ndis_smap) != 0) {
-		bus_dma_tag_destroy(sh->ndis_stag);
+		if (tag == NULL)
+			bus_dma_tag_destroy(sh->ndis_stag);
 		free(sh, M_NDIS_SUBR);
-		return;
+		return (NULL);
 	}
 
-	if (bus_dmamap_load(sh->ndis_stag, sh->ndis_smap, *vaddr,
-	    len, ndis_mapshared_cb, paddr, BUS_DMA_NOWAIT) != 0) {
-		bus_dmamem_free(sh->ndis_stag, *vaddr, sh->ndis_smap);
-		bus_dma_tag_destroy(sh->ndis_stag);
+	if (bus_dmamap_load(sh->ndis_stag, sh->ndis_smap, sh->ndis_saddr,
+	    len, ndis_mapshared_cb, &sh->ndis_paddr, BUS_DMA_NOWAIT) != 0 ||
+	    sh->ndis_paddr == 0) {
+		bus_dmamem_free(sh->ndis_stag, sh->ndis_saddr, sh->ndis_smap);
+		if (tag == NULL)
+			bus_dma_tag_destroy(sh->ndis_stag);
 		free(sh, M_NDIS_SUBR);
-		return;
+		return (NULL);
 	}
 
+	return (sh);
+}
+
+/*
+ * Find the chunk or allocation containing vaddr, or failing that
+ * the one containing paddr. Returns the byte offset of the address
+ * within it through *off.
+ */
+static struct ndis_shmem *
+ndis_shm_lookup(struct ndis_shmpool *nsp, void *vaddr, uint64_t paddr,
+    uint32_t *off)
+{
+	struct ndis_shmem *sh;
+	uintptr_t va = (uintptr_t)vaddr;
+
+	mtx_assert(&nsp->nsp_mtx, MA_OWNED);
+	LIST_FOREACH(sh, &nsp->nsp_vhash[NDIS_SHM_HASH(va)], ndis_vlink) {
+		if (va >= (uintptr_t)sh->ndis_saddr &&
+		    va < (uintptr_t)sh->ndis_saddr + sh->ndis_len) {
+			*off = va - (uintptr_t)sh->ndis_saddr;
+			return (sh);
+		}
+	}
 	/*
-	 * Save the physical address along with the source address.
 	 * The AirGo MIMO driver will call NdisMFreeSharedMemory()
 	 * with a bogus virtual address sometimes, but with a valid
 	 * physical address. To keep this from causing trouble, we
 	 * use the physical address to as a sanity check in case
 	 * searching based on the virtual address fails.
 	 */
-	NDIS_LOCK(sc);
-	sh->ndis_paddr = *paddr;
-	sh->ndis_saddr = *vaddr;
-	InsertHeadList(&sc->ndis_shlist, &sh->ndis_list);
-	NDIS_UNLOCK(sc);
+	LIST_FOREACH(sh, &nsp->nsp_phash[NDIS_SHM_HASH(paddr)], ndis_plink) {
+		if (paddr >= sh->ndis_paddr &&
+		    paddr < sh->ndis_paddr + sh->ndis_len) {
+			*off = paddr - sh->ndis_paddr;
+			return (sh);
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+NdisMAllocateSharedMemory(struct ndis_miniport_block *block, uint32_t len,
+    uint8_t cached, void **vaddr, uint64_t *paddr)
+{
+	struct ndis_softc *sc;
+	struct ndis_shmpool *nsp;
+	struct ndis_shmem *sh;
+	uint32_t size;
+	int cls, idx;
+
+	TRACE(NDBG_DMA, "block %p len %u cached %u vaddr %p paddr %p\n",
+	    block, len, cached, vaddr, paddr);
+	KASSERT(block != NULL, ("no block"));
+	KASSERT(block->physdeviceobj != NULL, ("no physdeviceobj"));
+	sc = device_get_softc(block->physdeviceobj->devext);
+	nsp = &sc->ndis_shm;
+
+	*vaddr = NULL;
+	*paddr = 0;
+	if (len == 0)
+		return;
+
+	/* Too big for a slab chunk: give it memory of its own. */
+	if (len > (1 << NDIS_SHM_MAXSHIFT)) {
+		sh = ndis_shm_backing(sc, NULL, len);
+		if (sh == NULL)
+			return;
+		mtx_lock(&nsp->nsp_mtx);
+		ndis_shm_insert(nsp, sh);
+		nsp->nsp_allocs++;
+		nsp->nsp_bytes += len;
+		mtx_unlock(&nsp->nsp_mtx);
+		*vaddr = sh->ndis_saddr;
+		*paddr = sh->ndis_paddr;
+		return;
+	}
+
+	for (cls = 0; (1 << (cls + NDIS_SHM_MINSHIFT)) < len; cls++)
+		;
+	size = 1 << (cls + NDIS_SHM_MINSHIFT);
+
+	mtx_lock(&nsp->nsp_mtx);
+	if (nsp->nsp_chunktag == NULL) {
+		/*
+		 * Chunks are whole pages, page aligned, so every object
+		 * in them is naturally aligned to its class size and one
+		 * tag serves all classes.
+		 */
+		if (bus_dma_tag_create(sc->ndis_parent_tag,
+				PAGE_SIZE, 0,
+				BUS_SPACE_MAXADDR_32BIT,
+				BUS_SPACE_MAXADDR,
+				NULL, NULL,
+				PAGE_SIZE,
+				1,
+				PAGE_SIZE,
+				0,
+				NULL,
+				NULL,
+				&nsp->nsp_chunktag) != 0) {
+			mtx_unlock(&nsp->nsp_mtx);
+			return;
+		}
+	}
+	sh = TAILQ_FIRST(&nsp->nsp_partial[cls]);
+	if (sh == NULL) {
+		mtx_unlock(&nsp->nsp_mtx);
+		sh = ndis_shm_backing(sc, nsp->nsp_chunktag, PAGE_SIZE);
+		if (sh == NULL)
+			return;
+		sh->ndis_class = cls;
+		mtx_lock(&nsp->nsp_mtx);
+		ndis_shm_insert(nsp, sh);
+		TAILQ_INSERT_HEAD(&nsp->nsp_partial[cls], sh, ndis_partial);
+	}
+
+	bit_ffc(sh->ndis_used, PAGE_SIZE / size, &idx);
+	KASSERT(idx != -1, ("full shared memory chunk on partial list"));
+	bit_set(sh->ndis_used, idx);
+	if (++sh->ndis_inuse == PAGE_SIZE / size)
+		TAILQ_REMOVE(&nsp->nsp_partial[cls], sh, ndis_partial);
+	nsp->nsp_objects++;
+	nsp->nsp_allocs++;
+	nsp->nsp_bytes += size;
+	mtx_unlock(&nsp->nsp_mtx);
+
+	*vaddr = (char *)sh->ndis_saddr + idx * size;
+	*paddr = sh->ndis_paddr + idx * size;
+	/* Fresh chunks come zeroed, recycled objects do not. */
+	bzero(*vaddr, size);
 }
 
 struct ndis_allocwork {
@@ -1340,51 +1493,61 @@ NdisMFreeSharedMemory(struct ndis_miniport_block *block,
     uint32_t len, uint8_t cached, void *vaddr, uint64_t paddr)
 {
 	struct ndis_softc *sc;
-	struct ndis_shmem *sh = NULL;
-	struct list_entry *l;
+	struct ndis_shmpool *nsp;
+	struct ndis_shmem *sh;
+	uint32_t off, size;
+	int idx;
 
 	TRACE(NDBG_DMA, "block %p len %u cached %u vaddr %p paddr %"PRIu64"\n",
 	    block, len, cached, vaddr, paddr);
 	KASSERT(block != NULL, ("no block"));
 	KASSERT(block->physdeviceobj != NULL, ("no physdeviceobj"));
-
-	/* Sanity check: is list empty? */
 	sc = device_get_softc(block->physdeviceobj->devext);
-	if (IsListEmpty(&sc->ndis_shlist))
-		return;
+	nsp = &sc->ndis_shm;
 
-	NDIS_LOCK(sc);
-	l = sc->ndis_shlist.flink;
-	while (l != &sc->ndis_shlist) {
-		sh = CONTAINING_RECORD(l, struct ndis_shmem, ndis_list);
-		if (sh->ndis_saddr == vaddr)
-			break;
-		/*
-		 * Check the physaddr too, just in case the driver lied
-		 * about the virtual address.
-		 */
-		if (sh->ndis_paddr == paddr)
-			break;
-		l = l->flink;
+	mtx_lock(&nsp->nsp_mtx);
+	sh = ndis_shm_lookup(nsp, vaddr, paddr, &off);
+	if (sh == NULL)
+		goto bad;
+
+	if (sh->ndis_class == -1) {
+		if (off != 0)
+			goto bad;
+		ndis_shm_remove(nsp, sh);
+		nsp->nsp_frees++;
+		nsp->nsp_bytes -= sh->ndis_len;
+		mtx_unlock(&nsp->nsp_mtx);
+		ndis_shm_release(sh);
+		return;
 	}
 
-	if (sh == NULL) {
-		NDIS_UNLOCK(sc);
-		printf("NDIS: buggy driver tried to free "
-		    "invalid shared memory: vaddr: %p paddr: 0x%jx\n",
-		    vaddr, (uintmax_t)paddr);
+	size = 1 << (sh->ndis_class + NDIS_SHM_MINSHIFT);
+	idx = off / size;
+	if (off % size != 0 || !bit_test(sh->ndis_used, idx))
+		goto bad;
+	bit_clear(sh->ndis_used, idx);
+	nsp->nsp_objects--;
+	nsp->nsp_frees++;
+	nsp->nsp_bytes -= size;
+	if (sh->ndis_inuse-- == PAGE_SIZE / size)
+		TAILQ_INSERT_HEAD(&nsp->nsp_partial[sh->ndis_class], sh,
+		    ndis_partial);
+	if (sh->ndis_inuse == 0) {
+		TAILQ_REMOVE(&nsp->nsp_partial[sh->ndis_class], sh,
+		    ndis_partial);
+		ndis_shm_remove(nsp, sh);
+		mtx_unlock(&nsp->nsp_mtx);
+		ndis_shm_release(sh);
 		return;
 	}
-
-	RemoveEntryList(&sh->ndis_list);
-
-	NDIS_UNLOCK(sc);
-
-	bus_dmamap_unload(sh->ndis_stag, sh->ndis_smap);
-	bus_dmamem_free(sh->ndis_stag, sh->ndis_saddr, sh->ndis_smap);
-	bus_dma_tag_destroy(sh->ndis_stag);
-
-	free(sh, M_NDIS_SUBR);
+	mtx_unlock(&nsp->nsp_mtx);
+	return;
+bad:
+	nsp->nsp_badfrees++;
+	mtx_unlock(&nsp->nsp_mtx);
+	printf("NDIS: buggy driver tried to free "
+	    "invalid shared memory: vaddr: %p paddr: 0x%jx\n",
+	    vaddr, (uintmax_t)paddr);
 }
 
 static int32_t
@@ -1493,6 +1656,16 @@ NdisAllocatePacketPool(int32_t *status, struct ndis_packet_pool **pool,
 		return;
 	}
 
+	/*
+	 * The magazines can hold at most half the pool between them,
+	 * so the shared list doesn't get starved. A CPU that finds its
+	 * own magazine and the shared list empty steals from the other
+	 * magazines, so the driver can still have all 'descnum' packets
+	 * out at once.
+	 */
+	p->magsize = min(NDIS_PKTMAG_MAX, descnum / (2 * mp_ncpus));
+	if (p->magsize <= 1)
+		p->magsize = 0;
 	p->cnt = descnum;
 	p->len = sizeof(struct ndis_packet) + protrsvdlen;
 
@@ -1505,6 +1678,17 @@ NdisAllocatePacketPool(int32_t *status, struct ndis_packet_pool **pool,
 
 	p->pktmem = packets;
 
+	if (p->magsize != 0) {
+		p->mags = malloc((mp_maxid + 1) * sizeof(struct ndis_pktmag),
+		    M_NDIS_SUBR, M_NOWAIT|M_ZERO);
+		if (p->mags == NULL)
+			p->magsize = 0;
+		else
+			CPU_FOREACH(i)
+				mtx_init(&p->mags[i].pm_mtx, "ndis pktmag",
+				    NULL, MTX_SPIN);
+	}
+
 	for (i = 0; i < p->cnt; i++)
 		InterlockedPushEntrySList(&p->head,
 		    (struct slist_entry *)&packets[i]);
@@ -1526,30 +1710,51 @@ NdisAllocatePacketPoolEx(int32_t *status, struct ndis_packet_pool **pool,
 static uint32_t
 NdisPacketPoolUsage(struct ndis_packet_pool *pool)
 {
-	return (pool->cnt - ExQueryDepthSList(&pool->head));
+	uint32_t cached = 0;
+	int i;
+
+	/* Packets parked in the magazines are free, not in use. */
+	if (pool->mags != NULL)
+		CPU_FOREACH(i)
+			cached += *(volatile uint32_t *)&pool->mags[i].pm_cnt;
+
+	return (pool->cnt - ExQueryDepthSList(&pool->head) - cached);
 }
 
 void
 NdisFreePacketPool(struct ndis_packet_pool *pool)
 {
+	int i;
+
 	TRACE(NDBG_PACKET, "pool %p\n", pool);
+	if (pool->mags != NULL)
+		CPU_FOREACH(i)
+			mtx_destroy(&pool->mags[i].pm_mtx);
+	free(pool->mags, M_NDIS_SUBR);
 	free(pool->pktmem, M_NDIS_SUBR);
 	free(pool, M_NDIS_SUBR);
 }
 
-void
-NdisAllocatePacket(int32_t *status, struct ndis_packet **packet,
-    struct ndis_packet_pool *pool)
-{
-	struct ndis_packet *pkt;
-
-	TRACE(NDBG_PACKET, "packet %p pool %p\n", packet, pool);
-	pkt = (struct ndis_packet *)InterlockedPopEntrySList(&pool->head);
-	if (pkt == NULL) {
-		*status = NDIS_STATUS_RESOURCES;
-		return;
-	}
-	memset(pkt, 0, sizeof(struct ndis_packet));
+/*
+ * Reset a recycled descriptor. Only the parts NDIS and we depend
+ * on are cleared: the private header (which also held the SList
+ * link), the OOB block, the per-packet info array and our own
+ * bookkeeping. The miniport/protocol reserved areas are owned by
+ * whoever allocates the packet and are not guaranteed to be zero
+ * on Windows either, so there is no point in clearing them.
+ */
+static __inline void
+ndis_packet_reinit(struct ndis_packet *pkt, struct ndis_packet_pool *pool)
+{
+	memset(&pkt->private, 0, sizeof(pkt->private));
+	memset(&pkt->oob, 0, sizeof(pkt->oob));
+	memset(&pkt->ext, 0, sizeof(pkt->ext));
+	pkt->refcnt = 0;
+	pkt->softc = NULL;
+	pkt->m0 = NULL;
+	pkt->txidx = 0;
+	pkt->txstage = 0;
+	pkt->loaned = FALSE;
 
 	/* Save pointer to the pool. */
 	pkt->private.pool = pool;
@@ -1565,6 +1770,92 @@ NdisAllocatePacket(int32_t *status, struct ndis_packet **packet,
 	 */
 	pkt->private.ndis_packet_flags = NDIS_PACKET_ALLOCATED_BY_NDIS;
 	pkt->private.valid_counts = FALSE;
+}
+
+static struct ndis_packet *
+ndis_packet_get(struct ndis_packet_pool *pool)
+{
+	struct ndis_pktmag *mag;
+	struct ndis_packet *pkt;
+	int i;
+
+	if (pool->mags == NULL)
+		return ((struct ndis_packet *)
+		    InterlockedPopEntrySList(&pool->head));
+
+	critical_enter();
+	mag = &pool->mags[curcpu];
+	mtx_lock_spin(&mag->pm_mtx);
+	if (mag->pm_cnt == 0) {
+		/* Refill half a magazine from the shared list. */
+		while (mag->pm_cnt < pool->magsize / 2) {
+			pkt = (struct ndis_packet *)
+			    InterlockedPopEntrySList(&pool->head);
+			if (pkt == NULL)
+				break;
+			mag->pm_pkts[mag->pm_cnt++] = pkt;
+		}
+	}
+	pkt = mag->pm_cnt == 0 ? NULL : mag->pm_pkts[--mag->pm_cnt];
+	mtx_unlock_spin(&mag->pm_mtx);
+	critical_exit();
+	if (pkt != NULL)
+		return (pkt);
+
+	/* What's left is sitting in the other CPUs' magazines. */
+	CPU_FOREACH(i) {
+		mag = &pool->mags[i];
+		if (*(volatile uint32_t *)&mag->pm_cnt == 0)
+			continue;
+		mtx_lock_spin(&mag->pm_mtx);
+		if (mag->pm_cnt != 0)
+			pkt = mag->pm_pkts[--mag->pm_cnt];
+		mtx_unlock_spin(&mag->pm_mtx);
+		if (pkt != NULL)
+			break;
+	}
+
+	return (pkt);
+}
+
+static void
+ndis_packet_put(struct ndis_packet_pool *pool, struct ndis_packet *pkt)
+{
+	struct ndis_pktmag *mag;
+
+	if (pool->mags == NULL) {
+		InterlockedPushEntrySList(&pool->head,
+		    (struct slist_entry *)pkt);
+		return;
+	}
+
+	critical_enter();
+	mag = &pool->mags[curcpu];
+	mtx_lock_spin(&mag->pm_mtx);
+	if (mag->pm_cnt == pool->magsize) {
+		/* Drain half a magazine back to the shared list. */
+		while (mag->pm_cnt > pool->magsize / 2)
+			InterlockedPushEntrySList(&pool->head,
+			    (struct slist_entry *)mag->pm_pkts[--mag->pm_cnt]);
+	}
+	mag->pm_pkts[mag->pm_cnt++] = pkt;
+	mtx_unlock_spin(&mag->pm_mtx);
+	critical_exit();
+}
+
+void
+NdisAllocatePacket(int32_t *status, struct ndis_packet **packet,
+    struct ndis_packet_pool *pool)
+{
+	struct ndis_packet *pkt;
+
+	TRACE(NDBG_PACKET, "packet %p pool %p\n", packet, pool);
+	pkt = ndis_packet_get(pool);
+	if (pkt == NULL) {
+		*status = NDIS_STATUS_RESOURCES;
+		return;
+	}
+	ndis_packet_reinit(pkt, pool);
 
 	*packet = pkt;
 	*status = NDIS_STATUS_SUCCESS;
@@ -1577,7 +1868,7 @@ NdisFreePacket(struct ndis_packet *packet)
 
 	TRACE(NDBG_PACKET, "packet %p\n", packet);
 	p = (struct ndis_packet_pool *)packet->private.pool;
-	InterlockedPushEntrySList(&p->head, (struct slist_entry *)packet);
+	ndis_packet_put(p, packet);
 }
 
 static void
@@ -1856,6 +2147,16 @@ ndis_intrhand(struct nt_kdpc *kdpc, struct ndis_miniport_interrupt *intr,
 	KeReleaseSpinLockFromDpcLevel(&intr->dpc_count_lock);
 }
 
+static struct device_object *
+ndis_intr_dpc_owner(struct nt_kdpc *kdpc)
+{
+	struct ndis_miniport_interrupt *intr;
+
+	intr = CONTAINING_RECORD(kdpc, struct ndis_miniport_interrupt,
+	    interrupt_dpc);
+	return (intr->block->deviceobj);
+}
+
 static int32_t
 NdisMRegisterInterrupt(struct ndis_miniport_interrupt *intr,
     struct ndis_miniport_block *block, uint32_t vec, uint32_t level,
@@ -1882,6 +2183,7 @@ NdisMRegisterInterrupt(struct ndis_miniport_interrupt *intr,
 
 	KeInitializeEvent(&intr->dpc_completed_event, NOTIFICATION_EVENT, TRUE);
 	KeInitializeDpc(&intr->interrupt_dpc, ndis_intrhand_wrap, intr);
+	ntoskrnl_execq_bind_dpc(&intr->interrupt_dpc, ndis_intr_dpc_owner);
 	KeSetImportanceDpc(&intr->interrupt_dpc, IMPORTANCE_LOW);
 
 	if (IoConnectInterrupt(&intr->interrupt_object,
@@ -2424,22 +2726,37 @@ NdisCloseFile(struct ndis_file_handle *file)
 	free(file, M_NDIS_SUBR);
 }
 
+/*
+ * Miniports size per-CPU state with this and index it with
+ * KeGetCurrentProcessorNumber(), so cover the highest CPU ID
+ * rather than just counting CPUs, in case there are holes.
+ */
 static uint8_t
 NdisSystemProcessorCount(void)
 {
-	return (mp_ncpus);
+	return (min(mp_maxid + 1, UINT8_MAX));
 }
 
+/*
+ * As on Windows, the total includes the idle time, so callers
+ * compute the load as 1 - idle / total between two samples.
+ */
 static void
 NdisGetCurrentProcessorCounts(uint32_t *idle_count, uint32_t *kernel_and_user,
     uint32_t *index)
 {
 	struct pcpu *pcpu;
+	uint32_t total;
+	int i;
 
-	pcpu = pcpu_find(curthread->td_oncpu);
+	critical_enter();
+	pcpu = get_pcpu();
 	*index = pcpu->pc_cpuid;
 	*idle_count = pcpu->pc_cp_time[CP_IDLE];
-	*kernel_and_user = pcpu->pc_cp_time[CP_INTR];
+	for (total = 0, i = 0; i < CPUSTATES; i++)
+		total += pcpu->pc_cp_time[i];
+	*kernel_and_user = total;
+	critical_exit();
 }
 
 static void
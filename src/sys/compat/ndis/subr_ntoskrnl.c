@@ -46,16 +46,19 @@ __FBSDID("$FreeBSD$");
 #include <sys/kernel.h>
 #include <sys/proc.h>
 #include <sys/condvar.h>
+#include <sys/cpuset.h>
 #include <sys/kthread.h>
 #include <sys/module.h>
 #include <sys/smp.h>
 #include <sys/sched.h>
 #include <sys/queue.h>
+#include <sys/sysctl.h>
 #include <sys/taskqueue.h>
 
 #include <machine/_inttypes.h>
 #include <machine/atomic.h>
 #include <machine/bus.h>
+#include <machine/cpu.h>
 #include <machine/stdarg.h>
 #include <machine/resource.h>
 
@@ -76,24 +79,80 @@ __FBSDID("$FreeBSD$");
 #include "hal_var.h"
 #include "ndis_var.h"
 
+#define	KDPC_QUEUES	(IMPORTANCE_HIGH + 1)
+
 struct kdpc_queue {
-	struct list_entry	disp;
+	struct list_entry	disp[KDPC_QUEUES];	/* indexed by importance */
+	volatile uintptr_t	incoming;		/* newly queued DPCs */
 	struct thread		*td;
+	int			cpu;
 	int			exit;
 	unsigned long		lock;
 	struct nt_kevent	proc;
 	struct nt_kevent	done;
 };
 
+/*
+ * One taskqueue per work queue type, so data path work items never
+ * wait behind slow control path ones.
+ */
+struct ntoskrnl_wqlane {
+	struct taskqueue	*wl_tq;
+	struct mtx		wl_mtx;		/* protects the counters */
+	uint64_t		wl_runs;
+	uint64_t		wl_lattotal;	/* usec queued, summed */
+	uint64_t		wl_latmax;	/* usec */
+};
+
+/*
+ * Per-device execution context. Work items queued against a device
+ * object that has one run on its own taskqueues, and DPCs bound to it
+ * run on its own DPC thread, so a miniport that blocks in a work item
+ * or DPC only stalls itself and not every other adapter.
+ */
+struct ntoskrnl_execq {
+	struct ntoskrnl_wqlane	eq_lane[WORKQUEUE_MAX];
+	struct kdpc_queue	eq_dpc;
+	volatile u_int		eq_refs;	/* KeInsertQueueDpc() calls */
+};
+
+/*
+ * A DPC bound to an execution context has KDPC_TYPE_EXECQ set in its
+ * type, and the low bits index the function that finds its device
+ * object. The DPC itself may live in driver memory and has no room
+ * for a pointer, but the structure around it does: the execution
+ * context is looked up through the device object at queue time.
+ */
+#define	KDPC_TYPE_EXECQ		0x8000
+#define	KDPC_TYPE_OWNER		0x000f
+#define	NTOSKRNL_DPC_OWNERS	(KDPC_TYPE_OWNER + 1)
+
+/*
+ * Thread priority of each lane, and its precedence on the shared
+ * queue used by devices without an execution context.
+ */
+static const struct {
+	const char	*name;
+	int		pri;
+	int		rank;
+} ntoskrnl_wqlanes[WORKQUEUE_MAX] = {
+	[CRITICAL] =		{ "critical",		PRI_MIN_KERN + 20, 1 },
+	[DELAYED] =		{ "delayed",		PRI_MIN_KERN + 32, 0 },
+	[HYPERCRITICAL] =	{ "hypercritical",	PRI_MIN_KERN + 8, 2 },
+};
+
 struct wb_ext {
 	struct cv		we_cv;
 	struct thread		*we_td;
 };
 
-struct ndis_work_item_task {
-	struct ndis_work_item *work;
-	struct task tq_item;
-};
+/*
+ * NdisScheduleWorkItem() keeps its task in the work item's
+ * WrapperReserved area, which belongs to us until the item runs.
+ */
+#define	NDIS_WORK_TASK(w)	((struct task *)(w)->wrapper_rsvd)
+CTASSERT(sizeof(struct task) <=
+    sizeof(((struct ndis_work_item *)0)->wrapper_rsvd));
 
 static struct list_entry nt_intlist;
 
@@ -141,11 +200,15 @@ static int ntoskrnl_is_signalled(struct nt_dispatcher_header *,
 static void ntoskrnl_ascii_to_unicode(char *, uint16_t *, int);
 static void ntoskrnl_destroy_dpc_thread(void);
 static void ntoskrnl_dpc_thread(void *);
+static void ntoskrnl_init_dpc_queue(struct kdpc_queue *, int);
+static void ntoskrnl_stop_dpc_thread(struct kdpc_queue *);
+static void ntoskrnl_drain_dpc_queue(struct kdpc_queue *);
 static void ntoskrnl_timercall(void *);
 static void ntoskrnl_unicode_to_ascii(uint16_t *, char *, int);
-static void run_ndis_work_item(struct ndis_work_item_task *, int);
+static void run_ndis_work_item(struct ndis_work_item *, int);
 static void IORunWorkItem(struct io_workitem *iw, int pending);
-static uint8_t ntoskrnl_insert_dpc(struct list_entry *, struct nt_kdpc *);
+static void ntoskrnl_insert_dpc(struct kdpc_queue *, struct nt_kdpc *);
+static void ntoskrnl_collect_dpcs(struct kdpc_queue *);
 static void WRITE_REGISTER_USHORT(uint16_t *, uint16_t);
 static uint16_t READ_REGISTER_USHORT(uint16_t *);
 static void WRITE_REGISTER_ULONG(uint32_t *, uint32_t);
@@ -300,16 +363,22 @@ static uint8_t ntoskrnl_kth;
 static struct nt_objref_head nt_reflist;
 static uma_zone_t mdl_zone;
 static uma_zone_t iw_zone;
-static struct kdpc_queue *kq_queue;
+static struct kdpc_queue *kq_queues;	/* one per CPU, by cpuid */
 static struct taskqueue *nq_queue;
 static struct taskqueue *wq_queue;
+static u_long ntoskrnl_active_cpus;	/* KAFFINITY of CPUs we run DPCs on */
+
+/* Filled in on first use and never cleared, so read without a lock. */
+static ntoskrnl_dpc_owner ntoskrnl_dpc_owners[NTOSKRNL_DPC_OWNERS];
 
 MALLOC_DEFINE(M_NDIS_NTOSKRNL, "ndis_ntoskrnl", "ndis_ntoskrnl buffers");
 
 void
 ntoskrnl_libinit(void)
 {
+	struct kdpc_queue *kq;
 	struct thread *t;
+	int cpu;
 
 	mtx_init(&nt_dispatchlock, "dispatchlock", NULL, MTX_DEF | MTX_RECURSE);
 	mtx_init(&nt_interlock, "interlock", NULL, MTX_SPIN);
@@ -319,17 +388,18 @@ ntoskrnl_libinit(void)
 
 	InitializeListHead(&nt_intlist);
 
-	kq_queue = ExAllocatePool(sizeof(struct kdpc_queue));
-	if (kq_queue == NULL)
-		panic("failed to allocate kq_queue");
-
-	InitializeListHead(&kq_queue->disp);
-	KeInitializeSpinLock(&kq_queue->lock);
-	KeInitializeEvent(&kq_queue->proc, SYNCHRONIZATION_EVENT, FALSE);
-	KeInitializeEvent(&kq_queue->done, SYNCHRONIZATION_EVENT, FALSE);
-	if (kproc_kthread_add(ntoskrnl_dpc_thread, kq_queue, &ndisproc,
-	    &t, RFHIGHPID, NDIS_KSTACK_PAGES, "ndis", "dpc"))
-		panic("failed to launch dpc thread");
+	kq_queues = malloc(sizeof(struct kdpc_queue) * (mp_maxid + 1),
+	    M_NDIS_NTOSKRNL, M_WAITOK|M_ZERO);
+
+	CPU_FOREACH(cpu) {
+		kq = kq_queues + cpu;
+		ntoskrnl_init_dpc_queue(kq, cpu);
+		if (cpu < sizeof(u_long) * NBBY)
+			ntoskrnl_active_cpus |= 1UL << cpu;
+		if (kproc_kthread_add(ntoskrnl_dpc_thread, kq, &ndisproc,
+		    &t, RFHIGHPID, NDIS_KSTACK_PAGES, "ndis", "dpc%d", cpu))
+			panic("failed to launch dpc thread for cpu %d", cpu);
+	}
 
 	if ((nq_queue = taskqueue_create("ndis queue", M_WAITOK,
 	    taskqueue_thread_enqueue, &nq_queue)) == NULL)
@@ -344,6 +414,7 @@ ntoskrnl_libinit(void)
 	    "ndis wq_queue");
 
 	windrv_wrap_table(ntoskrnl_functbl);
+	pe_functbl_sort(ntoskrnl_functbl);
 	ExAllocatePoolWithTag_wrap = ntoskrnl_findwrap(ExAllocatePoolWithTag);
 	ExFreePool_wrap = ntoskrnl_findwrap(ExFreePool);
 
@@ -380,7 +451,7 @@ ntoskrnl_libfini(void)
 
 	taskqueue_free(wq_queue);
 	taskqueue_free(nq_queue);
-	ExFreePool(kq_queue);
+	free(kq_queues, M_NDIS_NTOSKRNL);
 
 	uma_zdestroy(mdl_zone);
 	uma_zdestroy(iw_zone);
@@ -396,8 +467,8 @@ ntoskrnl_libfini(void)
 static void
 ntoskrnl_update_kuser(void *unused)
 {
-	ntoskrnl_time(&kuser_data.system_time);
-	KeQueryTickCount(&kuser_data.tick.tick_count_quad);
+	ntoskrnl_time((uint64_t *)&kuser_data.system_time);
+	KeQueryTickCount((int64_t *)&kuser_data.tick.tick_count_quad);
 	*((uint64_t *)&kuser_data.interrupt_time) = KeQueryInterruptTime();
 	callout_reset(&update_kuser, hz / 40, ntoskrnl_update_kuser, 0);
 }
@@ -697,6 +768,7 @@ IoCreateDevice(struct driver_object *drv, uint32_t devextlen,
 	dev->devobj_ext->type = 0;
 	dev->devobj_ext->size = sizeof(struct devobj_extension);
 	dev->devobj_ext->devobj = dev;
+	dev->devobj_ext->execq = NULL;
 
 	/*
 	 * Attach this device to the driver object's list
@@ -1307,12 +1379,13 @@ static void
 ntoskrnl_satisfy_multiple_waits(struct wait_block *wb)
 {
 	struct wait_block *cur = wb;
+	struct wb_ext *we = wb->wb_ext;
 	struct thread *td;
 
-	td = wb->wb_kthread;
+	td = we->we_td;
 
 	do {
-		ntoskrnl_satisfy_wait(wb->wb_object, td);
+		ntoskrnl_satisfy_wait(cur->wb_object, td);
 		cur->wb_awakened = TRUE;
 		cur = cur->wb_next;
 	} while (cur != wb);
@@ -1378,13 +1451,15 @@ ntoskrnl_waittest(struct nt_dispatcher_header *obj, uint32_t increment)
 			 */
 			next = w->wb_next;
 			while (next != w) {
-				if (ntoskrnl_is_signalled(obj, td) == FALSE) {
+				if (ntoskrnl_is_signalled(next->wb_object,
+				    td) == FALSE) {
 					satisfied = FALSE;
 					break;
 				}
 				next = next->wb_next;
 			}
-			ntoskrnl_satisfy_multiple_waits(w);
+			if (satisfied == TRUE)
+				ntoskrnl_satisfy_multiple_waits(w);
 		}
 
 		if (satisfied == TRUE)
@@ -1731,8 +1806,8 @@ KeWaitForMultipleObjects(uint32_t cnt, struct nt_dispatcher_header *obj[],
 				}
 				wcnt--;
 				if (wtype == WAIT_ANY) {
-					status = w->wb_waitkey &
-					    NDIS_STATUS_WAIT_0;
+					status = NDIS_STATUS_WAIT_0 +
+					    w->wb_waitkey;
 					goto wait_done;
 				}
 			}
@@ -1958,25 +2033,112 @@ ExDeleteNPagedLookasideList(struct npaged_lookaside_list *lookaside)
 		MSCALL1(freefunc, buf);
 }
 
+/*
+ * SLists. The header holds the first entry, the depth and a sequence
+ * number, and every update replaces all three with a single
+ * double-width compare-and-swap, so pushes need no lock at all.
+ *
+ * Pops do. To unlink the first entry a pop has to read its link,
+ * and if another pop got there first, that entry may already have
+ * been handed out and freed. Windows survives this by catching the
+ * fault in the pop; we can't, so pops are serialized on nt_interlock
+ * instead. An entry can then only leave the list while we hold the
+ * lock, which makes the read safe and the ABA problem impossible;
+ * the swap is still needed to catch racing pushes.
+ */
+#ifdef __amd64__
+static __inline int
+ntoskrnl_cmpset_slist(union slist_header *head, union slist_header *old,
+    union slist_header *new)
+{
+	uint8_t res;
+
+	__asm __volatile("lock; cmpxchg16b %1; sete %0"
+	    : "=q" (res), "+m" (*head),
+	      "+a" (old->slh_align[0]), "+d" (old->slh_align[1])
+	    : "b" (new->slh_align[0]), "c" (new->slh_align[1])
+	    : "memory", "cc");
+	return (res);
+}
+
+static __inline void
+ntoskrnl_read_slist(union slist_header *head, union slist_header *copy)
+{
+	copy->slh_align[0] = ((volatile uint64_t *)head->slh_align)[0];
+	copy->slh_align[1] = ((volatile uint64_t *)head->slh_align)[1];
+}
+
+/* cmpxchg16b faults on misaligned operands. */
+#define	NT_SLIST_LOCKFREE(head)	(((uintptr_t)(head) & 0xf) == 0)
+#else
+static __inline int
+ntoskrnl_cmpset_slist(union slist_header *head, union slist_header *old,
+    union slist_header *new)
+{
+	return (atomic_cmpset_64(&head->slh_align, old->slh_align,
+	    new->slh_align));
+}
+
+static __inline void
+ntoskrnl_read_slist(union slist_header *head, union slist_header *copy)
+{
+	/* A torn read is harmless, the swap will just fail. */
+	copy->slh_list.slh_next = head->slh_list.slh_next;
+	copy->slh_list.slh_depth = head->slh_list.slh_depth;
+	copy->slh_list.slh_seq = head->slh_list.slh_seq;
+}
+
+#define	NT_SLIST_LOCKFREE(head)	1
+#endif
+
 struct slist_entry *
 InterlockedPushEntrySList(union slist_header *head, struct slist_entry *entry)
 {
+	union slist_header old, new;
 	struct slist_entry *oldhead;
 
-	mtx_lock_spin(&nt_interlock);
-	oldhead = ntoskrnl_pushsl(head, entry);
-	mtx_unlock_spin(&nt_interlock);
+	if (!NT_SLIST_LOCKFREE(head)) {
+		mtx_lock_spin(&nt_interlock);
+		oldhead = ntoskrnl_pushsl(head, entry);
+		mtx_unlock_spin(&nt_interlock);
+		return (oldhead);
+	}
 
-	return (oldhead);
+	memset(&new, 0, sizeof(new));
+	do {
+		ntoskrnl_read_slist(head, &old);
+		entry->sl_next = old.slh_list.slh_next;
+		new.slh_list.slh_next = entry;
+		new.slh_list.slh_depth = old.slh_list.slh_depth + 1;
+		new.slh_list.slh_seq = old.slh_list.slh_seq + 1;
+	} while (!ntoskrnl_cmpset_slist(head, &old, &new));
+
+	return (old.slh_list.slh_next);
 }
 
 struct slist_entry *
 InterlockedPopEntrySList(union slist_header *head)
 {
+	union slist_header old, new;
 	struct slist_entry *first;
 
 	mtx_lock_spin(&nt_interlock);
-	first = ntoskrnl_popsl(head);
+	if (!NT_SLIST_LOCKFREE(head)) {
+		first = ntoskrnl_popsl(head);
+		mtx_unlock_spin(&nt_interlock);
+		return (first);
+	}
+
+	memset(&new, 0, sizeof(new));
+	do {
+		ntoskrnl_read_slist(head, &old);
+		first = old.slh_list.slh_next;
+		if (first == NULL)
+			break;
+		new.slh_list.slh_next = first->sl_next;
+		new.slh_list.slh_depth = old.slh_list.slh_depth - 1;
+		new.slh_list.slh_seq = old.slh_list.slh_seq;
+	} while (!ntoskrnl_cmpset_slist(head, &old, &new));
 	mtx_unlock_spin(&nt_interlock);
 
 	return (first);
@@ -2004,13 +2166,7 @@ ExInterlockedPopEntrySList(union slist_header *head, unsigned long *lock)
 uint16_t
 ExQueryDepthSList(union slist_header *head)
 {
-	uint16_t depth;
-
-	mtx_lock_spin(&nt_interlock);
-	depth = head->slh_list.slh_depth;
-	mtx_unlock_spin(&nt_interlock);
-
-	return (depth);
+	return (((volatile union slist_header *)head)->slh_list.slh_depth);
 }
 
 void
@@ -2019,24 +2175,81 @@ KeInitializeSpinLock(unsigned long *lock)
 	*lock = 0;
 }
 
+/*
+ * Emulated spinlocks keep the owning thread in the lock word. A
+ * waiter keeps spinning (with exponential backoff, to keep the
+ * cache line quiet) only while the owner is actually running on
+ * some CPU; if the owner got preempted or went to sleep, we yield
+ * instead of burning our whole quantum. This replaces the old
+ * scheme of boosting the owner's priority with sched_prio() on
+ * every acquire and release, which needed the thread lock twice
+ * per lock round-trip.
+ *
+ * Yielding only works if the owner cannot be preempted by the
+ * waiter itself, so a spinlock is always held at DISPATCH_LEVEL.
+ * That pins the owner and holds its CPU's dispatch lock, and a DPC
+ * thread for that CPU blocks on the dispatch lock, lending the
+ * owner its priority, instead of spinning. The AtDpcLevel
+ * variants do get called at PASSIVE_LEVEL, by drivers as well as
+ * from mbuf free and USB callbacks, so for those the IRQL is
+ * raised here, and hal_spin_lower() drops it again once the last
+ * lock taken since then is released.
+ */
+#define	NT_SPIN_BACKOFF_MAX	1024
+
+static __inline void
+ntoskrnl_acquire_spinlock(unsigned long *lock)
+{
+	volatile u_long *l = (volatile u_long *)lock;
+	struct thread *owner;
+	u_long self;
+	u_int backoff, i;
+
+	hal_spin_raise();
+	self = (u_long)curthread;
+	if (atomic_cmpset_acq_long(l, 0, self))
+		return;
+
+	backoff = 1;
+	for (;;) {
+		owner = (struct thread *)*l;
+		if (owner == NULL) {
+			if (atomic_cmpset_acq_long(l, 0, self))
+				return;
+			continue;
+		}
+		KASSERT(owner != curthread, ("spinlock %p recursed", lock));
+		if (TD_IS_RUNNING(owner)) {
+			for (i = 0; i < backoff; i++)
+				cpu_spinwait();
+			if (backoff < NT_SPIN_BACKOFF_MAX)
+				backoff <<= 1;
+		} else {
+			kern_yield(PRI_UNCHANGED);
+			backoff = 1;
+		}
+	}
+}
+
+static __inline void
+ntoskrnl_release_spinlock(unsigned long *lock)
+{
+
+	atomic_store_rel_long((volatile u_long *)lock, 0);
+	hal_spin_lower();
+}
+
 #ifdef __i386__
 void
 KefAcquireSpinLockAtDpcLevel(unsigned long *lock)
 {
-	while (atomic_cmpset_acq_int((volatile unsigned int *)lock, 0, 1) == 0)
-		/* sit and spin */;
-	thread_lock(curthread);
-	sched_prio(curthread, PRI_MIN_KERN);
-	thread_unlock(curthread);
+	ntoskrnl_acquire_spinlock(lock);
 }
 
 void
 KefReleaseSpinLockFromDpcLevel(unsigned long *lock)
 {
-	atomic_store_rel_int((volatile unsigned int *)lock, 0);
-	thread_lock(curthread);
-	sched_prio(curthread, PRI_MIN_KERN + 20);
-	thread_unlock(curthread);
+	ntoskrnl_release_spinlock(lock);
 }
 
 uint8_t
@@ -2052,6 +2265,28 @@ KeAcquireSpinLockRaiseToDpc(unsigned long *lock)
 #else
 void
 KeAcquireSpinLockAtDpcLevel(unsigned long *lock)
+{
+	ntoskrnl_acquire_spinlock(lock);
+}
+
+void
+KeReleaseSpinLockFromDpcLevel(unsigned long *lock)
+{
+	ntoskrnl_release_spinlock(lock);
+}
+#endif /* __i386__ */
+
+/*
+ * Microbenchmark for the spinlock/IRQL emulation: reading
+ * debug.ndis_lockbench times an uncontended KfAcquireSpinLock()/
+ * KfReleaseSpinLock() pair and an AtDpcLevel pair, next to the
+ * sched_prio() based scheme they replaced, and reports the
+ * average cost of each in nanoseconds.
+ */
+#define	NT_LOCKBENCH_LOOPS	1000000
+
+static void
+ntoskrnl_lockbench_old_acquire(unsigned long *lock)
 {
 	while (atomic_cmpset_acq_int((volatile unsigned int *)lock, 0, 1) == 0)
 		/* sit and spin */;
@@ -2060,25 +2295,98 @@ KeAcquireSpinLockAtDpcLevel(unsigned long *lock)
 	thread_unlock(curthread);
 }
 
-void
-KeReleaseSpinLockFromDpcLevel(unsigned long *lock)
+static void
+ntoskrnl_lockbench_old_release(unsigned long *lock)
 {
 	atomic_store_rel_int((volatile unsigned int *)lock, 0);
 	thread_lock(curthread);
 	sched_prio(curthread, PRI_MIN_KERN + 20);
 	thread_unlock(curthread);
 }
-#endif /* __i386__ */
+
+static uint64_t
+ntoskrnl_lockbench_nsecs(struct bintime *start)
+{
+	struct bintime bt;
+
+	binuptime(&bt);
+	bintime_sub(&bt, start);
+	return ((bt.sec * 1000000000ULL +
+	    (((uint64_t)1000000000 * (uint32_t)(bt.frac >> 32)) >> 32)) /
+	    NT_LOCKBENCH_LOOPS);
+}
+
+static int
+ntoskrnl_lockbench(SYSCTL_HANDLER_ARGS)
+{
+	struct mtx oldirql;
+	struct bintime start;
+	unsigned long lock;
+	uint64_t oldfull, newfull, olddpc, newdpc;
+	u_char pri;
+	uint8_t irql;
+	char buf[128];
+	int i;
+
+	KeInitializeSpinLock(&lock);
+	mtx_init(&oldirql, "lockbench", NULL, MTX_DEF | MTX_RECURSE);
+	thread_lock(curthread);
+	pri = curthread->td_priority;
+	thread_unlock(curthread);
+
+	/* Old scheme: global dispatch mutex plus priority games. */
+	binuptime(&start);
+	for (i = 0; i < NT_LOCKBENCH_LOOPS; i++) {
+		mtx_lock(&oldirql);
+		ntoskrnl_lockbench_old_acquire(&lock);
+		ntoskrnl_lockbench_old_release(&lock);
+		mtx_unlock(&oldirql);
+	}
+	oldfull = ntoskrnl_lockbench_nsecs(&start);
+
+	binuptime(&start);
+	for (i = 0; i < NT_LOCKBENCH_LOOPS; i++) {
+		ntoskrnl_lockbench_old_acquire(&lock);
+		ntoskrnl_lockbench_old_release(&lock);
+	}
+	olddpc = ntoskrnl_lockbench_nsecs(&start);
+
+	thread_lock(curthread);
+	sched_prio(curthread, pri);
+	thread_unlock(curthread);
+	mtx_destroy(&oldirql);
+
+	binuptime(&start);
+	for (i = 0; i < NT_LOCKBENCH_LOOPS; i++) {
+		KeAcquireSpinLock(&lock, &irql);
+		KeReleaseSpinLock(&lock, irql);
+	}
+	newfull = ntoskrnl_lockbench_nsecs(&start);
+
+	binuptime(&start);
+	for (i = 0; i < NT_LOCKBENCH_LOOPS; i++) {
+		KeAcquireSpinLockAtDpcLevel(&lock);
+		KeReleaseSpinLockFromDpcLevel(&lock);
+	}
+	newdpc = ntoskrnl_lockbench_nsecs(&start);
+
+	snprintf(buf, sizeof(buf), "raise+acquire: old %ju ns new %ju ns, "
+	    "at dpc level: old %ju ns new %ju ns", (uintmax_t)oldfull,
+	    (uintmax_t)newfull, (uintmax_t)olddpc, (uintmax_t)newdpc);
+	return (sysctl_handle_string(oidp, buf, sizeof(buf), req));
+}
+SYSCTL_PROC(_debug, OID_AUTO, ndis_lockbench, CTLTYPE_STRING | CTLFLAG_RD,
+    NULL, 0, ntoskrnl_lockbench, "A",
+    "Time the NDIS spinlock emulation against the old implementation");
 
 uintptr_t
 InterlockedExchange(volatile uint32_t *dst, uintptr_t val)
 {
-	uintptr_t r;
+	uint32_t r;
 
-	mtx_lock_spin(&nt_interlock);
-	r = *dst;
-	*dst = val;
-	mtx_unlock_spin(&nt_interlock);
+	do {
+		r = *dst;
+	} while (!atomic_cmpset_int(dst, r, (uint32_t)val));
 
 	return (r);
 }
@@ -2086,25 +2394,27 @@ InterlockedExchange(volatile uint32_t *dst, uintptr_t val)
 static int32_t
 InterlockedIncrement(volatile int32_t *addend)
 {
-	atomic_add_int(addend, 1);
-
-	return (*addend);
+	return (atomic_fetchadd_int((volatile u_int *)addend, 1) + 1);
 }
 
 static int32_t
 InterlockedDecrement(volatile int32_t *addend)
 {
-	atomic_subtract_int(addend, 1);
-
-	return (*addend);
+	return (atomic_fetchadd_int((volatile u_int *)addend, -1) - 1);
 }
 
 static void
 ExInterlockedAddLargeStatistic(uint64_t *addend, uint32_t inc)
 {
-	mtx_lock_spin(&nt_interlock);
-	*addend += inc;
-	mtx_unlock_spin(&nt_interlock);
+#ifdef __amd64__
+	atomic_add_long((volatile u_long *)addend, inc);
+#else
+	uint64_t old;
+
+	do {
+		old = *(volatile uint64_t *)addend;
+	} while (!atomic_cmpset_64(addend, old, old + inc));
+#endif
 }
 
 struct mdl *
@@ -2398,31 +2708,26 @@ ntoskrnl_finddev(device_t dev, uint64_t paddr, struct resource **res)
 }
 
 static void
-run_ndis_work_item(struct ndis_work_item_task *arg, int pending)
+run_ndis_work_item(struct ndis_work_item *work, int pending)
 {
-	struct ndis_work_item *work = arg->work;
-
+	/* The miniport may free or requeue the item from here on. */
 	if (work->func == NULL)
 		return;
 	MSCALL2(work->func, work, work->ctx);
-	free(arg, M_NDIS_NTOSKRNL);
 }
 
+/*
+ * Like Windows, we (re)initialize the task on every call, so the
+ * miniport must not schedule an item again before it starts running.
+ */
 void
 schedule_ndis_work_item(void *arg)
 {
-	struct ndis_work_item_task *task;
+	struct ndis_work_item *work = arg;
 
-	task = malloc(sizeof(struct ndis_work_item_task), M_NDIS_NTOSKRNL,
-	    M_NOWAIT | M_ZERO);
-	if (task == NULL) {
-		printf("schedule_ndis_work_item: malloc failed\n");
-		return;
-	}
-	TASK_INIT(&task->tq_item, 0, (task_fn_t *)run_ndis_work_item, task);
-	task->work = arg;
-
-	taskqueue_enqueue(nq_queue, &task->tq_item);
+	TASK_INIT(NDIS_WORK_TASK(work), 0, (task_fn_t *)run_ndis_work_item,
+	    work);
+	taskqueue_enqueue(nq_queue, NDIS_WORK_TASK(work));
 }
 
 struct io_workitem *
@@ -2437,6 +2742,8 @@ IoAllocateWorkItem(struct device_object *dobj)
 
 	InitializeListHead(&iw->list);
 	iw->dobj = dobj;
+	if (dobj != NULL && dobj->devobj_ext != NULL)
+		iw->execq = dobj->devobj_ext->execq;
 
 	return (iw);
 }
@@ -2451,8 +2758,21 @@ IoFreeWorkItem(struct io_workitem *iw)
 static void
 IORunWorkItem(struct io_workitem *iw, int pending)
 {
+	struct ntoskrnl_wqlane *wl;
+	uint64_t lat;
+
 	if (iw->func == NULL)
 		return;
+	if (iw->execq != NULL) {
+		lat = (sbinuptime() - iw->queued) / SBT_1US;
+		wl = &iw->execq->eq_lane[iw->lane];
+		mtx_lock(&wl->wl_mtx);
+		wl->wl_runs++;
+		wl->wl_lattotal += lat;
+		if (lat > wl->wl_latmax)
+			wl->wl_latmax = lat;
+		mtx_unlock(&wl->wl_mtx);
+	}
 	MSCALL2(iw->func, iw->dobj, iw->ctx);
 }
 
@@ -2474,13 +2794,24 @@ IoQueueWorkItem(struct io_workitem *iw, io_workitem_func func,
 	if (iw->ctx && iw->ctx != ctx)
 		printf("IoQueueWorkItem: warning iw->ctx got redefined\n");
 
+	if ((u_int)type >= WORKQUEUE_MAX)
+		type = DELAYED;
+
 	iw->func = func;
 	iw->ctx = ctx;
-	iw->tq_item.ta_priority = type;
+	iw->lane = type;
 	iw->tq_item.ta_func = (task_fn_t *)IORunWorkItem;
 	iw->tq_item.ta_context = iw;
 
-	taskqueue_enqueue(wq_queue, &iw->tq_item);
+	if (iw->execq != NULL) {
+		iw->queued = sbinuptime();
+		iw->tq_item.ta_priority = 0;
+		taskqueue_enqueue(iw->execq->eq_lane[type].wl_tq,
+		    &iw->tq_item);
+	} else {
+		iw->tq_item.ta_priority = ntoskrnl_wqlanes[type].rank;
+		taskqueue_enqueue(wq_queue, &iw->tq_item);
+	}
 }
 
 static int32_t
@@ -3375,7 +3706,10 @@ ntoskrnl_timercall(void *arg)
 	struct nt_ktimer *timer = arg;
 	struct nt_kdpc *dpc;
 
+	mtx_lock(&nt_dispatchlock);
 	timer->header.signal_state = TRUE;
+	ntoskrnl_waittest(&timer->header, IO_NO_INCREMENT);
+	mtx_unlock(&nt_dispatchlock);
 	/*
 	 * If this is a periodic timer, re-arm it
 	 * so it will fire again. We do this before
@@ -3441,15 +3775,19 @@ ntoskrnl_dpc_thread(void *arg)
 	struct nt_kdpc *d;
 	struct list_entry *l;
 	uint8_t irql;
+	int i;
 
 	kq->td = curthread;
 	kq->exit = FALSE;
 	/*
 	 * Elevate our priority. DPCs are used to run interrupt
 	 * handlers, and they should trigger as soon as possible
-	 * once scheduled by an ISR.
+	 * once scheduled by an ISR. Also pin ourselves to our CPU,
+	 * so that targeted DPCs really run where they were asked to.
 	 */
 	thread_lock(curthread);
+	if (kq->cpu != NOCPU)
+		sched_bind(curthread, kq->cpu);
 	sched_prio(curthread, PRI_MIN_KERN + 20);
 	thread_unlock(curthread);
 
@@ -3463,10 +3801,22 @@ ntoskrnl_dpc_thread(void *arg)
 			break;
 		}
 
-		while (!IsListEmpty(&kq->disp)) {
-			l = RemoveHeadList(&kq->disp);
+		/*
+		 * Always pick the most important pending DPC, so
+		 * that anything queued at high importance while we
+		 * were busy runs ahead of the low importance backlog.
+		 */
+		for (;;) {
+			ntoskrnl_collect_dpcs(kq);
+			for (i = IMPORTANCE_HIGH; i >= IMPORTANCE_LOW; i--)
+				if (!IsListEmpty(&kq->disp[i]))
+					break;
+			if (i < IMPORTANCE_LOW)
+				break;
+			l = RemoveHeadList(&kq->disp[i]);
 			d = CONTAINING_RECORD(l, struct nt_kdpc, dpclistentry);
 			InitializeListHead(&d->dpclistentry);
+			atomic_store_rel_ptr((volatile uintptr_t *)&d->lock, 0);
 			KeReleaseSpinLockFromDpcLevel(&kq->lock);
 			MSCALL4(d->deferedfunc, d, d->deferredctx,
 			    d->sysarg1, d->sysarg2);
@@ -3476,38 +3826,172 @@ ntoskrnl_dpc_thread(void *arg)
 
 		KeSetEvent(&kq->done, IO_NO_INCREMENT, FALSE);
 	}
+	if (kq->cpu != NOCPU) {
+		thread_lock(curthread);
+		sched_unbind(curthread);
+		thread_unlock(curthread);
+	}
 	kthread_exit();
 	/* notreached */
 }
 
+static void
+ntoskrnl_init_dpc_queue(struct kdpc_queue *kq, int cpu)
+{
+	int i;
+
+	for (i = 0; i < KDPC_QUEUES; i++)
+		InitializeListHead(&kq->disp[i]);
+	kq->cpu = cpu;
+	KeInitializeSpinLock(&kq->lock);
+	KeInitializeEvent(&kq->proc, SYNCHRONIZATION_EVENT, FALSE);
+	KeInitializeEvent(&kq->done, SYNCHRONIZATION_EVENT, FALSE);
+}
+
+static void
+ntoskrnl_stop_dpc_thread(struct kdpc_queue *kq)
+{
+	kq->exit = TRUE;
+	KeSetEvent(&kq->proc, IO_NO_INCREMENT, FALSE);
+	while (kq->exit)
+		tsleep(kq->td->td_proc, PWAIT, "dpcw", hz/10);
+}
+
+/*
+ * Kick a DPC thread and wait until it has run everything that was
+ * queued to it so far.
+ */
+static void
+ntoskrnl_drain_dpc_queue(struct kdpc_queue *kq)
+{
+	KeSetEvent(&kq->proc, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(&kq->done, 0, 0, TRUE, NULL);
+}
+
 static void
 ntoskrnl_destroy_dpc_thread(void)
 {
-	struct nt_kdpc dpc;
+	int cpu;
 
-	kq_queue->exit = TRUE;
-	KeInitializeDpc(&dpc, NULL, NULL);
-	KeSetTargetProcessorDpc(&dpc, 0);
-	KeInsertQueueDpc(&dpc, NULL, NULL);
-	while (kq_queue->exit)
-		tsleep(kq_queue->td->td_proc, PWAIT, "dpcw", hz/10);
+	CPU_FOREACH(cpu)
+		ntoskrnl_stop_dpc_thread(kq_queues + cpu);
 }
 
-static uint8_t
-ntoskrnl_insert_dpc(struct list_entry *head, struct nt_kdpc *dpc)
+/*
+ * Find the execution context a DPC is bound to, if any. Must be
+ * called in a critical section, which keeps ntoskrnl_execq_destroy()
+ * from freeing it under us.
+ */
+static struct ntoskrnl_execq *
+ntoskrnl_dpc_execq(struct nt_kdpc *dpc)
 {
-	struct list_entry *l;
+	struct device_object *dobj;
+	ntoskrnl_dpc_owner owner;
 
-	for (l = head->flink; l != head; l = l->flink)
-		if (CONTAINING_RECORD(l, struct nt_kdpc, dpclistentry) == dpc)
-			return (FALSE);
+	if (!(dpc->type & KDPC_TYPE_EXECQ))
+		return (NULL);
+	owner = ntoskrnl_dpc_owners[dpc->type & KDPC_TYPE_OWNER];
+	dobj = owner(dpc);
+	if (dobj == NULL || dobj->devobj_ext == NULL)
+		return (NULL);
+	return (dobj->devobj_ext->execq);
+}
 
-	if (dpc->importance == IMPORTANCE_LOW)
-		InsertTailList(head, &dpc->dpclistentry);
-	else
+/*
+ * Pick the queue a DPC should go to: the execution context it
+ * is bound to, the CPU it was targeted at with
+ * KeSetTargetProcessorDpc(), or the current CPU otherwise. The
+ * latter means that DPCs queued by an ISR run on the CPU that
+ * took the interrupt, same as on Windows. A DPC whose execution
+ * context went away falls back to its CPU target.
+ *
+ * An execution context is returned in 'eqp' with a reference
+ * held, which keeps ntoskrnl_execq_destroy() from freeing the
+ * queue until the caller is done with it. Must be called in a
+ * critical section.
+ */
+static struct kdpc_queue *
+ntoskrnl_dpc_queue(struct nt_kdpc *dpc, struct ntoskrnl_execq **eqp)
+{
+	struct ntoskrnl_execq *eq;
+
+	eq = ntoskrnl_dpc_execq(dpc);
+	if (eq != NULL)
+		atomic_add_int(&eq->eq_refs, 1);
+	*eqp = eq;
+	if (eq != NULL)
+		return (&eq->eq_dpc);
+	if (dpc->num == KDPC_CPU_DEFAULT)
+		return (kq_queues + PCPU_GET(cpuid));
+	return (kq_queues + dpc->num);
+}
+
+/*
+ * The 'lock' member of the DPC (DpcData in Windows) points to the
+ * queue the DPC is sitting on, or is NULL if it isn't queued. This
+ * is what makes queueing O(1): KeInsertQueueDpc() claims a DPC by
+ * atomically switching the marker from NULL to its queue, and then
+ * pushes it onto the queue's 'incoming' stack without taking any
+ * lock. The DPC thread periodically grabs the whole stack and sorts
+ * it into the importance lists, which are protected by the queue
+ * lock.
+ *
+ * KeRemoveQueueDpc() can unlink a DPC that already made it into one
+ * of the lists, but not one still on the incoming stack. Those get
+ * KDPC_REMOVED set in the marker instead, and the DPC thread drops
+ * them when it collects the stack. Queueing such a DPC again just
+ * clears the flag, since it's still physically queued.
+ */
+#define	KDPC_REMOVED	0x1
+
+static void
+ntoskrnl_insert_dpc(struct kdpc_queue *kq, struct nt_kdpc *dpc)
+{
+	struct list_entry *head = &kq->disp[dpc->importance];
+
+	if (dpc->importance == IMPORTANCE_HIGH)
 		InsertHeadList(head, &dpc->dpclistentry);
+	else
+		InsertTailList(head, &dpc->dpclistentry);
+}
 
-	return (TRUE);
+/*
+ * Move everything from the incoming stack onto the importance
+ * lists. Must be called with the queue lock held.
+ */
+static void
+ntoskrnl_collect_dpcs(struct kdpc_queue *kq)
+{
+	struct nt_kdpc *d, *next, *prev = NULL;
+	uintptr_t owner = (uintptr_t)kq;
+
+	if (kq->incoming == 0)
+		return;
+
+	/*
+	 * The stack is linked through dpclistentry.flink and is LIFO,
+	 * so reverse it to keep queueing order.
+	 */
+	d = (struct nt_kdpc *)atomic_readandclear_ptr(&kq->incoming);
+	while (d != NULL) {
+		next = (struct nt_kdpc *)d->dpclistentry.flink;
+		d->dpclistentry.flink = (struct list_entry *)prev;
+		prev = d;
+		d = next;
+	}
+
+	for (d = prev; d != NULL; d = next) {
+		next = (struct nt_kdpc *)d->dpclistentry.flink;
+		/*
+		 * Reset the entry before dropping the marker, the DPC
+		 * may be queued again as soon as the marker is clear.
+		 */
+		InitializeListHead(&d->dpclistentry);
+		if (atomic_cmpset_ptr((volatile uintptr_t *)&d->lock,
+		    owner | KDPC_REMOVED, 0))
+			continue;
+		ntoskrnl_insert_dpc(kq, d);
+	}
 }
 
 void
@@ -3518,31 +4002,78 @@ KeInitializeDpc(struct nt_kdpc *dpc, void *dpcfunc, void *dpcctx)
 
 	dpc->deferedfunc = dpcfunc;
 	dpc->deferredctx = dpcctx;
+	dpc->type = 0;
 	dpc->num = KDPC_CPU_DEFAULT;
 	dpc->importance = IMPORTANCE_MEDIUM;
+	dpc->lock = NULL;
 	InitializeListHead(&dpc->dpclistentry);
 }
 
+static uint8_t
+ntoskrnl_queue_dpc(struct kdpc_queue *kq, struct nt_kdpc *dpc,
+    void *sysarg1, void *sysarg2)
+{
+	uintptr_t head, owner;
+
+	for (;;) {
+		owner = atomic_load_acq_ptr((volatile uintptr_t *)&dpc->lock);
+		if (owner == 0) {
+			if (atomic_cmpset_ptr((volatile uintptr_t *)&dpc->lock,
+			    0, (uintptr_t)kq))
+				break;
+			continue;
+		}
+		if ((owner & KDPC_REMOVED) == 0)
+			return (FALSE);
+		/* Removed but not collected yet: just take it back. */
+		if (atomic_cmpset_ptr((volatile uintptr_t *)&dpc->lock,
+		    owner, owner & ~KDPC_REMOVED)) {
+			dpc->sysarg1 = sysarg1;
+			dpc->sysarg2 = sysarg2;
+			return (TRUE);
+		}
+	}
+
+	dpc->sysarg1 = sysarg1;
+	dpc->sysarg2 = sysarg2;
+	/* Not on any list yet, see KeRemoveQueueDpc(). */
+	dpc->dpclistentry.blink = NULL;
+	do {
+		head = kq->incoming;
+		dpc->dpclistentry.flink = (struct list_entry *)head;
+	} while (!atomic_cmpset_rel_ptr(&kq->incoming, head, (uintptr_t)dpc));
+
+	/*
+	 * If the stack wasn't empty, the DPC thread has already been
+	 * kicked and hasn't collected it yet, so it will see ours too.
+	 */
+	if (head == 0)
+		KeSetEvent(&kq->proc, IO_NO_INCREMENT, FALSE);
+
+	return (TRUE);
+}
+
 uint8_t
 KeInsertQueueDpc(struct nt_kdpc *dpc, void *sysarg1, void *sysarg2)
 {
+	struct ntoskrnl_execq *eq;
+	struct kdpc_queue *kq;
 	uint8_t r;
-	uint8_t irql;
 
 	KASSERT(dpc != NULL, ("no dpc"));
 
-	KeAcquireSpinLock(&kq_queue->lock, &irql);
-	r = ntoskrnl_insert_dpc(&kq_queue->disp, dpc);
-	if (r == TRUE) {
-		dpc->sysarg1 = sysarg1;
-		dpc->sysarg2 = sysarg2;
-	}
-	KeReleaseSpinLock(&kq_queue->lock, irql);
-
-	if (r == FALSE)
-		return (r);
+	/*
+	 * Stay on this CPU while we pick the queue, so an
+	 * untargeted DPC lands on the CPU that queued it, and so
+	 * ntoskrnl_execq_destroy() waits for us to take our reference.
+	 */
+	critical_enter();
+	kq = ntoskrnl_dpc_queue(dpc, &eq);
+	critical_exit();
 
-	KeSetEvent(&kq_queue->proc, IO_NO_INCREMENT, FALSE);
+	r = ntoskrnl_queue_dpc(kq, dpc, sysarg1, sysarg2);
+	if (eq != NULL)
+		atomic_subtract_rel_int(&eq->eq_refs, 1);
 
 	return (r);
 }
@@ -3550,37 +4081,78 @@ KeInsertQueueDpc(struct nt_kdpc *dpc, void *sysarg1, void *sysarg2)
 uint8_t
 KeRemoveQueueDpc(struct nt_kdpc *dpc)
 {
-	struct kdpc_queue *kq = kq_queue;
-	uint8_t irql;
+	struct kdpc_queue *kq;
+	struct list_entry *l;
+	uintptr_t owner;
+	uint8_t irql, r;
 
 	if (dpc == NULL)
 		return (FALSE);
 
+	owner = atomic_load_acq_ptr((volatile uintptr_t *)&dpc->lock);
+	if (owner == 0 || owner & KDPC_REMOVED)
+		return (FALSE);
+	kq = (struct kdpc_queue *)owner;
+
 	KeAcquireSpinLock(&kq->lock, &irql);
-	if (dpc->dpclistentry.flink == &dpc->dpclistentry) {
+	if ((uintptr_t)dpc->lock != owner) {
+		/* Ran or got removed while we were waiting. */
 		KeReleaseSpinLock(&kq->lock, irql);
 		return (FALSE);
 	}
 
-	RemoveEntryList(&dpc->dpclistentry);
-	InitializeListHead(&dpc->dpclistentry);
+	/*
+	 * A DPC sitting on one of the importance lists has a real
+	 * back link. One that's still on the incoming stack (or being
+	 * pushed there) is either unlinked or self-linked, and we leave
+	 * it for ntoskrnl_collect_dpcs() to drop.
+	 */
+	l = dpc->dpclistentry.blink;
+	if (l != NULL && l != &dpc->dpclistentry) {
+		RemoveEntryList(&dpc->dpclistentry);
+		InitializeListHead(&dpc->dpclistentry);
+		atomic_store_rel_ptr((volatile uintptr_t *)&dpc->lock, 0);
+		r = TRUE;
+	} else
+		r = atomic_cmpset_ptr((volatile uintptr_t *)&dpc->lock,
+		    owner, owner | KDPC_REMOVED);
 
 	KeReleaseSpinLock(&kq->lock, irql);
 
-	return (TRUE);
+	return (r);
 }
 
 void
 KeSetImportanceDpc(struct nt_kdpc *dpc, enum kdpc_importance imp)
 {
+	if (imp > IMPORTANCE_HIGH)
+		return;
+
 	dpc->importance = imp;
 }
 
+/*
+ * A DPC bound to an execution context whose DPC thread was pinned
+ * to a CPU stays there, so a miniport spreading its DPCs over the
+ * CPUs it was told about cannot escape the CPU it was confined to.
+ */
 void
 KeSetTargetProcessorDpc(struct nt_kdpc *dpc, uint8_t cpu)
 {
-	if (cpu > mp_ncpus)
+	struct ntoskrnl_execq *eq;
+	int pinned;
+
+	if (cpu > mp_maxid || CPU_ABSENT(cpu))
 		return;
+	if (dpc->type & KDPC_TYPE_EXECQ) {
+		critical_enter();
+		eq = ntoskrnl_dpc_execq(dpc);
+		pinned = eq != NULL && eq->eq_dpc.cpu != NOCPU;
+		critical_exit();
+		if (pinned)
+			return;
+		dpc->type &= ~(KDPC_TYPE_EXECQ | KDPC_TYPE_OWNER);
+	}
 
 	dpc->num = cpu;
 }
@@ -3590,25 +4162,204 @@ do_nothing_task(void *ptr, int pending)
 {
 }
 
+/*
+ * Wait for everything queued so far to run, both on the given
+ * device execution context and on the shared queues that anything
+ * without one falls back to. The shared work item queue is only
+ * drained when there is no execution context, so one adapter going
+ * away does not wait on work queued by the others.
+ */
 void
-flush_queue(void)
+flush_queue(struct ntoskrnl_execq *eq)
 {
 	struct task t_item;
+	int cpu, i;
+
 	bzero(&t_item, sizeof(struct task));
 	t_item.ta_func = (task_fn_t *)do_nothing_task;
 	t_item.ta_context = NULL;
-	taskqueue_enqueue(wq_queue, &t_item);
-	taskqueue_drain(wq_queue, &t_item);
+	if (eq != NULL) {
+		for (i = 0; i < WORKQUEUE_MAX; i++) {
+			taskqueue_enqueue(eq->eq_lane[i].wl_tq, &t_item);
+			taskqueue_drain(eq->eq_lane[i].wl_tq, &t_item);
+		}
+		ntoskrnl_drain_dpc_queue(&eq->eq_dpc);
+	} else {
+		taskqueue_enqueue(wq_queue, &t_item);
+		taskqueue_drain(wq_queue, &t_item);
+	}
 	taskqueue_enqueue(nq_queue, &t_item);
 	taskqueue_drain(nq_queue, &t_item);
-	KeSetEvent(&kq_queue->proc, IO_NO_INCREMENT, FALSE);
-	KeWaitForSingleObject(&kq_queue->done, 0, 0, TRUE, NULL);
+	CPU_FOREACH(cpu)
+		ntoskrnl_drain_dpc_queue(kq_queues + cpu);
+}
+
+static int
+ntoskrnl_validcpu(int cpu)
+{
+	if (cpu == NOCPU || cpu < 0 || cpu > mp_maxid || CPU_ABSENT(cpu))
+		return (NOCPU);
+	return (cpu);
+}
+
+/*
+ * Start the threads of one work queue lane, all of them on 'cpu'
+ * unless that is NOCPU.
+ */
+static void
+ntoskrnl_start_lane(struct ntoskrnl_wqlane *wl, const char *name,
+    int type, int nthreads, int cpu)
+{
+	cpuset_t mask;
+
+	mtx_init(&wl->wl_mtx, "ndis wq lane", NULL, MTX_DEF);
+	wl->wl_tq = taskqueue_create("ndis wq", M_WAITOK,
+	    taskqueue_thread_enqueue, &wl->wl_tq);
+	if (cpu == NOCPU) {
+		taskqueue_start_threads(&wl->wl_tq, nthreads,
+		    ntoskrnl_wqlanes[type].pri, "%s %s", name,
+		    ntoskrnl_wqlanes[type].name);
+		return;
+	}
+	CPU_SETOF(cpu, &mask);
+	taskqueue_start_threads_cpuset(&wl->wl_tq, nthreads,
+	    ntoskrnl_wqlanes[type].pri, &mask, "%s %s", name,
+	    ntoskrnl_wqlanes[type].name);
+}
+
+/*
+ * Create an execution context with 'nthreads' threads per work queue
+ * type and one DPC thread, bound to 'cpu' unless that is NOCPU.
+ * 'lanecpu', if not NULL, holds a CPU (or NOCPU) for each work queue
+ * type.
+ */
+struct ntoskrnl_execq *
+ntoskrnl_execq_create(const char *name, int nthreads, int cpu,
+    const int *lanecpu)
+{
+	struct ntoskrnl_execq *eq;
+	struct thread *t;
+	int i;
+
+	cpu = ntoskrnl_validcpu(cpu);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	eq = malloc(sizeof(struct ntoskrnl_execq), M_NDIS_NTOSKRNL,
+	    M_WAITOK|M_ZERO);
+	for (i = 0; i < WORKQUEUE_MAX; i++)
+		ntoskrnl_start_lane(&eq->eq_lane[i], name, i, nthreads,
+		    lanecpu != NULL ? ntoskrnl_validcpu(lanecpu[i]) : NOCPU);
+	ntoskrnl_init_dpc_queue(&eq->eq_dpc, cpu);
+	if (kproc_kthread_add(ntoskrnl_dpc_thread, &eq->eq_dpc, &ndisproc,
+	    &t, RFHIGHPID, NDIS_KSTACK_PAGES, "ndis", "%s dpc", name))
+		panic("failed to launch dpc thread for %s", name);
+	eq->eq_dpc.td = t;
+
+	return (eq);
+}
+
+/*
+ * The device object must no longer point at the execution context,
+ * which IoDeleteDevice() takes care of.
+ */
+void
+ntoskrnl_execq_destroy(struct ntoskrnl_execq *eq)
+{
+	int i;
+
+	if (eq == NULL)
+		return;
+
+	/*
+	 * KeInsertQueueDpc() calls that found us before the device
+	 * object went away may not hold a reference yet. They look
+	 * us up in a critical section, so once every CPU has been
+	 * through a context switch they all do. Wait for those to be
+	 * dropped, then run whatever they queued.
+	 */
+	quiesce_all_cpus("ndisxq", 0);
+	while (atomic_load_acq_int(&eq->eq_refs) != 0)
+		pause("ndisxq", 1);
+	ntoskrnl_drain_dpc_queue(&eq->eq_dpc);
+	ntoskrnl_stop_dpc_thread(&eq->eq_dpc);
+	for (i = 0; i < WORKQUEUE_MAX; i++) {
+		taskqueue_free(eq->eq_lane[i].wl_tq);
+		mtx_destroy(&eq->eq_lane[i].wl_mtx);
+	}
+	free(eq, M_NDIS_NTOSKRNL);
+}
+
+/*
+ * Export per lane work item counts and queueing latency under
+ * the given node.
+ */
+void
+ntoskrnl_execq_sysctls(struct ntoskrnl_execq *eq,
+    struct sysctl_ctx_list *ctx, struct sysctl_oid *parent)
+{
+	struct ntoskrnl_wqlane *wl;
+	struct sysctl_oid *node;
+	int i;
+
+	for (i = 0; i < WORKQUEUE_MAX; i++) {
+		wl = &eq->eq_lane[i];
+		node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(parent),
+		    OID_AUTO, ntoskrnl_wqlanes[i].name, CTLFLAG_RD, NULL,
+		    "Work queue lane");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "runs", CTLFLAG_RD, &wl->wl_runs,
+		    "Work items run");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "latency_total", CTLFLAG_RD, &wl->wl_lattotal,
+		    "Time work items spent queued, in usec");
+		SYSCTL_ADD_UQUAD(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "latency_max", CTLFLAG_RD, &wl->wl_latmax,
+		    "Longest time a work item spent queued, in usec");
+	}
+}
+
+/*
+ * Route work items allocated against this device object to the
+ * execution context from now on.
+ */
+void
+ntoskrnl_execq_attach(struct device_object *dobj, struct ntoskrnl_execq *eq)
+{
+	if (dobj->devobj_ext != NULL)
+		dobj->devobj_ext->execq = eq;
+}
+
+/*
+ * Make a DPC run on the execution context of its device object,
+ * whenever that has one. 'owner' finds the device object from the
+ * DPC, typically through the structure the DPC is embedded in, so
+ * nothing is kept about the DPC outside of it and KeInitializeDpc()
+ * undoes the binding. A miniport that later targets the DPC at a
+ * CPU with KeSetTargetProcessorDpc() overrides this. Should we run
+ * out of owner slots the DPC keeps using the shared queues.
+ */
+void
+ntoskrnl_execq_bind_dpc(struct nt_kdpc *dpc, ntoskrnl_dpc_owner owner)
+{
+	int i;
+
+	for (i = 0; i < NTOSKRNL_DPC_OWNERS; i++) {
+		if (ntoskrnl_dpc_owners[i] == NULL)
+			atomic_cmpset_ptr(
+			    (volatile uintptr_t *)&ntoskrnl_dpc_owners[i],
+			    0, (uintptr_t)owner);
+		if (ntoskrnl_dpc_owners[i] == owner) {
+			dpc->type = KDPC_TYPE_EXECQ | i;
+			return;
+		}
+	}
 }
 
 static uint32_t
 KeGetCurrentProcessorNumber(void)
 {
-	return (curthread->td_oncpu);
+	return (PCPU_GET(cpuid));
 }
 
 uint8_t
@@ -3691,10 +4442,14 @@ KeDelayExecutionThread(uint8_t wait_mode, uint8_t alertable, int64_t *interval)
 	return (NDIS_STATUS_SUCCESS);
 }
 
+/*
+ * Every CPU a DPC can be targeted at. CPUs numbered beyond the
+ * width of a KAFFINITY are left out, Windows could not name them.
+ */
 static unsigned long
 KeQueryActiveProcessors(void)
 {
-	return (1);
+	return (ntoskrnl_active_cpus);
 }
 
 static uint64_t
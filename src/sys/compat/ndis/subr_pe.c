@@ -71,13 +71,29 @@ static void	pe_get_nt_header(vm_offset_t, struct image_nt_header **);
 static void	pe_get_file_header(vm_offset_t, struct image_file_header **);
 static int	pe_get_section(vm_offset_t, struct image_section_header **,
 		    const char *);
-static int	pe_get_import_descriptor(vm_offset_t,
+static int	pe_get_import_descriptor(const struct pe_image *,
 		    struct image_import_descriptor **, const char *);
-static int	pe_get_messagetable(vm_offset_t,
+static int	pe_get_messagetable(const struct pe_image *,
 		    struct message_resource_data **);
 static vm_offset_t pe_imagebase(vm_offset_t);
-static vm_offset_t pe_directory_offset(vm_offset_t, enum image_directory_entry);
+static vm_offset_t pe_directory_offset(const struct pe_image *,
+		    enum image_directory_entry);
+static uint32_t	pe_section_len(const struct pe_image *,
+		    const struct image_section_header *);
 static vm_offset_t pe_functbl_match(struct image_patch_table *, const char *);
+static int	pe_functbl_cmp(const void *, const void *);
+static struct image_patch_table *pe_functbl_end(struct image_patch_table *);
+
+/*
+ * Import tables sorted by pe_functbl_sort(), and how many named
+ * entries each has, so lookups can do a binary search.
+ */
+#define	PE_FUNCTBL_MAX	8
+static struct pe_functbl_index {
+	struct image_patch_table	*tbl;
+	size_t				cnt;
+} pe_functbl_index[PE_FUNCTBL_MAX];
+static int pe_functbl_nindex;
 
 /*
  * Verify that this image has a Windows NT PE signature.
@@ -206,55 +222,121 @@ pe_imagebase(vm_offset_t imgbase)
  * image. Directories reside within sections.
  */
 static vm_offset_t
-pe_directory_offset(vm_offset_t imgbase, enum image_directory_entry diridx)
+pe_directory_offset(const struct pe_image *pi,
+    enum image_directory_entry diridx)
 {
 	struct image_optional_header *opt_hdr;
 	vm_offset_t dir;
 
-	pe_get_optional_header(imgbase, &opt_hdr);
+	pe_get_optional_header(pi->pi_base, &opt_hdr);
 	if (diridx >= opt_hdr->number_of_rva_and_sizes)
 		return (0);
 	dir = opt_hdr->data_directory[diridx].virtual_address;
 
-	return (pe_translate_addr(imgbase, dir));
+	return (pe_image_translate(pi, dir));
 }
 
-vm_offset_t
-pe_translate_addr(vm_offset_t imgbase, vm_offset_t rva)
+/*
+ * Parse the headers of an image for pe_image_translate(). The
+ * image must already have passed pe_validate_header().
+ */
+void
+pe_image_init(struct pe_image *pi, vm_offset_t imgbase)
 {
 	struct image_optional_header *opt_hdr;
-	struct image_section_header *sect_hdr;
-	int i = 0, sections, fixedlen;
+	int i;
 
-	sections = pe_numsections(imgbase);
+	pi->pi_base = imgbase;
+	pi->pi_nsect = pe_numsections(imgbase);
 	pe_get_optional_header(imgbase, &opt_hdr);
-	pe_get_section_header(imgbase, &sect_hdr);
+	pi->pi_align = opt_hdr->section_aligment;
+	pe_get_section_header(imgbase, &pi->pi_sect);
 
 	/*
-	 * The test here is to see if the RVA falls somewhere
-	 * inside the section, based on the section's start RVA
-	 * and its length. However it seems sometimes the
-	 * virtual length isn't enough to cover the entire
-	 * area of the section. We fudge by taking into account
-	 * the section alignment and rounding the section length
-	 * up to a page boundary.
+	 * The PE spec has the section table sorted by address,
+	 * but don't bet the translation on every linker doing so.
 	 */
-	while (i++ < sections) {
-		fixedlen = sect_hdr->misc.virtual_size;
-		fixedlen += ((opt_hdr->section_aligment - 1) -
-		    sect_hdr->misc.virtual_size) &
-		    (opt_hdr->section_aligment - 1);
-		if (sect_hdr->virtual_address <= (uint32_t)rva &&
-		    (sect_hdr->virtual_address + fixedlen) > (uint32_t)rva)
-			break;
-		sect_hdr++;
+	pi->pi_sorted = 1;
+	for (i = 1; i < pi->pi_nsect; i++)
+		if (pi->pi_sect[i].virtual_address <
+		    pi->pi_sect[i - 1].virtual_address)
+			pi->pi_sorted = 0;
+}
+
+/*
+ * It seems sometimes the virtual length isn't enough to cover
+ * the entire area of the section. We fudge by rounding it up to
+ * the section alignment, and by using the raw length when the
+ * virtual one is missing.
+ */
+static uint32_t
+pe_section_len(const struct pe_image *pi,
+    const struct image_section_header *sect)
+{
+	uint32_t len;
+
+	len = sect->misc.virtual_size;
+	if (len == 0)
+		len = sect->size_of_raw_data;
+	if (pi->pi_align != 0)
+		len = roundup2(len, pi->pi_align);
+	return (len);
+}
+
+/*
+ * Find the section an RVA falls into and turn the RVA into an
+ * address within the loaded file. Returns 0 if there is none.
+ */
+vm_offset_t
+pe_image_translate(const struct pe_image *pi, vm_offset_t rva)
+{
+	const struct image_section_header *sect;
+	int lo, hi, mid;
+
+	sect = NULL;
+	if (pi->pi_sorted) {
+		/* Last section starting at or below the RVA. */
+		lo = 0;
+		hi = pi->pi_nsect;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (pi->pi_sect[mid].virtual_address <= (uint32_t)rva)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo > 0)
+			sect = &pi->pi_sect[lo - 1];
+	} else {
+		for (lo = 0; lo < pi->pi_nsect; lo++)
+			if (pi->pi_sect[lo].virtual_address <= (uint32_t)rva &&
+			    pi->pi_sect[lo].virtual_address +
+			    pe_section_len(pi, &pi->pi_sect[lo]) >
+			    (uint32_t)rva) {
+				sect = &pi->pi_sect[lo];
+				break;
+			}
 	}
 
-	if (i > sections)
+	if (sect == NULL || (uint32_t)rva - sect->virtual_address >=
+	    pe_section_len(pi, sect))
 		return (0);
 
-	return ((vm_offset_t)(imgbase + rva - sect_hdr->virtual_address +
-	    sect_hdr->pointer_to_raw_data));
+	return ((vm_offset_t)(pi->pi_base + rva - sect->virtual_address +
+	    sect->pointer_to_raw_data));
+}
+
+/*
+ * One-off translation. Anything translating more than a handful of
+ * addresses should set up a struct pe_image and keep it around.
+ */
+vm_offset_t
+pe_translate_addr(vm_offset_t imgbase, vm_offset_t rva)
+{
+	struct pe_image pi;
+
+	pe_image_init(&pi, imgbase);
+	return (pe_image_translate(&pi, rva));
 }
 
 /*
@@ -289,6 +371,7 @@ pe_get_section(vm_offset_t imgbase, struct image_section_header **hdr,
 int
 pe_relocate(vm_offset_t imgbase)
 {
+	struct pe_image pi;
 	struct image_section_header *sect;
 	struct image_base_relocation *relhdr;
 	vm_offset_t base, txt;
@@ -298,10 +381,11 @@ pe_relocate(vm_offset_t imgbase)
 	uint16_t rel, *sloc;
 	int i, count;
 
+	pe_image_init(&pi, imgbase);
 	base = pe_imagebase(imgbase);
 	if (pe_get_section(imgbase, &sect, ".text"))
 		return (ENOEXEC);
-	txt = pe_translate_addr(imgbase, sect->virtual_address);
+	txt = pe_image_translate(&pi, sect->virtual_address);
 	delta = (uint32_t)(txt) - base - sect->virtual_address;
 
 	if (pe_get_section(imgbase, &sect, ".reloc"))
@@ -318,28 +402,28 @@ pe_relocate(vm_offset_t imgbase)
 			case IMAGE_REL_BASED_ABSOLUTE:
 				break;
 			case IMAGE_REL_BASED_HIGHLOW:
-				lloc = (uint32_t *)pe_translate_addr(imgbase,
+				lloc = (uint32_t *)pe_image_translate(&pi,
 				    relhdr->virtual_address +
 				    IMR_RELOFFSET(rel));
-				*lloc = pe_translate_addr(imgbase, (*lloc - base));
+				*lloc = pe_image_translate(&pi, (*lloc - base));
 				break;
 			case IMAGE_REL_BASED_HIGH:
-				sloc = (uint16_t *)pe_translate_addr(imgbase,
+				sloc = (uint16_t *)pe_image_translate(&pi,
 				    relhdr->virtual_address +
 				    IMR_RELOFFSET(rel));
 				*sloc += (delta & 0xFFFF0000) >> 16;
 				break;
 			case IMAGE_REL_BASED_LOW:
-				sloc = (uint16_t *)pe_translate_addr(imgbase,
+				sloc = (uint16_t *)pe_image_translate(&pi,
 				    relhdr->virtual_address +
 				    IMR_RELOFFSET(rel));
 				*sloc += (delta & 0xFFFF);
 				break;
 			case IMAGE_REL_BASED_DIR64:
-				qloc = (uint64_t *)pe_translate_addr(imgbase,
+				qloc = (uint64_t *)pe_image_translate(&pi,
 				    relhdr->virtual_address +
 				    IMR_RELOFFSET(rel));
-				*qloc = pe_translate_addr(imgbase, (*qloc - base));
+				*qloc = pe_image_translate(&pi, (*qloc - base));
 				break;
 			default:
 				printf("[%d]reloc type: %d\n", i, IMR_RELTYPE(rel));
@@ -362,7 +446,7 @@ pe_relocate(vm_offset_t imgbase)
  * Note: module names are case insensitive!
  */
 static int
-pe_get_import_descriptor(vm_offset_t imgbase,
+pe_get_import_descriptor(const struct pe_image *pi,
     struct image_import_descriptor **desc, const char *module)
 {
 	struct image_import_descriptor *imp_desc;
@@ -371,12 +455,12 @@ pe_get_import_descriptor(vm_offset_t imgbase,
 
 	KASSERT(module != NULL, ("no module"));
 
-	offset = pe_directory_offset(imgbase, IMAGE_DIRECTORY_ENTRY_IMPORT);
+	offset = pe_directory_offset(pi, IMAGE_DIRECTORY_ENTRY_IMPORT);
 	if (offset == 0)
 		return (ENOENT);
 
 	for (imp_desc = (void *)offset; imp_desc->name; imp_desc++) {
-		modname = (char *)pe_translate_addr(imgbase, imp_desc->name);
+		modname = (char *)pe_image_translate(pi, imp_desc->name);
 		if (!strncasecmp(module, modname, strlen(module))) {
 			*desc = imp_desc;
 			return (0);
@@ -386,7 +470,8 @@ pe_get_import_descriptor(vm_offset_t imgbase,
 }
 
 static int
-pe_get_messagetable(vm_offset_t imgbase, struct message_resource_data **md)
+pe_get_messagetable(const struct pe_image *pi,
+    struct message_resource_data **md)
 {
 	struct image_resource_directory *rdir, *rtype;
 	struct image_resource_directory_entry *dent, *dent2;
@@ -394,7 +479,7 @@ pe_get_messagetable(vm_offset_t imgbase, struct message_resource_data **md)
 	vm_offset_t offset;
 	int i;
 
-	offset = pe_directory_offset(imgbase, IMAGE_DIRECTORY_ENTRY_RESOURCE);
+	offset = pe_directory_offset(pi, IMAGE_DIRECTORY_ENTRY_RESOURCE);
 	if (offset == 0)
 		return (ENOENT);
 
@@ -417,7 +502,7 @@ pe_get_messagetable(vm_offset_t imgbase, struct message_resource_data **md)
 		}
 		rent = (struct image_resource_data_entry *)(offset +
 		    dent2->dataoff);
-		*md = (struct message_resource_data *)pe_translate_addr(imgbase,
+		*md = (struct message_resource_data *)pe_image_translate(pi,
 		    rent->offset_to_data);
 		return (0);
 	}
@@ -429,12 +514,14 @@ int
 pe_get_message(vm_offset_t imgbase, uint32_t id, char **str, int *len,
     uint16_t *flags)
 {
+	struct pe_image pi;
 	struct message_resource_data *md;
 	struct message_resource_block *mb;
 	struct message_resource_entry *me;
 	uint32_t i;
 
-	if (pe_get_messagetable(imgbase, &md))
+	pe_image_init(&pi, imgbase);
+	if (pe_get_messagetable(&pi, &md))
 		return (ENOENT);
 
 	mb = (struct message_resource_block *)((uintptr_t)md +
@@ -458,10 +545,94 @@ pe_get_message(vm_offset_t imgbase, uint32_t id, char **str, int *len,
 	return (ENOENT);
 }
 
+static int
+pe_functbl_cmp(const void *a, const void *b)
+{
+	return (strcmp(((const struct image_patch_table *)a)->name,
+	    ((const struct image_patch_table *)b)->name));
+}
+
+/*
+ * Sort the named entries of an import table in place and remember
+ * it, so that pe_functbl_lookup() can binary search it. Must be
+ * done before anything looks the table up, and nothing may refer
+ * to table entries by position afterwards.
+ */
+void
+pe_functbl_sort(struct image_patch_table *functbl)
+{
+	size_t cnt;
+	int i;
+
+	for (i = 0; i < pe_functbl_nindex; i++)
+		if (pe_functbl_index[i].tbl == functbl)
+			return;
+	if (pe_functbl_nindex == PE_FUNCTBL_MAX)
+		return;
+
+	for (cnt = 0; functbl[cnt].name != NULL; cnt++)
+		;
+	qsort(functbl, cnt, sizeof(struct image_patch_table),
+	    pe_functbl_cmp);
+	pe_functbl_index[pe_functbl_nindex].tbl = functbl;
+	pe_functbl_index[pe_functbl_nindex].cnt = cnt;
+	pe_functbl_nindex++;
+}
+
+/*
+ * Find the entry for a name in an import table, or NULL. Tables
+ * that were never sorted are searched linearly.
+ */
+struct image_patch_table *
+pe_functbl_lookup(struct image_patch_table *functbl, const char *name)
+{
+	struct image_patch_table *p;
+	size_t lo, hi, mid;
+	int i, r;
+
+	for (i = 0; i < pe_functbl_nindex; i++)
+		if (pe_functbl_index[i].tbl == functbl)
+			break;
+	if (i == pe_functbl_nindex) {
+		for (p = functbl; p->name != NULL; p++)
+			if (strcmp(p->name, name) == 0)
+				return (p);
+		return (NULL);
+	}
+
+	lo = 0;
+	hi = pe_functbl_index[i].cnt;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = strcmp(name, functbl[mid].name);
+		if (r == 0)
+			return (&functbl[mid]);
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return (NULL);
+}
+
+/* The entry for the routine standing in for unimplemented ones. */
+static struct image_patch_table *
+pe_functbl_end(struct image_patch_table *functbl)
+{
+	struct image_patch_table *p;
+	int i;
+
+	for (i = 0; i < pe_functbl_nindex; i++)
+		if (pe_functbl_index[i].tbl == functbl)
+			return (functbl + pe_functbl_index[i].cnt);
+	for (p = functbl; p->name != NULL; p++)
+		;
+	return (p);
+}
+
 /*
- * Find the function that matches a particular name. This doesn't
- * need to be particularly speedy since it's only run when loading
- * a module for the first time.
+ * Find the function that matches a particular name, or the dummy
+ * routine at the end of the table if we don't implement it.
  */
 static vm_offset_t
 pe_functbl_match(struct image_patch_table *functbl, const char *name)
@@ -471,27 +642,18 @@ pe_functbl_match(struct image_patch_table *functbl, const char *name)
 	KASSERT(functbl != NULL, ("no functbl"));
 	KASSERT(name != NULL, ("no name"));
 
-	for (p = functbl; p->name != NULL; p++) {
-		if (!strcmp(p->name, name)) {
-#ifdef _KERNEL
-			if (bootverbose)
-				printf("NDIS:    match for %s\n", name);
-#endif
-			/*
-			 * Return the wrapper pointer for this routine.
-			 * For x86, this is the same as the funcptr.
-			 * For amd64, this points to a wrapper routine
-			 * that does calling convention translation and
-			 * then invokes the underlying routine.
-			 */
-			return ((vm_offset_t)p->wrap);
-		}
+	p = pe_functbl_lookup(functbl, name);
+	if (p == NULL) {
+		printf("NDIS: no match for %s\n", name);
+		p = pe_functbl_end(functbl);
 	}
-	printf("NDIS: no match for %s\n", name);
 
 	/*
-	 * Same as above but for dummy routine:
-	 * the one which is not implemented yet.
+	 * Return the wrapper pointer for this routine.
+	 * For x86, this is the same as the funcptr.
+	 * For amd64, this points to a wrapper routine
+	 * that does calling convention translation and
+	 * then invokes the underlying routine.
 	 */
 	return ((vm_offset_t)p->wrap);
 }
@@ -508,27 +670,47 @@ int
 pe_patch_imports(vm_offset_t imgbase, const char *module,
      struct image_patch_table *functbl)
 {
+	struct pe_image pi;
 	struct image_import_descriptor *imp_desc;
 	char *name;
 	vm_offset_t *nptr, *fptr;
+	int nimp = 0;
 
 	KASSERT(module != NULL, ("no module"));
 	KASSERT(functbl != NULL, ("no functbl"));
 
-	if (pe_get_import_descriptor(imgbase, &imp_desc, module))
+	pe_image_init(&pi, imgbase);
+	if (pe_get_import_descriptor(&pi, &imp_desc, module))
 		return (ENOEXEC);
 
-	nptr = (vm_offset_t *)pe_translate_addr(imgbase,
+	nptr = (vm_offset_t *)pe_image_translate(&pi,
 	    imp_desc->u.original_first_thunk);
-	fptr = (vm_offset_t *)pe_translate_addr(imgbase, imp_desc->first_thunk);
+	fptr = (vm_offset_t *)pe_image_translate(&pi, imp_desc->first_thunk);
 
-	while (nptr != NULL && pe_translate_addr(imgbase, *nptr)) {
-		name = (char *)pe_translate_addr(imgbase,
-		    (*nptr & ~IMAGE_ORDINAL_FLAG) + 2);
-		*fptr = pe_functbl_match(functbl, name);
+	while (nptr != NULL && *nptr != 0) {
+		if (*nptr & IMAGE_ORDINAL_FLAG) {
+			/*
+			 * Imported by ordinal: there is no name to go
+			 * by, and export ordinals differ between Windows
+			 * releases, so all we can offer is the dummy.
+			 */
+			printf("NDIS: no match for %s ordinal %u\n", module,
+			    (unsigned)IMAGE_ORDINAL(*nptr));
+			*fptr = (vm_offset_t)pe_functbl_end(functbl)->wrap;
+		} else {
+			name = (char *)pe_image_translate(&pi, *nptr + 2);
+			if (name == NULL)
+				break;
+			*fptr = pe_functbl_match(functbl, name);
+		}
+		nimp++;
 		nptr++;
 		fptr++;
 	}
+#ifdef _KERNEL
+	if (bootverbose)
+		printf("NDIS: linked %d imports from %s\n", nimp, module);
+#endif
 
 	return (0);
 }
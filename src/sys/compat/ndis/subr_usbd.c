@@ -124,7 +124,7 @@ static void usbd_irpcancel(struct device_object *, struct irp *);
 static int32_t usbd_submit_urb(struct irp *);
 static int32_t usbd_urb2nt(int32_t);
 static void usbd_task(struct device_object *, struct ndis_softc *);
-static int32_t usbd_taskadd(struct irp *, unsigned);
+static void usbd_taskadd(struct irp *, unsigned);
 static void usbd_xfertask(struct device_object *, struct ndis_softc *);
 static void dummy(void);
 
@@ -157,6 +157,7 @@ usbd_libinit(void)
 	int i;
 
 	windrv_wrap_table(usbd_functbl);
+	pe_functbl_sort(usbd_functbl);
 	windrv_wrap((funcptr)usbd_ioinvalid, &usbd_ioinvalid_wrap, 2, STDCALL);
 	windrv_wrap((funcptr)usbd_iodispatch, &usbd_iodispatch_wrap, 2, STDCALL);
 	windrv_wrap((funcptr)usbd_pnp, &usbd_pnp_wrap, 2, STDCALL);
@@ -731,9 +732,7 @@ usbd_func_vendorclass(struct irp *ip)
 	USBD_URB_STATUS(urb) = USBD_STATUS_PENDING;
 	IoMarkIrpPending(ip);
 
-	error = usbd_taskadd(ip, NDISUSB_TASK_VENDOR);
-	if (error != USBD_STATUS_SUCCESS)
-		return (error);
+	usbd_taskadd(ip, NDISUSB_TASK_VENDOR);
 
 	return (USBD_STATUS_PENDING);
 }
@@ -772,20 +771,13 @@ static void
 usbd_xfer_complete(struct ndis_softc *sc, struct ndisusb_ep *ne,
     struct ndisusb_xfer *nx, usb_error_t status)
 {
-	struct ndisusb_xferdone *nd;
 	uint8_t irql;
 
-	nd = malloc(sizeof(struct ndisusb_xferdone),
-	    M_USBDEV, M_NOWAIT|M_ZERO);
-	if (nd == NULL) {
-		device_printf(sc->ndis_dev, "out of memory\n");
-		return;
-	}
-	nd->nd_xfer = nx;
-	nd->nd_status = status;
+	/* The transfer is off the endpoint queues, reuse its link. */
+	nx->nx_status = status;
 
 	KeAcquireSpinLock(&sc->ndisusb_xferdonelock, &irql);
-	InsertTailList(&sc->ndisusb_xferdonelist, &nd->nd_donelist);
+	InsertTailList(&sc->ndisusb_xferdonelist, &nx->nx_next);
 	KeReleaseSpinLock(&sc->ndisusb_xferdonelock, irql);
 
 	IoQueueWorkItem(sc->ndisusb_xferdoneitem,
@@ -1086,27 +1078,22 @@ usbd_xfertask(struct device_object *dobj, struct ndis_softc *sc)
 {
 	struct irp *ip;
 	struct list_entry *l;
-	struct ndisusb_xferdone *nd;
 	struct ndisusb_xfer *nq;
 	struct usbd_urb_bulk_or_intr_transfer *ubi;
 	struct usbd_urb_vendor_or_class_request *vcreq;
 	union usbd_urb *urb;
 	usb_error_t status;
-	void *priv;
-	int error;
 
 	if (IsListEmpty(&sc->ndisusb_xferdonelist))
 		return;
 
 	KeAcquireSpinLockAtDpcLevel(&sc->ndisusb_xferdonelock);
-	l = sc->ndisusb_xferdonelist.flink;
-	while (l != &sc->ndisusb_xferdonelist) {
-		nd = CONTAINING_RECORD(l, struct ndisusb_xferdone, nd_donelist);
-		nq = nd->nd_xfer;
-		priv = nq->nx_priv;
-		status = nd->nd_status;
-		error = 0;
-		ip = priv;
+	while (!IsListEmpty(&sc->ndisusb_xferdonelist)) {
+		l = RemoveHeadList(&sc->ndisusb_xferdonelist);
+		KeReleaseSpinLockFromDpcLevel(&sc->ndisusb_xferdonelock);
+		nq = CONTAINING_RECORD(l, struct ndisusb_xfer, nx_next);
+		ip = nq->nx_priv;
+		status = nq->nx_status;
 		urb = usbd_geturb(ip);
 
 		ip->cancelfunc = NULL;
@@ -1139,13 +1126,7 @@ usbd_xfertask(struct device_object *dobj, struct ndis_softc *sc)
 			break;
 		}
 
-		l = l->flink;
-		RemoveEntryList(&nd->nd_donelist);
 		free(nq, M_USBDEV);
-		free(nd, M_USBDEV);
-		if (error)
-			continue;
-		KeReleaseSpinLockFromDpcLevel(&sc->ndisusb_xferdonelock);
 		/* NB: call after cleaning  */
 		IoCompleteRequest(ip, IO_NO_INCREMENT);
 		KeAcquireSpinLockAtDpcLevel(&sc->ndisusb_xferdonelock);
@@ -1155,32 +1136,25 @@ usbd_xfertask(struct device_object *dobj, struct ndis_softc *sc)
 
 /*
  * This function is for mainly deferring a task to the another thread because
- * we don't want to be in the scope of HAL lock.
+ * we don't want to be in the scope of HAL lock. The IRP is pending with us
+ * until usbd_task() has dequeued it, so it carries its own list linkage.
  */
-static int32_t
+static void
 usbd_taskadd(struct irp *ip, unsigned type)
 {
 	device_t dev;
 	struct ndis_softc *sc;
-	struct ndisusb_task *nt;
 
 	dev = IRP_NDIS_DEV(ip);
 	sc = device_get_softc(dev);
 
-	nt = malloc(sizeof(struct ndisusb_task), M_USBDEV, M_NOWAIT|M_ZERO);
-	if (nt == NULL)
-		return (USBD_STATUS_NO_MEMORY);
-	nt->nt_type = type;
-	nt->nt_ctx = ip;
-
+	IRP_NDISUSB_TASKTYPE(ip) = type;
 	KeAcquireSpinLockAtDpcLevel(&sc->ndisusb_tasklock);
-	InsertTailList(&sc->ndisusb_tasklist, &nt->nt_tasklist);
+	InsertTailList(&sc->ndisusb_tasklist, &IRP_NDISUSB_TASK(ip));
 	KeReleaseSpinLockFromDpcLevel(&sc->ndisusb_tasklock);
 
 	IoQueueWorkItem(sc->ndisusb_taskitem,
 	    (io_workitem_func)usbd_task_wrap, CRITICAL, sc);
-
-	return (USBD_STATUS_SUCCESS);
 }
 
 static void
@@ -1189,23 +1163,26 @@ usbd_task(struct device_object *dobj, struct ndis_softc *sc)
 	struct irp *ip;
 	struct list_entry *l;
 	struct ndisusb_ep *ne;
-	struct ndisusb_task *nt;
 	union usbd_urb *urb;
+	uint32_t type;
 
 	if (IsListEmpty(&sc->ndisusb_tasklist))
 		return;
 
 	KeAcquireSpinLockAtDpcLevel(&sc->ndisusb_tasklock);
-	l = sc->ndisusb_tasklist.flink;
-	while (l != &sc->ndisusb_tasklist) {
-		nt = CONTAINING_RECORD(l, struct ndisusb_task, nt_tasklist);
-
-		ip = nt->nt_ctx;
+	while (!IsListEmpty(&sc->ndisusb_tasklist)) {
+		/*
+		 * Dequeue before letting go of the lock: once the transfer
+		 * is started the IRP can complete and be queued again.
+		 */
+		l = RemoveHeadList(&sc->ndisusb_tasklist);
+		ip = CONTAINING_RECORD(l, struct irp, tail.misc.usb.tasklist);
+		type = IRP_NDISUSB_TASKTYPE(ip);
 		urb = usbd_geturb(ip);
 
 		KeReleaseSpinLockFromDpcLevel(&sc->ndisusb_tasklock);
 		NDISUSB_LOCK(sc);
-		switch (nt->nt_type) {
+		switch (type) {
 		case NDISUSB_TASK_TSTART:
 			ne = usbd_get_ndisep(ip, urb->uu_bulkintr.ubi_epdesc);
 			if (ne == NULL)
@@ -1214,7 +1191,7 @@ usbd_task(struct device_object *dobj, struct ndis_softc *sc)
 			break;
 		case NDISUSB_TASK_IRPCANCEL:
 			ne = usbd_get_ndisep(ip,
-			    (nt->nt_type == NDISUSB_TASK_IRPCANCEL) ?
+			    (type == NDISUSB_TASK_IRPCANCEL) ?
 			    urb->uu_bulkintr.ubi_epdesc :
 			    urb->uu_pipe.upr_handle);
 			if (ne == NULL)
@@ -1235,10 +1212,6 @@ usbd_task(struct device_object *dobj, struct ndis_softc *sc)
 exit:
 		NDISUSB_UNLOCK(sc);
 		KeAcquireSpinLockAtDpcLevel(&sc->ndisusb_tasklock);
-
-		l = l->flink;
-		RemoveEntryList(&nt->nt_tasklist);
-		free(nt, M_USBDEV);
 	}
 	KeReleaseSpinLockFromDpcLevel(&sc->ndisusb_tasklock);
 }
@@ -1246,7 +1219,6 @@ exit:
 static int32_t
 usbd_func_bulkintr(struct irp *ip)
 {
-	int32_t error;
 	struct ndisusb_ep *ne;
 	struct ndisusb_xfer *nx;
 	struct usbd_urb_bulk_or_intr_transfer *ubi;
@@ -1282,9 +1254,7 @@ usbd_func_bulkintr(struct irp *ip)
 	USBD_URB_STATUS(urb) = USBD_STATUS_PENDING;
 	IoMarkIrpPending(ip);
 
-	error = usbd_taskadd(ip, NDISUSB_TASK_TSTART);
-	if (error != USBD_STATUS_SUCCESS)
-		return (error);
+	usbd_taskadd(ip, NDISUSB_TASK_TSTART);
 
 	return (USBD_STATUS_PENDING);
 }
@@ -41,6 +41,7 @@ __FBSDID("$FreeBSD$");
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/buf_ring.h>
 #include <sys/mbuf.h>
 #include <sys/malloc.h>
 #include <sys/sockio.h>
@@ -49,6 +50,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/socket.h>
 #include <sys/module.h>
 #include <sys/priv.h>
+#include <sys/sysctl.h>
 
 #include <net/bpf.h>
 #include <net/if.h>
@@ -57,6 +59,10 @@ __FBSDID("$FreeBSD$");
 #include <net/if_media.h>
 #include <net/if_types.h>
 
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+
 #include <machine/bus.h>
 #include <machine/resource.h>
 
@@ -90,6 +96,51 @@ MODULE_DEPEND(ndis, wlan, 1, 1, 1);
 MODULE_DEPEND(ndis, ndisapi, 3, 3, 3);
 MODULE_VERSION(ndis, 3);
 
+SYSCTL_NODE(_hw, OID_AUTO, ndis, CTLFLAG_RD, 0, "NDIS driver parameters");
+
+/*
+ * Maximum number of received packets we let the stack hold on to
+ * before we start copying them instead. Each loaned packet is one
+ * of the miniport's receive buffers, so holding too many starves it.
+ */
+static int ndis_rxloanmax = 128;
+TUNABLE_INT("hw.ndis.rx_loan_max", &ndis_rxloanmax);
+SYSCTL_INT(_hw_ndis, OID_AUTO, rx_loan_max, CTLFLAG_RDTUN, &ndis_rxloanmax,
+    0, "Default limit of RX packets loaned to the stack");
+
+/* Size of the per-interface transmit ring, must be a power of 2. */
+static int ndis_txringsize = 1024;
+TUNABLE_INT("hw.ndis.tx_ring_size", &ndis_txringsize);
+SYSCTL_INT(_hw_ndis, OID_AUTO, tx_ring_size, CTLFLAG_RDTUN, &ndis_txringsize,
+    0, "Transmit ring size");
+
+/*
+ * Largest batch of packets handed to the miniport at once, and the
+ * number of sends we keep in flight. Deserialized miniports get
+ * this many; serialized ones advertise their own limit through
+ * OID_GEN_MAXIMUM_SEND_PACKETS, which we only ever lower.
+ */
+static int ndis_txmaxpkts = 64;
+TUNABLE_INT("hw.ndis.tx_max_packets", &ndis_txmaxpkts);
+SYSCTL_INT(_hw_ndis, OID_AUTO, tx_max_packets, CTLFLAG_RDTUN,
+    &ndis_txmaxpkts, 0, "Max TX packets in flight and per send batch");
+
+/*
+ * How long cached link and 802.11 state may be served without asking
+ * the miniport again, in seconds. Status indications invalidate the
+ * affected fields regardless, so these only bound how stale a field
+ * can get when a miniport fails to indicate a change.
+ */
+static int ndis_stttl = 2;
+TUNABLE_INT("hw.ndis.state_ttl", &ndis_stttl);
+SYSCTL_INT(_hw_ndis, OID_AUTO, state_ttl, CTLFLAG_RDTUN, &ndis_stttl,
+    0, "Default lifetime of cached link state, in seconds");
+
+static int ndis_stttlstatic = 60;
+TUNABLE_INT("hw.ndis.state_ttl_static", &ndis_stttlstatic);
+SYSCTL_INT(_hw_ndis, OID_AUTO, state_ttl_static, CTLFLAG_RDTUN,
+    &ndis_stttlstatic, 0, "Default lifetime of cached 802.11 settings");
+
 static void	NdisMEthIndicateReceive(struct ndis_miniport_block *,
 		    void *, char *, void *, uint32_t, void *, uint32_t,
 		    uint32_t);
@@ -105,6 +156,7 @@ static void	NdisMTransferDataComplete(struct ndis_miniport_block *,
 		    struct ndis_packet *, uint32_t, uint32_t);
 static void	ndis_rxeof_xfr(struct nt_kdpc *, struct ndis_miniport_block *,
 		    void *, void *);
+static struct device_object *ndis_rxdpc_owner(struct nt_kdpc *);
 
 /* We need to wrap these functions for amd64. */
 static funcptr ndis_inputtask_wrap;
@@ -140,6 +192,9 @@ static void	ndis_init(void *);
 static int	ndis_ioctl(struct ifnet *, u_long, caddr_t);
 static int	ndis_ioctl_80211(struct ifnet *, u_long, caddr_t);
 static void	ndis_inputtask(struct device_object *, void *);
+static void	ndis_rxenqueue(struct ndis_softc *, struct mbuf *,
+		    struct mbuf *, int);
+static void	ndis_add_sysctls(struct ndis_softc *);
 static int	ndis_key_set(struct ieee80211vap *,
 		    const struct ieee80211_key *, const u_int8_t []);
 static int	ndis_key_delete(struct ieee80211vap *,
@@ -152,6 +207,12 @@ static int	ndis_nettype_mode(uint32_t);
 static int	ndis_newstate(struct ieee80211vap *, enum ieee80211_state, int);
 static int	ndis_get_physical_medium(struct ndis_softc *,
 		    enum ndis_physical_medium *);
+static int	ndis_state_get(struct ndis_softc *, enum ndis_stfield, void *);
+static void	ndis_state_indicate(struct ndis_softc *, int32_t, void *,
+		    uint32_t);
+static void	ndis_state_invalidate(struct ndis_softc *, uint32_t);
+static void	ndis_state_set(struct ndis_softc *, enum ndis_stfield,
+		    const void *);
 static int	ndis_probe_task_offload(struct ndis_softc *);
 static int	ndis_raw_xmit(struct ieee80211_node *, struct mbuf *,
 		    const struct ieee80211_bpf_params *);
@@ -181,8 +242,12 @@ static int	ndis_set_txpower(struct ndis_softc *);
 static void	ndis_set_wol(struct ndis_softc *);
 static int	ndis_set_wpa(struct ndis_softc *, void *, int);
 static void	ndis_setstate_80211(struct ndis_softc *, struct ieee80211vap *);
+static void	ndis_qflush(struct ifnet *);
 static void	ndis_start(struct ifnet *);
 static void	ndis_starttask(struct device_object *, void *);
+static int	ndis_transmit(struct ifnet *, struct mbuf *);
+static void	ndis_txdrain(struct ndis_softc *);
+static void	ndis_txstart(struct ndis_softc *);
 static void	ndis_stop(struct ndis_softc *);
 static void	ndis_tick(void *);
 static void	ndis_ticktask(struct device_object *, void *);
@@ -191,6 +256,13 @@ static void	ndis_update_promisc(struct ifnet *ifp);
 
 MALLOC_DEFINE(M_NDIS_DEV, "ndis_dev", "if_ndis buffers");
 
+static __inline int
+ndis_txq_empty(struct ndis_softc *sc)
+{
+	return (sc->ndis_txnext == NULL &&
+	    drbr_empty(sc->ndis_ifp, sc->ndis_txbr));
+}
+
 /*
  * This routine should call windrv_load() once for each driver image.
  * This will do the relocation and dynalinking for the image, and create
@@ -279,9 +351,12 @@ ndis_set_txpower(struct ndis_softc *sc)
 {
 	struct ieee80211com *ic = sc->ndis_ifp->if_l2com;
 	int32_t power;
+	int error;
 
 	power = dBm2mW[ic->ic_txpowlimit];
-	if (ndis_set_int(sc, OID_802_11_TX_POWER_LEVEL, power))
+	error = ndis_set_int(sc, OID_802_11_TX_POWER_LEVEL, power);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_TXPOWER));
+	if (error)
 		return (EINVAL);
 	return (0);
 }
@@ -290,12 +365,15 @@ static int
 ndis_set_powersave(struct ndis_softc *sc, uint32_t flags)
 {
 	enum ndis_80211_power_mode arg;
+	int error;
 
 	if (flags & IEEE80211_F_PMGTON)
 		arg = NDIS_802_11_POWER_MODE_FAST_PSP;
 	else
 		arg = NDIS_802_11_POWER_MODE_CAM;
-	return (ndis_set_int(sc, OID_802_11_POWER_MODE, arg));
+	error = ndis_set_int(sc, OID_802_11_POWER_MODE, arg);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_POWER));
+	return (error);
 }
 
 static int
@@ -308,28 +386,42 @@ static int
 ndis_set_rtsthreshold(struct ndis_softc *sc, uint16_t nrts)
 {
 	uint32_t rts = nrts;
+	int error;
 
-	return (ndis_set_int(sc, OID_802_11_RTS_THRESHOLD, rts));
+	error = ndis_set_int(sc, OID_802_11_RTS_THRESHOLD, rts);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_RTS));
+	return (error);
 }
 
 static int
 ndis_set_fragthreshold(struct ndis_softc *sc, uint16_t nfrag)
 {
 	uint32_t frag = nfrag;
+	int error;
 
-	return (ndis_set_int(sc, OID_802_11_FRAGMENTATION_THRESHOLD, frag));
+	error = ndis_set_int(sc, OID_802_11_FRAGMENTATION_THRESHOLD, frag);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_FRAG));
+	return (error);
 }
 
 static int
 ndis_set_encryption(struct ndis_softc *sc, enum ndis_80211_encryption_status s)
 {
-	return (ndis_set_int(sc, OID_802_11_ENCRYPTION_STATUS, s));
+	int error;
+
+	error = ndis_set_int(sc, OID_802_11_ENCRYPTION_STATUS, s);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_ENCSTAT));
+	return (error);
 }
 
 static int
 ndis_set_authmode(struct ndis_softc *sc, enum ndis_80211_authentication_mode m)
 {
-	return (ndis_set_int(sc, OID_802_11_AUTHENTICATION_MODE, m));
+	int error;
+
+	error = ndis_set_int(sc, OID_802_11_AUTHENTICATION_MODE, m);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_AUTHMODE));
+	return (error);
 }
 
 static int
@@ -359,6 +451,7 @@ ndis_set_privacy_filter(struct ndis_softc *sc, uint32_t filter)
 	else
 		arg = NDIS_802_11_PRIVFILT_ACCEPTALL;
 	ndis_set_int(sc, OID_802_11_PRIVACY_FILTER, arg);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_PRIVFILT));
 }
 
 /*
@@ -409,6 +502,7 @@ ndis_set_task_offload(struct ndis_softc *sc)
 	struct ndis_task_offload *nto;
 	struct ndis_task_offload_header *ntoh;
 	struct ndis_task_tcpip_csum *nttc;
+	struct ndis_task_tcp_largesend *nttl;
 	int error;
 	uint32_t len;
 
@@ -420,6 +514,9 @@ ndis_set_task_offload(struct ndis_softc *sc)
 	len = sizeof(struct ndis_task_offload_header) +
 	    sizeof(struct ndis_task_offload) +
 	    sizeof(struct ndis_task_tcpip_csum);
+	if (ifp->if_capenable & IFCAP_TSO4)
+		len += sizeof(struct ndis_task_offload) +
+		    sizeof(struct ndis_task_tcp_largesend);
 
 	ntoh = malloc(len, M_NDIS_DEV, M_NOWAIT|M_ZERO);
 	if (ntoh == NULL)
@@ -448,6 +545,22 @@ ndis_set_task_offload(struct ndis_softc *sc)
 	if (ifp->if_capenable & IFCAP_RXCSUM)
 		nttc->v4rx = sc->ndis_v4rx;
 
+	if (ifp->if_capenable & IFCAP_TSO4) {
+		nto->offset_next_task = sizeof(struct ndis_task_offload) +
+		    sizeof(struct ndis_task_tcpip_csum);
+		nto = (struct ndis_task_offload *)((char *)nto +
+		    nto->offset_next_task);
+		nto->version = NDIS_TASK_OFFLOAD_VERSION;
+		nto->size = sizeof(struct ndis_task_offload);
+		nto->task = NDIS_TASK_TCP_LARGESEND;
+		nto->offset_next_task = 0;
+		nto->task_buffer_length =
+		    sizeof(struct ndis_task_tcp_largesend);
+
+		nttl = (struct ndis_task_tcp_largesend *)nto->task_buffer;
+		*nttl = sc->ndis_lso;
+	}
+
 	error = ndis_set(sc, OID_TCP_TASK_OFFLOAD, ntoh, len);
 	free(ntoh, M_NDIS_DEV);
 	return (error);
@@ -460,6 +573,7 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 	struct ndis_task_offload *nto;
 	struct ndis_task_offload_header *ntoh;
 	struct ndis_task_tcpip_csum *nttc = NULL;
+	struct ndis_task_tcp_largesend *nttl = NULL;
 	int error;
 
 	ntoh = malloc(256, M_NDIS_DEV, M_NOWAIT|M_ZERO);
@@ -473,7 +587,7 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 	ntoh->encapsulation_format.encapsulation = NDIS_ENCAP_IEEE802_3;
 	ntoh->encapsulation_format.flags = NDIS_ENCAPFLAG_FIXEDHDRLEN;
 
-	error = ndis_get(sc, OID_TCP_TASK_OFFLOAD, ntoh, sizeof(ntoh));
+	error = ndis_get(sc, OID_TCP_TASK_OFFLOAD, ntoh, 256);
 	if (error) {
 		free(ntoh, M_NDIS_DEV);
 		return (error);
@@ -491,9 +605,12 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 		case NDIS_TASK_TCPIP_CSUM:
 			nttc = (struct ndis_task_tcpip_csum *)nto->task_buffer;
 			break;
+		case NDIS_TASK_TCP_LARGESEND:
+			nttl = (struct ndis_task_tcp_largesend *)
+			    nto->task_buffer;
+			break;
 		/* Don't handle these yet. */
 		case NDIS_TASK_IPSEC:
-		case NDIS_TASK_TCP_LARGESEND:
 		default:
 			break;
 		}
@@ -526,6 +643,22 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 	if (nttc->v4rx & NDIS_TCPSUM_FLAGS_UDP_CSUM)
 		ifp->if_capabilities |= IFCAP_RXCSUM;
 
+	/*
+	 * Only take large send if the miniport accepts anything our
+	 * stack may hand it: frames up to IP_MAXPACKET, carrying TCP
+	 * options (timestamps), of as little as two segments. It also
+	 * needs TX checksumming, and is not offered to scatter/gather
+	 * miniports, whose SG list cannot describe a full size TSO
+	 * frame in NDIS_MAXSEG elements.
+	 */
+	if (nttl != NULL && ifp->if_capabilities & IFCAP_TXCSUM &&
+	    !sc->ndis_sc && nttl->maxofflen >= IP_MAXPACKET &&
+	    nttl->minsegcnt <= 2 && nttl->tcpopt) {
+		sc->ndis_lso = *nttl;
+		sc->ndis_hwassist |= CSUM_TSO;
+		ifp->if_capabilities |= IFCAP_TSO4;
+	}
+
 	free(ntoh, M_NDIS_DEV);
 	return (0);
 }
@@ -570,6 +703,89 @@ ndis_auth_mode(uint32_t type)
 	return (IEEE80211_AUTH_NONE);
 }
 
+/*
+ * Export the per-adapter datapath knobs and counters under
+ * dev.ndis.<unit>. These live next to the registry keys, so keep
+ * the names distinct from anything an .INF file is likely to use.
+ */
+static void
+ndis_add_sysctls(struct ndis_softc *sc)
+{
+	struct sysctl_ctx_list *ctx;
+	struct sysctl_oid_list *child;
+
+	ctx = device_get_sysctl_ctx(sc->ndis_dev);
+	child = SYSCTL_CHILDREN(device_get_sysctl_tree(sc->ndis_dev));
+
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_loan_max", CTLFLAG_RW,
+	    &sc->ndis_rxloanmax, 0, "Max RX packets loaned to the stack");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_loaned", CTLFLAG_RD,
+	    &sc->ndis_rxloaned, 0, "RX packets currently loaned");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "rx_copied", CTLFLAG_RD,
+	    &sc->ndis_rxcopied, "RX packets copied instead of loaned");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "rx_batches", CTLFLAG_RD,
+	    &sc->ndis_rxbatches, "RX bursts queued for input");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "rx_batch_pkts", CTLFLAG_RD,
+	    &sc->ndis_rxbatchpkts, "RX packets queued for input");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "rx_input_runs", CTLFLAG_RD,
+	    &sc->ndis_rxinputruns, "RX input task runs");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "rx_input_pkts", CTLFLAG_RD,
+	    &sc->ndis_rxinputpkts, "RX packets passed to the stack");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "tx_max_packets", CTLFLAG_RD,
+	    &sc->ndis_maxpkts, 0, "Max TX packets in flight and per batch");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "tx_batches", CTLFLAG_RD,
+	    &sc->ndis_txbatches, "TX batches handed to the miniport");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "tx_batch_pkts", CTLFLAG_RD,
+	    &sc->ndis_txbatchpkts, "TX packets handed to the miniport");
+	SYSCTL_ADD_ULONG(ctx, child, OID_AUTO, "tx_tso_pkts", CTLFLAG_RD,
+	    &sc->ndis_txtsopkts, "TSO frames completed");
+	SYSCTL_ADD_ULONG(ctx, child, OID_AUTO, "tx_tso_bytes", CTLFLAG_RD,
+	    &sc->ndis_txtsobytes, "TCP payload bytes sent by TSO");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "shm_chunks", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_chunks, 0, "Shared memory slab chunks");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "shm_large", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_large, 0, "Shared memory large allocations");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "shm_objects", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_objects, 0, "Shared memory slab objects in use");
+	SYSCTL_ADD_ULONG(ctx, child, OID_AUTO, "shm_bytes", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_bytes, "Shared memory bytes handed out");
+	SYSCTL_ADD_ULONG(ctx, child, OID_AUTO, "shm_backing", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_backing, "Shared memory bytes allocated");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "shm_allocs", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_allocs, "Shared memory allocations");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "shm_frees", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_frees, "Shared memory frees");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "shm_badfrees", CTLFLAG_RD,
+	    &sc->ndis_shm.nsp_badfrees, "Frees of unknown shared memory");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "state_ttl", CTLFLAG_RW,
+	    &sc->ndis_st.ns_ttl, 0, "Lifetime of cached link state (sec)");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "state_ttl_static", CTLFLAG_RW,
+	    &sc->ndis_st.ns_ttl_static, 0,
+	    "Lifetime of cached 802.11 settings (sec)");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "state_hits", CTLFLAG_RD,
+	    &sc->ndis_st.ns_hits, "State lookups answered from the cache");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "state_queries", CTLFLAG_RD,
+	    &sc->ndis_st.ns_queries, "State lookups sent to the miniport");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "state_events", CTLFLAG_RD,
+	    &sc->ndis_st.ns_events, "Status indications applied to the cache");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "oid_requests", CTLFLAG_RD,
+	    &sc->ndis_oidreqs, "OID requests queued to the miniport");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "oid_pending", CTLFLAG_RD,
+	    &sc->ndis_oidpending, "OID requests completed asynchronously");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "oid_timeouts", CTLFLAG_RD,
+	    &sc->ndis_oidtimeouts, "OID requests abandoned after timeout");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "oid_cache", CTLFLAG_RW,
+	    &sc->ndis_oidcenable, 0, "Answer constant OID queries from cache");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "oid_cache_hits", CTLFLAG_RD,
+	    &sc->ndis_oidchits, "OID queries answered from the cache");
+	SYSCTL_ADD_UQUAD(ctx, child, OID_AUTO, "oid_cache_misses", CTLFLAG_RD,
+	    &sc->ndis_oidcmisses, "Cacheable OID queries sent to the miniport");
+	if (sc->ndis_execq != NULL)
+		ntoskrnl_execq_sysctls(sc->ndis_execq, ctx,
+		    SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "workq", CTLFLAG_RD,
+		    NULL, "Work item lanes"));
+}
+
 /*
  * Attach the interface. Allocate softc structures, do ifmedia
  * setup and ethernet/BPF attach.
@@ -590,10 +806,15 @@ ndis_attach(device_t dev)
 	sc = device_get_softc(dev);
 	mtx_init(&sc->ndis_mtx, device_get_nameunit(dev), MTX_NETWORK_LOCK,
 	    MTX_DEF);
+	mtx_init(&sc->ndis_txmtx, "ndis tx", NULL, MTX_DEF);
+	mtx_init(&sc->ndis_st.ns_mtx, "ndis state", NULL, MTX_DEF);
+	sc->ndis_st.ns_ttl = ndis_stttl;
+	sc->ndis_st.ns_ttl_static = ndis_stttlstatic;
 	KeInitializeSpinLock(&sc->ndis_rxlock);
 	KeInitializeSpinLock(&sc->ndisusb_tasklock);
 	KeInitializeSpinLock(&sc->ndisusb_xferdonelock);
-	InitializeListHead(&sc->ndis_shlist);
+	ndis_shm_init(sc);
+	ndis_oid_init(sc);
 	InitializeListHead(&sc->ndisusb_tasklist);
 	InitializeListHead(&sc->ndisusb_xferdonelist);
 	callout_init(&sc->ndis_stat_callout, CALLOUT_MPSAFE);
@@ -605,6 +826,8 @@ ndis_attach(device_t dev)
 		pdrv = windrv_lookup(0, "PCCARD Bus");
 	else if (sc->ndis_bus_type == NDIS_PNPBUS)
 		pdrv = windrv_lookup(0, "USB Bus");
+	else if (sc->ndis_bus_type == NDIS_INTERNAL)
+		pdrv = windrv_lookup(0, "Internal Bus");
 	else {
 		device_printf(dev, "unsupported interface type\n");
 		goto fail;
@@ -645,6 +868,7 @@ ndis_attach(device_t dev)
 	sc->ndisusb_taskitem =
 	    IoAllocateWorkItem(sc->ndis_block->deviceobj);
 	KeInitializeDpc(&sc->ndis_rxdpc, ndis_rxeof_xfr_wrap, sc->ndis_block);
+	ntoskrnl_execq_bind_dpc(&sc->ndis_rxdpc, ndis_rxdpc_owner);
 
 	if (ndis_init_nic(sc) != NDIS_STATUS_SUCCESS)
 		goto fail;
@@ -688,8 +912,9 @@ ndis_attach(device_t dev)
 		goto fail;
 	}
 
-	if (!NDIS_SERIALIZED(sc->ndis_block))
-		sc->ndis_maxpkts = 64; // FIXME sysctl
+	if (!NDIS_SERIALIZED(sc->ndis_block) ||
+	    sc->ndis_maxpkts > ndis_txmaxpkts)
+		sc->ndis_maxpkts = ndis_txmaxpkts;
 
 	sc->ndis_hang_timer = sc->ndis_block->check_for_hang_secs;
 
@@ -699,11 +924,29 @@ ndis_attach(device_t dev)
 
 	sc->ndis_txarray = malloc(sizeof(struct ndis_packet *) *
 	    sc->ndis_maxpkts, M_NDIS_DEV, M_NOWAIT|M_ZERO);
-	if (sc->ndis_txarray == NULL) {
+	sc->ndis_txstage = malloc(sizeof(struct ndis_packet *) *
+	    sc->ndis_maxpkts, M_NDIS_DEV, M_NOWAIT|M_ZERO);
+	if (sc->ndis_txarray == NULL || sc->ndis_txstage == NULL) {
 		device_printf(dev, "failed to allocate TX array\n");
 		goto fail;
 	}
 
+	if (!powerof2(ndis_txringsize))
+		ndis_txringsize = 1024;
+	sc->ndis_txbr = buf_ring_alloc(ndis_txringsize, M_NDIS_DEV,
+	    M_NOWAIT, &sc->ndis_txmtx);
+	if (sc->ndis_txbr == NULL) {
+		device_printf(dev, "failed to allocate TX ring\n");
+		goto fail;
+	}
+
+	sc->ndis_txmdls = malloc(sizeof(struct ndis_txmdl) * NDIS_MAXSEG *
+	    sc->ndis_maxpkts, M_NDIS_DEV, M_NOWAIT|M_ZERO);
+	if (sc->ndis_txmdls == NULL) {
+		device_printf(dev, "failed to allocate TX MDLs\n");
+		goto fail;
+	}
+
 	/* Allocate a pool of ndis_packets for TX encapsulation. */
 	NdisAllocatePacketPool(&rval, &sc->ndis_txpool, sc->ndis_maxpkts,
 	    PROTOCOL_RESERVED_SIZE_IN_PACKET);
@@ -714,6 +957,9 @@ ndis_attach(device_t dev)
 	}
 	sc->ndis_txpending = sc->ndis_maxpkts;
 
+	sc->ndis_rxloanmax = ndis_rxloanmax;
+	ndis_add_sysctls(sc);
+
 	/* If the NDIS module requested scatter/gather, init maps. */
 	if (sc->ndis_sc) {
 		rval = ndis_init_dma(sc);
@@ -750,6 +996,8 @@ ndis_attach(device_t dev)
 
 	if_initname(ifp, device_get_name(dev), device_get_unit(dev));
 	ifp->if_flags = IFF_BROADCAST | IFF_SIMPLEX | IFF_MULTICAST;
+	ifp->if_transmit = ndis_transmit;
+	ifp->if_qflush = ndis_qflush;
 	ifp->if_start = ndis_start;
 	ifp->if_init = ndis_init;
 	ifp->if_baudrate = 10000000;
@@ -1061,8 +1309,11 @@ int
 ndis_detach(device_t dev)
 {
 	struct ndis_softc *sc;
+	struct mbuf *m;
 
 	sc = device_get_softc(dev);
+	if (NDIS_INITIALIZED(sc) && ndis_drain_rx(sc) != 0)
+		return (EBUSY);
 	if (device_is_attached(dev)) {
 		if (sc->ndis_ifp != NULL) {
 			ndis_stop(sc);
@@ -1104,10 +1355,22 @@ ndis_detach(device_t dev)
 		ndis_destroy_dma(sc);
 	if (sc->ndis_txarray != NULL)
 		free(sc->ndis_txarray, M_NDIS_DEV);
+	if (sc->ndis_txstage != NULL)
+		free(sc->ndis_txstage, M_NDIS_DEV);
+	if (sc->ndis_txmdls != NULL)
+		free(sc->ndis_txmdls, M_NDIS_DEV);
+	if (sc->ndis_txbr != NULL) {
+		while ((m = buf_ring_dequeue_sc(sc->ndis_txbr)) != NULL)
+			m_freem(m);
+		buf_ring_free(sc->ndis_txbr, M_NDIS_DEV);
+	}
+	if (sc->ndis_txnext != NULL)
+		m_freem(sc->ndis_txnext);
 	if (!NDIS_80211(sc))
 		ifmedia_removeall(&sc->ifmedia);
 	if (sc->ndis_txpool != NULL)
 		NdisFreePacketPool(sc->ndis_txpool);
+	ndis_shm_destroy(sc);
 	if (sc->ndis_bus_type == NDIS_PCIBUS) {
 		windrv_destroy_pdo(windrv_lookup(0, "PCI Bus"), dev);
 		bus_dma_tag_destroy(sc->ndis_parent_tag);
@@ -1115,7 +1378,12 @@ ndis_detach(device_t dev)
 		windrv_destroy_pdo(windrv_lookup(0, "PCCARD Bus"), dev);
 	} else if (sc->ndis_bus_type == NDIS_PNPBUS) {
 		windrv_destroy_pdo(windrv_lookup(0, "USB Bus"), dev);
+	} else if (sc->ndis_bus_type == NDIS_INTERNAL) {
+		windrv_destroy_pdo(windrv_lookup(0, "Internal Bus"), dev);
 	}
+	ndis_oid_destroy(sc);
+	mtx_destroy(&sc->ndis_st.ns_mtx);
+	mtx_destroy(&sc->ndis_txmtx);
 	mtx_destroy(&sc->ndis_mtx);
 	return (0);
 }
@@ -1215,6 +1483,15 @@ NdisMEthIndicateReceiveComplete(struct ndis_miniport_block *block)
 	KeInsertQueueDpc(&sc->ndis_rxdpc, NULL, NULL);
 }
 
+static struct device_object *
+ndis_rxdpc_owner(struct nt_kdpc *dpc)
+{
+	struct ndis_softc *sc;
+
+	sc = CONTAINING_RECORD(dpc, struct ndis_softc, ndis_rxdpc);
+	return (sc->ndis_block->deviceobj);
+}
+
 /*
  * MiniportTransferData() handler, runs at DISPATCH_LEVEL.
  */
@@ -1228,7 +1505,8 @@ ndis_rxeof_xfr(struct nt_kdpc *dpc, struct ndis_miniport_block *block,
 	int32_t status;
 	struct ndis_ethpriv *priv;
 	struct ifnet *ifp;
-	struct mbuf *m;
+	struct mbuf *m, *mh = NULL, *mt = NULL;
+	int cnt = 0;
 
 	sc = device_get_softc(block->physdeviceobj->devext);
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
@@ -1262,12 +1540,12 @@ ndis_rxeof_xfr(struct nt_kdpc *dpc, struct ndis_miniport_block *block,
 		if (status == NDIS_STATUS_SUCCESS) {
 			IoFreeMdl(p->private.head);
 			NdisFreePacket(p);
-			KeAcquireSpinLockAtDpcLevel(&sc->ndis_rxlock);
-			_IF_ENQUEUE(&sc->ndis_rxqueue, m);
-			KeReleaseSpinLockFromDpcLevel(&sc->ndis_rxlock);
-			IoQueueWorkItem(sc->ndis_inputitem,
-			    (io_workitem_func)ndis_inputtask_wrap,
-			    CRITICAL, ifp);
+			if (mt == NULL)
+				mh = m;
+			else
+				mt->m_nextpkt = m;
+			mt = m;
+			cnt++;
 		}
 
 		if (status == NDIS_STATUS_FAILURE)
@@ -1275,6 +1553,8 @@ ndis_rxeof_xfr(struct nt_kdpc *dpc, struct ndis_miniport_block *block,
 	}
 
 	KeReleaseSpinLockFromDpcLevel(&block->lock);
+
+	ndis_rxenqueue(sc, mh, mt, cnt);
 }
 
 static void
@@ -1300,11 +1580,7 @@ NdisMTransferDataComplete(struct ndis_miniport_block *block,
 
 	m->m_len = m->m_pkthdr.len;
 	m->m_pkthdr.rcvif = ifp;
-	KeAcquireSpinLockAtDpcLevel(&sc->ndis_rxlock);
-	_IF_ENQUEUE(&sc->ndis_rxqueue, m);
-	KeReleaseSpinLockFromDpcLevel(&sc->ndis_rxlock);
-	IoQueueWorkItem(sc->ndis_inputitem,
-	    (io_workitem_func)ndis_inputtask_wrap, CRITICAL, ifp);
+	ndis_rxenqueue(sc, m, m, 1);
 }
 
 /*
@@ -1323,6 +1599,12 @@ NdisMTransferDataComplete(struct ndis_miniport_block *block,
  * this means the driver is running out of packet/buffer resources and wants
  * to maintain ownership of the packet. In this case, we have to copy the
  * packet data into local storage and let the driver keep the packet.
+ *
+ * When we do get ownership, the mbuf chain built by ndis_ptom() points
+ * straight at the driver's buffers, so we pass it up as is and the packet
+ * goes back to the miniport from ndis_return_packet() once the stack
+ * frees the last mbuf. We only fall back to copying when too many packets
+ * are already out on loan, so that the miniport doesn't run dry.
  */
 static void
 NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
@@ -1333,8 +1615,8 @@ NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
 	uint32_t s;
 	struct ndis_tcpip_csum *csum;
 	struct ifnet *ifp;
-	struct mbuf *m0, *m;
-	int i;
+	struct mbuf *m0, *m, *mh = NULL, *mt = NULL;
+	int cnt = 0, i;
 
 	sc = device_get_softc(block->physdeviceobj->devext);
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
@@ -1349,7 +1631,9 @@ NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
 		for (i = 0; i < pktcnt; i++) {
 			p = packets[i];
 			if (p->oob.status == NDIS_STATUS_SUCCESS) {
-				p->refcnt++;
+				p->softc = sc;
+				p->loaned = FALSE;
+				p->refcnt = 1;
 				ndis_return_packet(NULL, block, p);
 			}
 		}
@@ -1360,22 +1644,32 @@ NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
 		p = packets[i];
 		/* Stash the softc here so ptom can use it. */
 		p->softc = sc;
+		p->loaned = FALSE;
 		if (ndis_ptom(&m0, p)) {
 			device_printf(sc->ndis_dev, "ptom failed\n");
 			if (p->oob.status == NDIS_STATUS_SUCCESS)
 				ndis_return_packet(NULL, block, p);
 		} else {
-			m = m_dup(m0, M_DONTWAIT);
-			if (p->oob.status == NDIS_STATUS_RESOURCES)
-				p->refcnt++;
-			else
+			if (p->oob.status == NDIS_STATUS_SUCCESS &&
+			    sc->ndis_rxloaned < sc->ndis_rxloanmax &&
+			    !sc->ndis_rxnoloan) {
 				p->oob.status = NDIS_STATUS_PENDING;
-			m_freem(m0);
-			if (m == NULL) {
-				ifp->if_ierrors++;
-				continue;
+				p->loaned = TRUE;
+				atomic_add_int(&sc->ndis_rxloaned, 1);
+			} else {
+				m = m_dup(m0, M_DONTWAIT);
+				if (p->oob.status == NDIS_STATUS_RESOURCES)
+					p->refcnt++;
+				else
+					p->oob.status = NDIS_STATUS_PENDING;
+				m_freem(m0);
+				sc->ndis_rxcopied++;
+				if (m == NULL) {
+					ifp->if_ierrors++;
+					continue;
+				}
+				m0 = m;
 			}
-			m0 = m;
 			m0->m_pkthdr.rcvif = ifp;
 
 			/* Deal with checksum offload. */
@@ -1396,14 +1690,46 @@ NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
 				}
 			}
 
-			KeAcquireSpinLockAtDpcLevel(&sc->ndis_rxlock);
-			_IF_ENQUEUE(&sc->ndis_rxqueue, m0);
-			KeReleaseSpinLockFromDpcLevel(&sc->ndis_rxlock);
-			IoQueueWorkItem(sc->ndis_inputitem,
-			    (io_workitem_func)ndis_inputtask_wrap,
-			    CRITICAL, ifp);
+			if (mt == NULL)
+				mh = m0;
+			else
+				mt->m_nextpkt = m0;
+			mt = m0;
+			cnt++;
 		}
 	}
+
+	ndis_rxenqueue(sc, mh, mt, cnt);
+}
+
+/*
+ * Splice a chain of received frames (linked through m_nextpkt) onto
+ * the input queue and kick the input task. Callers collect a whole
+ * indication first, so we take the RX lock and queue the work item
+ * once per burst rather than once per frame.
+ */
+static void
+ndis_rxenqueue(struct ndis_softc *sc, struct mbuf *head, struct mbuf *tail,
+    int cnt)
+{
+	struct ifqueue *q = &sc->ndis_rxqueue;
+
+	if (head == NULL)
+		return;
+
+	KeAcquireSpinLockAtDpcLevel(&sc->ndis_rxlock);
+	if (q->ifq_tail == NULL)
+		q->ifq_head = head;
+	else
+		q->ifq_tail->m_nextpkt = head;
+	q->ifq_tail = tail;
+	q->ifq_len += cnt;
+	sc->ndis_rxbatches++;
+	sc->ndis_rxbatchpkts += cnt;
+	KeReleaseSpinLockFromDpcLevel(&sc->ndis_rxlock);
+
+	IoQueueWorkItem(sc->ndis_inputitem,
+	    (io_workitem_func)ndis_inputtask_wrap, HYPERCRITICAL, sc->ndis_ifp);
 }
 
 /*
@@ -1419,24 +1745,32 @@ ndis_inputtask(struct device_object *dobj, void *arg)
 	struct ndis_softc *sc = ifp->if_softc;
 	struct ieee80211com *ic = ifp->if_l2com;
 	struct ieee80211vap *vap;
-	struct mbuf *m;
+	struct mbuf *m, *next;
 	uint8_t irql;
+	int cnt;
 
 	vap = TAILQ_FIRST(&ic->ic_vaps);
 
+	/* Take everything queued so far in one go. */
 	KeAcquireSpinLock(&sc->ndis_rxlock, &irql);
-	for (;;) {
-		_IF_DEQUEUE(&sc->ndis_rxqueue, m);
-		if (m == NULL)
-			break;
-		KeReleaseSpinLock(&sc->ndis_rxlock, irql);
+	m = sc->ndis_rxqueue.ifq_head;
+	cnt = sc->ndis_rxqueue.ifq_len;
+	sc->ndis_rxqueue.ifq_head = sc->ndis_rxqueue.ifq_tail = NULL;
+	sc->ndis_rxqueue.ifq_len = 0;
+	if (m != NULL) {
+		sc->ndis_rxinputruns++;
+		sc->ndis_rxinputpkts += cnt;
+	}
+	KeReleaseSpinLock(&sc->ndis_rxlock, irql);
+
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
 		if (NDIS_80211(sc) && vap != NULL)
 			vap->iv_deliver_data(vap, vap->iv_bss, m);
 		else
 			(*ifp->if_input)(ifp, m);
-		KeAcquireSpinLock(&sc->ndis_rxlock, &irql);
 	}
-	KeReleaseSpinLock(&sc->ndis_rxlock, irql);
 }
 
 static void
@@ -1457,42 +1791,58 @@ NdisMSendComplete(struct ndis_miniport_block *block, struct ndis_packet *packet,
 	if (sc->ndis_sc)
 		bus_dmamap_unload(sc->ndis_ttag, sc->ndis_tmaps[idx]);
 
-	ndis_free_packet(packet);
+	/*
+	 * If the batch this packet went out in is still being looked
+	 * at by ndis_send_packets(), tell it the packet is gone. Must
+	 * happen before the packet can be recycled.
+	 */
+	atomic_cmpset_ptr((volatile uintptr_t *)
+	    &sc->ndis_txstage[packet->txstage], (uintptr_t)packet, 0);
+
+	/* The miniport replaces the MSS with the payload bytes it sent. */
+	if (m->m_pkthdr.csum_flags & CSUM_TSO) {
+		atomic_add_long(&sc->ndis_txtsopkts, 1);
+		atomic_add_long(&sc->ndis_txtsobytes,
+		    (uintptr_t)packet->ext.info[TCP_LARGE_SEND_PACKET_INFO]);
+	}
+
+	ndis_free_txpacket(packet, NDIS_TXMDLS(sc, idx));
 	m_freem(m);
 
-	NDIS_LOCK(sc);
-	sc->ndis_txarray[idx] = NULL;
-	sc->ndis_txpending++;
+	/*
+	 * The slot is handed back without any lock; the drainer only
+	 * ever looks at whether it is NULL.
+	 */
+	atomic_store_rel_ptr((volatile uintptr_t *)&sc->ndis_txarray[idx], 0);
 
 	if (status == NDIS_STATUS_SUCCESS)
-		ifp->if_opackets++;
+		atomic_add_long(&ifp->if_opackets, 1);
 	else
-		ifp->if_oerrors++;
+		atomic_add_long(&ifp->if_oerrors, 1);
 
 	/*
 	 * Stop watchdog if there are no pending packets or restart timer if
 	 * there are.
 	 */
-	if (sc->ndis_txpending == sc->ndis_maxpkts)
+	if (atomic_fetchadd_int(&sc->ndis_txpending, 1) + 1 ==
+	    sc->ndis_maxpkts)
 		sc->ndis_tx_timer = 0;
 	else
 		sc->ndis_tx_timer = NDIS_PACKET_TX_TIMEOUT;
 
+	if (ndis_txq_empty(sc))
+		return;
+
 	/*
-	 * Drop/set "tx hardware queue is full" flag if ndis_txarray can/can't
-	 * fit more packets.
+	 * Restart transmission right here if we can. A serialized
+	 * miniport calls us with its lock held, which the send path
+	 * needs too, so in that case punt to the start task.
 	 */
-	if (ifp->if_drv_flags & IFF_DRV_OACTIVE &&
-	    !sc->ndis_txarray[NDIS_NEXT_TXIDX(sc)])
-		ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
-	if (!ifp->if_drv_flags & IFF_DRV_OACTIVE &&
-	    sc->ndis_txarray[NDIS_NEXT_TXIDX(sc)])
-		ifp->if_drv_flags |= IFF_DRV_OACTIVE;
-
-	NDIS_UNLOCK(sc);
-
-	IoQueueWorkItem(sc->ndis_startitem,
-	    (io_workitem_func)ndis_starttask_wrap, CRITICAL, ifp);
+	if (NDIS_SERIALIZED(sc->ndis_block))
+		IoQueueWorkItem(sc->ndis_startitem,
+		    (io_workitem_func)ndis_starttask_wrap, HYPERCRITICAL, ifp);
+	else
+		ndis_txstart(sc);
 }
 
 static void
@@ -1507,6 +1857,8 @@ NdisMIndicateStatus(struct ndis_miniport_block *block, int32_t status,
 
 	sc = device_get_softc(block->physdeviceobj->devext);
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
+	ndis_oid_cache_status(sc, status);
+	ndis_state_indicate(sc, status, buf, len);
 	if ((sc->ndis_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0)
 		return;
 
@@ -1585,7 +1937,7 @@ NdisMIndicateStatusComplete(struct ndis_miniport_block *block)
 		    (io_workitem_func)ndis_ticktask_wrap, CRITICAL, sc);
 		IoQueueWorkItem(sc->ndis_startitem,
 		    (io_workitem_func)ndis_starttask_wrap,
-		    CRITICAL, sc->ndis_ifp);
+		    HYPERCRITICAL, sc->ndis_ifp);
 	} else if (sc->ndis_ifp->if_link_state == LINK_STATE_DOWN) {
 		IoQueueWorkItem(sc->ndis_tickitem,
 		    (io_workitem_func)ndis_ticktask_wrap, CRITICAL, sc);
@@ -1609,7 +1961,12 @@ ndis_tick(void *xsc)
 		    (io_workitem_func)ndis_resettask_wrap, CRITICAL, sc);
 		IoQueueWorkItem(sc->ndis_startitem,
 		    (io_workitem_func)ndis_starttask_wrap,
-		    CRITICAL, sc->ndis_ifp);
+		    HYPERCRITICAL, sc->ndis_ifp);
+	} else if (sc->ndis_tx_timer == 0 && sc->ndis_txnext != NULL) {
+		/* Send stalled on resources with nothing in flight. */
+		IoQueueWorkItem(sc->ndis_startitem,
+		    (io_workitem_func)ndis_starttask_wrap,
+		    HYPERCRITICAL, sc->ndis_ifp);
 	}
 	callout_reset(&sc->ndis_stat_callout, hz, ndis_tick, sc);
 }
@@ -1677,6 +2034,98 @@ ndis_starttask(struct device_object *d, void *arg)
 
 	if (!IFQ_DRV_IS_EMPTY(&ifp->if_snd))
 		ndis_start(ifp);
+	else
+		ndis_txstart(ifp->if_softc);
+}
+
+/*
+ * Transmit entry point. Any number of threads can get here at once;
+ * the frame goes on the lock-free ring and whoever manages to take
+ * the TX lock drains it.
+ */
+static int
+ndis_transmit(struct ifnet *ifp, struct mbuf *m)
+{
+	struct ndis_softc *sc = ifp->if_softc;
+	int error;
+
+	error = drbr_enqueue(ifp, sc->ndis_txbr, m);
+	if (error)
+		return (error);
+
+	ndis_txstart(sc);
+
+	return (0);
+}
+
+static void
+ndis_qflush(struct ifnet *ifp)
+{
+	struct ndis_softc *sc = ifp->if_softc;
+	struct mbuf *m;
+
+	NDIS_TX_LOCK(sc);
+	if (sc->ndis_txnext != NULL) {
+		m_freem(sc->ndis_txnext);
+		sc->ndis_txnext = NULL;
+	}
+	while ((m = buf_ring_dequeue_sc(sc->ndis_txbr)) != NULL)
+		m_freem(m);
+	NDIS_TX_UNLOCK(sc);
+
+	if_qflush(ifp);
+}
+
+/*
+ * Legacy if_start entry, used by anything that still hands frames
+ * over through if_snd. Just move them onto the ring.
+ */
+static void
+ndis_start(struct ifnet *ifp)
+{
+	struct ndis_softc *sc = ifp->if_softc;
+	struct mbuf *m;
+
+	for (;;) {
+		IFQ_DRV_DEQUEUE(&ifp->if_snd, m);
+		if (m == NULL)
+			break;
+		if (drbr_enqueue(ifp, sc->ndis_txbr, m) != 0)
+			break;
+	}
+
+	ndis_txstart(sc);
+}
+
+/*
+ * Run the drainer for as long as there is work and room for it.
+ * Only one thread drains at a time; the others just leave their
+ * frames on the ring. The check is repeated after the lock has
+ * been dropped so that a frame enqueued while the previous holder
+ * was on its way out is not left behind.
+ *
+ * A frame left in ndis_txnext means the drainer ran out of packets
+ * or could not map the frame. Trying again right away would just
+ * spin, so leave it to NdisMSendComplete(), or to ndis_tick() if
+ * nothing is in flight.
+ */
+static void
+ndis_txstart(struct ndis_softc *sc)
+{
+	struct ifnet *ifp = sc->ndis_ifp;
+
+	while (!ndis_txq_empty(sc) && ifp->if_drv_flags & IFF_DRV_RUNNING) {
+		if (!NDIS_TX_TRYLOCK(sc))
+			return;
+		ndis_txdrain(sc);
+		NDIS_TX_UNLOCK(sc);
+
+		/* Out of slots: NdisMSendComplete() will restart us. */
+		if (sc->ndis_txpending == 0 || NDIS_TXSLOT_BUSY(sc))
+			return;
+		if (sc->ndis_txnext != NULL)
+			return;
+	}
 }
 
 /*
@@ -1684,52 +2133,57 @@ ndis_starttask(struct device_object *d, void *arg)
  * mbuf chains into NDIS packets and feed them to the send packet routines.
  * Most drivers allow you to send several packets at once (up to the maxpkts
  * limit). Unfortunately, rather that accepting them in the form of a linked
- * list, they expect a contiguous array of pointers to packets.
+ * list, they expect a contiguous array of pointers to packets. That array
+ * is built in ndis_txstage[], so a batch never has to stop where the
+ * ndis_txarray[] ring of in-flight slots wraps around.
  *
  * For those drivers which use the NDIS scatter/gather DMA mechanism,
  * we need to perform busdma work here. Those that use map registers
  * will do the mapping themselves on a buffer by buffer basis.
+ *
+ * Called with the TX lock held, which is kept across the send so
+ * frames reach the miniport in ring order.
  */
 static void
-ndis_start(struct ifnet *ifp)
+ndis_txdrain(struct ndis_softc *sc)
 {
-	struct ndis_softc *sc = ifp->if_softc;
+	struct ifnet *ifp = sc->ndis_ifp;
 	struct mbuf *m = NULL;
-	struct ndis_packet **p0 = NULL, *p = NULL;
+	struct ndis_packet *p = NULL;
 	struct ndis_tcpip_csum *csum;
-	uint32_t pcnt = 0;
+	uint32_t i, pcnt = 0;
 	int32_t status;
 
-	if (ifp->if_drv_flags & IFF_DRV_OACTIVE)
-		return;
-
-	NDIS_LOCK(sc);
-	p0 = &sc->ndis_txarray[sc->ndis_txidx];
+	NDIS_TX_LOCK_ASSERT(sc, MA_OWNED);
 
 	while (sc->ndis_txpending) {
 		/*
 		 * Don't reuse txarray element which points to the packet
-		 * which is not yet processed by miniport driver. Set
-		 * "tx queue is full" flag.
+		 * which is not yet processed by miniport driver.
 		 */
-		if (sc->ndis_txarray[NDIS_NEXT_TXIDX(sc)]) {
-			ifp->if_drv_flags |= IFF_DRV_OACTIVE;
+		if (NDIS_TXSLOT_BUSY(sc))
 			break;
-		}
 
-		IFQ_DRV_DEQUEUE(&ifp->if_snd, m);
-		if (m == NULL)
-			break;
+		if (sc->ndis_txnext != NULL) {
+			m = sc->ndis_txnext;
+			sc->ndis_txnext = NULL;
+		} else {
+			m = drbr_dequeue(ifp, sc->ndis_txbr);
+			if (m == NULL)
+				break;
+		}
 
 		NdisAllocatePacket(&status,
 		    &sc->ndis_txarray[sc->ndis_txidx], sc->ndis_txpool);
-		if (status != NDIS_STATUS_SUCCESS)
+		if (status != NDIS_STATUS_SUCCESS) {
+			sc->ndis_txnext = m;
 			break;
+		}
 
-		if (ndis_mtop(m, &sc->ndis_txarray[sc->ndis_txidx])) {
-			IFQ_DRV_PREPEND(&ifp->if_snd, m);
-			NDIS_UNLOCK(sc);
-			return;
+		if (ndis_mtop(&m, &sc->ndis_txarray[sc->ndis_txidx],
+		    NDIS_TXMDLS(sc, sc->ndis_txidx))) {
+			sc->ndis_txnext = m;
+			break;
 		}
 
 		/*
@@ -1737,6 +2191,7 @@ ndis_start(struct ifnet *ifp)
 		 */
 		p = sc->ndis_txarray[sc->ndis_txidx];
 		p->txidx = sc->ndis_txidx;
+		p->txstage = pcnt;
 		p->m0 = m;
 		p->oob.status = NDIS_STATUS_PENDING;
 
@@ -1753,9 +2208,18 @@ ndis_start(struct ifnet *ifp)
 			p->ext.info[SCATTER_GATHER_LIST_PACKET_INFO] = &p->sclist;
 		}
 
-		/* Handle checksum offload. */
-		if (ifp->if_capenable & IFCAP_TXCSUM &&
+		/*
+		 * Large send. The miniport computes all the checksums
+		 * itself, so no checksum info goes with it.
+		 */
+		if (ifp->if_capenable & IFCAP_TSO4 &&
+		    m->m_pkthdr.csum_flags & CSUM_TSO) {
+			p->ext.info[TCP_LARGE_SEND_PACKET_INFO] =
+			    (void *)(uintptr_t)m->m_pkthdr.tso_segsz;
+			p->private.flags = NDIS_PROTOCOL_ID_TCP_IP;
+		} else if (ifp->if_capenable & IFCAP_TXCSUM &&
 		    m->m_pkthdr.csum_flags) {
+			/* Handle checksum offload. */
 			csum = (struct ndis_tcpip_csum *)
 				&p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO];
 			csum->u.txflags = NDIS_TXCSUM_DO_IPV4;
@@ -1768,10 +2232,9 @@ ndis_start(struct ifnet *ifp)
 			p->private.flags = NDIS_PROTOCOL_ID_TCP_IP;
 		}
 
+		sc->ndis_txstage[pcnt++] = p;
 		sc->ndis_txidx = NDIS_NEXT_TXIDX(sc);
-		sc->ndis_txpending--;
-
-		pcnt++;
+		atomic_subtract_int(&sc->ndis_txpending, 1);
 
 		/*
 		 * If there's a BPF listener, bounce a copy of this frame
@@ -1779,25 +2242,13 @@ ndis_start(struct ifnet *ifp)
 		 */
 		if (!NDIS_80211(sc))
 			BPF_MTAP(ifp, m);
-
-		/*
-		 * The array that p0 points to must appear contiguous,
-		 * so we must not wrap past the end of sc->ndis_txarray[].
-		 * If it looks like we're about to wrap, break out here
-		 * so the this batch of packets can be transmitted, then
-		 * wait for txeof to ask us to send the rest.
-		 */
-		if (sc->ndis_txidx == 0)
-			break;
 	}
 
-	if (pcnt == 0) {
-		NDIS_UNLOCK(sc);
+	if (pcnt == 0)
 		return;
-	}
 
-	if (sc->ndis_txpending == 0)
-		ifp->if_drv_flags |= IFF_DRV_OACTIVE;
+	sc->ndis_txbatches++;
+	sc->ndis_txbatchpkts += pcnt;
 
 	/*
 	 * Activate a watchdog timer if it was stopped.
@@ -1805,17 +2256,16 @@ ndis_start(struct ifnet *ifp)
 	if (sc->ndis_tx_timer == 0)
 		sc->ndis_tx_timer = NDIS_PACKET_TX_TIMEOUT;
 
-	NDIS_UNLOCK(sc);
-
 	/*
 	 * According to NDIS documentation, if a driver exports
 	 * a MiniportSendPackets() routine, we prefer that over
 	 * a MiniportSend() routine (which sends just a single packet).
 	 */
 	if (sc->ndis_chars->send_packets_func != NULL)
-		ndis_send_packets(sc, p0, pcnt);
+		ndis_send_packets(sc, sc->ndis_txstage, pcnt);
 	else
-		ndis_send_packet(sc, p);
+		for (i = 0; i < pcnt; i++)
+			ndis_send_packet(sc, sc->ndis_txstage[i]);
 }
 
 static void
@@ -1835,10 +2285,15 @@ ndis_init(void *xsc)
 
 	ndis_set_task_offload(sc);
 
-	NDIS_LOCK(sc);
+	/* Whatever we knew before a reset or power cycle is gone. */
+	ndis_state_invalidate(sc, NDIS_ST_ALL);
+
+	NDIS_TX_LOCK(sc);
 	sc->ndis_txidx = 0;
 	sc->ndis_txpending = sc->ndis_maxpkts;
+	NDIS_TX_UNLOCK(sc);
 
+	NDIS_LOCK(sc);
 	ifp->if_drv_flags |= IFF_DRV_RUNNING;
 	ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
 	sc->ndis_tx_timer = 0;
@@ -1871,13 +2326,13 @@ ndis_ifmedia_sts(struct ifnet *ifp, struct ifmediareq *ifmr)
 
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
 
-	ndis_get_int(sc, OID_GEN_MEDIA_CONNECT_STATUS, &linkstate);
-	if (linkstate == NDIS_MEDIA_STATE_CONNECTED)
-		ifmr->ifm_status |= IFM_ACTIVE;
-	else
+	if (ndis_state_get(sc, NDIS_ST_MEDIA, &linkstate) ||
+	    linkstate != NDIS_MEDIA_STATE_CONNECTED)
 		return;
+	ifmr->ifm_status |= IFM_ACTIVE;
 
-	ndis_get_int(sc, OID_GEN_LINK_SPEED, &media_info);
+	if (ndis_state_get(sc, NDIS_ST_LINKSPEED, &media_info))
+		return;
 
 	switch (media_info) {
 	case 100000:
@@ -1997,7 +2452,7 @@ ndis_media_status(struct ifnet *ifp, struct ifmediareq *ifmr)
 	uint32_t txrate;
 
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
-	if (!ndis_get_int(sc, OID_GEN_LINK_SPEED, &txrate))
+	if (!ndis_state_get(sc, NDIS_ST_LINKSPEED, &txrate))
 		vap->iv_bss->ni_txrate = txrate / 5000;
 	ieee80211_media_status(ifp, ifmr);
 }
@@ -2049,6 +2504,7 @@ ndis_set_infra(struct ndis_softc *sc, int opmode)
 	if (!(sc->ndis_ifp->if_flags & IFF_UP))
 		ndis_set_powerstate(sc, NDIS_DEVICE_STATE_D0);
 	rval = ndis_set_int(sc, OID_802_11_INFRASTRUCTURE_MODE, mode);
+	ndis_state_invalidate(sc, NDIS_ST_ALL);
 	if (!(sc->ndis_ifp->if_flags & IFF_UP))
 		ndis_set_powerstate(sc, NDIS_DEVICE_STATE_D3);
 	return (rval);
@@ -2058,6 +2514,7 @@ static void
 ndis_set_bssid(struct ndis_softc *sc, uint8_t *bssid)
 {
 	ndis_set(sc, OID_802_11_BSSID, bssid, IEEE80211_ADDR_LEN);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_BSSID));
 }
 
 static void
@@ -2071,6 +2528,7 @@ ndis_set_ssid(struct ndis_softc *sc, uint8_t *essid, uint8_t esslen)
 	memcpy(s->ssid, essid, esslen);
 	s->len = esslen;
 	ndis_set(sc, OID_802_11_SSID, s, sizeof(struct ndis_80211_ssid));
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_SSID));
 	free(s, M_NDIS_DEV);
 }
 
@@ -2109,6 +2567,7 @@ static void
 ndis_disassociate(struct ndis_softc *sc, struct ieee80211vap *vap)
 {
 	ndis_set(sc, OID_802_11_DISASSOCIATE, NULL, 0);
+	ndis_state_invalidate(sc, NDIS_ST_ASSOC);
 	if (vap->iv_opmode == IEEE80211_M_STA)
 		vap->iv_bss->ni_associd = 0;
 }
@@ -2139,58 +2598,210 @@ ndis_get_bssid_list(struct ndis_softc *sc, struct ndis_80211_bssid_list_ex **bl)
 	}
 }
 
+/*
+ * OID backing each cached state field. Volatile fields follow the
+ * association and expire after ns_ttl; the rest are settings that only
+ * change when we set them, and live for ns_ttl_static.
+ */
+static const struct ndis_stpolicy {
+	uint32_t	sp_oid;
+	uint32_t	sp_len;
+	int		sp_volatile;
+} ndis_stpolicy[NDIS_ST_FIELDS] = {
+	[NDIS_ST_MEDIA] =	{ OID_GEN_MEDIA_CONNECT_STATUS, 4, 1 },
+	[NDIS_ST_LINKSPEED] =	{ OID_GEN_LINK_SPEED, 4, 1 },
+	[NDIS_ST_BSSID] =	{ OID_802_11_BSSID, IEEE80211_ADDR_LEN, 1 },
+	[NDIS_ST_SSID] =	{ OID_802_11_SSID,
+				    sizeof(struct ndis_80211_ssid), 1 },
+	[NDIS_ST_RTS] =		{ OID_802_11_RTS_THRESHOLD, 4, 0 },
+	[NDIS_ST_FRAG] =	{ OID_802_11_FRAGMENTATION_THRESHOLD, 4, 0 },
+	[NDIS_ST_POWER] =	{ OID_802_11_POWER_MODE, 4, 0 },
+	[NDIS_ST_TXPOWER] =	{ OID_802_11_TX_POWER_LEVEL, 4, 0 },
+	[NDIS_ST_AUTHMODE] =	{ OID_802_11_AUTHENTICATION_MODE, 4, 1 },
+	[NDIS_ST_PRIVFILT] =	{ OID_802_11_PRIVACY_FILTER, 4, 0 },
+	[NDIS_ST_ENCSTAT] =	{ OID_802_11_ENCRYPTION_STATUS, 4, 1 },
+	[NDIS_ST_NETTYPE] =	{ OID_802_11_NETWORK_TYPE_IN_USE, 4, 1 },
+	[NDIS_ST_CONFIG] =	{ OID_802_11_CONFIGURATION,
+				    sizeof(struct ndis_80211_config), 1 },
+};
+
+/*
+ * Look up a state field, querying the miniport only if the cached
+ * copy is missing or has outlived its TTL. The cache lock is never
+ * held across the query; if an invalidation arrives while it is in
+ * flight the result is returned but not cached.
+ */
+static int
+ndis_state_get(struct ndis_softc *sc, enum ndis_stfield f, void *buf)
+{
+	struct ndis_stcache *ns = &sc->ndis_st;
+	const struct ndis_stpolicy *sp = &ndis_stpolicy[f];
+	union ndis_stval v;
+	uint32_t gen;
+	int error, ttl;
+
+	mtx_lock(&ns->ns_mtx);
+	ttl = sp->sp_volatile ? ns->ns_ttl : ns->ns_ttl_static;
+	if (ns->ns_valid & NDIS_ST_BIT(f) &&
+	    ticks - ns->ns_stamp[f] < ttl * hz) {
+		memcpy(buf, &ns->ns_val[f], sp->sp_len);
+		ns->ns_hits++;
+		mtx_unlock(&ns->ns_mtx);
+		return (0);
+	}
+	gen = ns->ns_gen;
+	ns->ns_queries++;
+	mtx_unlock(&ns->ns_mtx);
+
+	bzero(&v, sizeof(v));
+	if (f == NDIS_ST_CONFIG) {
+		v.v_config.len = sizeof(struct ndis_80211_config);
+		v.v_config.fhconfig.len = sizeof(struct ndis_80211_config_fh);
+	}
+	error = ndis_get(sc, sp->sp_oid, &v, sp->sp_len);
+	if (error)
+		return (error);
+	memcpy(buf, &v, sp->sp_len);
+
+	mtx_lock(&ns->ns_mtx);
+	if (ns->ns_gen == gen) {
+		ns->ns_val[f] = v;
+		ns->ns_stamp[f] = ticks;
+		ns->ns_valid |= NDIS_ST_BIT(f);
+	}
+	mtx_unlock(&ns->ns_mtx);
+	return (0);
+}
+
+static void
+ndis_state_set(struct ndis_softc *sc, enum ndis_stfield f, const void *buf)
+{
+	struct ndis_stcache *ns = &sc->ndis_st;
+
+	mtx_lock(&ns->ns_mtx);
+	bzero(&ns->ns_val[f], sizeof(ns->ns_val[f]));
+	memcpy(&ns->ns_val[f], buf, ndis_stpolicy[f].sp_len);
+	ns->ns_stamp[f] = ticks;
+	ns->ns_valid |= NDIS_ST_BIT(f);
+	mtx_unlock(&ns->ns_mtx);
+}
+
+static void
+ndis_state_invalidate(struct ndis_softc *sc, uint32_t mask)
+{
+	struct ndis_stcache *ns = &sc->ndis_st;
+
+	mtx_lock(&ns->ns_mtx);
+	ns->ns_valid &= ~mask;
+	ns->ns_gen++;
+	mtx_unlock(&ns->ns_mtx);
+}
+
+/*
+ * Fold a status indication into the state cache. This runs before
+ * the RUNNING check in NdisMIndicateStatus() so that a link change
+ * seen while the interface is down is not lost.
+ */
+static void
+ndis_state_indicate(struct ndis_softc *sc, int32_t status, void *buf,
+    uint32_t len)
+{
+	struct ndis_80211_status_indication *nsi;
+	uint32_t arg;
+
+	switch (status) {
+	case NDIS_STATUS_MEDIA_CONNECT:
+	case NDIS_STATUS_MEDIA_DISCONNECT:
+		ndis_state_invalidate(sc, NDIS_ST_ASSOC);
+		if (status == NDIS_STATUS_MEDIA_CONNECT)
+			arg = NDIS_MEDIA_STATE_CONNECTED;
+		else
+			arg = NDIS_MEDIA_STATE_DISCONNECTED;
+		ndis_state_set(sc, NDIS_ST_MEDIA, &arg);
+		break;
+	case NDIS_STATUS_LINK_SPEED_CHANGE:
+		if (buf == NULL || len < sizeof(uint32_t)) {
+			ndis_state_invalidate(sc,
+			    NDIS_ST_BIT(NDIS_ST_LINKSPEED));
+			break;
+		}
+		memcpy(&arg, buf, sizeof(arg));
+		ndis_state_set(sc, NDIS_ST_LINKSPEED, &arg);
+		break;
+	case NDIS_STATUS_MEDIA_SPECIFIC_INDICATION:
+		if (buf == NULL || len < sizeof(*nsi))
+			return;
+		nsi = buf;
+		switch (nsi->status_type) {
+		case NDIS_802_11_STATUS_TYPE_AUTHENTICATION:
+			ndis_state_invalidate(sc,
+			    NDIS_ST_BIT(NDIS_ST_AUTHMODE) |
+			    NDIS_ST_BIT(NDIS_ST_ENCSTAT));
+			break;
+		case NDIS_802_11_STATUS_TYPE_RADIO_STATE:
+			ndis_state_invalidate(sc, NDIS_ST_ALL);
+			break;
+		default:
+			return;
+		}
+		break;
+	default:
+		return;
+	}
+	mtx_lock(&sc->ndis_st.ns_mtx);
+	sc->ndis_st.ns_events++;
+	mtx_unlock(&sc->ndis_st.ns_mtx);
+}
+
 static void
 ndis_getstate_80211(struct ndis_softc *sc, struct ieee80211vap *vap)
 {
 	struct ieee80211com *ic = sc->ndis_ifp->if_l2com;
 	struct ieee80211_node *ni;
-	struct ndis_80211_config *config;
-	struct ndis_80211_ssid *ssid;
+	struct ndis_80211_config config;
+	struct ndis_80211_ssid ssid;
 	int chanflag = 0, i = 0;
 	uint32_t arg;
 
 	ni = ieee80211_ref_node(vap->iv_bss);
-	ssid = malloc(sizeof(struct ndis_80211_ssid), M_NDIS_DEV, M_NOWAIT|M_ZERO);
-	if (ssid == NULL)
-	    goto fail;
-	ndis_get(sc, OID_802_11_BSSID, ni->ni_bssid, IEEE80211_ADDR_LEN);
-
-	if (ndis_get(sc, OID_802_11_SSID, ssid, sizeof(struct ndis_80211_ssid)))
-	    goto fail;
-	memcpy(ni->ni_essid, ssid->ssid, ssid->len);
-	ni->ni_esslen = ssid->len;
+	ndis_state_get(sc, NDIS_ST_BSSID, ni->ni_bssid);
+
+	if (ndis_state_get(sc, NDIS_ST_SSID, &ssid))
+		goto fail;
+	memcpy(ni->ni_essid, ssid.ssid, ssid.len);
+	ni->ni_esslen = ssid.len;
 	if (vap->iv_opmode == IEEE80211_M_STA)
 		ni->ni_associd = 1 | 0xc000; /* fake associd */
 
-	if (!ndis_get_int(sc, OID_802_11_RTS_THRESHOLD, &arg))
+	if (!ndis_state_get(sc, NDIS_ST_RTS, &arg))
 		vap->iv_rtsthreshold = arg;
 	if (ic->ic_caps & IEEE80211_C_TXFRAG)
-		if (!ndis_get_int(sc, OID_802_11_FRAGMENTATION_THRESHOLD, &arg))
+		if (!ndis_state_get(sc, NDIS_ST_FRAG, &arg))
 			vap->iv_fragthreshold = arg;
 	if (ic->ic_caps & IEEE80211_C_PMGT)
-		if (!ndis_get_int(sc, OID_802_11_POWER_MODE, &arg)) {
+		if (!ndis_state_get(sc, NDIS_ST_POWER, &arg)) {
 			if (arg == NDIS_802_11_POWER_MODE_CAM)
 				vap->iv_flags &= ~IEEE80211_F_PMGTON;
 			else
 				vap->iv_flags |= IEEE80211_F_PMGTON;
 		}
 	if (ic->ic_caps & IEEE80211_C_TXPMGT)
-		if (!ndis_get_int(sc, OID_802_11_TX_POWER_LEVEL, &arg)) {
+		if (!ndis_state_get(sc, NDIS_ST_TXPOWER, &arg)) {
 			for (i = 0; i < (sizeof(dBm2mW) / sizeof(dBm2mW[0]));
 			    i++)
 				if (dBm2mW[i] >= arg)
 					break;
 			ic->ic_txpowlimit = i;
 		}
-	if (!ndis_get_int(sc, OID_802_11_AUTHENTICATION_MODE, &arg))
+	if (!ndis_state_get(sc, NDIS_ST_AUTHMODE, &arg))
 		ni->ni_authmode = ndis_auth_mode(arg);
-	if (!ndis_get_int(sc, OID_802_11_PRIVACY_FILTER, &arg)) {
+	if (!ndis_state_get(sc, NDIS_ST_PRIVFILT, &arg)) {
 		if (arg == NDIS_802_11_PRIVFILT_8021XWEP)
 			vap->iv_flags |= IEEE80211_F_DROPUNENC;
 		else
 			vap->iv_flags &= ~IEEE80211_F_DROPUNENC;
 	}
-	if (!ndis_get_int(sc, OID_802_11_ENCRYPTION_STATUS, &arg)) {
+	if (!ndis_state_get(sc, NDIS_ST_ENCSTAT, &arg)) {
 		switch (arg) {
 		case NDIS_802_11_WEPSTAT_ENC1ENABLED:
 		case NDIS_802_11_WEPSTAT_ENC2ENABLED:
@@ -2202,25 +2813,18 @@ ndis_getstate_80211(struct ndis_softc *sc, struct ieee80211vap *vap)
 			break;
 		}
 	}
-	if (!ndis_get_int(sc, OID_802_11_NETWORK_TYPE_IN_USE, &arg))
+	if (!ndis_state_get(sc, NDIS_ST_NETTYPE, &arg))
 		chanflag = ndis_nettype_chan(arg);
 
-	config = malloc(sizeof(struct ndis_80211_config),
-	    M_NDIS_DEV, M_NOWAIT|M_ZERO);
-	if (config == NULL)
-	    goto fail;
-	if (!ndis_get(sc, OID_802_11_CONFIGURATION, config,
-	    sizeof(struct ndis_80211_config))) {
+	if (!ndis_state_get(sc, NDIS_ST_CONFIG, &config)) {
 		ic->ic_curchan = ieee80211_find_channel(ic,
-		    config->dsconfig / 1000, chanflag);
+		    config.dsconfig / 1000, chanflag);
 		if (ic->ic_curchan == NULL)
 			ic->ic_curchan = &ic->ic_channels[0];
 		ni->ni_chan = ic->ic_bsschan = ic->ic_curchan;
-		ni->ni_intval = config->beaconperiod;
+		ni->ni_intval = config.beaconperiod;
 	}
-	free(config, M_NDIS_DEV);
 fail:
-	free(ssid, M_NDIS_DEV);
 	ieee80211_free_node(ni);
 }
 
@@ -2270,11 +2874,16 @@ ndis_ioctl(struct ifnet *ifp, u_long command, caddr_t data)
 		error = ifmedia_ioctl(ifp, ifr, &sc->ifmedia, command);
 		break;
 	case SIOCSIFCAP:
-		ifp->if_capenable = ifr->ifr_reqcap;
+		ifp->if_capenable = ifr->ifr_reqcap & ifp->if_capabilities;
+		/* Large send relies on TX checksum offload. */
+		if (!(ifp->if_capenable & IFCAP_TXCSUM))
+			ifp->if_capenable &= ~IFCAP_TSO4;
 		if (ifp->if_capenable & IFCAP_TXCSUM)
-			ifp->if_hwassist = sc->ndis_hwassist;
+			ifp->if_hwassist = sc->ndis_hwassist & ~CSUM_TSO;
 		else
 			ifp->if_hwassist = 0;
+		if (ifp->if_capenable & IFCAP_TSO4)
+			ifp->if_hwassist |= CSUM_TSO;
 		error = ndis_set_task_offload(sc);
 		break;
 	default:
@@ -2661,6 +3270,7 @@ ndis_set_channel(struct ieee80211com *ic)
 	config->len = sizeof(struct ndis_80211_config);
 	config->fhconfig.len = sizeof(struct ndis_80211_config_fh);
 	ndis_set(sc, OID_802_11_CONFIGURATION, config, config->len);
+	ndis_state_invalidate(sc, NDIS_ST_BIT(NDIS_ST_CONFIG));
 	free(config, M_NDIS_DEV);
 }
 
@@ -0,0 +1,1451 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A loopback miniport, in a module of its own (ndis_loop.ko), so the
+ * packet path can be exercised and timed without a card or a Windows
+ * driver.
+ *
+ * The miniport half is written like a Windows NDIS 5.1 driver: its
+ * entry points use the Microsoft calling convention, it is registered
+ * with NdisMRegisterMiniport() from a DriverEntry() routine, and it
+ * only ever calls into us through the same wrapped NDIS.SYS and
+ * ntoskrnl.exe exports that a PE image gets linked against. Every
+ * frame sent to the adapter's own address comes back as a receive
+ * indication. Whether sends are completed inline or pended to a DPC,
+ * whether the miniport is serialized, and how many packets go into
+ * each indication are registry keys, so they show up as dev.ndis.N.*
+ * sysctls like any other driver's.
+ *
+ * The FreeBSD half hangs the adapters off nexus, behind an emulated
+ * "Internal Bus", and adds a per-adapter benchmark that pushes frames
+ * through if_transmit (or if_start) and counts them on the way back
+ * up through if_input.
+ *
+ * This is amd64 only: the miniport relies on the compiler to produce
+ * ms_abi code for it.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/module.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/smp.h>
+#include <sys/bus.h>
+
+#include <machine/bus.h>
+#include <machine/cpu.h>
+
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/ethernet.h>
+#include <net/if_media.h>
+
+#include <dev/usb/usb.h>
+#include <dev/usb/usbdi.h>
+
+#include "pe_var.h"
+#include "resource_var.h"
+#include "ntoskrnl_var.h"
+#include "ndis_var.h"
+#include "if_ndisvar.h"
+
+#include "bus_if.h"
+
+/*
+ * Miniport side. Nothing below calls a FreeBSD (sysv) function
+ * directly; bulk copies go through RtlCopyMemory() rather than
+ * whatever the compiler would emit for a struct copy.
+ */
+
+#define	NLB_API		__attribute__((ms_abi))
+
+#define	NLB_TAG		0x4C42444E	/* 'NDBL' */
+#define	NLB_BUFSIZE	1536		/* a frame plus a VLAN tag */
+#define	NLB_RXBATCH_MAX	64
+#define	NLB_RXBUFS_MIN	16
+#define	NLB_RXBUFS_MAX	4096
+#define	NLB_SENDS_MAX	256
+#define	NLB_MCAST_MAX	32
+
+struct nlb_rxbuf {
+	struct nlb_rxbuf	*nr_next;
+	struct ndis_packet	*nr_packet;
+	struct mdl		*nr_mdl;
+	uint8_t			nr_data[NLB_BUFSIZE];
+};
+
+struct nlb_adapter {
+	struct ndis_miniport_block	*na_block;
+	struct ndis_spin_lock	na_lock;
+	struct nt_kdpc		na_dpc;
+	struct ndis_packet_pool	*na_rxpool;
+	void			*na_bufpool;
+	struct nlb_rxbuf	*na_rxbufs;
+	uint32_t		na_rxbufsize;	/* bytes in na_rxbufs */
+	uint32_t		na_rxinit;	/* rx buffers set up */
+	struct nlb_rxbuf	*na_rxfree;
+	uint32_t		na_rxfreecnt;
+	struct ndis_packet	*na_txhead;	/* sends to complete */
+	struct ndis_packet	**na_txtail;
+	struct nlb_rxbuf	*na_rxhead;	/* echoes to indicate */
+	struct nlb_rxbuf	**na_rxtail;
+	uint32_t		na_busy;	/* in nlb_service() */
+	uint32_t		na_dpcs;	/* DPC queued or running */
+	uint32_t		na_up;		/* in D0 */
+	uint32_t		na_filter;
+	uint8_t			na_addr[ETHER_ADDR_LEN];
+
+	/* Registry settings. */
+	uint32_t		na_deserialize;
+	uint32_t		na_pending;
+	uint32_t		na_maxsend;
+	uint32_t		na_rxbatch;
+	uint32_t		na_rxbufcnt;
+
+	/* Statistics. */
+	uint64_t		na_txok;
+	uint64_t		na_rxok;
+	uint64_t		na_rxnobuf;
+};
+
+/* Link pending sends through the miniport reserved area. */
+#define	NLB_TXNEXT(p)						\
+	(*(struct ndis_packet **)				\
+	    (p)->u.deserialized_reserved.miniport_reserved_ex)
+/* And point receive packets back at their buffer. */
+#define	NLB_RXBUF(p)						\
+	(*(struct nlb_rxbuf **)(p)->u.cl_reserved.miniport_reserved)
+
+typedef void (NLB_API *nlb_indicate_func)(struct ndis_miniport_block *,
+    struct ndis_packet **, uint32_t);
+typedef void (NLB_API *nlb_send_done_func)(struct ndis_miniport_block *,
+    struct ndis_packet *, int32_t);
+
+/*
+ * The imports, resolved by ndis_loop_link() the same way
+ * pe_patch_imports() fills in a driver's import address table.
+ */
+static struct {
+	void	(NLB_API *NdisInitializeWrapper)(void **,
+		    struct driver_object *, void *, void *);
+	int32_t	(NLB_API *NdisMRegisterMiniport)(void *,
+		    struct ndis_miniport_characteristics *, uint32_t);
+	int32_t	(NLB_API *NdisMSetAttributesEx)(void *, void *, uint32_t,
+		    uint32_t, enum ndis_bus_type);
+	void	(NLB_API *NdisOpenConfiguration)(int32_t *, void **,
+		    void *);
+	void	(NLB_API *NdisReadConfiguration)(int32_t *,
+		    struct ndis_configuration_parameter **, void *,
+		    struct unicode_string *, enum ndis_parameter_type);
+	void	(NLB_API *NdisCloseConfiguration)(void *);
+	void	(NLB_API *NdisInitializeString)(struct unicode_string *,
+		    char *);
+	void	(NLB_API *NdisFreeString)(struct unicode_string *);
+	int32_t	(NLB_API *NdisAllocateMemoryWithTag)(void **, uint32_t,
+		    uint32_t);
+	void	(NLB_API *NdisFreeMemory)(void *, uint32_t, uint32_t);
+	void	(NLB_API *NdisAllocateSpinLock)(struct ndis_spin_lock *);
+	void	(NLB_API *NdisFreeSpinLock)(struct ndis_spin_lock *);
+	void	(NLB_API *NdisAcquireSpinLock)(struct ndis_spin_lock *);
+	void	(NLB_API *NdisReleaseSpinLock)(struct ndis_spin_lock *);
+	void	(NLB_API *NdisDprAcquireSpinLock)(struct ndis_spin_lock *);
+	void	(NLB_API *NdisDprReleaseSpinLock)(struct ndis_spin_lock *);
+	void	(NLB_API *NdisAllocatePacketPool)(int32_t *,
+		    struct ndis_packet_pool **, uint32_t, uint32_t);
+	void	(NLB_API *NdisFreePacketPool)(struct ndis_packet_pool *);
+	void	(NLB_API *NdisAllocatePacket)(int32_t *,
+		    struct ndis_packet **, struct ndis_packet_pool *);
+	void	(NLB_API *NdisFreePacket)(struct ndis_packet *);
+	void	(NLB_API *NdisAllocateBufferPool)(int32_t *, void **,
+		    uint32_t);
+	void	(NLB_API *NdisFreeBufferPool)(void *);
+	void	(NLB_API *NdisAllocateBuffer)(int32_t *, struct mdl **,
+		    void *, void *, uint32_t);
+	void	(NLB_API *NdisFreeBuffer)(struct mdl *);
+	void	(NLB_API *NdisAdjustBufferLength)(struct mdl *, uint32_t);
+	void	(NLB_API *NdisMSleep)(uint32_t);
+	void	(NLB_API *KeInitializeDpc)(struct nt_kdpc *, void *,
+		    void *);
+	uint8_t	(NLB_API *KeInsertQueueDpc)(struct nt_kdpc *, void *,
+		    void *);
+	uint8_t	(NLB_API *KeRemoveQueueDpc)(struct nt_kdpc *);
+	void	(NLB_API *KeAcquireSpinLockAtDpcLevel)(unsigned long *);
+	void	(NLB_API *KeReleaseSpinLockFromDpcLevel)(unsigned long *);
+	void	(NLB_API *RtlCopyMemory)(void *, const void *, size_t);
+} nlb;
+
+static uint32_t nlb_instance;
+
+static const uint32_t nlb_oids[] = {
+	OID_GEN_SUPPORTED_LIST,
+	OID_GEN_HARDWARE_STATUS,
+	OID_GEN_MEDIA_SUPPORTED,
+	OID_GEN_MEDIA_IN_USE,
+	OID_GEN_MAXIMUM_LOOKAHEAD,
+	OID_GEN_MAXIMUM_FRAME_SIZE,
+	OID_GEN_LINK_SPEED,
+	OID_GEN_CURRENT_PACKET_FILTER,
+	OID_GEN_CURRENT_LOOKAHEAD,
+	OID_GEN_MAXIMUM_TOTAL_SIZE,
+	OID_GEN_MAXIMUM_SEND_PACKETS,
+	OID_GEN_VENDOR_DRIVER_VERSION,
+	OID_GEN_MEDIA_CONNECT_STATUS,
+	OID_GEN_XMIT_OK,
+	OID_GEN_RCV_OK,
+	OID_GEN_RCV_NO_BUFFER,
+	OID_802_3_PERMANENT_ADDRESS,
+	OID_802_3_CURRENT_ADDRESS,
+	OID_802_3_MULTICAST_LIST,
+	OID_802_3_MAXIMUM_LIST_SIZE,
+	OID_PNP_SET_POWER
+};
+
+static NLB_API uint32_t
+nlb_read_int(void *cfg, char *key, uint32_t def, uint32_t lo, uint32_t hi)
+{
+	struct ndis_configuration_parameter *parm;
+	struct unicode_string us;
+	uint32_t val = def;
+	int32_t status;
+
+	nlb.NdisInitializeString(&us, key);
+	nlb.NdisReadConfiguration(&status, &parm, cfg, &us,
+	    NDIS_PARAMETER_INTEGER);
+	if (status == NDIS_STATUS_SUCCESS)
+		val = parm->data.integer;
+	nlb.NdisFreeString(&us);
+
+	if (val < lo)
+		val = lo;
+	if (val > hi)
+		val = hi;
+	return (val);
+}
+
+static NLB_API void
+nlb_read_config(struct nlb_adapter *na, void *wrapctx)
+{
+	void *cfg;
+	int32_t status;
+
+	na->na_deserialize = 1;
+	na->na_pending = 1;
+	na->na_maxsend = 32;
+	na->na_rxbatch = 16;
+	na->na_rxbufcnt = 512;
+
+	nlb.NdisOpenConfiguration(&status, &cfg, wrapctx);
+	if (status != NDIS_STATUS_SUCCESS)
+		return;
+	na->na_deserialize = nlb_read_int(cfg, "Deserialize",
+	    na->na_deserialize, 0, 1);
+	na->na_pending = nlb_read_int(cfg, "SendPending",
+	    na->na_pending, 0, 1);
+	na->na_maxsend = nlb_read_int(cfg, "MaxSendPackets",
+	    na->na_maxsend, 1, NLB_SENDS_MAX);
+	na->na_rxbatch = nlb_read_int(cfg, "ReceiveBatch",
+	    na->na_rxbatch, 1, NLB_RXBATCH_MAX);
+	na->na_rxbufcnt = nlb_read_int(cfg, "ReceiveBuffers",
+	    na->na_rxbufcnt, NLB_RXBUFS_MIN, NLB_RXBUFS_MAX);
+	nlb.NdisCloseConfiguration(cfg);
+}
+
+static NLB_API void
+nlb_free(struct nlb_adapter *na)
+{
+	struct nlb_rxbuf *rb;
+	uint32_t i;
+
+	for (i = 0; i < na->na_rxinit; i++) {
+		rb = &na->na_rxbufs[i];
+		if (rb->nr_mdl != NULL)
+			nlb.NdisFreeBuffer(rb->nr_mdl);
+		if (rb->nr_packet != NULL)
+			nlb.NdisFreePacket(rb->nr_packet);
+	}
+	if (na->na_rxbufs != NULL)
+		nlb.NdisFreeMemory(na->na_rxbufs, na->na_rxbufsize, 0);
+	if (na->na_bufpool != NULL)
+		nlb.NdisFreeBufferPool(na->na_bufpool);
+	if (na->na_rxpool != NULL)
+		nlb.NdisFreePacketPool(na->na_rxpool);
+	nlb.NdisFreeSpinLock(&na->na_lock);
+	nlb.NdisFreeMemory(na, sizeof(*na), 0);
+}
+
+static NLB_API int32_t
+nlb_alloc_rx(struct nlb_adapter *na)
+{
+	struct ndis_packet *p;
+	struct nlb_rxbuf *rb;
+	int32_t status;
+
+	nlb.NdisAllocatePacketPool(&status, &na->na_rxpool, na->na_rxbufcnt,
+	    PROTOCOL_RESERVED_SIZE_IN_PACKET);
+	if (status != NDIS_STATUS_SUCCESS) {
+		na->na_rxpool = NULL;
+		return (NDIS_STATUS_RESOURCES);
+	}
+	nlb.NdisAllocateBufferPool(&status, &na->na_bufpool, na->na_rxbufcnt);
+	if (status != NDIS_STATUS_SUCCESS) {
+		na->na_bufpool = NULL;
+		return (NDIS_STATUS_RESOURCES);
+	}
+	na->na_rxbufsize = na->na_rxbufcnt * sizeof(struct nlb_rxbuf);
+	if (nlb.NdisAllocateMemoryWithTag((void **)&na->na_rxbufs,
+	    na->na_rxbufsize, NLB_TAG) != NDIS_STATUS_SUCCESS) {
+		na->na_rxbufs = NULL;
+		return (NDIS_STATUS_RESOURCES);
+	}
+
+	for (; na->na_rxinit < na->na_rxbufcnt; na->na_rxinit++) {
+		rb = &na->na_rxbufs[na->na_rxinit];
+		nlb.NdisAllocatePacket(&status, &rb->nr_packet,
+		    na->na_rxpool);
+		if (status != NDIS_STATUS_SUCCESS) {
+			rb->nr_packet = NULL;
+			return (NDIS_STATUS_RESOURCES);
+		}
+		nlb.NdisAllocateBuffer(&status, &rb->nr_mdl, na->na_bufpool,
+		    rb->nr_data, NLB_BUFSIZE);
+		if (status != NDIS_STATUS_SUCCESS) {
+			rb->nr_mdl = NULL;
+			na->na_rxinit++;
+			return (NDIS_STATUS_RESOURCES);
+		}
+		p = rb->nr_packet;
+		p->private.head = p->private.tail = rb->nr_mdl;
+		NLB_RXBUF(p) = rb;
+		rb->nr_next = na->na_rxfree;
+		na->na_rxfree = rb;
+		na->na_rxfreecnt++;
+	}
+	return (NDIS_STATUS_SUCCESS);
+}
+
+/*
+ * Complete pended sends and indicate echoed frames. Runs at
+ * DISPATCH_LEVEL, from the DPC or from a power down, and for a
+ * serialized miniport with the miniport lock held.
+ */
+static NLB_API void
+nlb_service(struct nlb_adapter *na)
+{
+	struct ndis_miniport_block *block = na->na_block;
+	struct ndis_packet *pkts[NLB_RXBATCH_MAX], *txq, *p;
+	struct nlb_rxbuf *rxq, *rb;
+	int32_t status;
+	uint32_t i, n;
+
+	nlb.NdisDprAcquireSpinLock(&na->na_lock);
+	na->na_busy++;
+	while (na->na_txhead != NULL || na->na_rxhead != NULL) {
+		txq = na->na_txhead;
+		na->na_txhead = NULL;
+		na->na_txtail = &na->na_txhead;
+		rxq = na->na_rxhead;
+		na->na_rxhead = NULL;
+		na->na_rxtail = &na->na_rxhead;
+		nlb.NdisDprReleaseSpinLock(&na->na_lock);
+
+		while ((p = txq) != NULL) {
+			txq = NLB_TXNEXT(p);
+			((nlb_send_done_func)block->send_done_func)(block, p,
+			    NDIS_STATUS_SUCCESS);
+		}
+
+		while (rxq != NULL) {
+			for (n = 0; rxq != NULL && n < na->na_rxbatch; n++) {
+				rb = rxq;
+				rxq = rb->nr_next;
+				pkts[n] = rb->nr_packet;
+			}
+
+			/*
+			 * Once we're running low, make NDIS copy the
+			 * frames so we get the buffers straight back.
+			 */
+			if (na->na_rxfreecnt < na->na_rxbufcnt / 8)
+				status = NDIS_STATUS_RESOURCES;
+			else
+				status = NDIS_STATUS_SUCCESS;
+			for (i = 0; i < n; i++)
+				pkts[i]->oob.status = status;
+			((nlb_indicate_func)block->packet_indicate_func)(block,
+			    pkts, n);
+			if (status != NDIS_STATUS_RESOURCES)
+				continue;
+
+			nlb.NdisDprAcquireSpinLock(&na->na_lock);
+			for (i = 0; i < n; i++) {
+				rb = NLB_RXBUF(pkts[i]);
+				rb->nr_next = na->na_rxfree;
+				na->na_rxfree = rb;
+				na->na_rxfreecnt++;
+			}
+			nlb.NdisDprReleaseSpinLock(&na->na_lock);
+		}
+		nlb.NdisDprAcquireSpinLock(&na->na_lock);
+	}
+	na->na_busy--;
+	nlb.NdisDprReleaseSpinLock(&na->na_lock);
+}
+
+static NLB_API void
+nlb_dpc(struct nt_kdpc *dpc, void *ctx, void *sysarg1, void *sysarg2)
+{
+	struct nlb_adapter *na = ctx;
+	struct ndis_miniport_block *block = na->na_block;
+	uint32_t serialized = !na->na_deserialize;
+
+	if (serialized)
+		nlb.KeAcquireSpinLockAtDpcLevel(&block->lock);
+	nlb_service(na);
+	if (serialized)
+		nlb.KeReleaseSpinLockFromDpcLevel(&block->lock);
+
+	/* Once this is dropped, nlb_halt() may free the adapter. */
+	nlb.NdisDprAcquireSpinLock(&na->na_lock);
+	na->na_dpcs--;
+	nlb.NdisDprReleaseSpinLock(&na->na_lock);
+}
+
+/*
+ * Queue the DPC, and count it until it has run so that nlb_halt()
+ * knows when it is done with the adapter. Called with na_lock held.
+ */
+static NLB_API void
+nlb_kick(struct nlb_adapter *na)
+{
+
+	if (nlb.KeInsertQueueDpc(&na->na_dpc, NULL, NULL))
+		na->na_dpcs++;
+}
+
+/*
+ * Compare the destination by hand: a memcmp() here could end up
+ * as a call into the kernel with the wrong calling convention.
+ */
+static NLB_API int
+nlb_for_us(struct nlb_adapter *na, struct ndis_packet *p)
+{
+	const uint8_t *d;
+	struct mdl *b;
+
+	b = p->private.head;
+	if (b == NULL || MmGetMdlByteCount(b) < ETHER_ADDR_LEN)
+		return (0);
+	d = MmGetMdlVirtualAddress(b);
+	return (d[0] == na->na_addr[0] && d[1] == na->na_addr[1] &&
+	    d[2] == na->na_addr[2] && d[3] == na->na_addr[3] &&
+	    d[4] == na->na_addr[4] && d[5] == na->na_addr[5]);
+}
+
+/*
+ * Copy a frame into a receive buffer. Returns 0 if it doesn't fit.
+ */
+static NLB_API int
+nlb_copy(struct nlb_rxbuf *rb, struct ndis_packet *p)
+{
+	struct mdl *b;
+	uint32_t len = 0;
+
+	for (b = p->private.head; b != NULL; b = b->next) {
+		if (len + MmGetMdlByteCount(b) > NLB_BUFSIZE)
+			return (0);
+		nlb.RtlCopyMemory(rb->nr_data + len,
+		    MmGetMdlVirtualAddress(b), MmGetMdlByteCount(b));
+		len += MmGetMdlByteCount(b);
+	}
+	nlb.NdisAdjustBufferLength(rb->nr_mdl, len);
+	return (1);
+}
+
+static NLB_API void
+nlb_send_packets(void *ctx, struct ndis_packet **packets, uint32_t cnt)
+{
+	struct nlb_adapter *na = ctx;
+	struct ndis_packet *p;
+	struct nlb_rxbuf *rb;
+	uint32_t i;
+
+	nlb.NdisAcquireSpinLock(&na->na_lock);
+	for (i = 0; i < cnt; i++) {
+		p = packets[i];
+		if (!na->na_up) {
+			p->oob.status = NDIS_STATUS_FAILURE;
+			continue;
+		}
+
+		/* Frames to anyone else go nowhere, like on a real wire. */
+		if (nlb_for_us(na, p)) {
+			rb = na->na_rxfree;
+			if (rb == NULL)
+				na->na_rxnobuf++;
+			else if (nlb_copy(rb, p)) {
+				na->na_rxfree = rb->nr_next;
+				na->na_rxfreecnt--;
+				rb->nr_next = NULL;
+				*na->na_rxtail = rb;
+				na->na_rxtail = &rb->nr_next;
+				na->na_rxok++;
+			}
+		}
+
+		na->na_txok++;
+		if (na->na_pending) {
+			p->oob.status = NDIS_STATUS_PENDING;
+			NLB_TXNEXT(p) = NULL;
+			*na->na_txtail = p;
+			na->na_txtail = &NLB_TXNEXT(p);
+		} else
+			p->oob.status = NDIS_STATUS_SUCCESS;
+	}
+	if (na->na_txhead != NULL || na->na_rxhead != NULL)
+		nlb_kick(na);
+	nlb.NdisReleaseSpinLock(&na->na_lock);
+}
+
+static NLB_API void
+nlb_return_packet(void *ctx, struct ndis_packet *p)
+{
+	struct nlb_adapter *na = ctx;
+	struct nlb_rxbuf *rb = NLB_RXBUF(p);
+
+	nlb.NdisAcquireSpinLock(&na->na_lock);
+	rb->nr_next = na->na_rxfree;
+	na->na_rxfree = rb;
+	na->na_rxfreecnt++;
+	nlb.NdisReleaseSpinLock(&na->na_lock);
+}
+
+/*
+ * Nothing left for the DPC to do and no DPC outstanding. If there
+ * is work but no DPC, queue one.
+ */
+static NLB_API int
+nlb_idle(struct nlb_adapter *na)
+{
+	int idle;
+
+	nlb.NdisAcquireSpinLock(&na->na_lock);
+	idle = (na->na_txhead == NULL && na->na_rxhead == NULL);
+	if (!idle && na->na_dpcs == 0)
+		nlb_kick(na);
+	idle = (idle && na->na_busy == 0 && na->na_dpcs == 0);
+	nlb.NdisReleaseSpinLock(&na->na_lock);
+	return (idle);
+}
+
+/*
+ * Going to D3 flushes out everything we still owe NDIS. A serialized
+ * miniport gets here at DISPATCH_LEVEL holding the miniport lock, so
+ * just do the work; a deserialized one is called at PASSIVE_LEVEL
+ * and can wait for the DPC instead.
+ */
+static NLB_API void
+nlb_set_power(struct nlb_adapter *na, uint32_t state)
+{
+	int i;
+
+	nlb.NdisAcquireSpinLock(&na->na_lock);
+	na->na_up = (state == NDIS_DEVICE_STATE_D0);
+	nlb.NdisReleaseSpinLock(&na->na_lock);
+	if (state == NDIS_DEVICE_STATE_D0)
+		return;
+
+	if (!na->na_deserialize) {
+		nlb_service(na);
+		return;
+	}
+	for (i = 0; i < 1000 && !nlb_idle(na); i++)
+		nlb.NdisMSleep(1000);
+}
+
+static NLB_API int32_t
+nlb_query_info(void *ctx, uint32_t oid, void *buf, uint32_t len,
+    uint32_t *written, uint32_t *needed)
+{
+	struct nlb_adapter *na = ctx;
+	const void *src;
+	uint64_t val64;
+	uint32_t val, srclen;
+
+	src = &val;
+	srclen = sizeof(val);
+	switch (oid) {
+	case OID_GEN_SUPPORTED_LIST:
+		src = nlb_oids;
+		srclen = sizeof(nlb_oids);
+		break;
+	case OID_GEN_HARDWARE_STATUS:
+		val = NDIS_HARDWARE_STATUS_READY;
+		break;
+	case OID_GEN_MEDIA_SUPPORTED:
+	case OID_GEN_MEDIA_IN_USE:
+		val = NDIS_MEDIUM_802_3;
+		break;
+	case OID_GEN_MAXIMUM_LOOKAHEAD:
+	case OID_GEN_CURRENT_LOOKAHEAD:
+	case OID_GEN_MAXIMUM_FRAME_SIZE:
+		val = ETHERMTU;
+		break;
+	case OID_GEN_MAXIMUM_TOTAL_SIZE:
+		val = ETHER_MAX_LEN - ETHER_CRC_LEN;
+		break;
+	case OID_GEN_LINK_SPEED:
+		val = 100000000;	/* 10Gbps, in units of 100bps */
+		break;
+	case OID_GEN_MEDIA_CONNECT_STATUS:
+		val = NDIS_MEDIA_STATE_CONNECTED;
+		break;
+	case OID_GEN_CURRENT_PACKET_FILTER:
+		val = na->na_filter;
+		break;
+	case OID_GEN_MAXIMUM_SEND_PACKETS:
+		val = na->na_maxsend;
+		break;
+	case OID_GEN_VENDOR_DRIVER_VERSION:
+		val = 0x00010000;
+		break;
+	case OID_802_3_PERMANENT_ADDRESS:
+	case OID_802_3_CURRENT_ADDRESS:
+		src = na->na_addr;
+		srclen = ETHER_ADDR_LEN;
+		break;
+	case OID_802_3_MAXIMUM_LIST_SIZE:
+		val = NLB_MCAST_MAX;
+		break;
+	case OID_GEN_XMIT_OK:
+		val64 = na->na_txok;
+		goto counter;
+	case OID_GEN_RCV_OK:
+		val64 = na->na_rxok;
+		goto counter;
+	case OID_GEN_RCV_NO_BUFFER:
+		val64 = na->na_rxnobuf;
+counter:
+		/* Statistics are 64 bits wide unless asked for less. */
+		if (len < sizeof(val64)) {
+			val = (uint32_t)val64;
+			break;
+		}
+		src = &val64;
+		srclen = sizeof(val64);
+		break;
+	default:
+		return (NDIS_STATUS_NOT_SUPPORTED);
+	}
+
+	if (len < srclen) {
+		*needed = srclen;
+		return (NDIS_STATUS_INVALID_LENGTH);
+	}
+	nlb.RtlCopyMemory(buf, src, srclen);
+	*written = srclen;
+	return (NDIS_STATUS_SUCCESS);
+}
+
+static NLB_API int32_t
+nlb_set_info(void *ctx, uint32_t oid, void *buf, uint32_t len,
+    uint32_t *read, uint32_t *needed)
+{
+	struct nlb_adapter *na = ctx;
+
+	switch (oid) {
+	case OID_802_3_MULTICAST_LIST:
+		/* We only ever echo unicast, so just sanity check it. */
+		if (len % ETHER_ADDR_LEN != 0 ||
+		    len / ETHER_ADDR_LEN > NLB_MCAST_MAX)
+			return (NDIS_STATUS_INVALID_LENGTH);
+		*read = len;
+		return (NDIS_STATUS_SUCCESS);
+	case OID_GEN_CURRENT_PACKET_FILTER:
+	case OID_GEN_CURRENT_LOOKAHEAD:
+	case OID_PNP_SET_POWER:
+		break;
+	default:
+		return (NDIS_STATUS_NOT_SUPPORTED);
+	}
+
+	if (len < sizeof(uint32_t)) {
+		*needed = sizeof(uint32_t);
+		return (NDIS_STATUS_INVALID_LENGTH);
+	}
+	if (oid == OID_GEN_CURRENT_PACKET_FILTER)
+		na->na_filter = *(uint32_t *)buf;
+	else if (oid == OID_PNP_SET_POWER)
+		nlb_set_power(na, *(uint32_t *)buf);
+	*read = sizeof(uint32_t);
+	return (NDIS_STATUS_SUCCESS);
+}
+
+static NLB_API int32_t
+nlb_reset(uint8_t *addressing_reset, void *ctx)
+{
+	*addressing_reset = FALSE;
+	return (NDIS_STATUS_SUCCESS);
+}
+
+static NLB_API void
+nlb_shutdown(void *ctx)
+{
+}
+
+/*
+ * NDIS has waited for the stack to give back every loaned packet,
+ * but sends may still be waiting for the DPC, which may itself be
+ * queued or running, and echoes not yet indicated hold buffers of
+ * their own. Keep the DPC going until all of that is done, however
+ * long it takes: everything it touches is about to be freed.
+ */
+static NLB_API void
+nlb_halt(void *ctx)
+{
+	struct nlb_adapter *na = ctx;
+
+	while (!nlb_idle(na) || na->na_rxfreecnt != na->na_rxinit)
+		nlb.NdisMSleep(1000);
+	nlb_free(na);
+}
+
+static NLB_API int32_t
+nlb_init(int32_t *open_err, uint32_t *medium_idx, enum ndis_medium *mlist,
+    uint32_t mcnt, void *block, void *wrapctx)
+{
+	struct nlb_adapter *na;
+	uint32_t i, unit;
+	int32_t status;
+
+	for (i = 0; i < mcnt; i++)
+		if (mlist[i] == NDIS_MEDIUM_802_3)
+			break;
+	if (i == mcnt)
+		return (NDIS_STATUS_UNSUPPORTED_MEDIA);
+	*medium_idx = i;
+
+	if (nlb.NdisAllocateMemoryWithTag((void **)&na, sizeof(*na),
+	    NLB_TAG) != NDIS_STATUS_SUCCESS)
+		return (NDIS_STATUS_RESOURCES);
+	na->na_block = block;
+	na->na_txtail = &na->na_txhead;
+	na->na_rxtail = &na->na_rxhead;
+	nlb.NdisAllocateSpinLock(&na->na_lock);
+	nlb.KeInitializeDpc(&na->na_dpc, nlb_dpc, na);
+
+	nlb_read_config(na, wrapctx);
+	nlb.NdisMSetAttributesEx(block, na, 0,
+	    na->na_deserialize ? NDIS_ATTRIBUTE_DESERIALIZE : 0, NDIS_INTERNAL);
+
+	status = nlb_alloc_rx(na);
+	if (status != NDIS_STATUS_SUCCESS) {
+		nlb_free(na);
+		return (status);
+	}
+
+	/* A locally administered address, unique to this adapter. */
+	unit = nlb_instance++;
+	na->na_addr[0] = 0x02;
+	na->na_addr[1] = 'N';
+	na->na_addr[2] = 'D';
+	na->na_addr[3] = 'L';
+	na->na_addr[4] = (unit >> 8) & 0xFF;
+	na->na_addr[5] = unit & 0xFF;
+	na->na_up = 1;
+
+	return (NDIS_STATUS_SUCCESS);
+}
+
+static struct ndis_miniport_characteristics nlb_chars = {
+	.version_major =	5,
+	.version_minor =	1,
+	.halt_func =		(ndis_halt_func)nlb_halt,
+	.init_func =		(ndis_init_func)nlb_init,
+	.query_info_func =	(ndis_query_info_func)nlb_query_info,
+	.reset_func =		(ndis_reset_func)nlb_reset,
+	.set_info_func =	(ndis_set_info_func)nlb_set_info,
+	.return_packet_func =	(ndis_return_packet_func)nlb_return_packet,
+	.send_packets_func =	(ndis_send_packets_func)nlb_send_packets,
+	.shutdown_func =	(ndis_shutdown_func)nlb_shutdown
+};
+
+static NLB_API int32_t
+nlb_driver_entry(struct driver_object *drv, struct unicode_string *path)
+{
+	void *wrapper;
+
+	nlb.NdisInitializeWrapper(&wrapper, drv, path, NULL);
+	return (nlb.NdisMRegisterMiniport(wrapper, &nlb_chars,
+	    sizeof(nlb_chars)));
+}
+
+/*
+ * FreeBSD side.
+ */
+
+#define	NDIS_LOOP_MAX		8
+#define	NDIS_LOOP_ETHERTYPE	0x88B5	/* local experimental */
+#define	NDIS_LOOP_NKEYS		5
+
+struct ndis_loop_softc {
+	struct ndis_softc	nl_sc;		/* must be first */
+	struct ndis_cfg		nl_regvals[NDIS_LOOP_NKEYS + 1];
+	char			nl_regbuf[NDIS_LOOP_NKEYS][12];
+
+	/* Benchmark state. */
+	void			(*nl_input)(struct ifnet *, struct mbuf *);
+	int			nl_busy;	/* under Giant */
+	u_int			nl_count;
+	u_int			nl_size;
+	u_int			nl_window;
+	u_int			nl_legacy;
+	volatile u_int		nl_rcvd;
+	volatile u_int		nl_rxmbufs;
+	char			nl_result[192];
+};
+
+static MALLOC_DEFINE(M_NDIS_LOOP, "ndis_loop", "NDIS loopback miniport");
+
+static struct driver_object ndis_loop_drv;
+static struct driver_object ndis_loop_bus;
+static int ndis_loop_loaded;
+static device_t ndis_loop_devs[NDIS_LOOP_MAX];
+static int ndis_loop_count;
+
+SYSCTL_DECL(_hw_ndis);
+static SYSCTL_NODE(_hw_ndis, OID_AUTO, loop, CTLFLAG_RD, 0,
+    "NDIS loopback miniport");
+
+/*
+ * Registry defaults for new loopback adapters. Each adapter starts
+ * out with a copy of them as dev.ndis.N.<key>, which the miniport
+ * reads once, from MiniportInitialize().
+ */
+static int ndis_loop_deserialize = 1;
+TUNABLE_INT("hw.ndis.loop.deserialize", &ndis_loop_deserialize);
+SYSCTL_INT(_hw_ndis_loop, OID_AUTO, deserialize, CTLFLAG_RW,
+    &ndis_loop_deserialize, 0, "Register new adapters as deserialized");
+
+static int ndis_loop_send_pending = 1;
+TUNABLE_INT("hw.ndis.loop.send_pending", &ndis_loop_send_pending);
+SYSCTL_INT(_hw_ndis_loop, OID_AUTO, send_pending, CTLFLAG_RW,
+    &ndis_loop_send_pending, 0, "Complete sends from a DPC, not inline");
+
+static int ndis_loop_max_send = 32;
+TUNABLE_INT("hw.ndis.loop.max_send_packets", &ndis_loop_max_send);
+SYSCTL_INT(_hw_ndis_loop, OID_AUTO, max_send_packets, CTLFLAG_RW,
+    &ndis_loop_max_send, 0, "Send batch size of serialized adapters");
+
+static int ndis_loop_rx_batch = 16;
+TUNABLE_INT("hw.ndis.loop.rx_batch", &ndis_loop_rx_batch);
+SYSCTL_INT(_hw_ndis_loop, OID_AUTO, rx_batch, CTLFLAG_RW,
+    &ndis_loop_rx_batch, 0, "Packets per receive indication");
+
+static int ndis_loop_rx_buffers = 512;
+TUNABLE_INT("hw.ndis.loop.rx_buffers", &ndis_loop_rx_buffers);
+SYSCTL_INT(_hw_ndis_loop, OID_AUTO, rx_buffers, CTLFLAG_RW,
+    &ndis_loop_rx_buffers, 0, "Receive buffers per adapter");
+
+static int	ndis_loop_probe(device_t);
+static int	ndis_loop_attach(device_t);
+static int	ndis_loop_detach(device_t);
+static int	ndis_loop_modevent(module_t, int, void *);
+
+static device_method_t ndis_loop_methods[] = {
+	DEVMETHOD(device_probe,		ndis_loop_probe),
+	DEVMETHOD(device_attach,	ndis_loop_attach),
+	DEVMETHOD(device_detach,	ndis_loop_detach),
+	DEVMETHOD(device_shutdown,	ndis_shutdown),
+	DEVMETHOD(device_suspend,	ndis_suspend),
+	DEVMETHOD(device_resume,	ndis_resume),
+	DEVMETHOD_END
+};
+
+static driver_t ndis_loop_driver = {
+	"ndis",
+	ndis_loop_methods,
+	sizeof(struct ndis_loop_softc)
+};
+
+DRIVER_MODULE(ndis, nexus, ndis_loop_driver, ndis_devclass,
+    ndis_loop_modevent, 0);
+MODULE_DEPEND(ndis_loop, ndis, 3, 3, 3);
+MODULE_VERSION(ndis_loop, 1);
+
+#define	NLB_NDIS(name)	{ ndis_functbl, #name, (void **)&nlb.name }
+#define	NLB_NTOS(name)	{ ntoskrnl_functbl, #name, (void **)&nlb.name }
+
+static const struct {
+	struct image_patch_table	*ni_functbl;
+	const char			*ni_name;
+	void				**ni_func;
+} ndis_loop_imports[] = {
+	NLB_NDIS(NdisInitializeWrapper),
+	NLB_NDIS(NdisMRegisterMiniport),
+	NLB_NDIS(NdisMSetAttributesEx),
+	NLB_NDIS(NdisOpenConfiguration),
+	NLB_NDIS(NdisReadConfiguration),
+	NLB_NDIS(NdisCloseConfiguration),
+	NLB_NDIS(NdisInitializeString),
+	NLB_NDIS(NdisFreeString),
+	NLB_NDIS(NdisAllocateMemoryWithTag),
+	NLB_NDIS(NdisFreeMemory),
+	NLB_NDIS(NdisAllocateSpinLock),
+	NLB_NDIS(NdisFreeSpinLock),
+	NLB_NDIS(NdisAcquireSpinLock),
+	NLB_NDIS(NdisReleaseSpinLock),
+	NLB_NDIS(NdisDprAcquireSpinLock),
+	NLB_NDIS(NdisDprReleaseSpinLock),
+	NLB_NDIS(NdisAllocatePacketPool),
+	NLB_NDIS(NdisFreePacketPool),
+	NLB_NDIS(NdisAllocatePacket),
+	NLB_NDIS(NdisFreePacket),
+	NLB_NDIS(NdisAllocateBufferPool),
+	NLB_NDIS(NdisFreeBufferPool),
+	NLB_NDIS(NdisAllocateBuffer),
+	NLB_NDIS(NdisFreeBuffer),
+	NLB_NDIS(NdisAdjustBufferLength),
+	NLB_NDIS(NdisMSleep),
+	NLB_NTOS(KeInitializeDpc),
+	NLB_NTOS(KeInsertQueueDpc),
+	NLB_NTOS(KeRemoveQueueDpc),
+	NLB_NTOS(KeAcquireSpinLockAtDpcLevel),
+	NLB_NTOS(KeReleaseSpinLockFromDpcLevel),
+	NLB_NTOS(RtlCopyMemory)
+};
+
+#undef NLB_NDIS
+#undef NLB_NTOS
+
+static int
+ndis_loop_link(void)
+{
+	int i;
+
+	for (i = 0; i < nitems(ndis_loop_imports); i++) {
+		*ndis_loop_imports[i].ni_func = ndis_get_routine_address(
+		    ndis_loop_imports[i].ni_functbl,
+		    __DECONST(char *, ndis_loop_imports[i].ni_name));
+		if (*ndis_loop_imports[i].ni_func == NULL) {
+			printf("NDIS: loopback: no export for %s\n",
+			    ndis_loop_imports[i].ni_name);
+			return (ENOEXEC);
+		}
+	}
+	return (0);
+}
+
+static void
+ndis_loop_unload(void)
+{
+	struct driver_object *drv = &ndis_loop_drv;
+	struct list_entry *e;
+
+	if (drv->driver_extension != NULL) {
+		while (!IsListEmpty(&drv->driver_extension->usrext)) {
+			e = RemoveHeadList(&drv->driver_extension->usrext);
+			ExFreePool(e);
+		}
+		free(drv->driver_extension, M_NDIS_LOOP);
+	}
+	RtlFreeUnicodeString(&drv->driver_name);
+	bzero(drv, sizeof(*drv));
+	ndis_loop_loaded = 0;
+}
+
+/*
+ * Set up the driver object and run DriverEntry(), much like
+ * windrv_load() does for a PE image. The object is deliberately
+ * left out of the driver database: windrv_unload() would take it
+ * for a bus, and nothing needs to look it up by image.
+ */
+static int
+ndis_loop_load(void)
+{
+	struct driver_object *drv = &ndis_loop_drv;
+	struct ansi_string as;
+	int32_t ret;
+	int error;
+
+	if (ndis_loop_loaded)
+		return (0);
+	error = ndis_loop_link();
+	if (error)
+		return (error);
+
+	drv->driver_extension = malloc(sizeof(struct driver_extension),
+	    M_NDIS_LOOP, M_WAITOK|M_ZERO);
+	InitializeListHead(&drv->driver_extension->usrext);
+	RtlInitAnsiString(&as, "\\\\ndis\\loopback");
+	if (RtlAnsiStringToUnicodeString(&drv->driver_name, &as, TRUE)) {
+		ndis_loop_unload();
+		return (ENOMEM);
+	}
+
+	ret = MSCALL2(nlb_driver_entry, drv, &drv->driver_name);
+	if (ret != NDIS_STATUS_SUCCESS) {
+		printf("NDIS: loopback: DriverEntry failed; "
+		    "status: 0x%08X\n", ret);
+		ndis_loop_unload();
+		return (ENXIO);
+	}
+	ndis_loop_loaded = 1;
+	return (0);
+}
+
+static int
+ndis_loop_create(void)
+{
+	struct driver_object *pdrv = &ndis_loop_bus;
+	device_t nexus, dev;
+	int error;
+
+	mtx_assert(&Giant, MA_OWNED);
+	if (ndis_loop_count == NDIS_LOOP_MAX)
+		return (ENOSPC);
+	error = ndis_loop_load();
+	if (error)
+		return (error);
+
+	nexus = devclass_get_device(devclass_find("nexus"), 0);
+	if (nexus == NULL)
+		return (ENXIO);
+	dev = BUS_ADD_CHILD(nexus, 0, "ndis", -1);
+	if (dev == NULL)
+		return (ENOMEM);
+	if (windrv_create_pdo(pdrv, dev) != NDIS_STATUS_SUCCESS) {
+		device_delete_child(nexus, dev);
+		return (ENOMEM);
+	}
+	error = device_probe_and_attach(dev);
+	if (error) {
+		/* A failed ndis_attach() already got rid of the PDO. */
+		windrv_destroy_pdo(pdrv, dev);
+		device_delete_child(nexus, dev);
+		return (error);
+	}
+	ndis_loop_devs[ndis_loop_count++] = dev;
+	return (0);
+}
+
+static int
+ndis_loop_destroy(void)
+{
+	device_t dev;
+	int error;
+
+	mtx_assert(&Giant, MA_OWNED);
+	if (ndis_loop_count == 0)
+		return (0);
+	dev = ndis_loop_devs[ndis_loop_count - 1];
+	error = device_delete_child(device_get_parent(dev), dev);
+	if (error)
+		return (error);
+	ndis_loop_devs[--ndis_loop_count] = NULL;
+	return (0);
+}
+
+static int
+ndis_loop_sysctl_adapters(SYSCTL_HANDLER_ARGS)
+{
+	int error, n;
+
+	n = ndis_loop_count;
+	error = sysctl_handle_int(oidp, &n, 0, req);
+	if (error || req->newptr == NULL)
+		return (error);
+	if (n < 0 || n > NDIS_LOOP_MAX)
+		return (EINVAL);
+
+	mtx_lock(&Giant);
+	while (error == 0 && ndis_loop_count < n)
+		error = ndis_loop_create();
+	while (error == 0 && ndis_loop_count > n)
+		error = ndis_loop_destroy();
+	mtx_unlock(&Giant);
+	return (error);
+}
+
+SYSCTL_PROC(_hw_ndis_loop, OID_AUTO, adapters, CTLTYPE_INT|CTLFLAG_RW,
+    NULL, 0, ndis_loop_sysctl_adapters, "I",
+    "Number of loopback adapters");
+
+/*
+ * Frames of our own type are counted and dropped on their way up,
+ * anything else goes on to ether_input() as usual.
+ */
+static void
+ndis_loop_input(struct ifnet *ifp, struct mbuf *m)
+{
+	struct ndis_loop_softc *nl = ifp->if_softc;
+	struct ether_header *eh;
+	struct mbuf *n;
+	u_int cnt;
+
+	eh = mtod(m, struct ether_header *);
+	if (m->m_len < sizeof(*eh) ||
+	    ntohs(eh->ether_type) != NDIS_LOOP_ETHERTYPE) {
+		(*nl->nl_input)(ifp, m);
+		return;
+	}
+	for (cnt = 0, n = m; n != NULL; n = n->m_next)
+		cnt++;
+	atomic_add_int(&nl->nl_rxmbufs, cnt);
+	atomic_add_int(&nl->nl_rcvd, 1);
+	m_freem(m);
+}
+
+static struct mbuf *
+ndis_loop_frame(struct ifnet *ifp, u_int size)
+{
+	struct ether_header *eh;
+	struct mbuf *m;
+
+	if (size > MHLEN)
+		m = m_getcl(M_WAITOK, MT_DATA, M_PKTHDR);
+	else
+		m = m_gethdr(M_WAITOK, MT_DATA);
+	m->m_len = m->m_pkthdr.len = size;
+	eh = mtod(m, struct ether_header *);
+	bcopy(IF_LLADDR(ifp), eh->ether_dhost, ETHER_ADDR_LEN);
+	bcopy(IF_LLADDR(ifp), eh->ether_shost, ETHER_ADDR_LEN);
+	eh->ether_type = htons(NDIS_LOOP_ETHERTYPE);
+	bzero(eh + 1, size - sizeof(*eh));
+	return (m);
+}
+
+/*
+ * Only count our own malloc types (M_NDIS_*), so that whatever the
+ * rest of the system is doing doesn't show up in the result.
+ */
+static void
+ndis_loop_count_mallocs(struct malloc_type *mtp, void *arg)
+{
+	struct malloc_type_internal *mtip = mtp->ks_handle;
+	uint64_t *cnt = arg;
+	int i;
+
+	if (strncmp(mtp->ks_shortdesc, "ndis_", 5) != 0)
+		return;
+	CPU_FOREACH(i)
+		*cnt += mtip->mti_stats[i].mts_numallocs;
+}
+
+static uint64_t
+ndis_loop_mallocs(void)
+{
+	uint64_t cnt = 0;
+
+	malloc_type_list(ndis_loop_count_mallocs, &cnt);
+	return (cnt);
+}
+
+/*
+ * Frames that won't make it back: those the miniport had no buffer
+ * for, and those NDIS failed to send or to pass up.
+ */
+static u_int
+ndis_loop_drops(struct ndis_loop_softc *nl)
+{
+	struct ndis_softc *sc = &nl->nl_sc;
+	struct nlb_adapter *na = sc->ndis_block->miniport_adapter_ctx;
+
+	return (na->na_rxnobuf + sc->ndis_ifp->if_ierrors +
+	    sc->ndis_ifp->if_oerrors);
+}
+
+/* Wait until no more than 'limit' frames are still on their way. */
+static int
+ndis_loop_wait(struct ndis_loop_softc *nl, u_int sent, u_int drop0,
+    u_int limit, sbintime_t timeout)
+{
+	sbintime_t deadline;
+	u_int done, last;
+
+	deadline = sbinuptime() + timeout;
+	last = nl->nl_rcvd;
+	for (;;) {
+		done = nl->nl_rcvd + ndis_loop_drops(nl) - drop0;
+		if ((int)(sent - done) <= (int)limit)
+			return (0);
+		if (nl->nl_rcvd != last) {
+			last = nl->nl_rcvd;
+			deadline = sbinuptime() + timeout;
+		} else if (sbinuptime() > deadline)
+			return (ETIMEDOUT);
+		kern_yield(PRI_USER);
+	}
+}
+
+static int
+ndis_loop_bench(struct ndis_loop_softc *nl, u_int count)
+{
+	struct ndis_softc *sc = &nl->nl_sc;
+	struct ifnet *ifp = sc->ndis_ifp;
+	struct mbuf *m;
+	sbintime_t t0, dt;
+	uint64_t c0, cycles, m0, mallocs, us, pps;
+	u_int sent, drop0, dropped, rcvd, size, window, rxmbufs;
+	int error = 0;
+
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0)
+		return (ENETDOWN);
+
+	size = max(nl->nl_size, ETHER_MIN_LEN - ETHER_CRC_LEN);
+	size = min(size, ETHER_MAX_LEN - ETHER_CRC_LEN);
+	window = max(nl->nl_window, 1);
+
+	nl->nl_rcvd = 0;
+	nl->nl_rxmbufs = 0;
+	nl->nl_input = ifp->if_input;
+	ifp->if_input = ndis_loop_input;
+	drop0 = ndis_loop_drops(nl);
+
+	m0 = ndis_loop_mallocs();
+	c0 = get_cyclecount();
+	t0 = sbinuptime();
+	for (sent = 0; sent < count; ) {
+		if (sent >= window) {
+			error = ndis_loop_wait(nl, sent, drop0, window - 1,
+			    SBT_1S);
+			if (error)
+				break;
+		}
+		m = ndis_loop_frame(ifp, size);
+		if (nl->nl_legacy) {
+			IFQ_ENQUEUE(&ifp->if_snd, m, error);
+			if (error == 0)
+				(*ifp->if_start)(ifp);
+		} else
+			error = (*ifp->if_transmit)(ifp, m);
+		if (error == ENOBUFS) {
+			/* The frame is gone, queues are full. */
+			error = 0;
+			kern_yield(PRI_USER);
+			continue;
+		}
+		if (error)
+			break;
+		sent++;
+	}
+	if (error == 0)
+		error = ndis_loop_wait(nl, sent, drop0, 0, 5 * SBT_1S);
+	dt = sbinuptime() - t0;
+	cycles = get_cyclecount() - c0;
+	mallocs = ndis_loop_mallocs() - m0;
+
+	ifp->if_input = nl->nl_input;
+	rcvd = nl->nl_rcvd;
+	rxmbufs = nl->nl_rxmbufs;
+	dropped = ndis_loop_drops(nl) - drop0;
+
+	us = (dt * 1000000) >> 32;
+	pps = us ? (uint64_t)rcvd * 1000000 / us : 0;
+	snprintf(nl->nl_result, sizeof(nl->nl_result),
+	    "%u sent, %u received, %u dropped, %ju us, %ju pps, "
+	    "%ju cycles/pkt, %ju.%02ju mallocs/pkt, %u.%02u mbufs/pkt%s",
+	    sent, rcvd, dropped, (uintmax_t)us, (uintmax_t)pps,
+	    (uintmax_t)(sent ? cycles / sent : 0),
+	    (uintmax_t)(sent ? mallocs / sent : 0),
+	    (uintmax_t)(sent ? mallocs * 100 / sent % 100 : 0),
+	    rcvd ? rxmbufs / rcvd : 0, rcvd ? rxmbufs * 100 / rcvd % 100 : 0,
+	    error ? " (incomplete)" : "");
+	device_printf(sc->ndis_dev, "bench: %s\n", nl->nl_result);
+	return (error);
+}
+
+static int
+ndis_loop_sysctl_bench(SYSCTL_HANDLER_ARGS)
+{
+	struct ndis_loop_softc *nl = arg1;
+	u_int count;
+	int error;
+
+	count = nl->nl_count;
+	error = sysctl_handle_int(oidp, &count, 0, req);
+	if (error || req->newptr == NULL)
+		return (error);
+	if (count == 0)
+		return (EINVAL);
+
+	mtx_lock(&Giant);
+	if (nl->nl_busy) {
+		mtx_unlock(&Giant);
+		return (EBUSY);
+	}
+	nl->nl_busy = 1;
+	mtx_unlock(&Giant);
+
+	nl->nl_count = count;
+	error = ndis_loop_bench(nl, count);
+
+	mtx_lock(&Giant);
+	nl->nl_busy = 0;
+	mtx_unlock(&Giant);
+	return (error);
+}
+
+static void
+ndis_loop_add_sysctls(struct ndis_loop_softc *nl)
+{
+	struct sysctl_ctx_list *ctx;
+	struct sysctl_oid_list *child;
+
+	ctx = device_get_sysctl_ctx(nl->nl_sc.ndis_dev);
+	child = SYSCTL_CHILDREN(device_get_sysctl_tree(nl->nl_sc.ndis_dev));
+
+	nl->nl_size = ETHER_MIN_LEN - ETHER_CRC_LEN;
+	nl->nl_window = 256;
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "bench",
+	    CTLTYPE_UINT|CTLFLAG_RW, nl, 0, ndis_loop_sysctl_bench, "IU",
+	    "Send this many frames through the adapter and time them");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "bench_size", CTLFLAG_RW,
+	    &nl->nl_size, 0, "Benchmark frame size");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "bench_window", CTLFLAG_RW,
+	    &nl->nl_window, 0, "Benchmark frames in flight");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "bench_legacy", CTLFLAG_RW,
+	    &nl->nl_legacy, 0, "Benchmark through if_start, not if_transmit");
+	SYSCTL_ADD_STRING(ctx, child, OID_AUTO, "bench_result", CTLFLAG_RD,
+	    nl->nl_result, 0, "Last benchmark result");
+}
+
+static void
+ndis_loop_set_regvals(struct ndis_loop_softc *nl)
+{
+	static const struct {
+		const char	*key;
+		const char	*desc;
+		int		*val;
+	} keys[NDIS_LOOP_NKEYS] = {
+		{ "Deserialize", "Deserialized miniport",
+		    &ndis_loop_deserialize },
+		{ "SendPending", "Complete sends from a DPC",
+		    &ndis_loop_send_pending },
+		{ "MaxSendPackets", "Send batch size",
+		    &ndis_loop_max_send },
+		{ "ReceiveBatch", "Packets per receive indication",
+		    &ndis_loop_rx_batch },
+		{ "ReceiveBuffers", "Receive buffers",
+		    &ndis_loop_rx_buffers }
+	};
+	int i;
+
+	for (i = 0; i < NDIS_LOOP_NKEYS; i++) {
+		snprintf(nl->nl_regbuf[i], sizeof(nl->nl_regbuf[i]), "%d",
+		    *keys[i].val);
+		nl->nl_regvals[i].key = __DECONST(char *, keys[i].key);
+		nl->nl_regvals[i].desc = __DECONST(char *, keys[i].desc);
+		nl->nl_regvals[i].val = nl->nl_regbuf[i];
+		nl->nl_regvals[i].idx = 0;
+	}
+	nl->nl_regvals[i].key = NULL;
+}
+
+static int
+ndis_loop_probe(device_t dev)
+{
+
+	if (windrv_find_pdo(&ndis_loop_bus, dev) == NULL)
+		return (ENXIO);
+	device_set_desc(dev, "NDIS loopback miniport");
+	return (BUS_PROBE_NOWILDCARD);
+}
+
+static int
+ndis_loop_attach(device_t dev)
+{
+	struct ndis_loop_softc *nl;
+	struct ndis_softc *sc;
+	int error;
+
+	nl = device_get_softc(dev);
+	sc = &nl->nl_sc;
+	sc->ndis_dev = dev;
+	sc->ndis_dobj = &ndis_loop_drv;
+	ndis_loop_set_regvals(nl);
+	sc->ndis_regvals = nl->nl_regvals;
+	sc->ndis_bus_type = NDIS_INTERNAL;
+	sc->ndis_devidx = 0;
+
+	error = ndis_attach(dev);
+	if (error == 0)
+		ndis_loop_add_sysctls(nl);
+	return (error);
+}
+
+static int
+ndis_loop_detach(device_t dev)
+{
+	struct ndis_loop_softc *nl;
+
+	nl = device_get_softc(dev);
+	if (nl->nl_busy)
+		return (EBUSY);
+	return (ndis_detach(dev));
+}
+
+static int
+ndis_loop_modevent(module_t mod, int cmd, void *arg)
+{
+	int error = 0;
+
+	switch (cmd) {
+	case MOD_LOAD:
+		/*
+		 * The adapters have no hardware behind them at all, so
+		 * they hang off a stub "internal" bus of their own.
+		 */
+		error = windrv_bus_attach(&ndis_loop_bus, "Internal Bus");
+		break;
+	case MOD_UNLOAD:
+		mtx_lock(&Giant);
+		while (error == 0 && ndis_loop_count > 0)
+			error = ndis_loop_destroy();
+		if (error == 0 && ndis_loop_loaded)
+			ndis_loop_unload();
+		if (error == 0)
+			error = windrv_bus_detach(&ndis_loop_bus);
+		mtx_unlock(&Giant);
+		break;
+	case MOD_SHUTDOWN:
+		break;
+	default:
+		error = EOPNOTSUPP;
+		break;
+	}
+	return (error);
+}
@@ -177,6 +177,8 @@ ndis_detach_usb(device_t dev)
 	int i;
 
 	sc = device_get_softc(dev);
+	if (NDIS_INITIALIZED(sc) && ndis_drain_rx(sc) != 0)
+		return (EBUSY);
 	sc->ndisusb_status |= NDISUSB_STATUS_DETACH;
 
 	ndis_pnp_event_nic(sc, NDIS_DEVICE_PNP_EVENT_SURPRISE_REMOVED, 0);
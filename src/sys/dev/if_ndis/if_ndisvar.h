@@ -35,6 +35,7 @@
 #ifndef _IF_NDISVAR_H_
 #define	_IF_NDISVAR_H_
 
+#include <sys/bitstring.h>
 #include <net80211/ieee80211_var.h>
 
 extern devclass_t ndis_devclass;
@@ -52,26 +53,154 @@ struct ndis_oid_data {		/* For setting/getting OIDs from userspace. */
 	uint32_t	len;
 };
 
+/*
+ * Shared memory handed out by NdisMAllocateSharedMemory(). Small
+ * requests are carved out of page sized slab chunks, one set of
+ * chunks per power of two size class; anything bigger gets its own
+ * DMA allocation. Either way one ndis_shmem describes the backing
+ * memory, and is hashed on both its virtual and physical page so
+ * frees can be resolved by either address.
+ */
+#define	NDIS_SHM_MINSHIFT	6	/* smallest class: a cache line */
+#define	NDIS_SHM_MAXSHIFT	(PAGE_SHIFT - 1)
+#define	NDIS_SHM_CLASSES	(NDIS_SHM_MAXSHIFT - NDIS_SHM_MINSHIFT + 1)
+#define	NDIS_SHM_MAXOBJS	(PAGE_SIZE >> NDIS_SHM_MINSHIFT)
+#define	NDIS_SHM_HASHSIZE	64
+#define	NDIS_SHM_HASH(a)	(((a) >> PAGE_SHIFT) & (NDIS_SHM_HASHSIZE - 1))
+
 struct ndis_shmem {
-	struct list_entry	ndis_list;
+	LIST_ENTRY(ndis_shmem)	ndis_vlink;
+	LIST_ENTRY(ndis_shmem)	ndis_plink;
+	TAILQ_ENTRY(ndis_shmem)	ndis_partial;	/* chunk with free slots */
 	bus_dma_tag_t		ndis_stag;
 	bus_dmamap_t		ndis_smap;
 	void			*ndis_saddr;
 	uint64_t		ndis_paddr;
+	uint32_t		ndis_len;
+	int			ndis_class;	/* -1: not a slab chunk */
+	uint32_t		ndis_inuse;
+	bitstr_t		bit_decl(ndis_used, NDIS_SHM_MAXOBJS);
+};
+
+struct ndis_shmpool {
+	struct mtx		nsp_mtx;
+	bus_dma_tag_t		nsp_chunktag;
+	TAILQ_HEAD(, ndis_shmem) nsp_partial[NDIS_SHM_CLASSES];
+	LIST_HEAD(, ndis_shmem)	nsp_vhash[NDIS_SHM_HASHSIZE];
+	LIST_HEAD(, ndis_shmem)	nsp_phash[NDIS_SHM_HASHSIZE];
+	/* Statistics. */
+	uint32_t		nsp_chunks;
+	uint32_t		nsp_large;
+	uint32_t		nsp_objects;
+	u_long			nsp_bytes;	/* handed out */
+	u_long			nsp_backing;	/* allocated from busdma */
+	uint64_t		nsp_allocs;
+	uint64_t		nsp_frees;
+	uint64_t		nsp_badfrees;
+};
+
+/*
+ * Cached link and 802.11 state. Status indications from the miniport
+ * (connect, disconnect, link speed, auth and radio events) and our own
+ * OID sets invalidate or update individual fields; everything else is
+ * answered from the cache until the field's TTL runs out. Volatile
+ * fields use ns_ttl, configuration-like fields use ns_ttl_static.
+ */
+enum ndis_stfield {
+	NDIS_ST_MEDIA,
+	NDIS_ST_LINKSPEED,
+	NDIS_ST_BSSID,
+	NDIS_ST_SSID,
+	NDIS_ST_RTS,
+	NDIS_ST_FRAG,
+	NDIS_ST_POWER,
+	NDIS_ST_TXPOWER,
+	NDIS_ST_AUTHMODE,
+	NDIS_ST_PRIVFILT,
+	NDIS_ST_ENCSTAT,
+	NDIS_ST_NETTYPE,
+	NDIS_ST_CONFIG,
+	NDIS_ST_FIELDS
+};
+
+#define	NDIS_ST_BIT(f)		(1 << (f))
+#define	NDIS_ST_ALL		(NDIS_ST_BIT(NDIS_ST_FIELDS) - 1)
+#define	NDIS_ST_ASSOC							\
+	(NDIS_ST_BIT(NDIS_ST_LINKSPEED) | NDIS_ST_BIT(NDIS_ST_BSSID) |	\
+	NDIS_ST_BIT(NDIS_ST_SSID) | NDIS_ST_BIT(NDIS_ST_AUTHMODE) |	\
+	NDIS_ST_BIT(NDIS_ST_ENCSTAT) | NDIS_ST_BIT(NDIS_ST_NETTYPE) |	\
+	NDIS_ST_BIT(NDIS_ST_CONFIG))
+
+union ndis_stval {
+	uint32_t			v_int;
+	uint8_t				v_bssid[IEEE80211_ADDR_LEN];
+	struct ndis_80211_ssid		v_ssid;
+	struct ndis_80211_config	v_config;
+};
+
+struct ndis_stcache {
+	struct mtx		ns_mtx;
+	uint32_t		ns_valid;	/* NDIS_ST_BIT() mask */
+	uint32_t		ns_gen;		/* bumped on invalidation */
+	int			ns_stamp[NDIS_ST_FIELDS];	/* ticks */
+	union ndis_stval	ns_val[NDIS_ST_FIELDS];
+	int			ns_ttl;		/* seconds, 0: always query */
+	int			ns_ttl_static;
+	uint64_t		ns_hits;
+	uint64_t		ns_queries;
+	uint64_t		ns_events;
 };
 
+/*
+ * Cached results of queries for OIDs that never or rarely change.
+ * Which OIDs are cached, and what expires them, is decided by the
+ * policy table in kern_ndis.c; this is just its per-adapter storage.
+ */
+#define	NDIS_OIDCACHE_MAX	16
+
+struct ndis_oidcache {
+	void			*oc_buf;
+	uint32_t		oc_len;
+	int			oc_valid;
+};
+
+/*
+ * Per-device registry. Every key lives on ndis_cfglist_head and in a
+ * case-insensitive hash, so NdisReadConfiguration() can look up the
+ * driver's Unicode key without converting it first. Values are kept
+ * as strings (the sysctl view) and parsed into NDIS parameters on
+ * first read of each type; a change of the string drops the parsed
+ * forms. Strings already handed to the driver are retired rather
+ * than freed, since it may still hold them.
+ */
+#define	NDIS_REG_HASHSIZE	64
+#define	NDIS_REG_VALLEN		256
+
 struct ndis_cfglist {
 	struct ndis_cfg		ndis_cfg;
 	struct sysctl_oid	*ndis_oid;
         TAILQ_ENTRY(ndis_cfglist)	link;
+	LIST_ENTRY(ndis_cfglist)	ndis_hlink;
+	struct ndis_softc	*ndis_sc;
+	uint32_t		ndis_hash;
+	uint32_t		ndis_parsed;	/* 1 << parameter type */
+	struct ndis_configuration_parameter
+				ndis_parm[NDIS_PARAMETER_BINARY + 1];
 };
 TAILQ_HEAD(nch, ndis_cfglist);
 
+struct ndis_regold {
+	SLIST_ENTRY(ndis_regold)	link;
+	struct unicode_string		str;
+};
+
 #define	NDIS_INITIALIZED(sc)	(sc->ndis_block->device_ctx != NULL)
 #define	NDIS_80211(sc)		\
 	sc->ndis_physical_medium == NDIS_PHYSICAL_MEDIUM_WIRELESS_LAN
 
 #define	NDIS_NEXT_TXIDX(x)	((x)->ndis_txidx + 1) % (x)->ndis_maxpkts
+#define	NDIS_TXSLOT_BUSY(x)	((x)->ndis_txarray[(x)->ndis_txidx] != NULL)
+#define	NDIS_TXMDLS(x, idx)	(&(x)->ndis_txmdls[(idx) * NDIS_MAXSEG])
 
 #define	NDIS_EVENTS	4
 #define	NDIS_EVTINC(x)	(x) = ((x) + 1) % NDIS_EVENTS
@@ -109,23 +238,14 @@ struct ndisusb_xfer {
 	uint32_t		nx_urbactlen;
 	uint32_t		nx_urblen;
 	uint8_t			nx_shortxfer;
+	usb_error_t		nx_status;	/* once on the done list */
 	struct list_entry	nx_next;
 };
 
-struct ndisusb_xferdone {
-	struct ndisusb_xfer	*nd_xfer;
-	usb_error_t		nd_status;
-	struct list_entry	nd_donelist;
-};
-
-struct ndisusb_task {
-	unsigned		nt_type;
+/* Deferred USB tasks, queued through the IRP itself. */
 #define	NDISUSB_TASK_TSTART	0
 #define	NDISUSB_TASK_IRPCANCEL	1
 #define	NDISUSB_TASK_VENDOR	2
-	void			*nt_ctx;
-	struct list_entry	nt_tasklist;
-};
 
 struct ndis_softc {
 	struct ifnet			*ndis_ifp;
@@ -133,6 +253,9 @@ struct ndis_softc {
 	u_long				ndis_hwassist;
 	uint32_t			ndis_v4tx;
 	uint32_t			ndis_v4rx;
+	struct ndis_task_tcp_largesend	ndis_lso;	/* as probed */
+	u_long				ndis_txtsopkts;
+	u_long				ndis_txtsobytes;
 	bus_space_handle_t		ndis_bhandle;
 	bus_space_tag_t			ndis_btag;
 	void				*ndis_intrhand;
@@ -158,11 +281,21 @@ struct ndis_softc {
 	uint32_t			ndis_maxpkts;
 	uint32_t			ndis_txidx;
 	uint32_t			ndis_txpending;
-	struct ndis_packet		**ndis_txarray;
+	struct ndis_packet		**ndis_txarray;	/* in flight, by slot */
+	struct ndis_packet		**ndis_txstage;	/* batch being sent */
+	uint64_t			ndis_txbatches;
+	uint64_t			ndis_txbatchpkts;
+	struct ndis_txmdl		*ndis_txmdls;	/* per TX slot */
+	struct buf_ring			*ndis_txbr;
+	struct mbuf			*ndis_txnext;	/* held back by drainer */
+	struct mtx			ndis_txmtx;	/* single TX drainer */
 	struct ndis_packet_pool		*ndis_txpool;
 	uint8_t				ndis_sc;
 	struct ndis_cfg			*ndis_regvals;
 	struct nch			ndis_cfglist_head;
+	LIST_HEAD(, ndis_cfglist)	ndis_reghash[NDIS_REG_HASHSIZE];
+	SLIST_HEAD(, ndis_regold)	ndis_regold;
+	struct mtx			ndis_regmtx;
 	enum ndis_physical_medium	ndis_physical_medium;
 	uint32_t			ndis_devidx;
 	enum ndis_bus_type		ndis_bus_type;
@@ -172,8 +305,23 @@ struct ndis_softc {
 	struct io_workitem		*ndis_resetitem;
 	struct io_workitem		*ndis_inputitem;
 	struct nt_kdpc			ndis_rxdpc;
+	struct ntoskrnl_execq		*ndis_execq;
 	bus_dma_tag_t			ndis_parent_tag;
-	struct list_entry		ndis_shlist;
+	struct ndis_shmpool		ndis_shm;
+	struct ndis_stcache		ndis_st;
+	struct mtx			ndis_oidmtx;
+	TAILQ_HEAD(, ndis_oidreq)	ndis_oidq;
+	struct ndis_oidreq		*ndis_oidcur;	/* in the miniport */
+	int				ndis_oidrun;	/* dispatcher active */
+	int				ndis_oidreset;	/* held for a reset */
+	uint64_t			ndis_oidreqs;
+	uint64_t			ndis_oidpending;
+	uint64_t			ndis_oidtimeouts;
+	struct ndis_oidcache		ndis_oidc[NDIS_OIDCACHE_MAX];
+	uint32_t			ndis_oidcgen;
+	int				ndis_oidcenable;
+	uint64_t			ndis_oidchits;
+	uint64_t			ndis_oidcmisses;
 	bus_dma_tag_t			ndis_mtag;
 	bus_dma_tag_t			ndis_ttag;
 	bus_dmamap_t			*ndis_mmaps;
@@ -184,6 +332,14 @@ struct ndis_softc {
 	uint32_t			ndis_evtcidx;
 	struct ifqueue			ndis_rxqueue;
 	unsigned long			ndis_rxlock;
+	uint32_t			ndis_rxloaned;
+	uint32_t			ndis_rxloanmax;
+	int				ndis_rxnoloan;	/* halting */
+	uint64_t			ndis_rxcopied;
+	uint64_t			ndis_rxbatches;
+	uint64_t			ndis_rxbatchpkts;
+	uint64_t			ndis_rxinputruns;
+	uint64_t			ndis_rxinputpkts;
 
 	int			(*ndis_newstate)(struct ieee80211com *,
 				    enum ieee80211_state, int);
@@ -212,6 +368,10 @@ struct ndis_softc {
 #define	NDIS_LOCK(_sc)			mtx_lock(&(_sc)->ndis_mtx)
 #define	NDIS_UNLOCK(_sc)		mtx_unlock(&(_sc)->ndis_mtx)
 #define	NDIS_LOCK_ASSERT(_sc, t)	mtx_assert(&(_sc)->ndis_mtx, t)
+#define	NDIS_TX_LOCK(_sc)		mtx_lock(&(_sc)->ndis_txmtx)
+#define	NDIS_TX_TRYLOCK(_sc)		mtx_trylock(&(_sc)->ndis_txmtx)
+#define	NDIS_TX_UNLOCK(_sc)		mtx_unlock(&(_sc)->ndis_txmtx)
+#define	NDIS_TX_LOCK_ASSERT(_sc, t)	mtx_assert(&(_sc)->ndis_txmtx, t)
 #define	NDISUSB_LOCK(_sc)		mtx_lock(&(_sc)->ndisusb_mtx)
 #define	NDISUSB_UNLOCK(_sc)		mtx_unlock(&(_sc)->ndisusb_mtx)
 #define	NDISUSB_LOCK_ASSERT(_sc, t)	mtx_assert(&(_sc)->ndisusb_mtx, t)
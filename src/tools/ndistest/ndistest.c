@@ -0,0 +1,188 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test and benchmark runner for the userland build of the NDIS
+ * runtime. Brings up the HAL and ntoskrnl emulation the same way
+ * the module does on load, runs the tests and tears it all down
+ * again, so leaks and stuck threads show up as well.
+ *
+ * usage: ndistest [-bv] [test ...]
+ */
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "ndistest.h"
+
+int nt_verbose;
+
+static struct nt_test *nt_suites[] = {
+	rtl_tests,
+	slist_tests,
+	sync_tests,
+	pe_tests,
+};
+
+static int nt_failed;
+
+void
+nt_fail(const char *file, int line, const char *exp)
+{
+	printf("  %s:%d: check failed: %s\n", file, line, exp);
+	nt_failed++;
+}
+
+void
+nt_log(const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("  ");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static struct image_patch_table *
+nt_lookup(const char *name)
+{
+	struct image_patch_table *p;
+
+	p = pe_functbl_lookup(ntoskrnl_functbl, name);
+	if (p == NULL)
+		p = pe_functbl_lookup(hal_functbl, name);
+	if (p == NULL)
+		panic("no such import: %s", name);
+	return (p);
+}
+
+/*
+ * Find the wrapped (ms_abi) entry point of an exported routine, the
+ * way an imported call from a driver would reach it.
+ */
+void *
+nt_import(const char *name)
+{
+	return (nt_lookup(name)->wrap);
+}
+
+/* The routine itself, for calls with more arguments than MSCALLn. */
+void *
+nt_native(const char *name)
+{
+	return (nt_lookup(name)->func);
+}
+
+uint64_t
+nt_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+uint64_t
+nt_cycles(void)
+{
+	return (__builtin_ia32_rdtsc());
+}
+
+static int
+nt_selected(struct nt_test *t, int bench, int argc, char **argv)
+{
+	int i;
+
+	if (argc == 0)
+		return (!t->nt_bench || bench);
+	for (i = 0; i < argc; i++)
+		if (strcmp(argv[i], t->nt_name) == 0)
+			return (1);
+	return (0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: ndistest [-bv] [test ...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct nt_test *t;
+	uint64_t start;
+	int bench = 0, ch, failed = 0, i, ran = 0;
+
+	while ((ch = getopt(argc, argv, "bv")) != -1) {
+		switch (ch) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'v':
+			nt_verbose = 1;
+			bootverbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	hal_libinit();
+	ntoskrnl_libinit();
+
+	for (i = 0; i < nitems(nt_suites); i++) {
+		for (t = nt_suites[i]; t->nt_name != NULL; t++) {
+			if (!nt_selected(t, bench, argc, argv))
+				continue;
+			nt_failed = 0;
+			start = nt_nsecs();
+			t->nt_func();
+			if (nt_failed)
+				failed++;
+			ran++;
+			if (nt_verbose)
+				printf("%s %s (%ju us)\n",
+				    nt_failed ? "FAIL" : "ok", t->nt_name,
+				    (uintmax_t)(nt_nsecs() - start) / 1000);
+			else
+				printf("%s %s\n", nt_failed ? "FAIL" : "ok",
+				    t->nt_name);
+		}
+	}
+
+	ntoskrnl_libfini();
+	hal_libfini();
+
+	printf("%d of %d tests failed\n", failed, ran);
+	return (failed != 0);
+}
@@ -0,0 +1,73 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _NDISTEST_H_
+#define	_NDISTEST_H_
+
+#include "pe_var.h"
+#include "resource_var.h"
+#include "ntoskrnl_var.h"
+#include "hal_var.h"
+#include "ndis_var.h"
+
+/*
+ * A test is a plain function that reports problems through NT_CHECK().
+ * Each test_*.c file exports a NULL terminated table of them; the
+ * ones flagged as benchmarks only run when asked for with -b.
+ */
+struct nt_test {
+	const char	*nt_name;
+	void		(*nt_func)(void);
+	int		nt_bench;
+};
+
+#define	NT_TEST(func)	{ #func, func, 0 }
+#define	NT_BENCH(func)	{ #func, func, 1 }
+
+#define	NT_CHECK(exp) do {						\
+	if (!(exp))							\
+		nt_fail(__FILE__, __LINE__, #exp);			\
+} while (0)
+
+/* Windows driver code, as seen by the runtime. */
+#define	NT_MSABI	__attribute__((ms_abi))
+
+extern struct nt_test	rtl_tests[];
+extern struct nt_test	slist_tests[];
+extern struct nt_test	sync_tests[];
+extern struct nt_test	pe_tests[];
+
+extern int	nt_verbose;
+
+void	nt_fail(const char *, int, const char *);
+void	nt_log(const char *, ...)
+	    __attribute__((__format__(__printf__, 1, 2)));
+void	*nt_import(const char *);
+void	*nt_native(const char *);
+uint64_t nt_nsecs(void);
+uint64_t nt_cycles(void);
+
+#endif /* _NDISTEST_H_ */
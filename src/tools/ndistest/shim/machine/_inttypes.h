@@ -0,0 +1,4 @@
+/* $FreeBSD$ */
+
+/* Provided by ndis_shim.h. */
+#include <inttypes.h>
@@ -0,0 +1,10 @@
+/* $FreeBSD$ */
+
+#ifndef _MACHINE_ASMACROS_H_
+#define	_MACHINE_ASMACROS_H_
+
+/* What winx_wrap.S needs to assemble as an ELF userland object. */
+#define	ENTRY(name)							\
+	.text; .p2align 4; .globl name; .type name,@function; name:
+
+#endif /* !_MACHINE_ASMACROS_H_ */
@@ -0,0 +1,3 @@
+/* $FreeBSD$ */
+
+/* Provided by ndis_shim.h. */
@@ -0,0 +1,90 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _NDIS_COMPAT_H_
+#define	_NDIS_COMPAT_H_
+
+/*
+ * The bits of <sys/types.h> and <sys/param.h> that the compat/ndis
+ * headers expect from a FreeBSD userland but that glibc does not
+ * provide. This is all subr_pe.c needs; the kernel side pulls in
+ * ndis_shim.h on top of it.
+ */
+
+#ifndef _GNU_SOURCE
+#define	_GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/cdefs.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef __FBSDID
+#define	__FBSDID(s)		struct __hack
+#endif
+#ifndef __DECONST
+#define	__DECONST(type, var)	((type)(uintptr_t)(const void *)(var))
+#endif
+#ifndef __unused
+#define	__unused		__attribute__((__unused__))
+#endif
+#ifndef __packed
+#define	__packed		__attribute__((__packed__))
+#endif
+#ifndef __aligned
+#define	__aligned(x)		__attribute__((__aligned__(x)))
+#endif
+
+#ifndef roundup2
+#define	roundup2(x, y)	(((x) + ((y) - 1)) & (~((y) - 1)))
+#endif
+#ifndef rounddown2
+#define	rounddown2(x, y) ((x) & (~((y) - 1)))
+#endif
+#ifndef nitems
+#define	nitems(x)	(sizeof((x)) / sizeof((x)[0]))
+#endif
+
+typedef uintptr_t	vm_offset_t;
+typedef size_t		vm_size_t;
+typedef uint64_t	vm_paddr_t;
+typedef int		vm_memattr_t;
+typedef uint64_t	bus_addr_t;
+typedef uint64_t	bus_size_t;
+typedef uint64_t	bus_space_handle_t;
+typedef int		bus_space_tag_t;
+typedef uint64_t	rman_res_t;
+typedef int64_t		sbintime_t;
+typedef char		*caddr_t;
+typedef int		lwpid_t;
+
+#endif /* _NDIS_COMPAT_H_ */
@@ -0,0 +1,976 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * pthreads implementation of the kernel services declared in
+ * ndis_shim.h.
+ */
+
+#include "ndis_shim.h"
+
+#include <sys/syscall.h>
+#include <limits.h>
+
+/* We want the libc versions from here on. */
+#undef malloc
+#undef free
+#undef pause
+
+int bootverbose;
+int hz = 1000;
+int tick = 1000;
+u_int mp_maxid;
+int mp_ncpus;
+
+static struct vm_map kernel_map_store;
+struct vm_map *kernel_map = &kernel_map_store;
+void *kernel_arena;
+
+MALLOC_DEFINE(M_TEMP, "temp", "misc temporary data buffers");
+MALLOC_DEFINE(M_DEVBUF, "devbuf", "device driver memory");
+static MALLOC_DEFINE(M_UMA, "uma", "UMA zone items");
+
+static volatile uint64_t ndis_shim_mallocs;
+
+static struct proc proc0 = { "ndistest" };
+static __thread struct thread *ndis_curthread;
+static volatile u_int ndis_nextcpu;
+
+static void callout_start(void);
+
+/*
+ * CPUs here are only labels on threads, so pretend to have a few
+ * even on a small box: the per-CPU code is what we want to run.
+ */
+#define	NDIS_SHIM_MINCPU	4
+
+static void __attribute__((__constructor__))
+ndis_shim_init(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < NDIS_SHIM_MINCPU)
+		n = NDIS_SHIM_MINCPU;
+	if (n > MAXCPU)
+		n = MAXCPU;
+	mp_ncpus = n;
+	mp_maxid = n - 1;
+}
+
+void
+ndis_shim_panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	fprintf(stderr, "panic: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+void
+ndis_shim_noport(void)
+{
+	panic("I/O port access is not available in userland");
+}
+
+/*
+ * Clocks.
+ */
+
+static void
+ndis_shim_clock(clockid_t clock, struct timespec *ts)
+{
+	if (clock_gettime(clock, ts) != 0)
+		panic("clock_gettime: %s", strerror(errno));
+}
+
+static void
+timespec2bintime(const struct timespec *ts, struct bintime *bt)
+{
+	bt->sec = ts->tv_sec;
+	/* 18446744073 = int(2^64 / 1000000000) */
+	bt->frac = ts->tv_nsec * (uint64_t)18446744073LL;
+}
+
+int
+ndis_shim_ticks(void)
+{
+	struct timespec ts;
+
+	ndis_shim_clock(CLOCK_MONOTONIC, &ts);
+	return ((int)((uint64_t)ts.tv_sec * hz +
+	    ts.tv_nsec / (1000000000 / hz)));
+}
+
+void
+binuptime(struct bintime *bt)
+{
+	struct timespec ts;
+
+	ndis_shim_clock(CLOCK_MONOTONIC, &ts);
+	timespec2bintime(&ts, bt);
+}
+
+void
+bintime(struct bintime *bt)
+{
+	struct timespec ts;
+
+	ndis_shim_clock(CLOCK_REALTIME, &ts);
+	timespec2bintime(&ts, bt);
+}
+
+sbintime_t
+sbinuptime(void)
+{
+	struct timespec ts;
+
+	ndis_shim_clock(CLOCK_MONOTONIC, &ts);
+	return (((sbintime_t)ts.tv_sec << 32) +
+	    (((uint64_t)ts.tv_nsec << 32) / 1000000000));
+}
+
+static void
+sbintime2timespec(sbintime_t sbt, struct timespec *ts)
+{
+	ts->tv_sec = sbt >> 32;
+	ts->tv_nsec = ((sbt & 0xffffffff) * 1000000000) >> 32;
+}
+
+void
+nanotime(struct timespec *ts)
+{
+	ndis_shim_clock(CLOCK_REALTIME, ts);
+}
+
+void
+nanouptime(struct timespec *ts)
+{
+	ndis_shim_clock(CLOCK_MONOTONIC, ts);
+}
+
+void
+microtime(struct timeval *tv)
+{
+	struct timespec ts;
+
+	ndis_shim_clock(CLOCK_REALTIME, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+void
+getmicrouptime(struct timeval *tv)
+{
+	struct timespec ts;
+
+	ndis_shim_clock(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+/* Same rounding as the kernel: always at least one full tick. */
+int
+tvtohz(struct timeval *tv)
+{
+	int64_t us;
+
+	us = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	if (us <= 0)
+		return (1);
+	us = (us + tick - 1) / tick + 1;
+	return (us > INT_MAX ? INT_MAX : (int)us);
+}
+
+static sbintime_t
+ticks2sbt(int timo)
+{
+	return ((sbintime_t)(timo > 0 ? timo : 1) * (SBT_1S / hz));
+}
+
+int
+ndis_shim_pause(const char *wmesg, int timo)
+{
+	struct timespec ts;
+
+	sbintime2timespec(ticks2sbt(timo), &ts);
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+	return (0);
+}
+
+void
+DELAY(int usec)
+{
+	sbintime_t end;
+
+	end = sbinuptime() + (sbintime_t)usec * SBT_1US;
+	while (sbinuptime() < end)
+		cpu_spinwait();
+}
+
+/*
+ * Memory.
+ */
+
+void
+malloc_type_allocated(struct malloc_type *type, unsigned long size)
+{
+	if (size == 0)
+		return;
+	__sync_fetch_and_add(&type->ks_calls, 1);
+	__sync_fetch_and_add(&type->ks_inuse, 1);
+	__sync_fetch_and_add(&ndis_shim_mallocs, 1);
+}
+
+void
+malloc_type_freed(struct malloc_type *type, unsigned long size)
+{
+	__sync_fetch_and_sub(&type->ks_inuse, 1);
+}
+
+uint64_t
+ndis_shim_malloc_calls(void)
+{
+	return (__atomic_load_n(&ndis_shim_mallocs, __ATOMIC_RELAXED));
+}
+
+void *
+ndis_shim_malloc(size_t size, struct malloc_type *type, int flags)
+{
+	void *p;
+
+	if (flags & M_ZERO)
+		p = calloc(1, size ? size : 1);
+	else
+		p = malloc(size ? size : 1);
+	if (p == NULL) {
+		if (flags & M_WAITOK)
+			panic("malloc(%zu, %s, M_WAITOK) failed", size,
+			    type->ks_shortdesc);
+		return (NULL);
+	}
+	malloc_type_allocated(type, 1);
+	return (p);
+}
+
+void
+ndis_shim_free(void *addr, struct malloc_type *type)
+{
+	if (addr == NULL)
+		return;
+	malloc_type_freed(type, 1);
+	free(addr);
+}
+
+struct uma_zone {
+	const char		*uz_name;
+	size_t			uz_size;
+};
+
+uma_zone_t
+uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
+    uma_init uminit, uma_fini fini, int align, uint32_t flags)
+{
+	uma_zone_t zone;
+
+	zone = ndis_shim_malloc(sizeof(*zone), M_UMA, M_WAITOK | M_ZERO);
+	zone->uz_name = name;
+	zone->uz_size = size;
+	return (zone);
+}
+
+void
+uma_zdestroy(uma_zone_t zone)
+{
+	ndis_shim_free(zone, M_UMA);
+}
+
+void *
+uma_zalloc(uma_zone_t zone, int flags)
+{
+	return (ndis_shim_malloc(zone->uz_size, M_UMA, flags));
+}
+
+void
+uma_zfree(uma_zone_t zone, void *item)
+{
+	ndis_shim_free(item, M_UMA);
+}
+
+vm_offset_t
+kmem_alloc_contig(void *arena, vm_size_t size, int flags, vm_paddr_t low,
+    vm_paddr_t high, u_long alignment, vm_paddr_t boundary,
+    vm_memattr_t memattr)
+{
+	void *p;
+
+	size = round_page(size);
+	p = aligned_alloc(MAX(alignment, PAGE_SIZE), size);
+	if (p != NULL && (flags & M_ZERO))
+		memset(p, 0, size);
+	return ((vm_offset_t)p);
+}
+
+void
+kmem_free(void *arena, vm_offset_t addr, vm_size_t size)
+{
+	free((void *)addr);
+}
+
+int
+sysctl_handle_string(struct sysctl_oid *oidp, void *arg1, size_t arg2,
+    struct sysctl_req *req)
+{
+	return (0);
+}
+
+/*
+ * Threads. Thread structures are never freed: callers such as
+ * ntoskrnl_stop_dpc_thread() still look at them after the thread
+ * has exited, as they may in the kernel.
+ */
+
+static struct thread *
+thread_alloc(const char *name)
+{
+	struct thread *td;
+
+	td = calloc(1, sizeof(*td));
+	if (td == NULL)
+		panic("can't allocate thread %s", name);
+	td->td_proc = &proc0;
+	td->td_oncpu = __sync_fetch_and_add(&ndis_nextcpu, 1) %
+	    (mp_maxid + 1);
+	td->td_priority = PRI_MAX_KERN;
+	snprintf(td->td_name, sizeof(td->td_name), "%s", name);
+	return (td);
+}
+
+static void
+thread_adopt(struct thread *td)
+{
+	td->td_tid = syscall(SYS_gettid);
+	td->td_pthread = pthread_self();
+	ndis_curthread = td;
+}
+
+struct thread *
+ndis_shim_curthread(void)
+{
+	struct thread *td;
+
+	if ((td = ndis_curthread) == NULL) {
+		td = thread_alloc("user");
+		thread_adopt(td);
+	}
+	return (td);
+}
+
+static void *
+thread_start(void *arg)
+{
+	struct thread *td = arg;
+
+	thread_adopt(td);
+	td->td_func(td->td_arg);
+	return (NULL);
+}
+
+static int
+thread_create(struct thread *td, int detach)
+{
+	pthread_attr_t attr;
+	int error;
+
+	pthread_attr_init(&attr);
+	if (detach)
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	error = pthread_create(&td->td_pthread, &attr, thread_start, td);
+	pthread_attr_destroy(&attr);
+	return (error);
+}
+
+int
+kproc_kthread_add(void (*func)(void *), void *arg, struct proc **procp,
+    struct thread **tdp, int flags, int pages, const char *procname,
+    const char *fmt, ...)
+{
+	struct thread *td;
+	char name[32];
+	va_list ap;
+	int error;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+
+	td = thread_alloc(name);
+	td->td_func = func;
+	td->td_arg = arg;
+	if (procp != NULL && *procp == NULL)
+		*procp = &proc0;
+	if (tdp != NULL)
+		*tdp = td;
+	if ((error = thread_create(td, 1)) != 0) {
+		free(td);
+		return (error);
+	}
+	return (0);
+}
+
+void
+kthread_exit(void)
+{
+	pthread_exit(NULL);
+}
+
+void
+sched_prio(struct thread *td, u_char prio)
+{
+	td->td_priority = prio;
+}
+
+void
+sched_bind(struct thread *td, int cpu)
+{
+	KASSERT(!CPU_ABSENT(cpu), ("sched_bind: bad cpu %d", cpu));
+	td->td_oncpu = cpu;
+}
+
+void
+sched_unbind(struct thread *td)
+{
+}
+
+/* Critical sections are no-ops here, so there is nothing to wait for. */
+int
+quiesce_all_cpus(const char *wmesg, int prio)
+{
+	return (0);
+}
+
+int
+cpuset_setthread(lwpid_t tid, cpuset_t *mask)
+{
+	struct thread *td = curthread;
+	int cpu;
+
+	if (tid != td->td_tid)
+		return (ESRCH);
+	for (cpu = 0; cpu <= mp_maxid; cpu++) {
+		if (CPU_ISSET(cpu, mask)) {
+			td->td_oncpu = cpu;
+			return (0);
+		}
+	}
+	return (EINVAL);
+}
+
+static pthread_mutex_t sleep_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleep_cv = PTHREAD_COND_INITIALIZER;
+
+/* All sleepers share one channel; tsleep() callers recheck anyway. */
+int
+tsleep(void *ident, int priority, const char *wmesg, int timo)
+{
+	struct timespec ts;
+	int error;
+
+	pthread_mutex_lock(&sleep_mtx);
+	if (timo > 0) {
+		sbintime2timespec(sbinuptime() + ticks2sbt(timo), &ts);
+		error = pthread_cond_timedwait(&sleep_cv, &sleep_mtx, &ts);
+	} else
+		error = pthread_cond_wait(&sleep_cv, &sleep_mtx);
+	pthread_mutex_unlock(&sleep_mtx);
+	return (error == ETIMEDOUT ? EWOULDBLOCK : 0);
+}
+
+void
+wakeup(void *ident)
+{
+	pthread_mutex_lock(&sleep_mtx);
+	pthread_cond_broadcast(&sleep_cv);
+	pthread_mutex_unlock(&sleep_mtx);
+}
+
+/*
+ * Mutexes and condition variables. Ownership is tracked by hand
+ * so that mtx_owned() and recursion work as in the kernel.
+ */
+
+void
+mtx_init(struct mtx *m, const char *name, const char *type, int opts)
+{
+	pthread_mutex_init(&m->mtx_lock, NULL);
+	m->mtx_owner = NULL;
+	m->mtx_recurse = 0;
+	m->mtx_flags = opts;
+	m->mtx_name = name;
+}
+
+void
+mtx_destroy(struct mtx *m)
+{
+	KASSERT(m->mtx_owner == NULL, ("destroying owned mutex %s",
+	    m->mtx_name));
+	pthread_mutex_destroy(&m->mtx_lock);
+}
+
+void
+mtx_lock(struct mtx *m)
+{
+	struct thread *td = curthread;
+
+	if (m->mtx_owner == td) {
+		KASSERT(m->mtx_flags & MTX_RECURSE,
+		    ("recursed on non-recursive mutex %s", m->mtx_name));
+		m->mtx_recurse++;
+		return;
+	}
+	pthread_mutex_lock(&m->mtx_lock);
+	m->mtx_owner = td;
+}
+
+void
+mtx_unlock(struct mtx *m)
+{
+	KASSERT(m->mtx_owner == curthread, ("mutex %s not owned",
+	    m->mtx_name));
+	if (m->mtx_recurse > 0) {
+		m->mtx_recurse--;
+		return;
+	}
+	m->mtx_owner = NULL;
+	pthread_mutex_unlock(&m->mtx_lock);
+}
+
+void
+cv_init(struct cv *cv, const char *desc)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cv->cv_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	cv->cv_description = desc;
+}
+
+void
+cv_destroy(struct cv *cv)
+{
+	pthread_cond_destroy(&cv->cv_cond);
+}
+
+void
+cv_wait(struct cv *cv, struct mtx *m)
+{
+	struct thread *td = curthread;
+
+	KASSERT(m->mtx_owner == td && m->mtx_recurse == 0,
+	    ("cv_wait: bad mutex state for %s", m->mtx_name));
+	m->mtx_owner = NULL;
+	pthread_cond_wait(&cv->cv_cond, &m->mtx_lock);
+	m->mtx_owner = td;
+}
+
+int
+cv_timedwait(struct cv *cv, struct mtx *m, int timo)
+{
+	struct thread *td = curthread;
+	struct timespec ts;
+	int error;
+
+	KASSERT(m->mtx_owner == td && m->mtx_recurse == 0,
+	    ("cv_timedwait: bad mutex state for %s", m->mtx_name));
+	sbintime2timespec(sbinuptime() + ticks2sbt(timo), &ts);
+	m->mtx_owner = NULL;
+	error = pthread_cond_timedwait(&cv->cv_cond, &m->mtx_lock, &ts);
+	m->mtx_owner = td;
+	return (error == ETIMEDOUT ? EWOULDBLOCK : 0);
+}
+
+void
+cv_signal(struct cv *cv)
+{
+	pthread_cond_signal(&cv->cv_cond);
+}
+
+void
+cv_broadcastpri(struct cv *cv, int pri)
+{
+	pthread_cond_broadcast(&cv->cv_cond);
+}
+
+/*
+ * Taskqueues. Like the kernel's, a task that is enqueued again
+ * before it runs is only run once, with ta_pending counting the
+ * enqueues.
+ */
+
+struct taskqueue_thread {
+	struct taskqueue	*tt_tq;
+	struct task		*tt_running;
+	struct thread		*tt_td;
+};
+
+struct taskqueue {
+	STAILQ_HEAD(, task)	tq_queue;
+	pthread_mutex_t		tq_mutex;
+	pthread_cond_t		tq_work;
+	pthread_cond_t		tq_done;
+	const char		*tq_name;
+	int			tq_exit;
+	int			tq_nthreads;
+	struct taskqueue_thread	*tq_threads;
+};
+
+struct taskqueue *
+taskqueue_create(const char *name, int mflags, taskqueue_enqueue_fn enqueue,
+    void *context)
+{
+	struct taskqueue *tq;
+
+	tq = calloc(1, sizeof(*tq));
+	if (tq == NULL)
+		return (NULL);
+	STAILQ_INIT(&tq->tq_queue);
+	pthread_mutex_init(&tq->tq_mutex, NULL);
+	pthread_cond_init(&tq->tq_work, NULL);
+	pthread_cond_init(&tq->tq_done, NULL);
+	tq->tq_name = name;
+	return (tq);
+}
+
+void
+taskqueue_thread_enqueue(void *context)
+{
+}
+
+static void
+taskqueue_thread_loop(void *arg)
+{
+	struct taskqueue_thread *tt = arg;
+	struct taskqueue *tq = tt->tt_tq;
+	struct task *task;
+	int pending;
+
+	pthread_mutex_lock(&tq->tq_mutex);
+	for (;;) {
+		if ((task = STAILQ_FIRST(&tq->tq_queue)) == NULL) {
+			if (tq->tq_exit)
+				break;
+			pthread_cond_wait(&tq->tq_work, &tq->tq_mutex);
+			continue;
+		}
+		STAILQ_REMOVE_HEAD(&tq->tq_queue, ta_link);
+		pending = task->ta_pending;
+		task->ta_pending = 0;
+		tt->tt_running = task;
+		pthread_mutex_unlock(&tq->tq_mutex);
+
+		task->ta_func(task->ta_context, pending);
+
+		pthread_mutex_lock(&tq->tq_mutex);
+		tt->tt_running = NULL;
+		pthread_cond_broadcast(&tq->tq_done);
+	}
+	pthread_mutex_unlock(&tq->tq_mutex);
+}
+
+static int
+taskqueue_start_threads_va(struct taskqueue **tqp, int count, int pri,
+    cpuset_t *mask, const char *fmt, va_list ap)
+{
+	struct taskqueue *tq = *tqp;
+	struct taskqueue_thread *tt;
+	char name[32];
+	int cpu, i;
+
+	vsnprintf(name, sizeof(name), fmt, ap);
+
+	tq->tq_threads = calloc(count, sizeof(*tq->tq_threads));
+	if (tq->tq_threads == NULL)
+		return (ENOMEM);
+	for (i = 0; i < count; i++) {
+		tt = &tq->tq_threads[i];
+		tt->tt_tq = tq;
+		tt->tt_td = thread_alloc(name);
+		tt->tt_td->td_priority = pri;
+		if (mask != NULL)
+			for (cpu = 0; cpu <= mp_maxid; cpu++)
+				if (CPU_ISSET(cpu, mask)) {
+					tt->tt_td->td_oncpu = cpu;
+					break;
+				}
+		tt->tt_td->td_func = taskqueue_thread_loop;
+		tt->tt_td->td_arg = tt;
+		if (thread_create(tt->tt_td, 0) != 0)
+			break;
+	}
+	tq->tq_nthreads = i;
+	return (i == count ? 0 : EAGAIN);
+}
+
+int
+taskqueue_start_threads(struct taskqueue **tqp, int count, int pri,
+    const char *fmt, ...)
+{
+	va_list ap;
+	int error;
+
+	va_start(ap, fmt);
+	error = taskqueue_start_threads_va(tqp, count, pri, NULL, fmt, ap);
+	va_end(ap);
+	return (error);
+}
+
+/* A thread only ever has one virtual CPU: the first one in the mask. */
+int
+taskqueue_start_threads_cpuset(struct taskqueue **tqp, int count, int pri,
+    cpuset_t *mask, const char *fmt, ...)
+{
+	va_list ap;
+	int error;
+
+	va_start(ap, fmt);
+	error = taskqueue_start_threads_va(tqp, count, pri, mask, fmt, ap);
+	va_end(ap);
+	return (error);
+}
+
+void
+taskqueue_free(struct taskqueue *tq)
+{
+	int i;
+
+	pthread_mutex_lock(&tq->tq_mutex);
+	tq->tq_exit = 1;
+	pthread_cond_broadcast(&tq->tq_work);
+	pthread_mutex_unlock(&tq->tq_mutex);
+	for (i = 0; i < tq->tq_nthreads; i++)
+		pthread_join(tq->tq_threads[i].tt_td->td_pthread, NULL);
+	pthread_cond_destroy(&tq->tq_work);
+	pthread_cond_destroy(&tq->tq_done);
+	pthread_mutex_destroy(&tq->tq_mutex);
+	free(tq->tq_threads);
+	free(tq);
+}
+
+int
+taskqueue_enqueue(struct taskqueue *tq, struct task *task)
+{
+	struct task *ins, *prev;
+
+	pthread_mutex_lock(&tq->tq_mutex);
+	if (task->ta_pending) {
+		if (task->ta_pending < USHRT_MAX)
+			task->ta_pending++;
+		pthread_mutex_unlock(&tq->tq_mutex);
+		return (0);
+	}
+
+	/* Higher priority tasks go first, FIFO within a priority. */
+	prev = NULL;
+	STAILQ_FOREACH(ins, &tq->tq_queue, ta_link) {
+		if (ins->ta_priority < task->ta_priority)
+			break;
+		prev = ins;
+	}
+	if (prev == NULL)
+		STAILQ_INSERT_HEAD(&tq->tq_queue, task, ta_link);
+	else
+		STAILQ_INSERT_AFTER(&tq->tq_queue, prev, task, ta_link);
+
+	task->ta_pending = 1;
+	pthread_cond_signal(&tq->tq_work);
+	pthread_mutex_unlock(&tq->tq_mutex);
+	return (0);
+}
+
+static int
+taskqueue_running(struct taskqueue *tq, struct task *task)
+{
+	int i;
+
+	for (i = 0; i < tq->tq_nthreads; i++)
+		if (tq->tq_threads[i].tt_running == task)
+			return (1);
+	return (0);
+}
+
+void
+taskqueue_drain(struct taskqueue *tq, struct task *task)
+{
+	pthread_mutex_lock(&tq->tq_mutex);
+	while (task->ta_pending != 0 || taskqueue_running(tq, task))
+		pthread_cond_wait(&tq->tq_done, &tq->tq_mutex);
+	pthread_mutex_unlock(&tq->tq_mutex);
+}
+
+/*
+ * Callouts. One thread runs them all, in order of expiry.
+ */
+
+static TAILQ_HEAD(, callout) callout_list =
+    TAILQ_HEAD_INITIALIZER(callout_list);
+static pthread_mutex_t callout_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t callout_work;
+static pthread_cond_t callout_done;
+static struct callout *callout_running;
+static struct thread *callout_td;
+static pthread_once_t callout_once = PTHREAD_ONCE_INIT;
+
+static void
+callout_thread(void *arg)
+{
+	struct callout *c;
+	struct timespec ts;
+	void (*func)(void *);
+
+	pthread_mutex_lock(&callout_mtx);
+	for (;;) {
+		if ((c = TAILQ_FIRST(&callout_list)) == NULL) {
+			pthread_cond_wait(&callout_work, &callout_mtx);
+			continue;
+		}
+		if (c->c_time > sbinuptime()) {
+			sbintime2timespec(c->c_time, &ts);
+			pthread_cond_timedwait(&callout_work, &callout_mtx,
+			    &ts);
+			continue;
+		}
+		TAILQ_REMOVE(&callout_list, c, c_link);
+		c->c_flags &= ~CALLOUT_PENDING;
+		callout_running = c;
+		func = c->c_func;
+		arg = c->c_arg;
+		pthread_mutex_unlock(&callout_mtx);
+
+		func(arg);
+
+		pthread_mutex_lock(&callout_mtx);
+		callout_running = NULL;
+		pthread_cond_broadcast(&callout_done);
+	}
+}
+
+static void
+callout_start_once(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&callout_work, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&callout_done, NULL);
+
+	callout_td = thread_alloc("callout");
+	callout_td->td_func = callout_thread;
+	if (thread_create(callout_td, 1) != 0)
+		panic("can't start callout thread");
+}
+
+static void
+callout_start(void)
+{
+	pthread_once(&callout_once, callout_start_once);
+}
+
+void
+callout_init(struct callout *c, int mpsafe)
+{
+	memset(c, 0, sizeof(*c));
+	c->c_flags = mpsafe ? CALLOUT_MPSAFE : 0;
+	callout_start();
+}
+
+static int
+callout_unlink(struct callout *c)
+{
+	if ((c->c_flags & CALLOUT_PENDING) == 0)
+		return (0);
+	TAILQ_REMOVE(&callout_list, c, c_link);
+	c->c_flags &= ~CALLOUT_PENDING;
+	return (1);
+}
+
+int
+callout_reset(struct callout *c, int to_ticks, void (*func)(void *),
+    void *arg)
+{
+	struct callout *ins;
+	int cancelled;
+
+	pthread_mutex_lock(&callout_mtx);
+	cancelled = callout_unlink(c);
+	c->c_time = sbinuptime() + ticks2sbt(to_ticks);
+	c->c_func = func;
+	c->c_arg = arg;
+	c->c_flags |= CALLOUT_PENDING;
+	TAILQ_FOREACH(ins, &callout_list, c_link)
+		if (ins->c_time > c->c_time)
+			break;
+	if (ins == NULL)
+		TAILQ_INSERT_TAIL(&callout_list, c, c_link);
+	else
+		TAILQ_INSERT_BEFORE(ins, c, c_link);
+	pthread_cond_signal(&callout_work);
+	pthread_mutex_unlock(&callout_mtx);
+	return (cancelled);
+}
+
+int
+callout_stop(struct callout *c)
+{
+	int cancelled;
+
+	pthread_mutex_lock(&callout_mtx);
+	cancelled = callout_unlink(c);
+	pthread_mutex_unlock(&callout_mtx);
+	return (cancelled);
+}
+
+int
+callout_drain(struct callout *c)
+{
+	int cancelled;
+
+	pthread_mutex_lock(&callout_mtx);
+	cancelled = callout_unlink(c);
+	while (callout_running == c && curthread != callout_td)
+		pthread_cond_wait(&callout_done, &callout_mtx);
+	pthread_mutex_unlock(&callout_mtx);
+	return (cancelled);
+}
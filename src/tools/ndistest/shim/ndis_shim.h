@@ -0,0 +1,571 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _NDIS_SHIM_H_
+#define	_NDIS_SHIM_H_
+
+/*
+ * Just enough of the FreeBSD kernel API to build subr_ntoskrnl.c and
+ * subr_hal.c as ordinary userland objects. Mutexes, condition
+ * variables, kernel threads, taskqueues and callouts are backed by
+ * pthreads; anything that needs real hardware (bus space I/O ports,
+ * the device tree, interrupts) is stubbed out.
+ *
+ * Every thread the shim knows about is given a virtual CPU number,
+ * which is what curcpu and PCPU_GET(cpuid) report. Threads created
+ * through kproc_kthread_add() and taskqueue_start_threads() are
+ * spread round-robin across the virtual CPUs, and sched_bind(),
+ * cpuset_setthread() and taskqueue_start_threads_cpuset() put a
+ * thread on a given one. The HAL dispatch
+ * locks are per CPU, so a thread must stay on the same CPU between
+ * KfRaiseIrql() and KfLowerIrql(), which a virtual CPU guarantees
+ * and a real one would not.
+ */
+
+#include "ndis_compat.h"
+
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * subr_ntoskrnl.c exports its own versions of these to Windows
+ * drivers; keep them from clashing with the libc prototypes.
+ */
+#define	atoi		ntoskrnl_atoi
+#define	atol		ntoskrnl_atol
+#define	rand		ntoskrnl_rand
+#define	srand		ntoskrnl_srand
+
+#ifndef TRUE
+#define	TRUE		1
+#endif
+#ifndef FALSE
+#define	FALSE		0
+#endif
+
+#ifndef PAGE_SIZE
+#define	PAGE_SIZE	4096
+#endif
+#define	PAGE_MASK	(PAGE_SIZE - 1)
+#ifndef CACHE_LINE_SIZE
+#define	CACHE_LINE_SIZE	64
+#endif
+#ifndef PAGE_SHIFT
+#define	PAGE_SHIFT	12
+#endif
+#define	round_page(x)	roundup2((vm_offset_t)(x), PAGE_SIZE)
+#define	trunc_page(x)	((vm_offset_t)(x) & ~(vm_offset_t)PAGE_MASK)
+#define	MAXCPU		64
+#define	NOCPU		(-1)
+
+struct mbuf;
+
+static __inline int imax(int a, int b) { return (a > b ? a : b); }
+static __inline int imin(int a, int b) { return (a < b ? a : b); }
+static __inline u_int max(u_int a, u_int b) { return (a > b ? a : b); }
+static __inline u_int min(u_int a, u_int b) { return (a < b ? a : b); }
+static __inline u_long ulmax(u_long a, u_long b) { return (a > b ? a : b); }
+static __inline u_long ulmin(u_long a, u_long b) { return (a < b ? a : b); }
+
+#define	CTASSERT(x)	_Static_assert(x, "compile-time assertion failed")
+
+void	ndis_shim_panic(const char *, ...) __attribute__((__noreturn__,
+	    __format__(__printf__, 1, 2)));
+#define	panic		ndis_shim_panic
+#define	KASSERT(exp, msg) do {						\
+	if (!(exp))							\
+		panic msg;						\
+} while (0)
+
+extern int	bootverbose;
+
+/* Clocks: hz and ticks are derived from CLOCK_MONOTONIC. */
+extern int	hz;
+extern int	tick;
+#define	ticks		ndis_shim_ticks()
+#define	SBT_1S		((sbintime_t)1 << 32)
+#define	SBT_1MS		(SBT_1S / 1000)
+#define	SBT_1US		(SBT_1S / 1000000)
+#define	SBT_1NS		(SBT_1S / 1000000000)
+
+struct bintime {
+	time_t		sec;
+	uint64_t	frac;
+};
+
+int		ndis_shim_ticks(void);
+void		binuptime(struct bintime *);
+void		bintime(struct bintime *);
+sbintime_t	sbinuptime(void);
+void		nanotime(struct timespec *);
+void		nanouptime(struct timespec *);
+void		microtime(struct timeval *);
+void		getmicrouptime(struct timeval *);
+int		tvtohz(struct timeval *);
+int		ndis_shim_pause(const char *, int);
+#define	pause		ndis_shim_pause
+void		DELAY(int);
+
+static __inline void
+bintime_sub(struct bintime *bt, const struct bintime *bt2)
+{
+	uint64_t u;
+
+	u = bt->frac;
+	bt->frac -= bt2->frac;
+	if (u < bt->frac)
+		bt->sec--;
+	bt->sec -= bt2->sec;
+}
+
+static __inline void
+bintime2timespec(const struct bintime *bt, struct timespec *ts)
+{
+	ts->tv_sec = bt->sec;
+	ts->tv_nsec =
+	    ((uint64_t)1000000000 * (uint32_t)(bt->frac >> 32)) >> 32;
+}
+
+/* malloc(9), with per-type accounting. */
+struct malloc_type {
+	const char		*ks_shortdesc;
+	volatile uint64_t	ks_calls;
+	volatile int64_t	ks_inuse;
+};
+
+#define	M_NOWAIT	0x0001
+#define	M_WAITOK	0x0002
+#define	M_ZERO		0x0100
+
+#define	MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	struct malloc_type type[1] = { { shortdesc, 0, 0 } }
+#define	MALLOC_DECLARE(type)						\
+	extern struct malloc_type type[1]
+
+MALLOC_DECLARE(M_TEMP);
+MALLOC_DECLARE(M_DEVBUF);
+
+void	*ndis_shim_malloc(size_t, struct malloc_type *, int);
+void	ndis_shim_free(void *, struct malloc_type *);
+uint64_t ndis_shim_malloc_calls(void);
+void	malloc_type_allocated(struct malloc_type *, unsigned long);
+void	malloc_type_freed(struct malloc_type *, unsigned long);
+
+#define	malloc(size, type, flags)	ndis_shim_malloc(size, type, flags)
+#define	free(addr, type)		ndis_shim_free(addr, type)
+
+/* UMA zones are plain malloc(9) with a fixed size. */
+typedef struct uma_zone	*uma_zone_t;
+typedef int	(*uma_ctor)(void *, int, void *, int);
+typedef void	(*uma_dtor)(void *, int, void *);
+typedef int	(*uma_init)(void *, int, int);
+typedef void	(*uma_fini)(void *, int);
+
+#define	UMA_ALIGN_PTR	(sizeof(void *) - 1)
+
+uma_zone_t uma_zcreate(const char *, size_t, uma_ctor, uma_dtor, uma_init,
+	    uma_fini, int, uint32_t);
+void	uma_zdestroy(uma_zone_t);
+void	*uma_zalloc(uma_zone_t, int);
+void	uma_zfree(uma_zone_t, void *);
+
+/* Threads and processes. */
+struct proc {
+	const char		*p_comm;
+};
+
+struct thread {
+	struct proc		*td_proc;
+	lwpid_t			td_tid;
+	int			td_oncpu;
+	u_char			td_priority;
+	pthread_t		td_pthread;
+	void			(*td_func)(void *);
+	void			*td_arg;
+	char			td_name[32];
+};
+
+#define	PRI_MIN_KERN		80
+#define	PRI_MAX_KERN		119
+#define	PRI_UNCHANGED		256
+#define	PWAIT			(PRI_MIN_KERN + 28)
+#define	RFHIGHPID		(1<<18)
+
+struct thread	*ndis_shim_curthread(void);
+#define	curthread	ndis_shim_curthread()
+#define	curcpu		(curthread->td_oncpu)
+#define	PCPU_GET(x)	PCPU_GET_##x()
+#define	PCPU_GET_cpuid()	curcpu
+
+extern u_int	mp_maxid;
+extern int	mp_ncpus;
+
+#define	CPU_ABSENT(cpu)		((u_int)(cpu) > mp_maxid)
+#define	CPU_FOREACH(i)							\
+	for ((i) = 0; (i) <= mp_maxid; (i)++)				\
+		if (!CPU_ABSENT((i)))
+
+typedef struct {
+	uint64_t	__bits[1];
+} cpuset_t;
+CTASSERT(MAXCPU <= 64);
+
+#undef CPU_ZERO
+#undef CPU_SET
+#undef CPU_ISSET
+#define	CPU_ZERO(p)		((p)->__bits[0] = 0)
+#define	CPU_SET(n, p)		((p)->__bits[0] |= (uint64_t)1 << (n))
+#define	CPU_ISSET(n, p)		(((p)->__bits[0] & ((uint64_t)1 << (n))) != 0)
+#define	CPU_SETOF(n, p)		((p)->__bits[0] = (uint64_t)1 << (n))
+
+int	cpuset_setthread(lwpid_t, cpuset_t *);
+
+int	kproc_kthread_add(void (*)(void *), void *, struct proc **,
+	    struct thread **, int, int, const char *, const char *, ...)
+	    __attribute__((__format__(__printf__, 8, 9)));
+void	kthread_exit(void) __attribute__((__noreturn__));
+
+#define	thread_lock(td)		do { (void)(td); } while (0)
+#define	thread_unlock(td)	do { (void)(td); } while (0)
+#define	critical_enter()	do { } while (0)
+#define	critical_exit()		do { } while (0)
+#define	sched_pin()		do { } while (0)
+#define	sched_unpin()		do { } while (0)
+#define	cpu_spinwait()		__builtin_ia32_pause()
+#define	kern_yield(pri)		sched_yield()
+
+/*
+ * There is no way to tell whether another pthread is on a CPU right
+ * now, so spinning waiters always yield rather than burn their
+ * quantum behind a preempted owner.
+ */
+#define	TD_IS_RUNNING(td)	0
+
+void	sched_prio(struct thread *, u_char);
+void	sched_bind(struct thread *, int);
+void	sched_unbind(struct thread *);
+int	quiesce_all_cpus(const char *, int);
+
+int	tsleep(void *, int, const char *, int);
+void	wakeup(void *);
+
+#define	KDB_WHY_NDIS	"ndis"
+#define	kdb_enter(why, msg)	panic("%s: %s", (why), (msg))
+
+/* Mutexes and condition variables. */
+struct mtx {
+	pthread_mutex_t		mtx_lock;
+	struct thread		*mtx_owner;
+	int			mtx_recurse;
+	int			mtx_flags;
+	const char		*mtx_name;
+};
+
+#define	MTX_DEF		0x0000
+#define	MTX_SPIN	0x0001
+#define	MTX_RECURSE	0x0004
+
+#define	MA_OWNED	0x01
+#define	MA_NOTOWNED	0x02
+
+void	mtx_init(struct mtx *, const char *, const char *, int);
+void	mtx_destroy(struct mtx *);
+void	mtx_lock(struct mtx *);
+void	mtx_unlock(struct mtx *);
+#define	mtx_lock_spin(m)	mtx_lock(m)
+#define	mtx_unlock_spin(m)	mtx_unlock(m)
+#define	mtx_owned(m)		((m)->mtx_owner == curthread)
+#define	mtx_assert(m, what)	do { } while (0)
+
+struct cv {
+	pthread_cond_t		cv_cond;
+	const char		*cv_description;
+};
+
+void	cv_init(struct cv *, const char *);
+void	cv_destroy(struct cv *);
+void	cv_wait(struct cv *, struct mtx *);
+int	cv_timedwait(struct cv *, struct mtx *, int);
+void	cv_signal(struct cv *);
+void	cv_broadcastpri(struct cv *, int);
+#define	cv_broadcast(cv)	cv_broadcastpri(cv, 0)
+
+/* Atomics, mapped onto the GCC builtins. */
+#define	atomic_cmpset_int(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_acq_int(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_rel_int(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_long(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_acq_long(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_rel_long(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_ptr(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_acq_ptr(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_rel_ptr(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_32(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_cmpset_64(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define	atomic_fetchadd_int(p, v)	__sync_fetch_and_add(p, v)
+#define	atomic_fetchadd_long(p, v)	__sync_fetch_and_add(p, v)
+#define	atomic_fetchadd_32(p, v)	__sync_fetch_and_add(p, v)
+#define	atomic_fetchadd_64(p, v)	__sync_fetch_and_add(p, v)
+#define	atomic_add_int(p, v)		((void)__sync_fetch_and_add(p, v))
+#define	atomic_add_long(p, v)		((void)__sync_fetch_and_add(p, v))
+#define	atomic_add_32(p, v)		((void)__sync_fetch_and_add(p, v))
+#define	atomic_add_64(p, v)		((void)__sync_fetch_and_add(p, v))
+#define	atomic_subtract_int(p, v)	((void)__sync_fetch_and_sub(p, v))
+#define	atomic_subtract_long(p, v)	((void)__sync_fetch_and_sub(p, v))
+#define	atomic_subtract_64(p, v)	((void)__sync_fetch_and_sub(p, v))
+#define	atomic_subtract_rel_int(p, v)	((void)__sync_fetch_and_sub(p, v))
+#define	atomic_readandclear_int(p)	\
+	__atomic_exchange_n(p, 0, __ATOMIC_SEQ_CST)
+#define	atomic_readandclear_long(p)	\
+	__atomic_exchange_n(p, 0, __ATOMIC_SEQ_CST)
+#define	atomic_readandclear_ptr(p)	\
+	__atomic_exchange_n(p, 0, __ATOMIC_SEQ_CST)
+#define	atomic_load_acq_int(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define	atomic_load_acq_long(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define	atomic_load_acq_ptr(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define	atomic_load_acq_64(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define	atomic_store_rel_int(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define	atomic_store_rel_long(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define	atomic_store_rel_ptr(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define	atomic_store_rel_64(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* Taskqueues. */
+typedef void task_fn_t(void *, int);
+
+struct task {
+	STAILQ_ENTRY(task)	ta_link;
+	uint16_t		ta_pending;
+	uint16_t		ta_priority;
+	task_fn_t		*ta_func;
+	void			*ta_context;
+};
+
+#define	TASK_INIT(task, priority, func, context) do {			\
+	(task)->ta_pending = 0;						\
+	(task)->ta_priority = (priority);				\
+	(task)->ta_func = (func);					\
+	(task)->ta_context = (context);					\
+} while (0)
+
+struct taskqueue;
+typedef void (*taskqueue_enqueue_fn)(void *);
+
+struct taskqueue *taskqueue_create(const char *, int, taskqueue_enqueue_fn,
+	    void *);
+void	taskqueue_free(struct taskqueue *);
+int	taskqueue_start_threads(struct taskqueue **, int, int,
+	    const char *, ...) __attribute__((__format__(__printf__, 4, 5)));
+int	taskqueue_start_threads_cpuset(struct taskqueue **, int, int,
+	    cpuset_t *, const char *, ...)
+	    __attribute__((__format__(__printf__, 5, 6)));
+int	taskqueue_enqueue(struct taskqueue *, struct task *);
+void	taskqueue_drain(struct taskqueue *, struct task *);
+void	taskqueue_thread_enqueue(void *);
+
+/* Callouts, run from a single timer thread. */
+struct callout {
+	TAILQ_ENTRY(callout)	c_link;
+	sbintime_t		c_time;
+	void			(*c_func)(void *);
+	void			*c_arg;
+	int			c_flags;
+};
+
+#define	CALLOUT_PENDING		0x0004
+#define	CALLOUT_MPSAFE		0x0008
+
+void	callout_init(struct callout *, int);
+int	callout_reset(struct callout *, int, void (*)(void *), void *);
+int	callout_stop(struct callout *);
+int	callout_drain(struct callout *);
+#define	callout_pending(c)	((c)->c_flags & CALLOUT_PENDING)
+
+/* sysctl(9) and tunables compile away. */
+struct sysctl_ctx_list;
+struct sysctl_oid;
+struct sysctl_oid_list;
+struct sysctl_req;
+
+#define	OID_AUTO		(-1)
+#define	CTLTYPE_NODE		1
+#define	CTLTYPE_INT		2
+#define	CTLTYPE_STRING		3
+#define	CTLTYPE_U64		9
+#define	CTLFLAG_RD		0x80000000
+#define	CTLFLAG_WR		0x40000000
+#define	CTLFLAG_RW		(CTLFLAG_RD|CTLFLAG_WR)
+#define	CTLFLAG_RDTUN		CTLFLAG_RD
+#define	CTLFLAG_RWTUN		CTLFLAG_RW
+
+#define	SYSCTL_HANDLER_ARGS	struct sysctl_oid *oidp, void *arg1,	\
+	intmax_t arg2, struct sysctl_req *req
+
+static __inline struct sysctl_oid *
+ndis_shim_sysctl_add(struct sysctl_ctx_list *ctx, ...)
+{
+	return (NULL);
+}
+
+#define	SYSCTL_DECL(name)		struct __hack
+#define	SYSCTL_NODE(...)		struct __hack
+#define	SYSCTL_INT(...)			struct __hack
+#define	SYSCTL_UINT(...)		struct __hack
+#define	TUNABLE_INT(...)		struct __hack
+#define	SYSCTL_PROC(parent, nbr, name, kind, a1, a2, handler, fmt, descr) \
+	static int (*const sysctl_##parent##_##name)(SYSCTL_HANDLER_ARGS) \
+	    __unused = (handler)
+#define	SYSCTL_CHILDREN(oid)	((struct sysctl_oid_list *)(void *)(oid))
+#define	SYSCTL_ADD_NODE(...)		ndis_shim_sysctl_add(__VA_ARGS__)
+#define	SYSCTL_ADD_INT(...)		ndis_shim_sysctl_add(__VA_ARGS__)
+#define	SYSCTL_ADD_UINT(...)		ndis_shim_sysctl_add(__VA_ARGS__)
+#define	SYSCTL_ADD_UQUAD(...)		ndis_shim_sysctl_add(__VA_ARGS__)
+#define	SYSCTL_ADD_PROC(...)		ndis_shim_sysctl_add(__VA_ARGS__)
+#define	SYSCTL_ADD_STRING(...)		ndis_shim_sysctl_add(__VA_ARGS__)
+#define	SYSCTL_OUT(req, p, l)		0
+
+int	sysctl_handle_string(struct sysctl_oid *, void *, size_t,
+	    struct sysctl_req *);
+
+/*
+ * Bus space: memory-mapped registers are just memory, which is
+ * enough for READ_REGISTER_*() and WRITE_REGISTER_*(). There are
+ * no I/O ports out here.
+ */
+#define	X86_BUS_SPACE_IO	0
+#define	X86_BUS_SPACE_MEM	1
+
+void	ndis_shim_noport(void) __attribute__((__noreturn__));
+
+#define	NDIS_SHIM_BUS_RW(w, type)					\
+static __inline type							\
+bus_space_read_##w(bus_space_tag_t t, bus_space_handle_t h,		\
+    bus_size_t o)							\
+{									\
+	if (t != X86_BUS_SPACE_MEM)					\
+		ndis_shim_noport();					\
+	return (*(volatile type *)(uintptr_t)(h + o));			\
+}									\
+static __inline void							\
+bus_space_write_##w(bus_space_tag_t t, bus_space_handle_t h,		\
+    bus_size_t o, type v)						\
+{									\
+	if (t != X86_BUS_SPACE_MEM)					\
+		ndis_shim_noport();					\
+	*(volatile type *)(uintptr_t)(h + o) = v;			\
+}									\
+static __inline void							\
+bus_space_read_multi_##w(bus_space_tag_t t, bus_space_handle_t h,	\
+    bus_size_t o, type *a, bus_size_t c)				\
+{									\
+	while (c-- > 0)							\
+		*a++ = bus_space_read_##w(t, h, o);			\
+}									\
+static __inline void							\
+bus_space_write_multi_##w(bus_space_tag_t t, bus_space_handle_t h,	\
+    bus_size_t o, const type *a, bus_size_t c)				\
+{									\
+	while (c-- > 0)							\
+		bus_space_write_##w(t, h, o, *a++);			\
+}
+
+NDIS_SHIM_BUS_RW(1, uint8_t)
+NDIS_SHIM_BUS_RW(2, uint16_t)
+NDIS_SHIM_BUS_RW(4, uint32_t)
+
+/* There is no device tree: nothing is ever found in it. */
+typedef struct device	*device_t;
+typedef struct devclass	*devclass_t;
+struct resource;
+
+struct resource_list_entry {
+	STAILQ_ENTRY(resource_list_entry) link;
+	int			type;
+	int			rid;
+	struct resource		*res;
+};
+STAILQ_HEAD(resource_list, resource_list_entry);
+
+#define	SYS_RES_IRQ		1
+#define	SYS_RES_MEMORY		3
+#define	SYS_RES_IOPORT		4
+#define	RF_ACTIVE		0x0002
+
+static __inline devclass_t
+devclass_find(const char *name)
+{
+	return (NULL);
+}
+
+static __inline int
+devclass_get_devices(devclass_t dc, device_t **devlistp, int *devcountp)
+{
+	*devlistp = NULL;
+	*devcountp = 0;
+	return (0);
+}
+
+static __inline int
+device_get_children(device_t dev, device_t **devlistp, int *devcountp)
+{
+	*devlistp = NULL;
+	*devcountp = 0;
+	return (0);
+}
+
+#define	device_is_alive(dev)		FALSE
+#define	device_get_parent(dev)		((device_t)NULL)
+#define	BUS_GET_RESOURCE_LIST(bus, dev)	((struct resource_list *)NULL)
+#define	bus_activate_resource(d, t, r, res)	ENXIO
+#define	rman_get_flags(r)		0
+#define	rman_get_start(r)		((rman_res_t)0)
+#define	rman_get_end(r)			((rman_res_t)0)
+#define	rman_get_virtual(r)		((void *)NULL)
+
+/* VM: every address is its own physical address. */
+#define	VM_MEMATTR_DEFAULT		0
+#define	VM_MEMATTR_UNCACHEABLE		1
+#define	VM_MEMATTR_WRITE_COMBINING	2
+
+struct pmap;
+struct vm_map {
+	struct pmap		*pmap;
+};
+extern struct vm_map	*kernel_map;
+extern void		*kernel_arena;
+
+#define	pmap_extract(pmap, va)		((vm_paddr_t)(va))
+#define	pmap_kextract(va)		((vm_paddr_t)(va))
+#define	vtophys(va)			((vm_paddr_t)(uintptr_t)(va))
+
+vm_offset_t kmem_alloc_contig(void *, vm_size_t, int, vm_paddr_t,
+	    vm_paddr_t, u_long, vm_paddr_t, vm_memattr_t);
+void	kmem_free(void *, vm_offset_t, vm_size_t);
+
+#endif /* _NDIS_SHIM_H_ */
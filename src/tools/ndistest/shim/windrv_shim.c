@@ -0,0 +1,155 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The pieces of kern_windrv.c and kern_ndis.c that subr_ntoskrnl.c
+ * and subr_hal.c call into. Wrappers are built from the same
+ * x86_64_wrap template in winx_wrap.S as in the kernel, so calls
+ * from ms_abi code into the runtime go through the real thing; they
+ * just live in their own executable page, since malloc()ed memory
+ * can't be executed out here.
+ */
+
+#include "ndis_shim.h"
+
+#include <sys/mman.h>
+
+#include "pe_var.h"
+#include "resource_var.h"
+#include "ntoskrnl_var.h"
+#include "ndis_var.h"
+
+#ifndef __amd64__
+#error "the userland runtime is only supported on amd64"
+#endif
+
+extern void	x86_64_wrap(void);
+extern void	x86_64_wrap_call(void);
+extern void	x86_64_wrap_end(void);
+
+int ndis_debug = 0;
+
+void
+windrv_wrap(funcptr func, funcptr *wrap, uint8_t argcnt,
+    enum windrv_wrap_type type)
+{
+	vm_offset_t *calladdr, wrapstart, wrapend, wrapcall;
+	void *p;
+
+	wrapstart = (vm_offset_t)&x86_64_wrap;
+	wrapend = (vm_offset_t)&x86_64_wrap_end;
+	wrapcall = (vm_offset_t)&x86_64_wrap_call;
+
+	KASSERT(wrapend - wrapstart <= PAGE_SIZE, ("wrapper too big"));
+	p = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		panic("failed to allocate new wrapper instance");
+
+	bcopy((char *)wrapstart, p, wrapend - wrapstart);
+	calladdr = (vm_offset_t *)((char *)p + (wrapcall - wrapstart) + 2);
+	*calladdr = (vm_offset_t)func;
+
+	if (mprotect(p, PAGE_SIZE, PROT_READ | PROT_EXEC) != 0)
+		panic("failed to make wrapper executable");
+	*wrap = (funcptr)p;
+}
+
+void
+windrv_unwrap(funcptr func)
+{
+	if (func != NULL)
+		munmap((void *)func, PAGE_SIZE);
+}
+
+void
+windrv_wrap_table(struct image_patch_table *table)
+{
+	struct image_patch_table *p;
+
+	for (p = table; p->func != NULL; p++)
+		windrv_wrap(p->func, &p->wrap, p->argcnt, p->ftype);
+}
+
+void
+windrv_unwrap_table(struct image_patch_table *table)
+{
+	struct image_patch_table *p;
+
+	for (p = table; p->func != NULL; p++)
+		windrv_unwrap(p->wrap);
+}
+
+/*
+ * No FPU state to save in userland, so these go straight to the
+ * assembly stubs.
+ */
+uint64_t
+_x86_64_call1(void *fn, uint64_t a)
+{
+	return (x86_64_call1(fn, a));
+}
+
+uint64_t
+_x86_64_call2(void *fn, uint64_t a, uint64_t b)
+{
+	return (x86_64_call2(fn, a, b));
+}
+
+uint64_t
+_x86_64_call3(void *fn, uint64_t a, uint64_t b, uint64_t c)
+{
+	return (x86_64_call3(fn, a, b, c));
+}
+
+uint64_t
+_x86_64_call4(void *fn, uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+	return (x86_64_call4(fn, a, b, c, d));
+}
+
+uint64_t
+_x86_64_call5(void *fn, uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+    uint64_t e)
+{
+	return (x86_64_call5(fn, a, b, c, d, e));
+}
+
+uint64_t
+_x86_64_call6(void *fn, uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+    uint64_t e, uint64_t f)
+{
+	return (x86_64_call6(fn, a, b, c, d, e, f));
+}
+
+void *
+ndis_get_routine_address(struct image_patch_table *functbl, char *name)
+{
+	struct image_patch_table *p;
+
+	p = pe_functbl_lookup(functbl, name);
+	return (p != NULL ? p->wrap : NULL);
+}
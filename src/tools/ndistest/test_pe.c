@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The PE loader, run against small images put together in memory.
+ * Sections are laid out in the file at their virtual addresses, so
+ * an RVA is also the file offset.
+ */
+
+#include "ndistest.h"
+
+#define	PE_ALIGN	0x1000
+#define	PE_LFANEW	0x80
+#define	PE_IMAGEBASE	0x140000000UL
+#define	PE_NSECT	4
+
+/* Where the relocated pointers live in .data. */
+#define	PE_RELOC0	0x000
+#define	PE_RELOC1	0x008
+
+struct pe_module {
+	const char	*pm_name;
+	const char	**pm_imports;	/* NULL for an ordinal */
+	int		pm_nimports;
+};
+
+struct pe_img {
+	uint8_t		*pi_buf;
+	size_t		pi_size;
+	uint32_t	pi_data;	/* RVA of .data */
+	uint32_t	pi_iat[2];	/* RVA of each module's IAT */
+};
+
+static void
+pe_section(struct image_section_header *sh, const char *name, uint32_t rva,
+    uint32_t size, uint32_t flags)
+{
+	strncpy((char *)sh->name, name, sizeof(sh->name));
+	sh->misc.virtual_size = size;
+	sh->virtual_address = rva;
+	sh->size_of_raw_data = size;
+	sh->pointer_to_raw_data = rva;
+	sh->characteristics = flags;
+}
+
+/*
+ * Build an image importing from up to two modules, with a couple of
+ * DIR64 relocations in .data.
+ */
+static void
+pe_build(struct pe_img *pi, struct pe_module *mods, int nmods)
+{
+	struct image_dos_header *dos;
+	struct image_nt_header *nt;
+	struct image_section_header *sh;
+	struct image_import_descriptor *imp;
+	struct image_base_relocation *rel;
+	uint64_t *ilt, *iat;
+	uint32_t rdata, rsize, data, reloc, off;
+	int i, m;
+
+	/* Descriptors, then module names, then ILT/IAT, then names. */
+	rsize = (nmods + 1) * sizeof(*imp);
+	for (m = 0; m < nmods; m++) {
+		rsize += 32 + 2 * (mods[m].pm_nimports + 1) * sizeof(*ilt);
+		for (i = 0; i < mods[m].pm_nimports; i++)
+			if (mods[m].pm_imports[i] != NULL)
+				rsize += roundup2(
+				    strlen(mods[m].pm_imports[i]) + 3, 2);
+	}
+	rdata = 2 * PE_ALIGN;
+	data = rdata + roundup2(rsize, PE_ALIGN);
+	reloc = data + PE_ALIGN;
+	pi->pi_size = reloc + PE_ALIGN;
+	pi->pi_data = data;
+	pi->pi_buf = aligned_alloc(PE_ALIGN, pi->pi_size);
+	if (pi->pi_buf == NULL)
+		panic("out of memory");
+	memset(pi->pi_buf, 0, pi->pi_size);
+
+	dos = (struct image_dos_header *)pi->pi_buf;
+	dos->e_magic = IMAGE_DOS_SIGNATURE;
+	dos->e_lfanew = PE_LFANEW;
+
+	nt = (struct image_nt_header *)(pi->pi_buf + PE_LFANEW);
+	nt->signature = IMAGE_NT_SIGNATURE;
+	nt->file_header.machine = IMAGE_FILE_MACHINE_AMD64;
+	nt->file_header.number_of_sections = PE_NSECT;
+	nt->file_header.size_of_optional_header =
+	    sizeof(struct image_optional_header);
+	nt->file_header.characteristics = IMAGE_FILE_EXECUTABLE_IMAGE;
+	nt->optional_header.magic = IMAGE_OPTIONAL_MAGIC_64;
+	nt->optional_header.image_base = PE_IMAGEBASE;
+	nt->optional_header.section_aligment = PE_ALIGN;
+	nt->optional_header.file_aligment = PE_ALIGN;
+	nt->optional_header.size_of_image = pi->pi_size;
+	nt->optional_header.size_of_headers = PE_ALIGN;
+	nt->optional_header.number_of_rva_and_sizes =
+	    IMAGE_DIRECTORY_ENTRIES_MAX;
+	nt->optional_header.data_directory[IMAGE_DIRECTORY_ENTRY_IMPORT].
+	    virtual_address = rdata;
+	nt->optional_header.data_directory[IMAGE_DIRECTORY_ENTRY_IMPORT].
+	    size = (nmods + 1) * sizeof(*imp);
+	nt->optional_header.data_directory[IMAGE_DIRECTORY_ENTRY_BASERELOC].
+	    virtual_address = reloc;
+
+	pe_get_section_header((vm_offset_t)pi->pi_buf, &sh);
+	pe_section(&sh[0], ".text", PE_ALIGN, PE_ALIGN,
+	    IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE);
+	pe_section(&sh[1], ".rdata", rdata, rsize,
+	    IMAGE_SCN_CNT_INITIALIZED_DATA);
+	pe_section(&sh[2], ".data", data, 2 * sizeof(uint64_t),
+	    IMAGE_SCN_CNT_INITIALIZED_DATA);
+	pe_section(&sh[3], ".reloc", reloc, PE_ALIGN,
+	    IMAGE_SCN_CNT_INITIALIZED_DATA);
+
+	imp = (struct image_import_descriptor *)(pi->pi_buf + rdata);
+	off = rdata + (nmods + 1) * sizeof(*imp);
+	for (m = 0; m < nmods; m++) {
+		imp[m].name = off;
+		strcpy((char *)pi->pi_buf + off, mods[m].pm_name);
+		off += 32;
+		imp[m].u.original_first_thunk = off;
+		ilt = (uint64_t *)(pi->pi_buf + off);
+		off += (mods[m].pm_nimports + 1) * sizeof(*ilt);
+		imp[m].first_thunk = off;
+		pi->pi_iat[m] = off;
+		iat = (uint64_t *)(pi->pi_buf + off);
+		off += (mods[m].pm_nimports + 1) * sizeof(*iat);
+		for (i = 0; i < mods[m].pm_nimports; i++) {
+			if (mods[m].pm_imports[i] == NULL) {
+				ilt[i] = iat[i] = IMAGE_ORDINAL_FLAG | (i + 1);
+				continue;
+			}
+			ilt[i] = iat[i] = off;
+			/* Skip the hint. */
+			strcpy((char *)pi->pi_buf + off + 2,
+			    mods[m].pm_imports[i]);
+			off += roundup2(strlen(mods[m].pm_imports[i]) + 3, 2);
+		}
+	}
+
+	/* Two pointers into the image as linked, to be relocated. */
+	*(uint64_t *)(pi->pi_buf + data + PE_RELOC0) = PE_IMAGEBASE + PE_ALIGN;
+	*(uint64_t *)(pi->pi_buf + data + PE_RELOC1) = PE_IMAGEBASE + data +
+	    PE_RELOC1;
+	rel = (struct image_base_relocation *)(pi->pi_buf + reloc);
+	rel->virtual_address = data;
+	rel->size_of_block = 2 * sizeof(uint32_t) + 2 * sizeof(uint16_t);
+	rel->type_offset[0] = IMAGE_REL_BASED_DIR64 << 12 | PE_RELOC0;
+	rel->type_offset[1] = IMAGE_REL_BASED_DIR64 << 12 | PE_RELOC1;
+	/* An all-zero block ends the list. */
+}
+
+static void
+pe_free(struct pe_img *pi)
+{
+	(free)(pi->pi_buf);
+}
+
+static uint64_t *
+pe_iat(struct pe_img *pi, int m)
+{
+	return ((uint64_t *)(pi->pi_buf + pi->pi_iat[m]));
+}
+
+/* What pe_patch_imports() hands out for routines we don't have. */
+static void *
+pe_dummy(struct image_patch_table *functbl)
+{
+	struct image_patch_table *p;
+
+	for (p = functbl; p->name != NULL; p++)
+		;
+	return (p->wrap);
+}
+
+static const char *pe_nt_imports[] = {
+	"KeSetEvent", "RtlZeroMemory", "NoSuchRoutine", NULL,
+	"KeInitializeDpc"
+};
+static const char *pe_hal_imports[] = { "KfAcquireSpinLock" };
+
+static struct pe_module pe_modules[] = {
+	{ "ntoskrnl.exe", pe_nt_imports, nitems(pe_nt_imports) },
+	{ "HAL.dll", pe_hal_imports, nitems(pe_hal_imports) },
+};
+
+static void
+pe_header(void)
+{
+	struct pe_img pi;
+	vm_offset_t base;
+	struct image_nt_header *nt;
+
+	pe_build(&pi, pe_modules, nitems(pe_modules));
+	base = (vm_offset_t)pi.pi_buf;
+	nt = (struct image_nt_header *)(pi.pi_buf + PE_LFANEW);
+
+	NT_CHECK(pe_validate_header(base) == 0);
+	NT_CHECK(pe_numsections(base) == PE_NSECT);
+
+	nt->file_header.machine = IMAGE_FILE_MACHINE_I386;
+	NT_CHECK(pe_validate_header(base) == ENOEXEC);
+	nt->file_header.machine = IMAGE_FILE_MACHINE_AMD64;
+
+	nt->file_header.characteristics |= IMAGE_FILE_RELOCS_STRIPPED;
+	NT_CHECK(pe_validate_header(base) == ENOEXEC);
+	nt->file_header.characteristics &= ~IMAGE_FILE_RELOCS_STRIPPED;
+
+	nt->signature = 0;
+	NT_CHECK(pe_validate_header(base) == EINVAL);
+
+	pe_free(&pi);
+}
+
+static void
+pe_translate(void)
+{
+	struct pe_img pi;
+	struct pe_image img;
+	vm_offset_t base;
+
+	pe_build(&pi, pe_modules, nitems(pe_modules));
+	base = (vm_offset_t)pi.pi_buf;
+	pe_image_init(&img, base);
+
+	NT_CHECK(pe_image_translate(&img, PE_ALIGN) == base + PE_ALIGN);
+	NT_CHECK(pe_image_translate(&img, pi.pi_data + 8) ==
+	    base + pi.pi_data + 8);
+	NT_CHECK(pe_translate_addr(base, pi.pi_iat[0]) ==
+	    base + pi.pi_iat[0]);
+	/* Short sections are rounded up to the section alignment. */
+	NT_CHECK(pe_image_translate(&img, pi.pi_data + PE_ALIGN - 1) ==
+	    base + pi.pi_data + PE_ALIGN - 1);
+	/* Headers and past the end belong to no section. */
+	NT_CHECK(pe_image_translate(&img, 0x10) == 0);
+	NT_CHECK(pe_image_translate(&img, pi.pi_size) == 0);
+
+	pe_free(&pi);
+}
+
+static void
+pe_reloc(void)
+{
+	struct pe_img pi;
+	vm_offset_t base;
+	uint64_t *q;
+
+	pe_build(&pi, pe_modules, nitems(pe_modules));
+	base = (vm_offset_t)pi.pi_buf;
+	q = (uint64_t *)(pi.pi_buf + pi.pi_data);
+
+	NT_CHECK(pe_relocate(base) == 0);
+	NT_CHECK(q[PE_RELOC0 / 8] == base + PE_ALIGN);
+	NT_CHECK(q[PE_RELOC1 / 8] == base + pi.pi_data + PE_RELOC1);
+
+	pe_free(&pi);
+}
+
+static void
+pe_imports(void)
+{
+	struct pe_img pi;
+	vm_offset_t base;
+	uint64_t *iat;
+	uint8_t buf[16];
+
+	pe_build(&pi, pe_modules, nitems(pe_modules));
+	base = (vm_offset_t)pi.pi_buf;
+
+	/* Module names are matched case insensitively. */
+	NT_CHECK(pe_patch_imports(base, "NTOSKRNL.EXE",
+	    ntoskrnl_functbl) == 0);
+	NT_CHECK(pe_patch_imports(base, "hal", hal_functbl) == 0);
+	NT_CHECK(pe_patch_imports(base, "USBD", hal_functbl) == ENOEXEC);
+
+	iat = pe_iat(&pi, 0);
+	NT_CHECK(iat[0] == (uint64_t)nt_import("KeSetEvent"));
+	NT_CHECK(iat[1] == (uint64_t)nt_import("RtlZeroMemory"));
+	NT_CHECK(iat[2] == (uint64_t)pe_dummy(ntoskrnl_functbl));
+	NT_CHECK(iat[3] == (uint64_t)pe_dummy(ntoskrnl_functbl));
+	NT_CHECK(iat[4] == (uint64_t)nt_import("KeInitializeDpc"));
+	NT_CHECK(iat[5] == 0);
+	NT_CHECK(pe_iat(&pi, 1)[0] == (uint64_t)nt_import("KfAcquireSpinLock"));
+
+	/* And the driver can call through what we patched in. */
+	memset(buf, 0xff, sizeof(buf));
+	MSCALL2((void *)iat[1], buf, sizeof(buf));
+	NT_CHECK(buf[0] == 0 && buf[sizeof(buf) - 1] == 0);
+
+	pe_free(&pi);
+}
+
+/*
+ * Time pe_patch_imports() on an import table about the size of a
+ * big driver's, against the registered (sorted) ntoskrnl table and
+ * against an unregistered copy of it, which gets searched linearly
+ * like every table used to be.
+ */
+#define	PE_BENCH_IMPORTS	4096
+#define	PE_BENCH_LOOPS		50
+
+static uint64_t
+pe_bench_patch(struct pe_img *pi, struct image_patch_table *functbl)
+{
+	uint64_t t;
+	int i;
+
+	t = nt_nsecs();
+	for (i = 0; i < PE_BENCH_LOOPS; i++)
+		pe_patch_imports((vm_offset_t)pi->pi_buf, "ntoskrnl.exe",
+		    functbl);
+	return ((nt_nsecs() - t) / PE_BENCH_LOOPS);
+}
+
+static void
+pe_import_bench(void)
+{
+	struct image_patch_table *copy, *p;
+	struct pe_module mod;
+	struct pe_img pi;
+	const char **names;
+	uint64_t sorted, linear;
+	int i, n, cnt;
+
+	for (cnt = 0; ntoskrnl_functbl[cnt].func != NULL; cnt++)
+		;
+	for (n = 0; ntoskrnl_functbl[n].name != NULL; n++)
+		;
+
+	/* Everything we export, over and over, shuffled a bit. */
+	names = calloc(PE_BENCH_IMPORTS, sizeof(*names));
+	for (i = 0; i < PE_BENCH_IMPORTS; i++)
+		names[i] = ntoskrnl_functbl[(i * 7) % n].name;
+	mod.pm_name = "ntoskrnl.exe";
+	mod.pm_imports = names;
+	mod.pm_nimports = PE_BENCH_IMPORTS;
+	pe_build(&pi, &mod, 1);
+
+	copy = calloc(cnt + 1, sizeof(*copy));
+	memcpy(copy, ntoskrnl_functbl, (cnt + 1) * sizeof(*copy));
+
+	sorted = pe_bench_patch(&pi, ntoskrnl_functbl);
+	for (i = 0; i < PE_BENCH_IMPORTS; i++) {
+		p = pe_functbl_lookup(ntoskrnl_functbl, names[i]);
+		NT_CHECK(pe_iat(&pi, 0)[i] == (uint64_t)p->wrap);
+	}
+	linear = pe_bench_patch(&pi, copy);
+	nt_log("%d imports, %d exports: sorted %.1f ns/import, "
+	    "linear %.1f ns/import\n", PE_BENCH_IMPORTS, n,
+	    (double)sorted / PE_BENCH_IMPORTS,
+	    (double)linear / PE_BENCH_IMPORTS);
+
+	(free)(copy);
+	(free)(names);
+	pe_free(&pi);
+}
+
+struct nt_test pe_tests[] = {
+	NT_TEST(pe_header),
+	NT_TEST(pe_translate),
+	NT_TEST(pe_reloc),
+	NT_TEST(pe_imports),
+	NT_BENCH(pe_import_bench),
+	{ NULL, NULL, 0 }
+};
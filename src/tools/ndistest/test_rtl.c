@@ -0,0 +1,168 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Rtl string and memory helpers. Everything is called through the
+ * import wrappers, like a driver would.
+ */
+
+#include "ndistest.h"
+
+static const uint16_t nt_ustr_hello[] = { 'H', 'e', 'l', 'l', 'o', 0 };
+
+static void
+rtl_init_string(void)
+{
+	struct ansi_string as;
+	struct unicode_string us;
+
+	MSCALL2(nt_import("RtlInitAnsiString"), &as, "Hello");
+	NT_CHECK(as.len == 5);
+	NT_CHECK(as.maxlen == 6);
+	NT_CHECK(strcmp(as.buf, "Hello") == 0);
+
+	MSCALL2(nt_import("RtlInitAnsiString"), &as, NULL);
+	NT_CHECK(as.len == 0 && as.maxlen == 0 && as.buf == NULL);
+
+	MSCALL2(nt_import("RtlInitUnicodeString"), &us, nt_ustr_hello);
+	NT_CHECK(us.len == 5 * sizeof(uint16_t));
+	NT_CHECK(us.maxlen == 6 * sizeof(uint16_t));
+	NT_CHECK(us.buf == nt_ustr_hello);
+}
+
+static void
+rtl_convert_string(void)
+{
+	struct ansi_string as, as2;
+	struct unicode_string us;
+	int i;
+
+	RtlInitAnsiString(&as, "Hello");
+	NT_CHECK(MSCALL3(nt_import("RtlAnsiStringToUnicodeString"),
+	    &us, &as, TRUE) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(us.len == 5 * sizeof(uint16_t));
+	for (i = 0; i < 5; i++)
+		NT_CHECK(us.buf[i] == nt_ustr_hello[i]);
+
+	NT_CHECK(MSCALL3(nt_import("RtlUnicodeStringToAnsiString"),
+	    &as2, &us, TRUE) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(as2.len == 5);
+	NT_CHECK(strcmp(as2.buf, "Hello") == 0);
+	NT_CHECK((uint8_t)MSCALL3(nt_import("RtlEqualString"),
+	    &as, &as2, FALSE) == TRUE);
+
+	MSCALL1(nt_import("RtlFreeUnicodeString"), &us);
+	NT_CHECK(us.buf == NULL);
+	MSCALL1(nt_import("RtlFreeAnsiString"), &as2);
+	NT_CHECK(as2.buf == NULL);
+}
+
+static void
+rtl_compare_string(void)
+{
+	struct ansi_string a, b;
+	void *cmp, *eq;
+
+	cmp = nt_import("RtlCompareString");
+	eq = nt_import("RtlEqualString");
+
+	RtlInitAnsiString(&a, "NdisTest");
+	RtlInitAnsiString(&b, "ndistest");
+	NT_CHECK((int32_t)MSCALL3(cmp, &a, &b, FALSE) < 0);
+	NT_CHECK((int32_t)MSCALL3(cmp, &a, &b, TRUE) == 0);
+	NT_CHECK((uint8_t)MSCALL3(eq, &a, &b, FALSE) == FALSE);
+	NT_CHECK((uint8_t)MSCALL3(eq, &a, &b, TRUE) == TRUE);
+
+	RtlInitAnsiString(&b, "NdisTes");
+	NT_CHECK((int32_t)MSCALL3(cmp, &a, &b, FALSE) > 0);
+	NT_CHECK((uint8_t)MSCALL3(eq, &a, &b, TRUE) == FALSE);
+}
+
+static void
+rtl_string_to_integer(void)
+{
+	static const uint16_t dec[] = { ' ', '-', '4', '2', 0 };
+	static const uint16_t hex[] = { '0', 'x', '1', 'f', 0 };
+	static const uint16_t bad[] = { '1', 'z', 0 };
+	struct unicode_string us;
+	uint32_t val;
+	void *conv;
+
+	conv = nt_import("RtlUnicodeStringToInteger");
+
+	RtlInitUnicodeString(&us, dec);
+	NT_CHECK(MSCALL3(conv, &us, 0, &val) == NDIS_STATUS_SUCCESS);
+	NT_CHECK((int32_t)val == -42);
+
+	RtlInitUnicodeString(&us, hex);
+	NT_CHECK(MSCALL3(conv, &us, 0, &val) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(val == 0x1f);
+
+	RtlInitUnicodeString(&us, bad);
+	NT_CHECK(MSCALL3(conv, &us, 10, &val) != NDIS_STATUS_SUCCESS);
+
+	NT_CHECK(MSCALL3(nt_import("RtlCharToInteger"), "0b101", 0, &val) ==
+	    NDIS_STATUS_SUCCESS);
+	NT_CHECK(val == 5);
+}
+
+static void
+rtl_memory(void)
+{
+	uint8_t a[64], b[64];
+	int i;
+
+	MSCALL3(nt_import("RtlFillMemory"), a, sizeof(a), 0xa5);
+	for (i = 0; i < sizeof(a); i++)
+		NT_CHECK(a[i] == 0xa5);
+
+	MSCALL2(nt_import("RtlZeroMemory"), b, sizeof(b));
+	for (i = 0; i < sizeof(b); i++)
+		NT_CHECK(b[i] == 0);
+
+	NT_CHECK(MSCALL3(nt_import("RtlCompareMemory"), a, b, sizeof(a)) ==
+	    0);
+	MSCALL3(nt_import("RtlCopyMemory"), b, a, 32);
+	NT_CHECK(MSCALL3(nt_import("RtlCompareMemory"), a, b, sizeof(a)) ==
+	    32);
+
+	/* Overlapping move. */
+	for (i = 0; i < sizeof(a); i++)
+		a[i] = i;
+	MSCALL3(nt_import("RtlMoveMemory"), a + 1, a, sizeof(a) - 1);
+	NT_CHECK(a[0] == 0);
+	for (i = 1; i < sizeof(a); i++)
+		NT_CHECK(a[i] == i - 1);
+}
+
+struct nt_test rtl_tests[] = {
+	NT_TEST(rtl_init_string),
+	NT_TEST(rtl_convert_string),
+	NT_TEST(rtl_compare_string),
+	NT_TEST(rtl_string_to_integer),
+	NT_TEST(rtl_memory),
+	{ NULL, NULL, 0 }
+};
@@ -0,0 +1,272 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SLists and the non-paged lookaside lists built on top of them.
+ */
+
+#include <pthread.h>
+
+#include "ndistest.h"
+
+MALLOC_DECLARE(M_NDIS_NTOSKRNL);
+
+#define	SLIST_NENTRIES	64
+#define	SLIST_NTHREADS	4
+#define	SLIST_NLOOPS	200000
+
+struct slist_item {
+	struct slist_entry	si_link;	/* must be first */
+	int			si_id;
+	volatile int		si_busy;
+};
+
+static void
+slist_basic(void)
+{
+	union slist_header head;
+	struct slist_item items[3];
+	struct slist_entry *e;
+	int i;
+
+	MSCALL1(nt_import("InitializeSListHead"), &head);
+	NT_CHECK(MSCALL1(nt_import("ExQueryDepthSList"), &head) == 0);
+	NT_CHECK(MSCALL1(nt_import("InterlockedPopEntrySList"), &head) == 0);
+
+	for (i = 0; i < nitems(items); i++) {
+		items[i].si_id = i;
+		e = (struct slist_entry *)MSCALL2(
+		    nt_import("InterlockedPushEntrySList"), &head,
+		    &items[i].si_link);
+		NT_CHECK(e == (i == 0 ? NULL : &items[i - 1].si_link));
+	}
+	NT_CHECK(ExQueryDepthSList(&head) == nitems(items));
+
+	/* LIFO. */
+	for (i = nitems(items) - 1; i >= 0; i--) {
+		e = (struct slist_entry *)MSCALL1(
+		    nt_import("InterlockedPopEntrySList"), &head);
+		NT_CHECK(e == &items[i].si_link);
+	}
+	NT_CHECK(ExQueryDepthSList(&head) == 0);
+	NT_CHECK(InterlockedPopEntrySList(&head) == NULL);
+}
+
+/*
+ * Drivers embed SList headers in their own structures, and not all
+ * of them get the alignment right. Those take the locked path.
+ */
+static void
+slist_misaligned(void)
+{
+	uint64_t buf[4] __aligned(16);
+	union slist_header *head;
+	struct slist_item items[2];
+
+	head = (union slist_header *)&buf[1];
+	memset(head, 0, sizeof(*head));
+
+	NT_CHECK(MSCALL3(nt_import("ExInterlockedPushEntrySList"), head,
+	    &items[0].si_link, NULL) == 0);
+	NT_CHECK(MSCALL3(nt_import("ExInterlockedPushEntrySList"), head,
+	    &items[1].si_link, NULL) == (uint64_t)&items[0].si_link);
+	NT_CHECK(ExQueryDepthSList(head) == 2);
+	NT_CHECK(MSCALL2(nt_import("ExInterlockedPopEntrySList"), head,
+	    NULL) == (uint64_t)&items[1].si_link);
+	NT_CHECK(MSCALL2(nt_import("ExInterlockedPopEntrySList"), head,
+	    NULL) == (uint64_t)&items[0].si_link);
+	NT_CHECK(ExQueryDepthSList(head) == 0);
+}
+
+static union slist_header slist_stress_head;
+static volatile int slist_stress_errors;
+
+static void *
+slist_stress_thread(void *arg)
+{
+	struct slist_item *it;
+	int i;
+
+	for (i = 0; i < SLIST_NLOOPS; i++) {
+		it = (struct slist_item *)
+		    InterlockedPopEntrySList(&slist_stress_head);
+		if (it == NULL)
+			continue;
+		/* Nobody else may hold it while we do. */
+		if (__sync_lock_test_and_set(&it->si_busy, 1) != 0)
+			__sync_fetch_and_add(&slist_stress_errors, 1);
+		__sync_lock_release(&it->si_busy);
+		InterlockedPushEntrySList(&slist_stress_head, &it->si_link);
+	}
+	return (NULL);
+}
+
+/*
+ * Pop and push the same few entries from several threads, which is
+ * exactly the pattern that goes wrong without the ABA protection.
+ */
+static void
+slist_stress(void)
+{
+	struct slist_item items[SLIST_NENTRIES];
+	pthread_t threads[SLIST_NTHREADS];
+	struct slist_entry *e;
+	uint64_t seen = 0;
+	int i, n;
+
+	memset(&slist_stress_head, 0, sizeof(slist_stress_head));
+	memset(items, 0, sizeof(items));
+	for (i = 0; i < SLIST_NENTRIES; i++) {
+		items[i].si_id = i;
+		InterlockedPushEntrySList(&slist_stress_head,
+		    &items[i].si_link);
+	}
+
+	slist_stress_errors = 0;
+	for (i = 0; i < SLIST_NTHREADS; i++)
+		pthread_create(&threads[i], NULL, slist_stress_thread, NULL);
+	for (i = 0; i < SLIST_NTHREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	NT_CHECK(slist_stress_errors == 0);
+	NT_CHECK(ExQueryDepthSList(&slist_stress_head) == SLIST_NENTRIES);
+	n = 0;
+	while ((e = InterlockedPopEntrySList(&slist_stress_head)) != NULL) {
+		i = ((struct slist_item *)e)->si_id;
+		NT_CHECK((seen & (1ULL << i)) == 0);
+		seen |= 1ULL << i;
+		n++;
+	}
+	NT_CHECK(n == SLIST_NENTRIES);
+}
+
+/*
+ * ExAllocateFromNPagedLookasideList() and ExFreeToNPagedLookasideList()
+ * are inlines in the DDK headers, so the driver side is done by hand
+ * here, the same way.
+ */
+static void *
+lookaside_alloc(struct npaged_lookaside_list *l)
+{
+	void *buf;
+
+	l->nll_l.total_alocates++;
+	buf = InterlockedPopEntrySList(&l->nll_l.list_head);
+	if (buf == NULL) {
+		l->nll_l.u_a.allocate_misses++;
+		buf = (void *)MSCALL3(l->nll_l.allocfunc, l->nll_l.type,
+		    l->nll_l.size, l->nll_l.tag);
+	}
+	return (buf);
+}
+
+static void
+lookaside_free(struct npaged_lookaside_list *l, void *buf)
+{
+	l->nll_l.total_frees++;
+	if (ExQueryDepthSList(&l->nll_l.list_head) >= l->nll_l.depth) {
+		l->nll_l.u_f.free_misses++;
+		MSCALL1(l->nll_l.freefunc, buf);
+	} else
+		InterlockedPushEntrySList(&l->nll_l.list_head, buf);
+}
+
+static void
+lookaside_list(void)
+{
+	struct npaged_lookaside_list l;
+	void (*init)(struct npaged_lookaside_list *, void *, void *,
+	    uint32_t, size_t, uint32_t, uint16_t);
+	void *bufs[8], *again[4];
+	long inuse;
+	int i, j;
+
+	inuse = M_NDIS_NTOSKRNL->ks_inuse;
+	init = nt_native("ExInitializeNPagedLookasideList");
+	init(&l, NULL, NULL, 0, 100, 0x54534554, 4);
+	NT_CHECK(l.nll_l.size == 100);
+	NT_CHECK(l.nll_l.allocfunc != NULL && l.nll_l.freefunc != NULL);
+
+	for (i = 0; i < nitems(bufs); i++) {
+		bufs[i] = lookaside_alloc(&l);
+		NT_CHECK(bufs[i] != NULL);
+		memset(bufs[i], i, 100);
+	}
+	NT_CHECK(l.nll_l.u_a.allocate_misses == nitems(bufs));
+	NT_CHECK(M_NDIS_NTOSKRNL->ks_inuse == inuse + nitems(bufs));
+
+	/* Half of them go back to the pool, the list is only 4 deep. */
+	for (i = 0; i < nitems(bufs); i++)
+		lookaside_free(&l, bufs[i]);
+	NT_CHECK(ExQueryDepthSList(&l.nll_l.list_head) == 4);
+	NT_CHECK(l.nll_l.u_f.free_misses == 4);
+	NT_CHECK(M_NDIS_NTOSKRNL->ks_inuse == inuse + 4);
+
+	/* And the next four come off the list. */
+	for (i = 0; i < nitems(again); i++) {
+		again[i] = lookaside_alloc(&l);
+		for (j = 0; j < 4; j++)
+			if (again[i] == bufs[j])
+				break;
+		NT_CHECK(j < 4);
+	}
+	NT_CHECK(l.nll_l.u_a.allocate_misses == nitems(bufs));
+	for (i = 0; i < nitems(again); i++)
+		lookaside_free(&l, again[i]);
+
+	MSCALL1(nt_import("ExDeleteNPagedLookasideList"), &l);
+	NT_CHECK(M_NDIS_NTOSKRNL->ks_inuse == inuse);
+}
+
+static void
+slist_bench(void)
+{
+	union slist_header head;
+	struct slist_item item;
+	uint64_t c, t;
+	int i, n = 10000000;
+
+	memset(&head, 0, sizeof(head));
+	t = nt_nsecs();
+	c = nt_cycles();
+	for (i = 0; i < n; i++) {
+		InterlockedPushEntrySList(&head, &item.si_link);
+		InterlockedPopEntrySList(&head);
+	}
+	c = nt_cycles() - c;
+	t = nt_nsecs() - t;
+	nt_log("push+pop: %.1f ns, %ju cycles\n", (double)t / n,
+	    (uintmax_t)(c / n));
+}
+
+struct nt_test slist_tests[] = {
+	NT_TEST(slist_basic),
+	NT_TEST(slist_misaligned),
+	NT_TEST(slist_stress),
+	NT_TEST(lookaside_list),
+	NT_BENCH(slist_bench),
+	{ NULL, NULL, 0 }
+};
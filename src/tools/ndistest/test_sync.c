@@ -0,0 +1,541 @@
+/*-
+ * Copyright (c) 2026
+ *	The NDISulator project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * DPCs, timers, spinlocks and the dispatcher objects drivers wait on.
+ */
+
+#include <pthread.h>
+
+#include "ndistest.h"
+
+#define	SYNC_MS(ms)	(-(int64_t)(ms) * 10000)	/* relative 100ns */
+
+static int32_t
+sync_wait(void *obj, int64_t timeout)
+{
+	return ((int32_t)MSCALL5(nt_import("KeWaitForSingleObject"), obj,
+	    0, 0, FALSE, timeout != 0 ? &timeout : NULL));
+}
+
+static int32_t
+sync_wait_multiple(uint32_t cnt, void *obj[], uint32_t wtype,
+    int64_t timeout)
+{
+	int32_t (*wfmo)(uint32_t, void *[], uint32_t, uint32_t, uint32_t,
+	    uint8_t, int64_t *, struct wait_block *);
+
+	wfmo = nt_native("KeWaitForMultipleObjects");
+	return (wfmo(cnt, obj, wtype, 0, 0, FALSE,
+	    timeout != 0 ? &timeout : NULL, NULL));
+}
+
+struct dpc_ctx {
+	struct nt_kevent	dc_done;
+	volatile int		dc_runs;
+	volatile int		dc_cpu;
+	void			*dc_arg1;
+	void			*dc_arg2;
+	volatile int		*dc_gate;	/* spin until zero */
+	volatile int		*dc_order;	/* where to record our turn */
+	int			dc_id;
+};
+
+static volatile int dpc_turn;
+
+static void NT_MSABI
+dpc_func(struct nt_kdpc *dpc, void *ctx, void *arg1, void *arg2)
+{
+	struct dpc_ctx *dc = ctx;
+
+	while (dc->dc_gate != NULL && *dc->dc_gate)
+		cpu_spinwait();
+	if (dc->dc_order != NULL)
+		dc->dc_order[__sync_fetch_and_add(&dpc_turn, 1)] = dc->dc_id;
+	dc->dc_cpu = curcpu;
+	dc->dc_arg1 = arg1;
+	dc->dc_arg2 = arg2;
+	__sync_fetch_and_add(&dc->dc_runs, 1);
+	KeSetEvent(&dc->dc_done, IO_NO_INCREMENT, FALSE);
+}
+
+static void
+dpc_init(struct nt_kdpc *dpc, struct dpc_ctx *dc)
+{
+	memset(dc, 0, sizeof(*dc));
+	KeInitializeEvent(&dc->dc_done, SYNCHRONIZATION_EVENT, FALSE);
+	MSCALL3(nt_import("KeInitializeDpc"), dpc, dpc_func, dc);
+}
+
+static void
+dpc_run(void)
+{
+	struct nt_kdpc dpc;
+	struct dpc_ctx dc;
+	int cpu;
+
+	dpc_init(&dpc, &dc);
+	cpu = curcpu;
+	NT_CHECK((uint8_t)MSCALL3(nt_import("KeInsertQueueDpc"), &dpc,
+	    (void *)1, (void *)2) == TRUE);
+	NT_CHECK(sync_wait(&dc.dc_done, SYNC_MS(1000)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(dc.dc_runs == 1);
+	NT_CHECK(dc.dc_arg1 == (void *)1 && dc.dc_arg2 == (void *)2);
+	/* Untargeted DPCs run where they were queued. */
+	NT_CHECK(dc.dc_cpu == cpu);
+	NT_CHECK(dpc.lock == NULL);
+}
+
+static void
+dpc_target(void)
+{
+	struct nt_kdpc dpc;
+	struct dpc_ctx dc;
+	int cpu;
+
+	dpc_init(&dpc, &dc);
+	CPU_FOREACH(cpu) {
+		MSCALL2(nt_import("KeSetTargetProcessorDpc"), &dpc, cpu);
+		NT_CHECK(KeInsertQueueDpc(&dpc, NULL, NULL) == TRUE);
+		NT_CHECK(sync_wait(&dc.dc_done, SYNC_MS(1000)) ==
+		    NDIS_STATUS_SUCCESS);
+		NT_CHECK(dc.dc_cpu == cpu);
+	}
+	NT_CHECK(dc.dc_runs == mp_ncpus);
+}
+
+/*
+ * Hold up the DPC thread of CPU 0 with one DPC, then check what
+ * happens to the ones queued behind it. The test thread moves to
+ * another CPU for that, or it would be waiting on CPU 0's dispatch
+ * lock itself.
+ */
+static void
+dpc_queued(void)
+{
+	struct nt_kdpc blocker, dpc[3];
+	struct dpc_ctx bc, dc[3];
+	volatile int gate = 1, order[3];
+	int i;
+
+	if (mp_ncpus < 2) {
+		nt_log("needs two CPUs, skipped\n");
+		return;
+	}
+	sched_bind(curthread, 1);
+
+	dpc_init(&blocker, &bc);
+	bc.dc_gate = &gate;
+	KeSetTargetProcessorDpc(&blocker, 0);
+	NT_CHECK(KeInsertQueueDpc(&blocker, NULL, NULL) == TRUE);
+	while (blocker.lock != NULL)
+		cpu_spinwait();
+
+	dpc_turn = 0;
+	for (i = 0; i < nitems(dpc); i++) {
+		dpc_init(&dpc[i], &dc[i]);
+		dc[i].dc_id = i;
+		dc[i].dc_order = order;
+		KeSetTargetProcessorDpc(&dpc[i], 0);
+		MSCALL2(nt_import("KeSetImportanceDpc"), &dpc[i], i);
+		NT_CHECK(KeInsertQueueDpc(&dpc[i], NULL, NULL) == TRUE);
+		/* Already queued. */
+		NT_CHECK(KeInsertQueueDpc(&dpc[i], NULL, NULL) == FALSE);
+	}
+
+	/* Take the medium one out again, and put it back. */
+	NT_CHECK((uint8_t)MSCALL1(nt_import("KeRemoveQueueDpc"),
+	    &dpc[IMPORTANCE_MEDIUM]) == TRUE);
+	NT_CHECK(KeRemoveQueueDpc(&dpc[IMPORTANCE_MEDIUM]) == FALSE);
+	NT_CHECK(KeInsertQueueDpc(&dpc[IMPORTANCE_MEDIUM], NULL, NULL) ==
+	    TRUE);
+
+	/* And the low one for good. */
+	NT_CHECK(KeRemoveQueueDpc(&dpc[IMPORTANCE_LOW]) == TRUE);
+
+	gate = 0;
+	NT_CHECK(sync_wait(&bc.dc_done, SYNC_MS(1000)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(sync_wait(&dc[IMPORTANCE_MEDIUM].dc_done, SYNC_MS(1000)) ==
+	    NDIS_STATUS_SUCCESS);
+	NT_CHECK(sync_wait(&dc[IMPORTANCE_HIGH].dc_done, SYNC_MS(1000)) ==
+	    NDIS_STATUS_SUCCESS);
+
+	/* Most important first, the removed one not at all. */
+	NT_CHECK(dpc_turn == 2);
+	NT_CHECK(order[0] == IMPORTANCE_HIGH);
+	NT_CHECK(order[1] == IMPORTANCE_MEDIUM);
+	NT_CHECK(dc[IMPORTANCE_LOW].dc_runs == 0);
+	NT_CHECK(dc[IMPORTANCE_MEDIUM].dc_runs == 1);
+	NT_CHECK(dc[IMPORTANCE_HIGH].dc_runs == 1);
+	NT_CHECK(dpc[IMPORTANCE_LOW].lock == NULL);
+
+	sched_unbind(curthread);
+}
+
+static void
+event_notification(void)
+{
+	struct nt_kevent ev;
+
+	MSCALL3(nt_import("KeInitializeEvent"), &ev, NOTIFICATION_EVENT,
+	    FALSE);
+	NT_CHECK(MSCALL1(nt_import("KeReadStateEvent"), &ev) == FALSE);
+	NT_CHECK(sync_wait(&ev, SYNC_MS(10)) == NDIS_STATUS_TIMEOUT);
+
+	NT_CHECK((int32_t)MSCALL3(nt_import("KeSetEvent"), &ev,
+	    IO_NO_INCREMENT, FALSE) == FALSE);
+	/* Stays signalled until reset. */
+	NT_CHECK(sync_wait(&ev, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(sync_wait(&ev, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK((int32_t)MSCALL1(nt_import("KeResetEvent"), &ev) == TRUE);
+	NT_CHECK(sync_wait(&ev, SYNC_MS(10)) == NDIS_STATUS_TIMEOUT);
+}
+
+static void
+event_synchronization(void)
+{
+	struct nt_kevent ev;
+
+	KeInitializeEvent(&ev, SYNCHRONIZATION_EVENT, TRUE);
+	/* Auto-clears on a satisfied wait. */
+	NT_CHECK(sync_wait(&ev, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(sync_wait(&ev, SYNC_MS(10)) == NDIS_STATUS_TIMEOUT);
+	KeSetEvent(&ev, IO_NO_INCREMENT, FALSE);
+	NT_CHECK(sync_wait(&ev, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+}
+
+struct waiter {
+	pthread_t	w_thread;
+	void		*w_obj[2];
+	int		w_cnt;
+	uint32_t	w_type;
+	int32_t		w_status;
+};
+
+static void *
+waiter_thread(void *arg)
+{
+	struct waiter *w = arg;
+
+	if (w->w_cnt == 1)
+		w->w_status = sync_wait(w->w_obj[0], 0);
+	else
+		w->w_status = sync_wait_multiple(w->w_cnt, w->w_obj,
+		    w->w_type, 0);
+	return (NULL);
+}
+
+static void
+waiter_start(struct waiter *w)
+{
+	w->w_status = -1;
+	pthread_create(&w->w_thread, NULL, waiter_thread, w);
+	/* Give it time to block. */
+	pause("waiter", hz / 50);
+}
+
+static void
+event_wakeup(void)
+{
+	struct nt_kevent ev;
+	struct waiter w[3];
+	int i;
+
+	KeInitializeEvent(&ev, NOTIFICATION_EVENT, FALSE);
+	for (i = 0; i < nitems(w); i++) {
+		w[i].w_obj[0] = &ev;
+		w[i].w_cnt = 1;
+		waiter_start(&w[i]);
+	}
+	for (i = 0; i < nitems(w); i++)
+		NT_CHECK(w[i].w_status == -1);
+	/* A notification event wakes everybody. */
+	KeSetEvent(&ev, IO_NO_INCREMENT, FALSE);
+	for (i = 0; i < nitems(w); i++) {
+		pthread_join(w[i].w_thread, NULL);
+		NT_CHECK(w[i].w_status == NDIS_STATUS_SUCCESS);
+	}
+}
+
+static void
+wait_multiple(void)
+{
+	struct nt_kevent ev[2];
+	struct waiter w;
+	void *obj[2] = { &ev[0], &ev[1] };
+
+	KeInitializeEvent(&ev[0], NOTIFICATION_EVENT, FALSE);
+	KeInitializeEvent(&ev[1], NOTIFICATION_EVENT, TRUE);
+
+	NT_CHECK(sync_wait_multiple(2, obj, WAIT_ANY, SYNC_MS(10)) ==
+	    NDIS_STATUS_WAIT_0 + 1);
+	NT_CHECK(sync_wait_multiple(2, obj, WAIT_ALL, SYNC_MS(10)) ==
+	    NDIS_STATUS_TIMEOUT);
+	KeSetEvent(&ev[0], IO_NO_INCREMENT, FALSE);
+	NT_CHECK(sync_wait_multiple(2, obj, WAIT_ALL, SYNC_MS(10)) ==
+	    NDIS_STATUS_SUCCESS);
+
+	/* Blocking WaitAny reports which object woke it. */
+	KeResetEvent(&ev[0]);
+	KeResetEvent(&ev[1]);
+	memset(&w, 0, sizeof(w));
+	w.w_obj[0] = &ev[0];
+	w.w_obj[1] = &ev[1];
+	w.w_cnt = 2;
+	w.w_type = WAIT_ANY;
+	waiter_start(&w);
+	NT_CHECK(w.w_status == -1);
+	KeSetEvent(&ev[1], IO_NO_INCREMENT, FALSE);
+	pthread_join(w.w_thread, NULL);
+	NT_CHECK(w.w_status == NDIS_STATUS_WAIT_0 + 1);
+
+	/* Blocking WaitAll needs both. */
+	KeResetEvent(&ev[1]);
+	w.w_type = WAIT_ALL;
+	waiter_start(&w);
+	KeSetEvent(&ev[0], IO_NO_INCREMENT, FALSE);
+	pause("waitall", hz / 50);
+	NT_CHECK(w.w_status == -1);
+	KeSetEvent(&ev[1], IO_NO_INCREMENT, FALSE);
+	pthread_join(w.w_thread, NULL);
+	NT_CHECK(w.w_status == NDIS_STATUS_SUCCESS);
+}
+
+static void
+mutex_recursion(void)
+{
+	struct nt_kmutex m;
+	struct waiter w;
+	void *release;
+
+	release = nt_import("KeReleaseMutex");
+	MSCALL2(nt_import("KeInitializeMutex"), &m, 0);
+	NT_CHECK(sync_wait(&m, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(sync_wait(&m, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(m.owner_thread == curthread);
+	NT_CHECK((int32_t)MSCALL1(nt_import("KeReadStateMutex"), &m) == -1);
+
+	/* Somebody else has to wait until we let go completely. */
+	memset(&w, 0, sizeof(w));
+	w.w_obj[0] = &m;
+	w.w_cnt = 1;
+	waiter_start(&w);
+	NT_CHECK((int32_t)MSCALL2(release, &m, FALSE) == -1);
+	pause("mutex", hz / 50);
+	NT_CHECK(w.w_status == -1);
+	NT_CHECK((int32_t)MSCALL2(release, &m, FALSE) == 0);
+	pthread_join(w.w_thread, NULL);
+	NT_CHECK(w.w_status == NDIS_STATUS_SUCCESS);
+
+	/* Which now owns it, not us. */
+	NT_CHECK((int32_t)MSCALL2(release, &m, FALSE) ==
+	    (int32_t)NDIS_STATUS_MUTANT_NOT_OWNED);
+}
+
+static void
+semaphore(void)
+{
+	struct nt_ksemaphore s;
+	void *release;
+
+	release = nt_import("KeReleaseSemaphore");
+	MSCALL3(nt_import("KeInitializeSemaphore"), &s, 2, 2);
+	NT_CHECK(sync_wait(&s, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(sync_wait(&s, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(sync_wait(&s, SYNC_MS(10)) == NDIS_STATUS_TIMEOUT);
+	NT_CHECK((int32_t)MSCALL4(release, &s, 0, 1, FALSE) == 0);
+	NT_CHECK(sync_wait(&s, SYNC_MS(10)) == NDIS_STATUS_SUCCESS);
+
+	/* Never above the limit. */
+	NT_CHECK((int32_t)MSCALL4(release, &s, 0, 5, FALSE) == 0);
+	NT_CHECK((int32_t)MSCALL1(nt_import("KeReadStateSemaphore"), &s) ==
+	    2);
+}
+
+static void
+timer_oneshot(void)
+{
+	struct nt_ktimer t;
+	struct nt_kdpc dpc;
+	struct dpc_ctx dc;
+	uint64_t start;
+
+	dpc_init(&dpc, &dc);
+	MSCALL1(nt_import("KeInitializeTimer"), &t);
+	start = nt_nsecs();
+	NT_CHECK((uint8_t)MSCALL3(nt_import("KeSetTimer"), &t, SYNC_MS(20),
+	    &dpc) == FALSE);
+	NT_CHECK(sync_wait(&t, SYNC_MS(1000)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(nt_nsecs() - start >= 15 * 1000000);
+	NT_CHECK(sync_wait(&dc.dc_done, SYNC_MS(1000)) == NDIS_STATUS_SUCCESS);
+	NT_CHECK(dc.dc_runs == 1);
+	NT_CHECK(MSCALL1(nt_import("KeReadStateTimer"), &t) == TRUE);
+
+	/* A cancelled timer never fires. */
+	KeSetTimer(&t, SYNC_MS(20), &dpc);
+	NT_CHECK((uint8_t)MSCALL1(nt_import("KeCancelTimer"), &t) == TRUE);
+	NT_CHECK(sync_wait(&t, SYNC_MS(50)) == NDIS_STATUS_TIMEOUT);
+	NT_CHECK(dc.dc_runs == 1);
+}
+
+static void
+timer_periodic(void)
+{
+	struct nt_ktimer t;
+	struct nt_kdpc dpc;
+	struct dpc_ctx dc;
+	int runs;
+
+	dpc_init(&dpc, &dc);
+	MSCALL2(nt_import("KeInitializeTimerEx"), &t, SYNCHRONIZATION_TIMER);
+	MSCALL4(nt_import("KeSetTimerEx"), &t, SYNC_MS(5), 5, &dpc);
+	while (dc.dc_runs < 3)
+		NT_CHECK(sync_wait(&dc.dc_done, SYNC_MS(1000)) ==
+		    NDIS_STATUS_SUCCESS);
+	NT_CHECK(KeCancelTimer(&t) == TRUE);
+	pause("timer", hz / 20);
+	runs = dc.dc_runs;
+	pause("timer", hz / 20);
+	NT_CHECK(dc.dc_runs == runs);
+}
+
+/*
+ * The AtDpcLevel routines raise IRQL themselves when called below
+ * DISPATCH_LEVEL, and it has to stay raised until the last lock is
+ * gone, whatever order they're released in.
+ */
+static void
+spin_nested(void)
+{
+	unsigned long a, b;
+	uint8_t irql;
+
+	KeInitializeSpinLock(&a);
+	KeInitializeSpinLock(&b);
+	NT_CHECK(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	MSCALL1(nt_import("KeAcquireSpinLockAtDpcLevel"), &a);
+	NT_CHECK(KeGetCurrentIrql() == DISPATCH_LEVEL);
+	MSCALL1(nt_import("KeAcquireSpinLockAtDpcLevel"), &b);
+	MSCALL1(nt_import("KeReleaseSpinLockFromDpcLevel"), &a);
+	NT_CHECK(KeGetCurrentIrql() == DISPATCH_LEVEL);
+	MSCALL1(nt_import("KeReleaseSpinLockFromDpcLevel"), &b);
+	NT_CHECK(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+	/* Locks taken at a real DISPATCH_LEVEL leave IRQL alone. */
+	KeAcquireSpinLock(&a, &irql);
+	NT_CHECK(irql == PASSIVE_LEVEL);
+	MSCALL1(nt_import("KeAcquireSpinLockAtDpcLevel"), &b);
+	MSCALL1(nt_import("KeReleaseSpinLockFromDpcLevel"), &b);
+	NT_CHECK(KeGetCurrentIrql() == DISPATCH_LEVEL);
+	KeReleaseSpinLock(&a, irql);
+	NT_CHECK(KeGetCurrentIrql() == PASSIVE_LEVEL);
+	NT_CHECK(a == 0 && b == 0);
+}
+
+/*
+ * Uncontended spinlock round trips: the raising pair, and the
+ * AtDpcLevel pair both below and at DISPATCH_LEVEL.
+ */
+static void
+spin_bench(void)
+{
+	unsigned long lock;
+	uint64_t t[3];
+	uint8_t irql;
+	int i, n = 1000000;
+
+	KeInitializeSpinLock(&lock);
+	t[0] = nt_nsecs();
+	for (i = 0; i < n; i++) {
+		KeAcquireSpinLock(&lock, &irql);
+		KeReleaseSpinLock(&lock, irql);
+	}
+	t[0] = nt_nsecs() - t[0];
+
+	t[1] = nt_nsecs();
+	for (i = 0; i < n; i++) {
+		KeAcquireSpinLockAtDpcLevel(&lock);
+		KeReleaseSpinLockFromDpcLevel(&lock);
+	}
+	t[1] = nt_nsecs() - t[1];
+
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	t[2] = nt_nsecs();
+	for (i = 0; i < n; i++) {
+		KeAcquireSpinLockAtDpcLevel(&lock);
+		KeReleaseSpinLockFromDpcLevel(&lock);
+	}
+	t[2] = nt_nsecs() - t[2];
+	KeLowerIrql(irql);
+
+	nt_log("spinlock: raise+acquire %.1f ns, at dpc level %.1f ns "
+	    "(from passive) %.1f ns (from dispatch)\n", (double)t[0] / n,
+	    (double)t[1] / n, (double)t[2] / n);
+}
+
+/*
+ * Round trip through the DPC machinery: queue a DPC from here and
+ * wait for it to signal back.
+ */
+static void
+dpc_bench(void)
+{
+	struct nt_kdpc dpc;
+	struct dpc_ctx dc;
+	uint64_t c, t;
+	int i, n = 100000;
+
+	dpc_init(&dpc, &dc);
+	t = nt_nsecs();
+	c = nt_cycles();
+	for (i = 0; i < n; i++) {
+		KeInsertQueueDpc(&dpc, NULL, NULL);
+		KeWaitForSingleObject(&dc.dc_done, 0, 0, FALSE, NULL);
+	}
+	c = nt_cycles() - c;
+	t = nt_nsecs() - t;
+	nt_log("DPC round trip: %.0f ns, %ju cycles\n", (double)t / n,
+	    (uintmax_t)(c / n));
+}
+
+struct nt_test sync_tests[] = {
+	NT_TEST(dpc_run),
+	NT_TEST(dpc_target),
+	NT_TEST(dpc_queued),
+	NT_TEST(event_notification),
+	NT_TEST(event_synchronization),
+	NT_TEST(event_wakeup),
+	NT_TEST(wait_multiple),
+	NT_TEST(mutex_recursion),
+	NT_TEST(semaphore),
+	NT_TEST(timer_oneshot),
+	NT_TEST(timer_periodic),
+	NT_TEST(spin_nested),
+	NT_BENCH(dpc_bench),
+	NT_BENCH(spin_bench),
+	{ NULL, NULL, 0 }
+};